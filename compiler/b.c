@@ -1,9 +1,12 @@
+#include <elf.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "bif.h"
+
 static char *ofname = NULL;
 static int runld = 1;
 
@@ -13,23 +16,61 @@ struct linkobj {
     int remove;
 };
 
+// an intermediate file, and the object to compile it to
+//
+struct unit {
+    struct unit *next;
+    char *ifile;
+    char *out;                  // or NULL, if not compiled by ba
+    int ok;                     // compiled to intermediate code
+    int keep;                   // an input or output, not to be removed
+};
+
 static const char *rtlib = "lib/libbrt.a";
+static const char *rtarchive = "lib/brt.bia";
 static const char *linkscript = "share/b/blink";
 
+// the machines we can compile for. each has its own runtime library
+// in the sysroot, built for the same word size.
+//
+static struct target {
+    const char *name;
+    const char *asflags;        // to assemble for the target
+    const char *ldemul;         // linker emulation
+    const char *rtlib;          // runtime library, relative to the sysroot
+    int baobj;                  // ba can write threaded code objects itself
+} targets[] = {
+    { "i386",   "-march=i386 --32", "elf_i386",   "lib/libbrt.a",           1 },
+    { "i386-tos", "-march=i386 --32", "elf_i386", "lib/tos/libbrt.a",       1 },
+    { "x86_64", "--64",             "elf_x86_64", "lib/x86_64/libbrt.a",    0 },
+};
+static int ntargets = sizeof(targets) / sizeof(targets[0]);
+static struct target *target = &targets[0];
+
 static char *sysroot;
 static struct linkobj *linkhead, *linktail;
 static const char *bccmd;
 static const char *bacmd;
+static const char *barcmd;
 static const char *ascmd;
 static const char *ldcmd;
 static int debug = 0;
 static int listing = 0;
 static int packrat = 0;   // don't delete any intermediate files
 static int verbose = 0;
+static int threaded = 1;  // compiling to direct threaded code
+static int lto = 0;       // optimizing the whole program at link time
+static char *bcflags = "";
+static char *baflags = "";
 
 static void usage(void);
-static int compile(const char *fn, const char *outf);
+static int compile(const char *fn, const char *ifile);
+static int assemble(const char *ifile, const char *outf);
+static int picklib(struct unit *units, const char *outf);
+static int isbif(const char *fn);
+static char *undefs(const char *objf, char *flags);
 static int ld(const char *outf);
+static int preshift(const char *outf);
 static const char *ext(const char *fn);
 static int isext(const char *fn, const char *ex);
 static const char *stripdir(const char *fn);
@@ -51,31 +92,58 @@ static char *safestrdup(const char *fn);
 int 
 main(int argc, char **argv)
 {
-    int ch, i, rc, files = 0, bfiles = 0;
+    int ch, i, rc, files = 0, bfiles = 0, profgen = 0;
     char *fn, *out;
     struct linkobj *lobj;
+    struct unit *units = NULL, **unitp = &units, *u;
 
     sysroot = findfile(rundir(argv[0]), rtlib);
 
     bccmd = fqcommand(sysroot, "bin/bc");
     bacmd = fqcommand(sysroot, "bin/ba");
+    barcmd = fqcommand(sysroot, "bin/bar");
     ascmd = fqcommand(rundir("as"), "as");
     ldcmd = fqcommand(rundir("ld"), "ld");
 
-    while ((ch = getopt(argc, argv, "cglo:ps:v")) != -1) {
+    while ((ch = getopt(argc, argv, "cf:gj:lm:o:ps:t:v")) != -1) {
         switch (ch) {
         case 'c':
             runld = 0;
             break;
 
+        case 'f':
+            if (strcmp(optarg, "profile-generate") == 0) {
+                baflags = aprintf("%s-fprofile-generate ", baflags);
+                profgen = 1;
+            } else if (strcmp(optarg, "lto") == 0) {
+                lto = 1;
+            } else if (strncmp(optarg, "profile-use=", 12) == 0) {
+                bcflags = aprintf("-f%s ", optarg);
+                baflags = aprintf("%s-f%s ", baflags, optarg);
+            } else if (strncmp(optarg, "function-order=", 15) == 0) {
+                baflags = aprintf("%s-f%s ", baflags, optarg);
+            } else {
+                usage();
+            }
+            break;
+
         case 'g':
             debug = 1;
             break;
 
+        case 'j':
+            baflags = aprintf("%s-j %s ", baflags, optarg);
+            break;
+
         case 'l':
             listing = 1;
             break;
 
+        case 'm':
+            threaded = strcmp(optarg, "threaded") == 0;
+            baflags = aprintf("%s-m %s ", baflags, optarg);
+            break;
+
         case 'o':
             ofname = optarg;
             break;
@@ -88,6 +156,17 @@ main(int argc, char **argv)
             sysroot = optarg;
             break;
 
+        case 't':
+            for (i = 0; i < ntargets && strcmp(targets[i].name, optarg); i++)
+                ;
+            if (i == ntargets) {
+                fprintf(stderr, "b: unknown target %s\n", optarg);
+                usage();
+            }
+            target = &targets[i];
+            baflags = aprintf("%s-t %s ", baflags, optarg);
+            break;
+
         case 'v':
             verbose = 1;
             break;
@@ -101,6 +180,7 @@ main(int argc, char **argv)
     veprintf("sysroot=%s\n", sysroot);
     veprintf("bc=%s\n", bccmd);
     veprintf("ba=%s\n", bacmd);
+    veprintf("bar=%s\n", barcmd);
     veprintf("as=%s\n", ascmd);
     veprintf("ld=%s\n", ldcmd);
 
@@ -130,41 +210,115 @@ main(int argc, char **argv)
         }
     } 
 
+    // the counts are kept by each file's labels, which are renumbered
+    // when the files are merged
+    //
+    if (lto && profgen) {
+        fprintf(stderr, "b: -flto cannot be used with -fprofile-generate\n");
+        return 1;
+    }
+
     if (!runld && ofname && bfiles > 1) {
         fprintf(stderr, "b: cannot specify multiple source files with -c and -o\n");
         return 1;
     }
 
+    // every file is compiled to intermediate code first, so that the
+    // library code the program needs can be picked out before ba runs.
+    // with -flto, the intermediate files are kept as the objects, and
+    // are linked by bar into one file for ba
+    //
     for (i = optind, rc = 0; i < argc; i++) {
         fn = argv[i];
         if (isext(fn, "b")) {
             if (runld || !ofname) {
                 out = replext(stripdir(fn), "o");
             } else {
-                out = ofname;
+                out = safestrdup(ofname);
             } 
+
+            u = safemalloc(sizeof(struct unit));
+            u->ifile = replext(out, "i");
+            u->out = out;
+            u->keep = 0;
+            u->next = NULL;
+            *unitp = u;
+            unitp = &u->next;
+
+            if (lto && !runld) {
+                free(u->ifile);
+                u->ifile = out;
+                u->keep = 1;
+            }
                   
-            if (!compile(fn, out)) {
+            if (!(u->ok = compile(fn, u->ifile))) {
                 rc = 1;
             }          
 
-            addobj(out, 1);
-            if (out != ofname) {
-                free(out);
+            if (!lto) {
+                addobj(out, 1);
+            } else {
+                if (runld) {
+                    free(out);
+                }
+                u->out = NULL;
+            }
+        } else if (runld && isbif(fn)) {
+            if (!lto) {
+                fprintf(stderr, "b: %s was compiled with -flto, so must be linked with it\n", fn);
+                rc = 1;
+                continue;
             }
+            u = safemalloc(sizeof(struct unit));
+            u->ifile = safestrdup(fn);
+            u->out = NULL;
+            u->ok = 1;
+            u->keep = 1;
+            u->next = NULL;
+            *unitp = u;
+            unitp = &u->next;
         } else {
             addobj(fn, 0);
         }
     }
 
-    addobj(pathlcat(sysroot, -1, rtlib), 0);
+    if (rc == 0 && runld) {
+        out = replext(stripdir(ofname ? ofname : "a.out"), lto ? "lto.o" : "rt.o");
+        if ((i = picklib(units, out)) < 0) {
+            rc = 1;
+        }
+        if (i > 0) {
+            u = safemalloc(sizeof(struct unit));
+            u->ifile = replext(out, "i");
+            u->out = out;
+            u->ok = 1;
+            u->keep = 0;
+            u->next = NULL;
+            *unitp = u;
+            addobj(out, 1);
+        } else {
+            free(out);
+        }
+    }
+
+    for (u = units; u; u = u->next) {
+        if (u->ok && u->out && !assemble(u->ifile, u->out)) {
+            rc = 1;
+        }
+        if (!packrat && !u->keep) {
+            veprintf("removing %s\n", u->ifile);
+            remove(u->ifile);
+        }
+    }
+
+    addobj(pathlcat(sysroot, -1, target->rtlib), 0);
     
     if (rc) {
         return rc;
     }
 
     if (runld) {
-        ld(ofname ? ofname : "a.out");
+        rc = !ld(ofname ? ofname : "a.out");
 
         if (!packrat) {
             for (lobj = linkhead; lobj; lobj = lobj->next) {
@@ -176,7 +330,7 @@ main(int argc, char **argv)
         }
     }
 
-    return 0;
+    return rc;
 }
 
 // print usage and exit
@@ -185,56 +339,147 @@ void
 usage(void)
 {
     fprintf(stderr, "b: -c -v -g -s sysroot -o outfile srcfile [srcfile ...]\n");    
+    fprintf(stderr, "   -fprofile-generate    instrument the program to write bprof.out\n");
+    fprintf(stderr, "   -fprofile-use=file    optimize using counts from bprof.out\n");
+    fprintf(stderr, "   -ffunction-order=file place functions named in file first, in order\n");
+    fprintf(stderr, "   -flto                 optimize the whole program as one when linking\n");
+    fprintf(stderr, "   -j jobs               write out functions with this many processes\n");
+    fprintf(stderr, "   -m token              compile to compact one byte opcodes\n");
+    fprintf(stderr, "   -m call               compile to native calls of the op handlers\n");
+    fprintf(stderr, "   -m native             compile to native code instead of threaded code\n");
+    fprintf(stderr, "   -m reg                compile to native code, keeping values in registers\n");
+    fprintf(stderr, "   -t i386|i386-tos|x86_64 compile for the given machine (default i386)\n");
     exit(1);
 }
 
-// compile the given b file
+// compile the given b file to intermediate code
 //
 int
-compile(const char *fn, const char *out)
+compile(const char *fn, const char *ifile)
 {
-    int l, rc;
-    char *ifile = replext(out, "i");
-    char *sfile = replext(out, "s");
-    char *lstfile = NULL;
-    char *lstflag = NULL;
     char *cmd;
+    int rc;
 
-
-    cmd = aprintf("%s -o %s %s", bccmd, ifile, fn);
+    cmd = aprintf("%s %s-o %s %s", bccmd, bcflags, ifile, fn);
     veprintf("%s\n", cmd);
     rc = system(cmd);
     free(cmd);
     
-    if (rc) {
-        return 0;
+    return rc == 0;
+}
+
+// Pick out of the library archive the code that the program's
+// intermediate files, and any objects given, need, into the
+// intermediate file for 'out'. With -flto, the whole program is
+// written there instead. Returns 1 if the picks were written, 0 if
+// there is no archive, and -1 on failure.
+//
+int
+picklib(struct unit *units, const char *out)
+{
+    char *arch = pathlcat(sysroot, -1, rtarchive);
+    char *ifile = replext(out, "i");
+    char *cmd, *flags = safestrdup("");
+    struct linkobj *obj;
+    struct unit *u;
+    int rc;
+
+    if (access(arch, R_OK) != 0) {
+        if (lto) {
+            fprintf(stderr, "b: -flto needs %s\n", arch);
+        }
+        free(arch);
+        free(ifile);
+        free(flags);
+        return lto ? -1 : 0;
     }
 
-    cmd = aprintf("%s -o %s %s", bacmd, sfile, ifile);
+    for (obj = linkhead; obj; obj = obj->next) {
+        if (!obj->remove && isext(obj->name, "o")) {
+            flags = undefs(obj->name, flags);
+        }
+    }
+    for (u = units; u; u = u->next) {
+        cmd = aprintf("%s%s ", flags, u->ifile);
+        free(flags);
+        flags = cmd;
+    }
+
+    cmd = aprintf("%s %s %s -o %s %s", barcmd, lto ? "-l" : "-x", arch, ifile, flags);
     veprintf("%s\n", cmd);
     rc = system(cmd);
     free(cmd);
+    free(flags);
+    free(arch);
+    free(ifile);
 
-    if (!packrat) {
-        veprintf("removing %s\n", ifile);
-        remove(ifile);
+    return rc == 0 ? 1 : -1;
+}
+
+// is 'fn' an intermediate file, as written for an object with -flto
+//
+int
+isbif(const char *fn)
+{
+    FILE *fp;
+    unsigned char magic[4];
+    int bif;
+
+    if ((fp = fopen(fn, "rb")) == NULL) {
+        return 0;
     }
-    
+    bif = fread(magic, 1, 4, fp) == 4 
+        && (magic[0] | magic[1] << 8 | magic[2] << 16 | (unsigned)magic[3] << 24) == BIFMAGIC2;
+    fclose(fp);
+    return bif;
+}
+
+// compile an intermediate file to an object
+//
+int
+assemble(const char *ifile, const char *out)
+{
+    int rc;
+    char *sfile = replext(out, "s");
+    char *lstfile = NULL;
+    char *lstflag = NULL;
+    char *cmd;
+    int direct = !listing && !debug && threaded && target->baobj;
+
+    // without a listing or debug info, ba writes the object itself
+    // when it can, and the assembler isn't needed
+    //
+    if (direct) {
+        cmd = aprintf("%s %s-c -o %s %s", bacmd, baflags, out, ifile);
+    } else {
+        cmd = aprintf("%s %s-o %s %s", bacmd, baflags, sfile, ifile);
+    }
+    veprintf("%s\n", cmd);
+    rc = system(cmd);
+    free(cmd);
+
     if (rc) {
+        free(sfile);
         return 0;
     }
 
+    if (direct) {
+        free(sfile);
+        return 1;
+    }
+
     if (listing) {
         lstfile = replext(out, "lst");
         lstflag = aprintf("-aghlms=%s ", lstfile);
         free(lstfile);
     }
 
-    cmd = aprintf("%s %s%s-o %s -march=i386 --32 %s", 
+    cmd = aprintf("%s %s%s-o %s %s %s", 
         ascmd, 
         debug ? "-g " : "",
         lstflag ? lstflag : "",
         out, 
+        target->asflags,
         sfile);
     veprintf("%s\n", cmd);
     rc = system(cmd);
@@ -245,14 +490,14 @@ compile(const char *fn, const char *out)
         remove(sfile);
     }
 
-    free(ifile);
     free(sfile);
     free(lstflag);
     
     return rc == 0; 
 }
 
-// run the linker
+// run the linker. Returns 0 on failure, and removes the output if
+// it was linked but its pointers could not be shifted.
 //
 int
 ld(const char *out)
@@ -267,7 +512,7 @@ ld(const char *out)
     
     if (linkhead == NULL) {
         fprintf(stderr, "b: nothing to link\n");
-        return 1;
+        return 0;
     }
 
     for (obj = linkhead; obj; obj = obj->next) {
@@ -293,9 +538,10 @@ ld(const char *out)
     blink = pathlcat(sysroot, -1, linkscript);
 
 #if 1
-    cmd = aprintf("%s %s-m elf_i386 -o %s -T %s %s", 
+    cmd = aprintf("%s %s-m %s --gc-sections -o %s -T %s %s", 
             ldcmd, 
             mflag ? mflag : "",
+            target->ldemul,
             out, 
             blink,
             names);
@@ -314,7 +560,174 @@ ld(const char *out)
     free(mflag);
     free(blink);
 
-    return rc == 0;
+    if (rc != 0) {
+        return 0;
+    }
+    if (!preshift(out)) {
+        remove(out);
+        return 0;
+    }
+    return 1;
+}
+
+// Pointers are addresses shifted right by 2 bits (3 for 8 byte words),
+// which the linker can't compute. Instead ba lists the address of each
+// word in the data that should hold a pointer in .pinit, which blink
+// links but does not load, and the words are shifted here in the
+// linked program.
+//
+#define EHDR(f) (is64 ? ((Elf64_Ehdr *)img)->f : ((Elf32_Ehdr *)img)->f)
+#define SHDR(i, f) (is64 ? ((Elf64_Shdr *)(img + shoff))[i].f : ((Elf32_Shdr *)(img + shoff))[i].f)
+#define PHDR(i, f) (is64 ? ((Elf64_Phdr *)(img + phoff))[i].f : ((Elf32_Phdr *)(img + phoff))[i].f)
+
+static int
+preshift(const char *out)
+{
+    FILE *fp;
+    unsigned char *img, *p, *w;
+    unsigned long size, shoff, phoff, offs, end, addr, val;
+    const char *shstr;
+    int is64, wsize, i, j, k;
+
+    if ((fp = fopen(out, "r+b")) == NULL) {
+        perror(out);
+        return 0;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+    img = safemalloc(size);
+    if (fread(img, 1, size, fp) != size || memcmp(img, ELFMAG, SELFMAG) != 0) {
+        fprintf(stderr, "b: %s is not an ELF file\n", out);
+        fclose(fp);
+        free(img);
+        return 0;
+    }
+
+    is64 = img[EI_CLASS] == ELFCLASS64;
+    wsize = is64 ? 8 : 4;
+    shoff = EHDR(e_shoff);
+    phoff = EHDR(e_phoff);
+    shstr = (char *)img + SHDR(EHDR(e_shstrndx), sh_offset);
+
+    for (i = 0; i < EHDR(e_shnum); i++) {
+        if (strcmp(shstr + SHDR(i, sh_name), ".pinit") != 0) {
+            continue;
+        }
+
+        offs = SHDR(i, sh_offset);
+        end = offs + SHDR(i, sh_size);
+        for (; offs < end; offs += wsize) {
+            for (addr = 0, k = wsize; k--; ) {
+                addr = addr << 8 | img[offs + k];
+            }
+
+            // find the word in the loaded image
+            //
+            for (j = 0, w = NULL; j < EHDR(e_phnum); j++) {
+                if (PHDR(j, p_type) == PT_LOAD && addr >= PHDR(j, p_vaddr) 
+                    && addr - PHDR(j, p_vaddr) < PHDR(j, p_filesz)) {
+                    w = img + PHDR(j, p_offset) + (addr - PHDR(j, p_vaddr));
+                    break;
+                }
+            }
+            if (w == NULL) {
+                fprintf(stderr, "b: %s: pointer at %lx is not in the program\n", out, addr);
+                fclose(fp);
+                free(img);
+                return 0;
+            }
+
+            for (val = 0, k = wsize; k--; ) {
+                val = val << 8 | w[k];
+            }
+            val >>= is64 ? 3 : 2;
+            for (p = w, k = 0; k < wsize; k++, val >>= 8) {
+                *p++ = val;
+            }
+        }
+    }
+
+    rewind(fp);
+    if (fwrite(img, 1, size, fp) != size || fclose(fp) != 0) {
+        perror(out);
+        free(img);
+        return 0;
+    }
+    free(img);
+
+    return 1;
+}
+
+// Add a -u flag for bar to 'flags' for each B name that the object
+// 'objf' refers to but does not define, so the library code it needs
+// is picked as well. B names are the symbols starting with _, or __
+// for a vector.
+//
+#define SYM(i, f) (is64 ? ((Elf64_Sym *)(img + symoff))[i].f : ((Elf32_Sym *)(img + symoff))[i].f)
+
+static char *
+undefs(const char *objf, char *flags)
+{
+    FILE *fp;
+    unsigned char *img;
+    unsigned long size, shoff, symoff, strtab, nsyms, k;
+    const char *name;
+    char *nf;
+    int is64, i;
+
+    if ((fp = fopen(objf, "rb")) == NULL) {
+        return flags;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+    img = safemalloc(size + 1);
+    if (fread(img, 1, size, fp) != size || size < sizeof(Elf32_Ehdr) 
+        || memcmp(img, ELFMAG, SELFMAG) != 0) {
+        fclose(fp);
+        free(img);
+        return flags;
+    }
+    fclose(fp);
+    img[size] = '\0';
+
+    is64 = img[EI_CLASS] == ELFCLASS64;
+    shoff = EHDR(e_shoff);
+    if (shoff > size || EHDR(e_shnum) * (unsigned long)EHDR(e_shentsize) > size - shoff) {
+        free(img);
+        return flags;
+    }
+
+    for (i = 0; i < EHDR(e_shnum); i++) {
+        if (SHDR(i, sh_type) != SHT_SYMTAB || SHDR(i, sh_link) >= EHDR(e_shnum)) {
+            continue;
+        }
+        symoff = SHDR(i, sh_offset);
+        nsyms = SHDR(i, sh_entsize) ? SHDR(i, sh_size) / SHDR(i, sh_entsize) : 0;
+        strtab = SHDR(SHDR(i, sh_link), sh_offset);
+        if (symoff > size || nsyms * SHDR(i, sh_entsize) > size - symoff || strtab > size) {
+            continue;
+        }
+
+        for (k = 1; k < nsyms; k++) {
+            if (SYM(k, st_shndx) != SHN_UNDEF || strtab + SYM(k, st_name) >= size) {
+                continue;
+            }
+            name = (char *)img + strtab + SYM(k, st_name);
+            if (name[0] != '_') {
+                continue;
+            }
+            name += name[1] == '_' ? 2 : 1;
+            nf = aprintf("%s-u %s ", flags, name);
+            free(flags);
+            flags = nf;
+        }
+    }
+
+    free(img);
+    return flags;
 }
 
 // Return the file extension of fn, which is always a 
@@ -554,7 +967,7 @@ aprintf(const char *fmt, ...)
 
     p = safemalloc(wrote + 1);
     va_start(arg, fmt);
-    vsnprintf(start, wrote + 1, fmt, arg);
+    vsnprintf(p, wrote + 1, fmt, arg);
     va_end(arg);
 
     return p;
@@ -57,6 +57,7 @@ struct ival {
         struct constant con;        // if constant, the value
         struct stabent *name;       // else the symbol
     } v; 
+    int strpoffs;                   // if a string, where it is in the pool
 };
 
 enum codeop {
@@ -74,11 +75,11 @@ enum codeop {
     OPSHSYM,                        // /pshsym/ symbol-value
     ODEREF,                         // addr /deref/ value-ateaddr 
     OSTORE,                         // p1 p0 /store/     ; mem[p1] = p0
-    OCALL,                          // pn pn-1 ... p0 fn /call(fn)/ pn pn-1 ... p0 retval 
+    OCALL,                          // pn pn-1 ... p0 fn /call(fn)/ pn pn-1 ... p0 ; T has retval
     OENTER,                         // push display pointer, set display pointer to current 
                                     // stack, and reserve 'n' stack slots
     OLEAVE,                         // pop 'n' stack slots, pop dp  
-    ORET,                           // return 
+    ORET,                           // return ; T has retval
     OAVINIT,                        // initialize the auto vector at offset 'n'
 
     OADD,                           // a1 a0 /add/ a1+a0
@@ -102,6 +103,33 @@ enum codeop {
     OGT,                            // a1 a0 /gt/  a1>a0
     OCASE,                          // disc /case/ disc if not taken
                                     // disc /case/      if taken
+
+    // conditional branches. these pop their operands and jump if the
+    // condition holds
+    OBNZ,                           //    a0 /bnz/  branch if a0!=0
+    OBEQ,                           // a1 a0 /beq/  branch if a1==a0
+    OBNE,                           // a1 a0 /bne/  branch if a1!=a0
+    OBLE,                           // a1 a0 /ble/  branch if a1<=a0
+    OBLT,                           // a1 a0 /blt/  branch if a1<a0
+    OBGE,                           // a1 a0 /bge/  branch if a1>=a0
+    OBGT,                           // a1 a0 /bgt/  branch if a1>a0
+
+    // indexed access to vector elements. the address is the sum of
+    // the (word) pointer and index, as for v[i]
+    OLDX,                           // a1 a0 /ldx/  mem[a1+a0]
+    OSTX,                           // a2 a1 a0 /stx/ a0 ; mem[a2+a1] = a0
+
+    // in-place updates of a variable, or of the vector element a1[a0] 
+    // on the stack if there is no variable. each pushes its result 
+    // unless it is marked as discarded
+    OINC,                           // /inc/ ++v
+    ODEC,                           // /dec/ --v
+    OPOSTINC,                       // /postinc/ v++
+    OPOSTDEC,                       // /postdec/ v--
+    OADDTO,                         // a0 /addto/ v =+ a0
+    OSUBTO,                         // a0 /subto/ v =- a0
+    OANDTO,                         // a0 /andto/ v =& a0
+    OORTO,                          // a0 /orto/ v =| a0
 };
 
 struct codenode {
@@ -118,6 +146,10 @@ struct codenode {
             unsigned disc;
             struct stabent *label;
         } caseval;
+        struct {
+            struct stabent *target; // variable, or NULL for a vector element
+            int discard;            // the result isn't used
+        } rmw;
     } arg;
 };
 
@@ -1,34 +1,112 @@
 #include <assert.h>
+#include <stdarg.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
+#include "belf.h"
 #include "bif.h"
 #include "b.h"
 
 static int err = 0;
 static char *srcfname;
 static char *outfname;
-static FILE *fin;
+static const unsigned char *inp;       // the input file, mapped
+static size_t inlen;
+static size_t inpos;                    // where it is being read
+static int ineof;                       // a read went past the end
+static int inmapped;                    // or else read into memory
 static FILE *fout;
+static int profgen = 0;
+static int superops = 1;
+static int native = 0;
+static int regs = 0;
+static int calls = 0;
+static int tokens = 0;
+static int objout = 0;                  // write an object file, not assembly
+static int jobs = 1;                    // processes writing functions
+static const char *lblfmt = "$%d";
+static const char *tname = "i386";   // target
+static int wordsize = 4;                // bytes in a word on the target
+static const char *wordop = ".int";     // directive for a word
+static unsigned char *strrefs;          // how each pool offset is referred to
+static char sectname[MAXNAM + 24];      // the section last switched to
+static int bifver = 1;                  // of the intermediate file
+static unsigned bifoffs[BIFSMAX + 1];   // file offset of each version 2 section
+static unsigned bifsize[BIFSMAX + 1];
+static char *names;                     // version 2 name table
+static unsigned nnames;
+static unsigned *funcoffs;              // version 2 function index
+static int nfuncs;
+static unsigned nstrrefs;
+
+#define STRCODE 1                       // pushed by code
+#define STRDATA 2                       // initializes a datum
+
+// placement of a function's code, from a function ordering
+// file or a profile
+//
+struct fnorder {
+    struct fnorder *next;
+    char name[MAXNAM + 1];
+    int rank;                   // position among hot functions, or -1 if cold
+    unsigned count;             // entry count, if from a profile
+};
+
+#define ORDHASH 1024
+static struct fnorder *ordtab[ORDHASH];
 
 static void wrheader(void);
 static void wrdata(void);
 static void wrcode(void);
+static void wrjobs(int ncode);
+static void wrfunc(int i);
 static void wrstrp(void);
 static void wrname(const char *name);
+static void wrprof(const char *fn, int fnum, int id);
+static void emit(const char *op, const char *fmt, ...);
+static void flushinst(void);
+static void wrnative(const char *op, const char *args);
+static void wrtoken(const char *op, const char *args);
+static int rmwtemplate(const char *op, int *mode);
+static void radd(const char *op, const char *args);
+static void rfunc(void);
+static int rdopen(const char *fn);
+static void rdclose(void);
 static unsigned rdbytes(int bytes);
+static void rdchars(char *buf, int n);
 static void rdname(char *name);
+static int rdorder(const char *fn);
+static int rdprof(const char *fn);
+static const char *fnsect(const char *fn, char *buf);
+static const char *strref(unsigned offs, int how, char *buf);
+static void wrascii(const char *p, int n);
+static void wrsect(const char *name);
+static void pushsect(const char *name, const char *flags);
+static void popsect(void);
+static void wralign(int align);
+static void wrzero(int n);
+static void wrlabel(const char *name);
+static void wrword(const char *fmt, ...);
+static unsigned rdint(void);
+static void rdhead(void);
+static void bifseek(int sect);
 
 #define RDBYTE() rdbytes(1)
-#define RDINT() rdbytes(INTSIZE)
+#define RDINT() rdint()
 
 static void
 usage()
 {
-    fprintf(stderr, "ba: [-o outfile] infile\n");
+    fprintf(stderr, "ba: [-c] [-fprofile-generate] [-fprofile-use=file] [-ffunction-order=file]\n");
+    fprintf(stderr, "    [-fno-superops] [-j jobs] [-m threaded|token|call|native|reg] [-t i386|i386-tos|x86_64]\n");
+    fprintf(stderr, "    [-o outfile] infile\n");
     exit(1);
 }
 
@@ -49,7 +127,7 @@ mkoutf(const char *inf)
     out = malloc(l + 3);
     memcpy(out, inf, l);
     out[l] = '.';
-    out[l+1] = 's';
+    out[l+1] = objout ? 'o' : 's';
     out[l+2] = '\0';
 
     return out;
@@ -61,12 +139,73 @@ main(int argc, char **argv)
     int outfail;
     int ch;
 
-    while ((ch = getopt(argc, argv, "o:")) != -1) {
+    while ((ch = getopt(argc, argv, "cf:j:m:o:t:")) != -1) {
         switch (ch) {
+        case 'c':
+            objout = 1;
+            break;
+
+        case 'f':
+            if (strcmp(optarg, "profile-generate") == 0) {
+                profgen = 1;
+            } else if (strncmp(optarg, "profile-use=", 12) == 0) {
+                if (rdprof(optarg + 12)) {
+                    return 1;
+                }
+            } else if (strcmp(optarg, "no-superops") == 0) {
+                superops = 0;
+            } else if (strncmp(optarg, "function-order=", 15) == 0) {
+                if (rdorder(optarg + 15)) {
+                    return 1;
+                }
+            } else {
+                usage();
+            }
+            break;
+
+        case 'm':
+            if (strcmp(optarg, "native") == 0) {
+                native = 1;
+                lblfmt = ".Lb%d";
+            } else if (strcmp(optarg, "token") == 0) {
+                tokens = 1;
+                lblfmt = ".Lb%d";
+            } else if (strcmp(optarg, "call") == 0) {
+                native = 1;
+                calls = 1;
+                lblfmt = ".Lb%d";
+            } else if (strcmp(optarg, "reg") == 0) {
+                native = 1;
+                regs = 1;
+                lblfmt = ".Lb%d";
+            } else if (strcmp(optarg, "threaded") != 0) {
+                usage();
+            }
+            break;
+
+        case 'j':
+            if ((jobs = atoi(optarg)) < 1) {
+                usage();
+            }
+            break;
+
         case 'o':
             outfname = optarg;
             break;
 
+        case 't':
+            // i386-tos is the i386 runtime which keeps the top of the
+            // stack in a register. threaded code is the same for both.
+            //
+            tname = optarg;
+            if (strcmp(optarg, "x86_64") == 0) {
+                wordsize = 8;
+                wordop = ".quad";
+            } else if (strcmp(optarg, "i386") != 0 && strcmp(optarg, "i386-tos") != 0) {
+                usage();
+            }
+            break;
+
         default:
             usage();
             break;
@@ -78,21 +217,38 @@ main(int argc, char **argv)
     }
     srcfname = argv[optind];
 
+    if ((native || tokens) && strcmp(tname, "i386") != 0) {
+        fprintf(stderr, "ba: only direct threaded code is generated for %s\n", tname);
+        return 1;
+    }
+
+    if (objout && (native || tokens || wordsize != 4)) {
+        fprintf(stderr, "ba: objects are only written for i386 threaded code\n");
+        return 1;
+    }
+
     if (outfname == NULL) {
         outfname = mkoutf(srcfname);
     }
 
-    if ((fin = fopen(srcfname, "rb")) == NULL) {
-        perror(srcfname);
+    if (rdopen(srcfname)) {
         return 1;
     }
 
-    if ((fout = fopen(outfname, "w")) == NULL) {
+    if ((fout = fopen(outfname, objout ? "wb" : "w")) == NULL) {
         perror(outfname);
         return 1;
     }
 
-    if (RDINT() != BIFMAGIC) {
+    switch (RDINT()) {
+    case BIFMAGIC:
+        break;
+
+    case BIFMAGIC2:
+        rdhead();
+        break;
+
+    default:
         fprintf(stderr, "%s: not an intermediate file\n", srcfname);
         err = 1;
     }
@@ -102,12 +258,16 @@ main(int argc, char **argv)
     wrcode();
     wrstrp();
 
-    if (feof(fin)) {
+    if (objout && !err && elfwrite(fout)) {
+        err = 1;
+    }
+
+    if (ineof) {
         fprintf(stderr, "premature end of file on %s\n", srcfname);
         err = 1;
     }
 
-    fclose(fin);
+    rdclose();
 
     outfail = ferror(fout);
     if (fclose(fout) == -1 || outfail) {
@@ -146,14 +306,29 @@ mksname(const char *srcname)
     return sname;
 }
 
-// Insert a pointer initializer 
+// Insert a pointer initializer: list the word just written in .pinit,
+// for b to shift into a pointer once the program is linked. Each
+// section has its own .pinit, which the linker keeps only if it keeps
+// the section.
 //
 void
 pinit()
 {
+    int sect;
+    unsigned offs;
+
+    if (objout) {
+        sect = elfcursect();
+        offs = elfoffset() - 4;
+        elfpushlinked(".pinit");
+        elfsectword(sect, offs);
+        elfpopsection();
+        return;
+    }
+
     fprintf(fout, "0:\n");
-    fprintf(fout, "    .pushsection .pinit, \"aw\", @progbits\n");
-    fprintf(fout, "    .int 0b-4\n");
+    fprintf(fout, "    .pushsection .pinit, \"ao\", @progbits, %s\n", sectname);
+    fprintf(fout, "    %s 0b-%d\n", wordop, wordsize);
     fprintf(fout, "    .popsection\n");
 }
 
@@ -164,56 +339,70 @@ wrdata(void)
 {
     int i, j;
     int fl, type;
-    int ndata = RDINT();
+    int ndata;
     int ninit;
     char uname[MAXNAM+1];
     char name[MAXNAM];
     char exname[MAXNAM];
+    char sbuf[32];
+    char sect[MAXNAM + 8];
     int vecsize;
 
-    if (feof(fin)) {
+    bifseek(BIFSDATA);
+    ndata = RDINT();
+    if (ineof) {
         return;
     } 
     
-    if (ndata) {
-        fprintf(fout, "    .data\n");
-    }
-
+    // each datum has its own section, which the linker drops if
+    // nothing refers to it
+    //
     for (i = 0; i < ndata; i++) {
         rdname(name);
 
         fl = RDBYTE();
+        vecsize = (fl & BIFVEC) ? RDINT() : 0;
+        ninit = RDINT();
+
+        sprintf(sect, ".data.%s", name);
+        wrsect(sect);
+
         if (fl & BIFVEC) {
+            // a vector with no initial values only needs space, which
+            // the loader clears
+            //
+            if (ninit == 0) {
+                sprintf(sect, ".bss.%s", name);
+                wrsect(sect);
+            }
             sprintf(uname, "_%s", name);
             wrname(uname);
-            vecsize = RDINT();
 
         } else {
             wrname(name);
         }
 
-        ninit = RDINT();
         for (j = 0; j < ninit; j++) {
             type = RDBYTE();
             switch (type) {
             case BIFINAM:
                 rdname(exname);
-                fprintf(fout, "    .int _%s\n", exname);
+                wrword("_%s", exname);
                 pinit();
                 break;
 
             case BIFIVEC:
                 rdname(exname);
-                fprintf(fout, "    .int __%s\n", exname);
+                wrword("__%s", exname);
                 pinit();
                 break;
 
             case BIFIINT:
-                fprintf(fout, "    .int %u\n", RDINT());
+                wrword("%d", (int)RDINT());
                 break;
 
             case BIFISTR:
-                fprintf(fout, "    .int strp + %u\n", RDINT());
+                wrword("%s", strref(RDINT(), STRDATA, sbuf));
                 pinit();
                 break;
             }
@@ -221,13 +410,14 @@ wrdata(void)
 
         if (fl & BIFVEC) {
             if (vecsize > ninit) {
-                fprintf(fout, "    .align 4\n");
-                fprintf(fout, "    .rept %d\n", vecsize - ninit);
-                fprintf(fout, "    .int 0\n");
-                fprintf(fout, "    .endr\n");
+                wrzero((vecsize - ninit) * wordsize);
+            }
+            if (ninit == 0) {
+                sprintf(sect, ".data.%s", name);
+                wrsect(sect);
             }
             wrname(name);
-            fprintf(fout, "    .int __%s\n", name);
+            wrword("__%s", name);
             pinit();
         }
     }
@@ -267,9 +457,48 @@ static struct {
     { OLE,    "LE" },
     { OGT,    "GT" },
     { OGE,    "GE" },
+    { OLDX,   "LDX" },
+    { OSTX,   "STX" },
 };
 static int nsimpleops = sizeof(simpleops) / sizeof(simpleops[0]);
 
+// ops which take a branch target as their only argument
+//
+static struct {
+    enum codeop op;
+    const char *text;
+} branchops[] = {
+    { OJMP,   "JMP" },
+    { OBZ,    "BZ" },
+    { OBNZ,   "BNZ" },
+    { OBEQ,   "BEQ" },
+    { OBNE,   "BNE" },
+    { OBLE,   "BLE" },
+    { OBLT,   "BLT" },
+    { OBGE,   "BGE" },
+    { OBGT,   "BGT" },
+};
+static int nbranchops = sizeof(branchops) / sizeof(branchops[0]);
+
+// in-place update ops, by addressing mode (extrn, auto, vector
+// element), for when the result is used and when it is discarded
+//
+static struct {
+    enum codeop op;
+    const char *used[3];
+    const char *discard[3];
+} rmwops[] = {
+    { OINC,     { "PREINCS", "PREINCA", "PREINCX" },    { "INCS", "INCA", "INCX" } },
+    { ODEC,     { "PREDECS", "PREDECA", "PREDECX" },    { "DECS", "DECA", "DECX" } },
+    { OPOSTINC, { "POSTINCS", "POSTINCA", "POSTINCX" }, { "INCS", "INCA", "INCX" } },
+    { OPOSTDEC, { "POSTDECS", "POSTDECA", "POSTDECX" }, { "DECS", "DECA", "DECX" } },
+    { OADDTO,   { "ADDTOS", "ADDTOA", "ADDTOX" },       { "ADDTOPS", "ADDTOPA", "ADDTOPX" } },
+    { OSUBTO,   { "SUBTOS", "SUBTOA", "SUBTOX" },       { "SUBTOPS", "SUBTOPA", "SUBTOPX" } },
+    { OANDTO,   { "ANDTOS", "ANDTOA", "ANDTOX" },       { "ANDTOPS", "ANDTOPA", "ANDTOPX" } },
+    { OORTO,    { "ORTOS", "ORTOA", "ORTOX" },          { "ORTOPS", "ORTOPA", "ORTOPX" } },
+};
+static int nrmwops = sizeof(rmwops) / sizeof(rmwops[0]);
+
 // find a simple op (no args)
 //
 static const char *
@@ -284,6 +513,34 @@ simpop(int n)
     return NULL;
 }
 
+// find a branch op
+//
+static const char *
+brop(int n)
+{
+    int i;
+    for (i = 0; i < nbranchops; i++) {
+        if (branchops[i].op == n) {
+            return branchops[i].text;
+        }
+    }
+    return NULL;
+}
+
+// find an in-place update op
+//
+static int
+rmwop(int n)
+{
+    int i;
+    for (i = 0; i < nrmwops; i++) {
+        if (rmwops[i].op == n) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 // Adjust an offset for an automatic variable or arg based on
 // the stack frame layout
 //   |   arg n   |
@@ -307,215 +564,2682 @@ adjauto(unsigned offs)
         soffs += 2;
     }
 
-    // scale to target INTSIZE
+    // scale to the target word size
     //
-    soffs *= INTSIZE;
+    soffs *= wordsize;
 
     return soffs;
 }
 
-// Write out functions
+// Superinstructions. Each entry replaces a run of threaded ops with one
+// combined op, which takes the operands of the original ops in order.
+// Runs are matched as each instruction is queued, so an entry may be
+// written in terms of earlier combined ops, and an empty replacement
+// deletes the run. Patterns never span a label, so nothing can branch
+// into the middle of one. To add an entry, implement the combined op
+// in blib.s.
 //
-void
-wrcode(void)
-{
-    int ncode = RDINT();
-    int i;
-    int j, nex, ninst, op, n, offs;
-    char fn[MAXNAM + 1], name[MAXNAM + 1];
-    const char *opcode;
-    char *extrns;
+static struct {
+    const char *seq;            // ops to match, separated by spaces
+    const char *op;             // the op to replace them with
+} superopt[] = {
+    { "PSHAUTO DEREF",      "LDAUTO" },
+    { "PSHSYM DEREF",       "LDSYM" },
+    { "PSHCON ADD",         "ADDCON" },
+    { "PSHCON SUB",         "SUBCON" },
+    { "PSHCON MUL",         "MULCON" },
+    { "PSHCON MOD",         "MODCON" },
+    { "DUPN DEREF CALL",    "CALLN" },
+    { "DUP ROT STORE",      "ASSIGN" },
+    { "ASSIGN POP",         "STORE" },
+    { "PUSHT POP",          "" },
+    { "LDAUTO LDX",         "LDXA" },
+    { "PSHCON LDX",         "LDXC" },
+    { "LDAUTO LDAUTO LDX",  "LDXAA" },
+    { "LDSYM LDAUTO LDX",   "LDXSA" },
+    { "STX POP",            "STXP" },
+};
+static int nsuperopt = sizeof(superopt) / sizeof(superopt[0]);
+
+#define MAXSEQ 4                // longest pattern in superopt
+#define MAXARGS 64
+
+// the most recent instructions, waiting to be matched against superopt
+//
+static struct inst {
+    const char *op;
+    char args[MAXARGS];
+} window[MAXSEQ];
+static int nwindow;
 
-    if (ncode) {
-        fprintf(fout, "    .text\n");
+// write out one instruction
+//
+static void
+wrinst(struct inst *in)
+{
+    char *p, *q;
+
+    if (native) {
+        wrnative(in->op, in->args);
+    } else if (tokens) {
+        wrtoken(in->op, in->args);
+    } else if (objout) {
+        wrword("%s", in->op);
+        for (p = in->args; *p; p = q) {
+            if ((q = strstr(p, ", ")) != NULL) {
+                *q = '\0';
+                q += 2;
+            } else {
+                q = p + strlen(p);
+            }
+            wrword("%s", p);
+        }
+    } else if (in->args[0]) {
+        fprintf(fout, "    %s %s, %s\n", wordop, in->op, in->args);
+    } else {
+        fprintf(fout, "    %s %s\n", wordop, in->op);
     }
+}
 
-    for (i = 0; i < ncode; i++) {
-        rdname(fn);
-        wrname(fn);
+// Return the number of instructions at the end of the window matched
+// by the pattern 'seq', or 0 if it doesn't match
+//
+static int
+matchseq(const char *seq)
+{
+    const char *p;
+    int i, l, n;
 
-        fprintf(fout, "    .int .+4\n");
-        pinit();
-        
-        // TODO don't really need this?
-        nex = RDINT();
-        extrns = malloc(nex * (MAXNAM + 1));
-        if (!extrns) {
-            err = 1;
-            fprintf(stderr, "out of memory\n");
-            return;
+    for (n = 0, p = seq; *p; n++) {
+        p += strcspn(p, " ");
+        p += strspn(p, " ");
+    }
+    if (n > nwindow) {
+        return 0;
+    }
+
+    for (i = nwindow - n; *seq; i++) {
+        l = strcspn(seq, " ");
+        if (strncmp(window[i].op, seq, l) || window[i].op[l]) {
+            return 0;
         }
-        for (j = 0; j < nex; j++) {
-            rdname(extrns + j * (MAXNAM + 1));
+        seq += l;
+        seq += strspn(seq, " ");
+    }
+    return n;
+}
+
+// Replace the longest pattern at the end of the window with its
+// superinstruction. Returns 0 if nothing matched.
+//
+static int
+combine(void)
+{
+    int i, n, best = -1, nbest = 0;
+    struct inst sup;
+
+    for (i = 0; i < nsuperopt; i++) {
+        if ((n = matchseq(superopt[i].seq)) > nbest) {
+            best = i;
+            nbest = n;
         }
+    }
+    if (best == -1) {
+        return 0;
+    }
 
-        ninst = RDINT();
-        for (j = 0; j < ninst; j++) {
-            op = RDBYTE();
-            if ((opcode = simpop(op)) != NULL) {
-                fprintf(fout, "    .int %s\n", opcode);
-                continue;
+    sup.op = superopt[best].op;
+    sup.args[0] = '\0';
+    for (i = nwindow - nbest; i < nwindow; i++) {
+        if (window[i].args[0]) {
+            if (sup.args[0]) {
+                strcat(sup.args, ", ");
             }
+            strcat(sup.args, window[i].args);
+        }
+    }
 
-            switch (op) {
-            case ONAMDEF:
-                fprintf(fout, "$%d:\n", RDINT());
-                break;
+    nwindow -= nbest;
+    if (sup.op[0]) {
+        window[nwindow++] = sup;
+    }
+    return 1;
+}
 
-            case OJMP:
-            case OBZ:
-                fprintf(fout, "    .int %s, $%d\n", (op == OJMP) ? "JMP" : "BZ", RDINT());
-                break;
+// Queue an instruction, given the op and a format for its operands.
+// The oldest instruction is written out once the window is full, as
+// it can no longer be part of a pattern.
+//
+void
+emit(const char *op, const char *fmt, ...)
+{
+    va_list args;
+    struct inst *in;
+    char buf[MAXARGS];
+
+    if (regs) {
+        va_start(args, fmt);
+        vsnprintf(buf, MAXARGS, fmt, args);
+        va_end(args);
+        radd(op, buf);
+        return;
+    }
 
-            case OCASE:
-                fprintf(fout, "    .int CASE, ");
-                fprintf(fout, "%u, ", RDINT());
-                fprintf(fout, "$%d\n", RDINT());
-                break;
+    if (nwindow == MAXSEQ) {
+        wrinst(&window[0]);
+        memmove(window, window + 1, --nwindow * sizeof(struct inst));
+    }
 
-            case OPOPN:
-                fprintf(fout, "    .int POPN, %u\n", INTSIZE * RDINT());
-                break;
+    in = &window[nwindow++];
+    in->op = op;
+    va_start(args, fmt);
+    vsnprintf(in->args, MAXARGS, fmt, args);
+    va_end(args);
 
-            case ODUPN:
-                fprintf(fout, "    .int DUPN, %u\n", INTSIZE * RDINT());
-                break;
+    if (superops) {
+        while (combine())
+            ;
+    }
+}
 
-            case OENTER:
-                fprintf(fout, "    .int ENTER, %u\n", INTSIZE * RDINT());
-                break;
+// Write out all queued instructions, at a label or the end of a
+// function.
+//
+void
+flushinst(void)
+{
+    int i;
 
-            case OAVINIT:
-                fprintf(fout, "    .int AVINIT, %d\n", INTSIZE * RDINT());
-                break;
+    for (i = 0; i < nwindow; i++) {
+        wrinst(&window[i]);
+    }
+    nwindow = 0;
+}
 
-            case OPSHCON:
-                if (RDBYTE()) {
-                    // strcon
-                    fprintf(fout, "    .int PSHSYM, strp + %u\n", RDINT());
-                } else {
-                    // intcon
-                    fprintf(fout, "    .int PSHCON, %u\n", RDINT());
-                }
-                break;
+// Native code templates. With -m native, each op (including the
+// superinstructions) is expanded inline from the body of its handler
+// in blib.s instead of being threaded. @1, @2 and @3 stand for the 
+// op's operands, and ';' separates instructions. The machine stack,
+// EBP and EBX (T) are used just as the handlers use them, so threaded
+// and native functions can call each other through CALL and RET.
+//
+static struct {
+    const char *op;
+    const char *text;
+} templates[] = {
+    { "ENTER",      "push %ebp; mov %esp, %ebp; sub $@1, %esp" },
+    { "LEAVE",      "mov %ebp, %esp; pop %ebp" },
+    { "RET",        "pop %ecx; jmp *(%ecx)" },
+    { "AVINIT",     "lea @1+4(%ebp), %edx; shr $2, %edx; mov %edx, @1(%ebp)" },
+
+    // a call pushes the address of a word holding the address to
+    // return to, as CALL does for threaded code
+    { "CALL",       "pop %ecx; shl $2, %ecx; push $8f; jmp *(%ecx); 8: .int 9f; 9:" },
+    { "CALLN",      "mov @1(%esp), %ecx; shl $2, %ecx; mov (%ecx), %ecx; shl $2, %ecx;"
+                    "push $8f; jmp *(%ecx); 8: .int 9f; 9:" },
+
+    { "JMP",        "jmp @1" },
+    { "BZ",         "pop %eax; test %eax, %eax; jz @1" },
+    { "BNZ",        "pop %eax; test %eax, %eax; jnz @1" },
+    { "BEQ",        "pop %eax; pop %edx; cmp %eax, %edx; je @1" },
+    { "BNE",        "pop %eax; pop %edx; cmp %eax, %edx; jne @1" },
+    { "BLE",        "pop %eax; pop %edx; cmp %eax, %edx; jle @1" },
+    { "BLT",        "pop %eax; pop %edx; cmp %eax, %edx; jl @1" },
+    { "BGE",        "pop %eax; pop %edx; cmp %eax, %edx; jge @1" },
+    { "BGT",        "pop %eax; pop %edx; cmp %eax, %edx; jg @1" },
+    { "CASE",       "cmpl $@1, (%esp); jne 9f; add $4, %esp; jmp @2; 9:" },
+
+    { "PSHCON",     "push $@1" },
+    { "PSHSYM",     "mov $@1, %eax; shr $2, %eax; push %eax" },
+    { "PSHAUTO",    "lea @1(%ebp), %eax; shr $2, %eax; push %eax" },
+    { "DEREF",      "pop %edx; push (,%edx,4)" },
+    { "STORE",      "pop %eax; pop %edx; mov %eax, (,%edx,4)" },
+    { "ROT",        "pop %eax; pop %edx; pop %esi; push %eax; push %esi; push %edx" },
+    { "PUSHT",      "push %ebx" },
+    { "POPT",       "pop %ebx" },
+    { "DUP",        "push (%esp)" },
+    { "DUPN",       "push @1(%esp)" },
+    { "POP",        "add $4, %esp" },
+    { "POPN",       "add $@1, %esp" },
+    { "PROF",       "incl @1" },
+    { "LDX",        "pop %eax; pop %edx; add %eax, %edx; push (,%edx,4)" },
+    { "STX",        "pop %eax; pop %edx; add (%esp), %edx; mov %eax, (,%edx,4); mov %eax, (%esp)" },
+
+    { "ADD",        "pop %eax; add %eax, (%esp)" },
+    { "SUB",        "pop %eax; sub %eax, (%esp)" },
+    { "NEG",        "negl (%esp)" },
+    { "NOT",        "pop %eax; push $0; test %eax, %eax; setz (%esp)" },
+    { "SHR",        "pop %ecx; shrl %cl, (%esp)" },
+    { "SHL",        "pop %ecx; shll %cl, (%esp)" },
+    { "AND",        "pop %eax; and %eax, (%esp)" },
+    { "OR",         "pop %eax; or %eax, (%esp)" },
+    { "DIV",        "pop %esi; pop %eax; cltd; idiv %esi; push %eax" },
+    { "MOD",        "pop %esi; pop %eax; cltd; idiv %esi; push %edx" },
+    { "MUL",        "pop %eax; imul (%esp), %eax; mov %eax, (%esp)" },
+    { "EQ",         "pop %eax; pop %edx; push $0; cmp %eax, %edx; sete (%esp)" },
+    { "NE",         "pop %eax; pop %edx; push $0; cmp %eax, %edx; setne (%esp)" },
+    { "LT",         "pop %eax; pop %edx; push $0; cmp %eax, %edx; setl (%esp)" },
+    { "LE",         "pop %eax; pop %edx; push $0; cmp %eax, %edx; setle (%esp)" },
+    { "GT",         "pop %eax; pop %edx; push $0; cmp %eax, %edx; setg (%esp)" },
+    { "GE",         "pop %eax; pop %edx; push $0; cmp %eax, %edx; setge (%esp)" },
+
+    // superinstructions
+    { "LDAUTO",     "push @1(%ebp)" },
+    { "LDSYM",      "push @1" },
+    { "ADDCON",     "addl $@1, (%esp)" },
+    { "SUBCON",     "subl $@1, (%esp)" },
+    { "MULCON",     "imul $@1, (%esp), %eax; mov %eax, (%esp)" },
+    { "MODCON",     "pop %eax; mov $@1, %esi; cltd; idiv %esi; push %edx" },
+    { "ASSIGN",     "pop %eax; pop %edx; mov %eax, (,%edx,4); push %eax" },
+    { "LDXA",       "pop %edx; add @1(%ebp), %edx; push (,%edx,4)" },
+    { "LDXC",       "pop %edx; push @1*4(,%edx,4)" },
+    { "LDXAA",      "mov @1(%ebp), %edx; add @2(%ebp), %edx; push (,%edx,4)" },
+    { "LDXSA",      "mov @1, %edx; add @2(%ebp), %edx; push (,%edx,4)" },
+    { "STXP",       "pop %eax; pop %edx; pop %esi; add %esi, %edx; mov %eax, (,%edx,4)" },
+};
+static int ntemplates = sizeof(templates) / sizeof(templates[0]);
 
-            case OPSHSYM:
-                if (RDBYTE() == 0) {
-                    // extrn
-                    fprintf(fout, "    .int PSHSYM, _%s\n", extrns + (MAXNAM + 1) * RDINT());
-                } else {
-                    offs = RDINT();
-                    fprintf(fout, "    .int PSHAUTO, %d\n", adjauto(offs));    
-                }
-                break;
+// In-place updates are put together from the addressing mode, which
+// gives any code to find the operand (@A) and the operand itself (@M),
+// and the update. The assignments pop their right hand side first.
+//
+static const char *rmwaddr[3][2] = {
+    { "", "@1" },
+    { "", "@1(%ebp)" },
+    { "pop %edx; pop %esi; add %esi, %edx;", "(,%edx,4)" },
+};
 
-            default:
-                fprintf(stderr, "internal error: intermediate op %d at %d not handled\n", op, (int)ftell(fin));
-                assert(0);
-            }
-        }
+static struct {
+    const char *prefix;         // op name, without the mode suffix
+    const char *text;
+} rmwtemplates[] = {
+    { "INC",        "incl @M" },
+    { "DEC",        "decl @M" },
+    { "PREINC",     "incl @M; push @M" },
+    { "PREDEC",     "decl @M; push @M" },
+    { "POSTINC",    "push @M; incl @M" },
+    { "POSTDEC",    "push @M; decl @M" },
+    { "ADDTO",      "pop %eax; @A add %eax, @M; push @M" },
+    { "SUBTO",      "pop %eax; @A sub %eax, @M; push @M" },
+    { "ANDTO",      "pop %eax; @A and %eax, @M; push @M" },
+    { "ORTO",       "pop %eax; @A or %eax, @M; push @M" },
+    { "ADDTOP",     "pop %eax; @A add %eax, @M" },
+    { "SUBTOP",     "pop %eax; @A sub %eax, @M" },
+    { "ANDTOP",     "pop %eax; @A and %eax, @M" },
+    { "ORTOP",      "pop %eax; @A or %eax, @M" },
+};
+static int nrmwtemplates = sizeof(rmwtemplates) / sizeof(rmwtemplates[0]);
+
+// With -m call, these ops are compiled to a call of their handler in
+// bcall.s. Control transfers, frame handling and ops no longer than
+// a call are still expanded inline from their templates. The first
+// operand is passed in ECX and the second in EAX.
+//
+static const char *callops[] = {
+    "ROT", "LDX", "STX", "ASSIGN", "STXP", "LDXA", "LDXAA", "LDXSA",
+    "NOT", "DIV", "MOD", "MUL", "MODCON", "EQ", "NE", "LT", "LE", "GT", "GE",
+    "ADDTOS", "SUBTOS", "ANDTOS", "ORTOS", "ADDTOA", "SUBTOA", "ANDTOA", "ORTOA",
+};
+static int ncallops = sizeof(callops) / sizeof(callops[0]);
+
+// Write out the call of an op's handler, if it has one. Returns 0 if
+// the op is to be expanded inline.
+//
+static int
+wrcall(const char *op, const char *args)
+{
+    static const char *argregs[] = { "%ecx", "%eax" };
+    char argbuf[MAXARGS];
+    char *p, *q;
+    int i, mode;
+
+    // every update of a vector element is called
+    //
+    for (i = 0; i < ncallops && strcmp(callops[i], op); i++)
+        ;
+    if (i == ncallops && (rmwtemplate(op, &mode) == -1 || mode != 2)) {
+        return 0;
     }
 
-    free(extrns);
+    strcpy(argbuf, args);
+    for (p = argbuf, i = 0; *p && i < 2; p = q, i++) {
+        if ((q = strstr(p, ", ")) != NULL) {
+            *q = '\0';
+            q += 2;
+        } else {
+            q = p + strlen(p);
+        }
+        fprintf(fout, "    mov $%s, %s\n", p, argregs[i]);
+    }
+    fprintf(fout, "    call c_%s\n", op);
+    return 1;
 }
 
-// Write the string pool
-// 
+// Write out the native code for an op with the given operands
+//
 void
-wrstrp()
+wrnative(const char *op, const char *args)
 {
-    const int perline = 8;
-    int i, j, m;
-    int n = RDINT();
-    
+    static const char modes[] = "SAX";
+    const char *argv[3], *text = NULL, *t;
+    char argbuf[MAXARGS], tbuf[256];
+    char *p, *q;
+    int i, l, argc = 0, mode;
 
-    if (n == 0) {
+    if (calls && wrcall(op, args)) {
         return;
     }
 
-    fprintf(fout, "    .data\n");
-    fprintf(fout, "    .local strp\n");
-    fprintf(fout, "    .align 4\n");
-    fprintf(fout, "strp:\n");
+    for (i = 0; i < ntemplates; i++) {
+        if (strcmp(templates[i].op, op) == 0) {
+            text = templates[i].text;
+            break;
+        }
+    }
+
+    for (i = 0; text == NULL && i < nrmwtemplates; i++) {
+        l = strlen(rmwtemplates[i].prefix);
+        if (strncmp(op, rmwtemplates[i].prefix, l) || op[l] == '\0' || op[l+1] != '\0' 
+            || (p = strchr(modes, op[l])) == NULL) {
+            continue;
+        }
+
+        // put together the template for this addressing mode. if
+        // there's no right hand side, the operand is found first
+        //
+        mode = p - modes;
+        q = tbuf;
+        t = rmwtemplates[i].text;
+        if (strstr(t, "@A") == NULL) {
+            q += sprintf(q, "%s", rmwaddr[mode][0]);
+        }
+        for (; *t; t++) {
+            if (t[0] == '@' && t[1] == 'M') {
+                q += sprintf(q, "%s", rmwaddr[mode][1]);
+                t++;
+            } else if (t[0] == '@' && t[1] == 'A') {
+                q += sprintf(q, "%s", rmwaddr[mode][0]);
+                t++;
+            } else {
+                *q++ = *t;
+            }
+        }
+        *q = '\0';
+        text = tbuf;
+    }
+
+    if (text == NULL) {
+        fprintf(stderr, "internal error: no native template for %s\n", op);
+        err = 1;
+        return;
+    }
 
-    for (i = 0; i < n; i += perline) {
-        fprintf(fout, "    .byte ");
-        m = n - i;
-        if (m > perline) {
-            m = perline;
+    strcpy(argbuf, args);
+    for (p = argbuf; *p && argc < 3; ) {
+        argv[argc++] = p;
+        if ((p = strstr(p, ", ")) == NULL) {
+            break;
         }
+        *p = '\0';
+        p += 2;
+    }
 
-        for (j = 0; j < m; j++) {
-            fprintf(fout, "0x%02x%c", RDBYTE() & 0xff, (j < m-1) ? ',' : '\n');
+    fprintf(fout, "    ");
+    for (; *text; text++) {
+        if (*text == ';') {
+            fprintf(fout, "\n    ");
+            text += strspn(text + 1, " ");
+        } else if (*text == '@' && text[1] >= '1' && text[1] <= '3') {
+            i = *++text - '1';
+            fprintf(fout, "%s", i < argc ? argv[i] : "0");
+        } else {
+            fputc(*text, fout);
         }
     }
+    fprintf(fout, "\n");
 }
 
-// write the asm file header
+// Token threaded code. With -m token, each op is written to .tcode
+// as a one byte opcode, the symbol tOP defined in btok.s, followed by
+// its operands as given here. n is a number, which is a byte unless
+// one doesn't fit, when the long form of the op (tOPL) is used with
+// words instead; w is a word; r is a branch target, as a 16 bit offset
+// from the end of the operand; and c is the word aligned return address
+// following a call. Ops not listed have no operands.
+//
+static struct {
+    const char *op;
+    const char *fmt;
+} tokops[] = {
+    { "ENTER",      "n" },
+    { "AVINIT",     "n" },
+    { "CALL",       "c" },
+    { "CALLN",      "nc" },
+    { "JMP",        "r" },
+    { "BZ",         "r" },
+    { "BNZ",        "r" },
+    { "BEQ",        "r" },
+    { "BNE",        "r" },
+    { "BLE",        "r" },
+    { "BLT",        "r" },
+    { "BGE",        "r" },
+    { "BGT",        "r" },
+    { "CASE",       "wr" },
+    { "PSHCON",     "n" },
+    { "PSHSYM",     "w" },
+    { "PSHAUTO",    "n" },
+    { "DUPN",       "n" },
+    { "POPN",       "n" },
+    { "PROF",       "w" },
+    { "LDAUTO",     "n" },
+    { "LDSYM",      "w" },
+    { "ADDCON",     "n" },
+    { "SUBCON",     "n" },
+    { "MULCON",     "n" },
+    { "MODCON",     "n" },
+    { "LDXA",       "n" },
+    { "LDXC",       "n" },
+    { "LDXAA",      "nn" },
+    { "LDXSA",      "wn" },
+};
+static int ntokops = sizeof(tokops) / sizeof(tokops[0]);
+
+// Write out the token threaded code for an op with the given operands
 //
 void
-wrheader(void)
+wrtoken(const char *op, const char *args)
 {
-    fprintf(fout, "# %s\n", srcfname);
+    static const char *rmwfmt[3] = { "w", "n", "" };
+    const char *argv[3], *fmt = "";
+    char argbuf[MAXARGS];
+    char *p, *end;
+    int i, argc = 0, mode, islong = 0;
+    long n;
+
+    for (i = 0; i < ntokops; i++) {
+        if (strcmp(tokops[i].op, op) == 0) {
+            fmt = tokops[i].fmt;
+            break;
+        }
+    }
+    if (i == ntokops && rmwtemplate(op, &mode) != -1) {
+        fmt = rmwfmt[mode];
+    }
+
+    strcpy(argbuf, args);
+    for (p = argbuf; *p && argc < 3; ) {
+        argv[argc++] = p;
+        if ((p = strstr(p, ", ")) == NULL) {
+            break;
+        }
+        *p = '\0';
+        p += 2;
+    }
+
+    for (i = 0; fmt[i] && i < argc; i++) {
+        if (fmt[i] == 'n') {
+            n = strtol(argv[i], &end, 10);
+            if (*end || n < -128 || n > 127) {
+                islong = 1;
+            }
+        }
+    }
+
+    fprintf(fout, "    .byte t%s%s\n", op, islong ? "L" : "");
+    for (i = 0; *fmt; fmt++) {
+        switch (*fmt) {
+        case 'n':
+            fprintf(fout, "    %s %s\n", islong ? ".int" : ".byte", i < argc ? argv[i] : "0");
+            i++;
+            break;
+
+        case 'w':
+            fprintf(fout, "    .int %s\n", i < argc ? argv[i] : "0");
+            i++;
+            break;
+
+        case 'r':
+            fprintf(fout, "    .short %s-.-2\n", i < argc ? argv[i] : ".");
+            i++;
+            break;
+
+        case 'c':
+            fprintf(fout, "    .balign 4, 0\n");
+            fprintf(fout, "    .int TRESUME\n");
+            break;
+        }
+    }
 }
 
+// Register allocating code generator. With -m reg, each function is
+// read in whole and compiled to x86 code which keeps the operand stack
+// in registers. Within a basic block the stack is simulated: an entry
+// may be a constant, the address of a name, or a value in a scratch
+// register (EAX, ECX, EDX), and is only pushed onto the machine stack
+// when the registers run out, or at a label, branch or call. Scalar
+// autos and arguments whose address is never taken are given ESI and
+// EDI by a linear scan over their live ranges; they are kept in
+// registers across basic blocks and only saved to their frame slots
+// around calls. EBP, EBX (T) and the machine stack are used just as
+// threaded code uses them, so code compiled this way calls and is
+// called through the usual CALL, ENTER and RET.
+//
+#define NSCRATCH    3
+#define NAUTOREG    2
+
+static const char *scratch[NSCRATCH] = { "%eax", "%ecx", "%edx" };
+static const char *scratchlo[NSCRATCH] = { "%al", "%cl", "%dl" };
+static const char *autoreg[NAUTOREG] = { "%esi", "%edi" };
+
+// an instruction or label (op NULL) of the function being compiled
+//
+struct rinst {
+    const char *op;
+    char args[MAXARGS];
+};
+static struct rinst *rcode;
+static int *rdepth;             // loop nesting depth of each instruction
+static int nrcode, maxrcode;
+
+// a scalar auto or argument, by frame offset
+//
+struct rauto {
+    int offs;
+    int start, end;             // live range, as indices into rcode
+    int weight;                 // references, weighted by loop depth
+    int reg;                    // index into autoreg, or -1 if in memory
+};
+static struct rauto *rautos;
+static int nrautos, maxrautos;
+
+// simulated operand stack entries
+//
+enum {
+    VSTK,                       // on the machine stack
+    VCON,                       // a constant
+    VSYMA,                      // address of an extrn (or a string)
+    VAUTOA,                     // address of an auto
+    VAREG,                      // value of an auto held in a register
+    VREG,                       // value in a scratch register
+};
+
+struct vent {
+    int kind;
+    int n;                      // register, auto offset or constant
+    char sym[MAXARGS];
+};
+
+#define VMAX 64
+static struct vent vstack[VMAX];
+static int nvstack;
+static int regrefs[NSCRATCH];   // vstack entries and held values using each register
+
 static void
-chkinerr(void)
+rout(const char *fmt, ...)
 {
-    if (feof(fin)) {
-        fprintf(stderr, "premature eof or I/O error on %s\n", srcfname);
-        fclose(fin);
-        fclose(fout);
-        remove(outfname);
-        exit(1);
-    }
+    va_list args;
+
+    fprintf(fout, "    ");
+    va_start(args, fmt);
+    vfprintf(fout, fmt, args);
+    va_end(args);
+    fprintf(fout, "\n");
 }
 
-// write a gloal name
+// queue an instruction or label of the current function
 //
-void 
-wrname(const char *name)
+static void
+radd(const char *op, const char *args)
 {
-    fprintf(
-        fout,
-            "    .align 4\n"
-            "    .global _%s\n"
-            "_%s:\n",
-        name,
-        name);
+    if (nrcode == maxrcode) {
+        maxrcode = maxrcode ? 2 * maxrcode : 256;
+        rcode = realloc(rcode, maxrcode * sizeof(struct rinst));
+        rdepth = realloc(rdepth, maxrcode * sizeof(int));
+        if (rcode == NULL || rdepth == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    rcode[nrcode].op = op;
+    strcpy(rcode[nrcode].args, args);
+    nrcode++;
 }
 
-// read an n byte integer
-// TODO some things should be unsigned
+// find or add the auto at frame offset 'offs'
 //
-unsigned
-rdbytes(int n)
+static struct rauto *
+rauto(int offs)
 {
-    int i, ch;
-    unsigned long ul = 0;
+    int i;
 
-    for (i = 0; i < n; i++) {
-        ch = fgetc(fin);
-        ul |= ((ch & 0xff) << (8*i));
+    for (i = 0; i < nrautos; i++) {
+        if (rautos[i].offs == offs) {
+            return &rautos[i];
+        }
     }
 
-    chkinerr();
-    return ul;
+    if (nrautos == maxrautos) {
+        maxrautos = maxrautos ? 2 * maxrautos : 16;
+        rautos = realloc(rautos, maxrautos * sizeof(struct rauto));
+        if (rautos == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    rautos[nrautos].offs = offs;
+    rautos[nrautos].start = -1;
+    rautos[nrautos].end = -1;
+    rautos[nrautos].weight = 0;
+    rautos[nrautos].reg = -1;
+    return &rautos[nrautos++];
+}
+
+// note a reference to an auto at instruction 'i'
+//
+static void
+rref(int offs, int i)
+{
+    struct rauto *ra = rauto(offs);
+
+    if (ra->start == -1 || i < ra->start) {
+        ra->start = i;
+    }
+    if (i > ra->end) {
+        ra->end = i;
+    }
+    ra->weight += 1 << 3 * (rdepth[i] < 3 ? rdepth[i] : 3);
+}
+
+// return the rmw template for an in-place update op, setting 'mode'
+// to its addressing mode, or -1 if 'op' isn't one
+//
+static int
+rmwtemplate(const char *op, int *mode)
+{
+    static const char modes[] = "SAX";
+    const char *p;
+    int i, l;
+
+    for (i = 0; i < nrmwtemplates; i++) {
+        l = strlen(rmwtemplates[i].prefix);
+        if (strncmp(op, rmwtemplates[i].prefix, l) == 0 && op[l] && op[l+1] == '\0'
+            && (p = strchr(modes, op[l])) != NULL) {
+            *mode = p - modes;
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int
+isbranch(const char *op)
+{
+    int i;
+
+    for (i = 0; i < nbranchops; i++) {
+        if (strcmp(branchops[i].text, op) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// return the index of label 'lbl' in rcode, or -1
+//
+static int
+rlabel(const char *lbl)
+{
+    int i;
+
+    for (i = 0; i < nrcode; i++) {
+        if (rcode[i].op == NULL && strcmp(rcode[i].args, lbl) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// return the branch target of instruction 'in', or NULL
+//
+static const char *
+rtarget(struct rinst *in)
+{
+    const char *p;
+
+    if (in->op == NULL) {
+        return NULL;
+    }
+    if (isbranch(in->op)) {
+        return in->args;
+    }
+    if (strcmp(in->op, "CASE") == 0 && (p = strstr(in->args, ", ")) != NULL) {
+        return p + 2;
+    }
+    return NULL;
+}
+
+// return the number of operands popped and results pushed by an op
+// which only uses the values of its operands
+//
+static void
+valeffect(const char *op, int *pops, int *pushes)
+{
+    *pops = 2;
+    *pushes = 1;
+    if (strcmp(op, "BZ") == 0 || strcmp(op, "BNZ") == 0 || strcmp(op, "POPT") == 0) {
+        *pops = 1;
+        *pushes = 0;
+    } else if (strcmp(op, "NEG") == 0 || strcmp(op, "NOT") == 0) {
+        *pops = 1;
+    } else if (strcmp(op, "STX") == 0) {
+        *pops = 3;
+    } else if (isbranch(op)) {
+        *pops = strcmp(op, "JMP") ? 2 : 0;
+        *pushes = 0;
+    } else if (strcmp(op, "ENTER") == 0 || strcmp(op, "LEAVE") == 0
+        || strcmp(op, "RET") == 0 || strcmp(op, "PROF") == 0) {
+        *pops = 0;
+        *pushes = 0;
+    }
+}
+
+// Find the autos which may be kept in registers. An auto qualifies if
+// its address is only ever used to load or store it; an address which
+// goes anywhere else (into arithmetic, a call, or across a label)
+// escapes. If any address escapes, nothing is kept in registers, since
+// B code may walk from one auto or argument to its neighbours.
+//
+static int
+rescape(void)
+{
+    int tags[VMAX];
+    int depth = 0, i, j, n, m, t, mode;
+    struct rinst *in;
+    const char *op;
+
+#define POPTAG() (depth ? tags[--depth] : -1)
+#define PUSHTAG(t) do { if (depth == VMAX) return 1; tags[depth++] = (t); } while (0)
+
+    for (i = 0; i < nrcode; i++) {
+        in = &rcode[i];
+        op = in->op;
+        if (op == NULL) {
+            for (j = 0; j < depth; j++) {
+                if (tags[j] != -1) {
+                    return 1;
+                }
+            }
+            continue;
+        }
+
+        if (strcmp(op, "PSHAUTO") == 0) {
+            n = atoi(in->args);
+            rref(n, i);
+            PUSHTAG(n);
+        } else if (strcmp(op, "PSHCON") == 0 || strcmp(op, "PSHSYM") == 0
+            || strcmp(op, "PUSHT") == 0) {
+            PUSHTAG(-1);
+        } else if (strcmp(op, "DEREF") == 0) {
+            POPTAG();
+            PUSHTAG(-1);
+        } else if (strcmp(op, "STORE") == 0) {
+            if (POPTAG() != -1) {
+                return 1;
+            }
+            POPTAG();
+        } else if (strcmp(op, "DUP") == 0) {
+            t = depth ? tags[depth - 1] : -1;
+            PUSHTAG(t);
+        } else if (strcmp(op, "DUPN") == 0) {
+            n = atoi(in->args) / wordsize;
+            t = n < depth ? tags[depth - 1 - n] : -1;
+            PUSHTAG(t);
+        } else if (strcmp(op, "ROT") == 0) {
+            if (depth < 3) {
+                return 1;
+            }
+            t = tags[depth - 1];
+            tags[depth - 1] = tags[depth - 2];
+            tags[depth - 2] = tags[depth - 3];
+            tags[depth - 3] = t;
+        } else if (strcmp(op, "POP") == 0) {
+            POPTAG();
+        } else if (strcmp(op, "POPN") == 0) {
+            for (n = atoi(in->args) / wordsize; n > 0; n--) {
+                POPTAG();
+            }
+        } else if (strcmp(op, "CALL") == 0) {
+            // the arguments, which the following POPN removes, are read
+            // by the callee
+            n = 0;
+            if (i + 1 < nrcode && rcode[i+1].op && strcmp(rcode[i+1].op, "POPN") == 0) {
+                n = depth - 1 - atoi(rcode[i+1].args) / wordsize;
+            }
+            for (j = n > 0 ? n : 0; j < depth; j++) {
+                if (tags[j] != -1) {
+                    return 1;
+                }
+            }
+            POPTAG();
+        } else if (strcmp(op, "AVINIT") == 0) {
+            return 1;
+        } else if (strcmp(op, "CASE") == 0) {
+            if (depth && tags[depth - 1] != -1) {
+                return 1;
+            }
+        } else if ((t = rmwtemplate(op, &mode)) != -1) {
+            if (strstr(rmwtemplates[t].text, "pop %eax") && POPTAG() != -1) {
+                return 1;
+            }
+            if (mode == 1) {
+                rref(atoi(in->args), i);
+            } else if (mode == 2) {
+                if (POPTAG() != -1 || POPTAG() != -1) {
+                    return 1;
+                }
+            }
+            if (strstr(rmwtemplates[t].text, "push")) {
+                PUSHTAG(-1);
+            }
+        } else {
+            // everything else only uses the values of its operands
+            valeffect(op, &n, &m);
+            for (; n > 0; n--) {
+                if (POPTAG() != -1) {
+                    return 1;
+                }
+            }
+            if (m) {
+                PUSHTAG(-1);
+            }
+        }
+    }
+    return 0;
+
+#undef POPTAG
+#undef PUSHTAG
+}
+
+static int
+cmpstart(const void *a, const void *b)
+{
+    return ((const struct rauto *)a)->start - ((const struct rauto *)b)->start;
+}
+
+// Give registers to autos by linear scan. Live ranges are stretched
+// over any loop they overlap, and an argument is live from the entry.
+// When there are more live autos than registers, the one with the
+// fewest references (counting those in loops more) stays in memory.
+//
+static void
+ralloc(void)
+{
+    struct rauto *active[NAUTOREG];
+    int nactive = 0;
+    int i, j, k, t, changed;
+    const char *lbl;
+
+    memset(rdepth, 0, nrcode * sizeof(int));
+    for (i = 0; i < nrcode; i++) {
+        if ((lbl = rtarget(&rcode[i])) != NULL && (t = rlabel(lbl)) != -1 && t < i) {
+            for (j = t; j <= i; j++) {
+                rdepth[j]++;
+            }
+        }
+    }
+
+    nrautos = 0;
+    if (rescape()) {
+        nrautos = 0;
+        return;
+    }
+
+    for (i = 0; i < nrautos; i++) {
+        if (rautos[i].offs > 0) {
+            rautos[i].start = 0;
+        }
+    }
+
+    do {
+        changed = 0;
+        for (i = 0; i < nrcode; i++) {
+            if ((lbl = rtarget(&rcode[i])) == NULL || (t = rlabel(lbl)) == -1 || t > i) {
+                continue;
+            }
+            for (j = 0; j < nrautos; j++) {
+                if (rautos[j].start <= i && rautos[j].end >= t
+                    && (rautos[j].start > t || rautos[j].end < i)) {
+                    if (rautos[j].start > t) {
+                        rautos[j].start = t;
+                    }
+                    if (rautos[j].end < i) {
+                        rautos[j].end = i;
+                    }
+                    changed = 1;
+                }
+            }
+        }
+    } while (changed);
+
+    qsort(rautos, nrautos, sizeof(struct rauto), cmpstart);
+
+    for (i = 0; i < nrautos; i++) {
+        for (j = 0; j < nactive; ) {
+            if (active[j]->end < rautos[i].start) {
+                active[j] = active[--nactive];
+            } else {
+                j++;
+            }
+        }
+
+        if (nactive < NAUTOREG) {
+            for (k = 0; k < NAUTOREG; k++) {
+                for (j = 0; j < nactive && active[j]->reg != k; j++)
+                    ;
+                if (j == nactive) {
+                    break;
+                }
+            }
+            rautos[i].reg = k;
+            active[nactive++] = &rautos[i];
+            continue;
+        }
+
+        for (k = 0, j = 1; j < nactive; j++) {
+            if (active[j]->weight < active[k]->weight) {
+                k = j;
+            }
+        }
+        if (active[k]->weight < rautos[i].weight) {
+            rautos[i].reg = active[k]->reg;
+            active[k]->reg = -1;
+            active[k] = &rautos[i];
+        }
+    }
+}
+
+// return the register holding the auto at 'offs', or -1
+//
+static int
+rautoreg(int offs)
+{
+    int i;
+
+    for (i = 0; i < nrautos; i++) {
+        if (rautos[i].offs == offs) {
+            return rautos[i].reg;
+        }
+    }
+    return -1;
+}
+
+// push simulated entries from the bottom up to and including 'top'
+// onto the machine stack. The address of an auto held in a register
+// can't go there; it only ever reaches a load or store.
+//
+static void
+vflushto(int top)
+{
+    struct vent *v;
+    int i;
+
+    for (i = 0; i <= top; i++) {
+        v = &vstack[i];
+        switch (v->kind) {
+        case VSTK:
+            continue;
+        case VCON:
+            rout("push $%d", v->n);
+            break;
+        case VSYMA:
+            rout("push $%s", v->sym);
+            rout("shrl $2, (%%esp)");
+            break;
+        case VAUTOA:
+            if (rautoreg(v->n) != -1) {
+                continue;
+            }
+            rout("push %%ebp");
+            rout("addl $%d, (%%esp)", v->n);
+            rout("shrl $2, (%%esp)");
+            break;
+        case VAREG:
+            rout("push %s", autoreg[rautoreg(v->n)]);
+            break;
+        case VREG:
+            rout("push %s", scratch[v->n]);
+            regrefs[v->n]--;
+            break;
+        }
+        v->kind = VSTK;
+    }
+}
+
+static void
+vflush(void)
+{
+    vflushto(nvstack - 1);
+}
+
+// return a free scratch register, pushing the oldest entries held in
+// registers if need be
+//
+static int
+getreg(void)
+{
+    int i, r;
+
+    for (;;) {
+        for (r = 0; r < NSCRATCH; r++) {
+            if (regrefs[r] == 0) {
+                regrefs[r] = 1;
+                return r;
+            }
+        }
+        for (i = 0; i < nvstack && vstack[i].kind != VREG; i++)
+            ;
+        assert(i < nvstack);
+        vflushto(i);
+    }
+}
+
+static void
+release(struct vent *v)
+{
+    if (v->kind == VREG) {
+        regrefs[v->n]--;
+    }
+}
+
+static void
+vpush(struct vent *v)
+{
+    if (nvstack == VMAX) {
+        vflushto(0);
+        assert(vstack[0].kind == VSTK);
+        memmove(vstack, vstack + 1, --nvstack * sizeof(struct vent));
+    }
+    vstack[nvstack++] = *v;
+}
+
+static void
+vpushreg(int r)
+{
+    struct vent v;
+
+    v.kind = VREG;
+    v.n = r;
+    vpush(&v);
+}
+
+// pop the top entry; an entry on the machine stack is popped into a
+// register
+//
+static struct vent
+vpop(void)
+{
+    struct vent v;
+
+    if (nvstack && vstack[nvstack - 1].kind != VSTK) {
+        return vstack[--nvstack];
+    }
+    if (nvstack) {
+        nvstack--;
+    }
+    v.kind = VREG;
+    v.n = getreg();
+    rout("pop %s", scratch[v.n]);
+    return v;
+}
+
+// Put the value of 'v' in a scratch register and return it. If 'own'
+// is set, the register can be written.
+//
+static int
+toreg(struct vent *v, int own)
+{
+    int r;
+
+    if (v->kind == VREG) {
+        if (!own || regrefs[v->n] == 1) {
+            return v->n;
+        }
+        vflush();
+        if (regrefs[v->n] == 1) {
+            return v->n;
+        }
+    }
+
+    r = getreg();
+    switch (v->kind) {
+    case VREG:
+        rout("mov %s, %s", scratch[v->n], scratch[r]);
+        regrefs[v->n]--;
+        break;
+    case VCON:
+        rout("mov $%d, %s", v->n, scratch[r]);
+        break;
+    case VSYMA:
+        rout("mov $%s, %s", v->sym, scratch[r]);
+        rout("shr $2, %s", scratch[r]);
+        break;
+    case VAUTOA:
+        rout("lea %d(%%ebp), %s", v->n, scratch[r]);
+        rout("shr $2, %s", scratch[r]);
+        break;
+    case VAREG:
+        rout("mov %s, %s", autoreg[rautoreg(v->n)], scratch[r]);
+        break;
+    }
+    v->kind = VREG;
+    v->n = r;
+    return r;
+}
+
+// Put the value of 'v' in scratch register 'r', which must be free
+// unless 'v' is already there.
+//
+static void
+rmove(struct vent *v, int r)
+{
+    if (v->kind == VREG && v->n == r) {
+        return;
+    }
+    if (v->kind == VREG) {
+        rout("mov %s, %s", scratch[v->n], scratch[r]);
+        regrefs[v->n]--;
+    } else if (v->kind == VCON) {
+        rout("mov $%d, %s", v->n, scratch[r]);
+    } else if (v->kind == VAREG) {
+        rout("mov %s, %s", autoreg[rautoreg(v->n)], scratch[r]);
+    } else {
+        rout("mov %s, %s", scratch[toreg(v, 0)], scratch[r]);
+        regrefs[v->n]--;
+    }
+    v->kind = VREG;
+    v->n = r;
+    regrefs[r] = 1;
+}
+
+// return 'v' as a source operand: an immediate or a register
+//
+static const char *
+srcop(struct vent *v)
+{
+    static char buf[4][MAXARGS + 2];
+    static int nbuf;
+    char *p = buf[nbuf++ % 4];
+
+    if (v->kind == VCON) {
+        sprintf(p, "$%d", v->n);
+        return p;
+    }
+    if (v->kind == VAREG) {
+        return autoreg[rautoreg(v->n)];
+    }
+    return scratch[toreg(v, 0)];
+}
+
+// before an auto held in a register is written, push any copies of
+// its old value
+//
+static void
+vclobber(int offs)
+{
+    int i;
+
+    for (i = nvstack - 1; i >= 0; i--) {
+        if (vstack[i].kind == VAREG && vstack[i].n == offs) {
+            vflushto(i);
+            return;
+        }
+    }
+}
+
+// save (or reload, if 'load') the autos held in registers which are
+// live across the call at instruction 'i'
+//
+static void
+rsave(int i, int load)
+{
+    int j;
+
+    for (j = 0; j < nrautos; j++) {
+        if (rautos[j].reg != -1 && rautos[j].start < i && rautos[j].end > i) {
+            if (load) {
+                rout("mov %d(%%ebp), %s", rautos[j].offs, autoreg[rautos[j].reg]);
+            } else {
+                rout("mov %s, %d(%%ebp)", autoreg[rautos[j].reg], rautos[j].offs);
+            }
+        }
+    }
+}
+
+// in-place update through the operand 'mem'
+//
+static void
+rmwgen(int t, const char *mem, struct vent *rhs)
+{
+    const char *prefix = rmwtemplates[t].prefix;
+    const char *insn;
+    int r;
+
+    if (strncmp(prefix, "POST", 4) == 0) {
+        r = getreg();
+        rout("mov %s, %s", mem, scratch[r]);
+        rout("%sl %s", prefix[4] == 'I' ? "inc" : "dec", mem);
+        vpushreg(r);
+        return;
+    }
+
+    if (rhs) {
+        insn = strncmp(prefix, "ADD", 3) == 0 ? "add" : strncmp(prefix, "SUB", 3) == 0 ? "sub"
+            : strncmp(prefix, "AND", 3) == 0 ? "and" : "or";
+        rout("%sl %s, %s", insn, srcop(rhs), mem);
+        release(rhs);
+    } else {
+        rout("%sl %s", strstr(prefix, "INC") ? "inc" : "dec", mem);
+    }
+
+    if (strstr(rmwtemplates[t].text, "push")) {
+        r = getreg();
+        rout("mov %s, %s", mem, scratch[r]);
+        vpushreg(r);
+    }
+}
+
+// return 'v' as a register operand which is only read
+//
+static const char *
+rdop(struct vent *v)
+{
+    if (v->kind == VAREG) {
+        return autoreg[rautoreg(v->n)];
+    }
+    return scratch[toreg(v, 0)];
+}
+
+// ops which become a single instruction on a register, and the
+// condition codes of the comparisons
+//
+struct opinsn {
+    const char *op;
+    const char *insn;
+};
+
+static const struct opinsn arith[] = {
+    { "ADD", "add" }, { "SUB", "sub" }, { "AND", "and" },
+    { "OR",  "or" },  { "MUL", "imul" },
+};
+
+static const struct opinsn conds[] = {
+    { "EQ", "e" },  { "NE", "ne" }, { "LT", "l" },
+    { "LE", "le" }, { "GT", "g" },  { "GE", "ge" },
+};
+
+// return the index of 'op' in table 'tab' of 'n' entries, or -1
+//
+static int
+rcond(const char *op, const struct opinsn *tab, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (strcmp(tab[i].op, op) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// compile instruction 'i' of the current function
+//
+static void
+rgen(int i)
+{
+    struct rinst *in = &rcode[i];
+    const char *op = in->op;
+    struct vent a, b, c;
+    int j, n, r, t, mode;
+    char mem[MAXARGS + 16];
+
+    if (op == NULL) {
+        vflush();
+        fprintf(fout, "%s:\n", in->args);
+        return;
+    }
+
+    if (strcmp(op, "PSHCON") == 0) {
+        a.kind = VCON;
+        a.n = atoi(in->args);
+        vpush(&a);
+    } else if (strcmp(op, "PSHSYM") == 0) {
+        a.kind = VSYMA;
+        strcpy(a.sym, in->args);
+        vpush(&a);
+    } else if (strcmp(op, "PSHAUTO") == 0) {
+        a.kind = VAUTOA;
+        a.n = atoi(in->args);
+        vpush(&a);
+    } else if (strcmp(op, "DEREF") == 0) {
+        a = vpop();
+        if (a.kind == VAUTOA && rautoreg(a.n) != -1) {
+            a.kind = VAREG;
+            vpush(&a);
+            return;
+        }
+        if (a.kind == VSYMA || a.kind == VAUTOA) {
+            r = getreg();
+            if (a.kind == VSYMA) {
+                rout("mov %s, %s", a.sym, scratch[r]);
+            } else {
+                rout("mov %d(%%ebp), %s", a.n, scratch[r]);
+            }
+        } else {
+            r = toreg(&a, 1);
+            rout("mov (,%s,4), %s", scratch[r], scratch[r]);
+        }
+        vpushreg(r);
+    } else if (strcmp(op, "STORE") == 0) {
+        b = vpop();
+        a = vpop();
+        if (a.kind == VSYMA) {
+            rout("movl %s, %s", srcop(&b), a.sym);
+        } else if (a.kind == VAUTOA && (r = rautoreg(a.n)) != -1) {
+            vclobber(a.n);
+            if (b.kind != VAREG || b.n != a.n) {
+                rout("mov %s, %s", srcop(&b), autoreg[r]);
+            }
+        } else if (a.kind == VAUTOA) {
+            rout("movl %s, %d(%%ebp)", srcop(&b), a.n);
+        } else {
+            rout("movl %s, (,%s,4)", srcop(&b), scratch[toreg(&a, 0)]);
+            release(&a);
+        }
+        release(&b);
+    } else if (strcmp(op, "ROT") == 0) {
+        c = vpop();
+        b = vpop();
+        a = vpop();
+        vpush(&c);
+        vpush(&a);
+        vpush(&b);
+    } else if (strcmp(op, "DUP") == 0 || strcmp(op, "DUPN") == 0) {
+        n = strcmp(op, "DUP") ? atoi(in->args) / wordsize : 0;
+        j = nvstack - 1 - n;
+        if (j >= 0 && vstack[j].kind != VSTK) {
+            a = vstack[j];
+            if (a.kind == VREG) {
+                regrefs[a.n]++;
+            }
+            vpush(&a);
+            return;
+        }
+        r = getreg();
+        for (j = nvstack - 1, t = 0; n >= 0; j--, n--) {
+            if (j < 0 || vstack[j].kind == VSTK) {
+                t++;
+            }
+        }
+        rout("mov %d(%%esp), %s", wordsize * (t - 1), scratch[r]);
+        vpushreg(r);
+    } else if (strcmp(op, "POP") == 0 || strcmp(op, "POPN") == 0) {
+        n = strcmp(op, "POP") ? atoi(in->args) / wordsize : 1;
+        for (t = 0; n > 0; n--) {
+            if (nvstack == 0 || vstack[nvstack - 1].kind == VSTK) {
+                t++;
+            } else {
+                release(&vstack[nvstack - 1]);
+            }
+            if (nvstack) {
+                nvstack--;
+            }
+        }
+        if (t) {
+            rout("add $%d, %%esp", wordsize * t);
+        }
+    } else if (strcmp(op, "POPT") == 0) {
+        a = vpop();
+        rout("mov %s, %%ebx", srcop(&a));
+        release(&a);
+    } else if (strcmp(op, "PUSHT") == 0) {
+        r = getreg();
+        rout("mov %%ebx, %s", scratch[r]);
+        vpushreg(r);
+    } else if (strcmp(op, "CALL") == 0) {
+        a = vpop();
+        vflush();
+        if (a.kind != VREG || a.n != 1) {
+            rout("mov %s, %%ecx", srcop(&a));
+        }
+        release(&a);
+        rout("shl $2, %%ecx");
+        rsave(i, 0);
+        rout("push $8f");
+        rout("jmp *(%%ecx)");
+        rout("8: .int 9f");
+        rout("9:");
+        rsave(i, 1);
+    } else if (strcmp(op, "ENTER") == 0) {
+        wrnative(op, in->args);
+        for (j = 0; j < nrautos; j++) {
+            if (rautos[j].reg != -1 && rautos[j].offs > 0) {
+                rout("mov %d(%%ebp), %s", rautos[j].offs, autoreg[rautos[j].reg]);
+            }
+        }
+    } else if (strcmp(op, "LEAVE") == 0 || strcmp(op, "RET") == 0
+        || strcmp(op, "AVINIT") == 0 || strcmp(op, "CASE") == 0
+        || strcmp(op, "JMP") == 0 || strcmp(op, "PROF") == 0) {
+        vflush();
+        wrnative(op, in->args);
+    } else if (strcmp(op, "BZ") == 0 || strcmp(op, "BNZ") == 0) {
+        a = vpop();
+        vflush();
+        rout("test %s, %s", rdop(&a), rdop(&a));
+        rout("%s %s", op[1] == 'Z' ? "jz" : "jnz", in->args);
+        release(&a);
+    } else if (isbranch(op)) {
+        b = vpop();
+        a = vpop();
+        vflush();
+        j = rcond(op + 1, conds, 6);
+        rout("cmp %s, %s", srcop(&b), rdop(&a));
+        rout("j%s %s", conds[j].insn, in->args);
+        release(&a);
+        release(&b);
+    } else if (rcond(op, conds, 6) != -1 || rcond(op, arith, 5) != -1) {
+        b = vpop();
+        a = vpop();
+        r = toreg(&a, 1);
+        if ((j = rcond(op, arith, 5)) != -1) {
+            rout("%s %s, %s", arith[j].insn, srcop(&b), scratch[r]);
+        } else {
+            rout("cmp %s, %s", srcop(&b), scratch[r]);
+            rout("set%s %s", conds[rcond(op, conds, 6)].insn, scratchlo[r]);
+            rout("movzbl %s, %s", scratchlo[r], scratch[r]);
+        }
+        release(&b);
+        vpushreg(r);
+    } else if (strcmp(op, "DIV") == 0 || strcmp(op, "MOD") == 0) {
+        // the dividend goes in EAX, and the divisor anywhere but EAX
+        // or EDX
+        b = vpop();
+        a = vpop();
+        vflush();
+        if (a.kind == VREG && a.n == 1 && b.kind == VREG && b.n == 0) {
+            rout("xchg %%eax, %%ecx");
+            a.n = 0;
+            b.n = 1;
+        } else if (a.kind == VREG && a.n == 1) {
+            rmove(&a, 0);
+        }
+        if (b.kind != VAREG) {
+            rmove(&b, 1);
+        }
+        rmove(&a, 0);
+        rout("cltd");
+        rout("idiv %s", rdop(&b));
+        release(&b);
+        if (op[0] == 'M') {
+            regrefs[0]--;
+            regrefs[2]++;
+            a.n = 2;
+        }
+        vpush(&a);
+    } else if (strcmp(op, "SHL") == 0 || strcmp(op, "SHR") == 0) {
+        // a shift count which isn't constant goes in CL
+        b = vpop();
+        a = vpop();
+        if (b.kind == VCON) {
+            r = toreg(&a, 1);
+            rout("%s $%d, %s", op[2] == 'L' ? "shl" : "shr", b.n, scratch[r]);
+        } else {
+            vflush();
+            if (a.kind == VREG && a.n == 1) {
+                if (b.kind == VREG && b.n == 0) {
+                    rout("xchg %%eax, %%ecx");
+                    a.n = 0;
+                    b.n = 1;
+                } else {
+                    rmove(&a, getreg());
+                }
+            }
+            rmove(&b, 1);
+            r = toreg(&a, 1);
+            rout("%s %%cl, %s", op[2] == 'L' ? "shl" : "shr", scratch[r]);
+            release(&b);
+        }
+        vpushreg(r);
+    } else if (strcmp(op, "NEG") == 0) {
+        a = vpop();
+        r = toreg(&a, 1);
+        rout("neg %s", scratch[r]);
+        vpushreg(r);
+    } else if (strcmp(op, "NOT") == 0) {
+        a = vpop();
+        r = toreg(&a, 1);
+        rout("test %s, %s", scratch[r], scratch[r]);
+        rout("setz %s", scratchlo[r]);
+        rout("movzbl %s, %s", scratchlo[r], scratch[r]);
+        vpushreg(r);
+    } else if (strcmp(op, "LDX") == 0) {
+        b = vpop();
+        a = vpop();
+        r = toreg(&a, 1);
+        rout("add %s, %s", srcop(&b), scratch[r]);
+        rout("mov (,%s,4), %s", scratch[r], scratch[r]);
+        release(&b);
+        vpushreg(r);
+    } else if (strcmp(op, "STX") == 0) {
+        c = vpop();
+        b = vpop();
+        a = vpop();
+        r = toreg(&a, 1);
+        rout("add %s, %s", srcop(&b), scratch[r]);
+        rout("movl %s, (,%s,4)", srcop(&c), scratch[r]);
+        release(&b);
+        regrefs[r]--;
+        vpush(&c);
+    } else if ((t = rmwtemplate(op, &mode)) != -1) {
+        n = strstr(rmwtemplates[t].text, "pop %eax") != NULL;
+        if (n) {
+            c = vpop();
+        }
+        if (mode == 0) {
+            strcpy(mem, in->args);
+        } else if (mode == 1 && (r = rautoreg(atoi(in->args))) != -1) {
+            vclobber(atoi(in->args));
+            strcpy(mem, autoreg[r]);
+        } else if (mode == 1) {
+            sprintf(mem, "%s(%%ebp)", in->args);
+        } else {
+            b = vpop();
+            a = vpop();
+            r = toreg(&a, 1);
+            rout("add %s, %s", srcop(&b), scratch[r]);
+            release(&b);
+            sprintf(mem, "(,%s,4)", scratch[r]);
+        }
+        rmwgen(t, mem, n ? &c : NULL);
+        if (mode == 2) {
+            regrefs[r]--;
+        }
+    } else {
+        fprintf(stderr, "internal error: no register code for %s\n", op);
+        err = 1;
+    }
+}
+
+// compile the queued function
+//
+static void
+rfunc(void)
+{
+    int i;
+
+    ralloc();
+    nvstack = 0;
+    memset(regrefs, 0, sizeof(regrefs));
+    for (i = 0; i < nrcode; i++) {
+        rgen(i);
+    }
+    nrcode = 0;
+}
+
+// Write out functions
+//
+void
+wrcode(void)
+{
+    int ncode;
+    int i;
+
+    bifseek(BIFSCODE);
+    ncode = bifver == 1 ? RDINT() : nfuncs;
+
+    // version 2 indexes the functions, so they may be written
+    // independently
+    //
+    if (jobs > 1 && bifver != 1 && ncode > 1) {
+        wrjobs(ncode);
+        return;
+    }
+
+    for (i = 0; i < ncode && !err; i++) {
+        wrfunc(i);
+    }
+}
+
+// Write out the functions across 'jobs' processes, each given a run of
+// them balanced by the size of their intermediate code. A worker reads
+// the input through the mapping it shares and writes to a temporary file,
+// with the string pool offsets it referenced after the output and then
+// the lengths of both. The files are copied out (or for an object,
+// their logs replayed) in order, so the output is the same as from a
+// single process.
+//
+void
+wrjobs(int ncode)
+{
+    FILE **tmp;
+    pid_t *pid;
+    int *first;
+    unsigned char w[8];
+    unsigned outlen, nrefs, k;
+    int i, j, c, status;
+    char buf[4096];
+
+    tmp = calloc(jobs, sizeof(FILE *));
+    pid = calloc(jobs, sizeof(pid_t));
+    first = calloc(jobs + 1, sizeof(int));
+    if (!tmp || !pid || !first) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    for (i = 0, j = 1; j < jobs; j++) {
+        while (i < ncode && funcoffs[i] < (unsigned long long)bifsize[BIFSCODE] * j / jobs) {
+            i++;
+        }
+        first[j] = i;
+    }
+    first[jobs] = ncode;
+
+    fflush(fout);
+    for (j = 0; j < jobs; j++) {
+        if ((tmp[j] = tmpfile()) == NULL) {
+            perror("ba");
+            exit(1);
+        }
+        if ((pid[j] = fork()) == -1) {
+            perror("ba");
+            exit(1);
+        }
+        if (pid[j] != 0) {
+            continue;
+        }
+
+        fout = tmp[j];
+        if (objout) {
+            elflog(fout);
+        }
+        for (i = first[j]; i < first[j + 1] && !err; i++) {
+            wrfunc(i);
+        }
+        if (objout) {
+            elflog(NULL);
+        }
+        outlen = ftell(fout);
+        fwrite(strrefs, 1, nstrrefs, fout);
+        for (k = 0; k < 4; k++) {
+            w[k] = outlen >> (8 * k);
+            w[k + 4] = nstrrefs >> (8 * k);
+        }
+        fwrite(w, 1, 8, fout);
+        _exit(err || ineof || fflush(fout) || ferror(fout));
+    }
+
+    for (j = 0; j < jobs; j++) {
+        if (waitpid(pid[j], &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+            err = 1;
+        }
+    }
+
+    for (j = 0; j < jobs && !err; j++) {
+        if (fseek(tmp[j], -8, SEEK_END) || fread(w, 1, 8, tmp[j]) != 8) {
+            err = 1;
+            break;
+        }
+        outlen = w[0] | w[1] << 8 | w[2] << 16 | (unsigned)w[3] << 24;
+        nrefs = w[4] | w[5] << 8 | w[6] << 16 | (unsigned)w[7] << 24;
+
+        rewind(tmp[j]);
+        if (objout) {
+            err = elfreplay(tmp[j]) != 0;
+        } else {
+            for (k = 0; k < outlen; k += c) {
+                c = outlen - k < sizeof(buf) ? outlen - k : sizeof(buf);
+                if (fread(buf, 1, c, tmp[j]) != (size_t)c) {
+                    err = 1;
+                    break;
+                }
+                fwrite(buf, 1, c, fout);
+            }
+        }
+
+        fseek(tmp[j], outlen, SEEK_SET);
+        for (k = 0; k < nrefs; k++) {
+            if ((c = getc(tmp[j])) == EOF) {
+                err = 1;
+                break;
+            }
+            if (c & STRCODE) {
+                strref(k, STRCODE, buf);
+            }
+            if (c & STRDATA) {
+                strref(k, STRDATA, buf);
+            }
+        }
+        fclose(tmp[j]);
+    }
+
+    if (err) {
+        fprintf(stderr, "ba: a job writing functions failed\n");
+    }
+    free(tmp);
+    free(pid);
+    free(first);
+}
+
+// Write out function 'i'
+//
+void
+wrfunc(int i)
+{
+    int j, nex, ninst, op, n, offs, mode;
+    char fn[MAXNAM + 1];
+    const char *opcode;
+    char *extrns;
+    char sect[32];
+    char lbl[32];
+
+    if (bifver != 1) {
+        inpos = bifoffs[BIFSCODE] + funcoffs[i];
+    }
+    rdname(fn);
+    wrsect(fnsect(fn, sect));
+    wrname(fn);
+
+    wrword(".+%d", wordsize);
+    pinit();
+
+    // native code is entered through a word holding its address,
+    // just as threaded code is entered through its first op
+    //
+    if (native) {
+        fprintf(fout, "    .int .+4\n");
+    }
+
+    // token threaded code is entered through TSTART, which finds
+    // the function's code from the word following
+    //
+    if (tokens) {
+        fprintf(fout, "    .int TSTART, .Lt%d\n", i);
+        fprintf(fout, "    .pushsection .tcode.%s, \"a\", @progbits\n", fn);
+        fprintf(fout, ".Lt%d:\n", i);
+    }
+
+    if (profgen) {
+        wrprof(fn, i, -1);
+    }
+    
+    // version 1 has the function's own table of extrns; version 2
+    // refers to the name table
+    //
+    if (bifver == 1) {
+        nex = RDINT();
+        extrns = malloc(nex * (MAXNAM + 1));
+        if (!extrns) {
+            err = 1;
+            fprintf(stderr, "out of memory\n");
+            return;
+        }
+        for (j = 0; j < nex; j++) {
+            rdname(extrns + j * (MAXNAM + 1));
+        }
+    } else {
+        extrns = names;
+    }
+
+    ninst = RDINT();
+    for (j = 0; j < ninst; j++) {
+        op = RDBYTE();
+        if ((opcode = simpop(op)) != NULL) {
+            emit(opcode, "");
+            continue;
+        }
+
+        if ((opcode = brop(op)) != NULL) {
+            emit(opcode, lblfmt, RDINT());
+            continue;
+        }
+
+        if ((n = rmwop(op)) != -1) {
+            mode = RDBYTE();
+            assert(mode <= 2);
+            opcode = RDBYTE() ? rmwops[n].discard[mode] : rmwops[n].used[mode];
+            if (mode == 0) {
+                emit(opcode, "_%s", extrns + (MAXNAM + 1) * RDINT());
+            } else if (mode == 1) {
+                emit(opcode, "%d", adjauto(RDINT()));
+            } else {
+                emit(opcode, "");
+            }
+            continue;
+        }
+
+        switch (op) {
+        case ONAMDEF:
+            n = RDINT();
+            sprintf(lbl, lblfmt, n);
+            if (regs) {
+                radd(NULL, lbl);
+            } else {
+                flushinst();
+                wrlabel(lbl);
+            }
+            if (profgen) {
+                wrprof(fn, i, n);
+            }
+            break;
+
+        case OCASE:
+            n = RDINT();
+            sprintf(lbl, lblfmt, RDINT());
+            emit("CASE", "%u, %s", n, lbl);
+            break;
+
+        case OPOPN:
+            emit("POPN", "%u", wordsize * RDINT());
+            break;
+
+        case ODUPN:
+            emit("DUPN", "%u", wordsize * RDINT());
+            break;
+
+        case OENTER:
+            emit("ENTER", "%u", wordsize * RDINT());
+            break;
+
+        case OAVINIT:
+            emit("AVINIT", "%d", wordsize * RDINT());
+            break;
+
+        case OPSHCON:
+            if (RDBYTE()) {
+                // strcon
+                emit("PSHSYM", "%s", strref(RDINT(), STRCODE, lbl));
+            } else {
+                // intcon
+                emit("PSHCON", "%d", (int)RDINT());
+            }
+            break;
+
+        case OPSHSYM:
+            if (RDBYTE() == 0) {
+                // extrn
+                emit("PSHSYM", "_%s", extrns + (MAXNAM + 1) * RDINT());
+            } else {
+                offs = RDINT();
+                emit("PSHAUTO", "%d", adjauto(offs));
+            }
+            break;
+
+        default:
+            fprintf(stderr, "internal error: intermediate op %d at %d not handled\n", op, (int)inpos);
+            assert(0);
+        }
+    }
+
+    if (regs) {
+        rfunc();
+    } else {
+        flushinst();
+    }
+
+    if (tokens) {
+        fprintf(fout, "    .popsection\n");
+    }
+
+    if (bifver == 1) {
+        free(extrns);
+    }
+}
+
+// Write the string pool. The strings code pushes go in a section of
+// mergeable strings, which the linker may share with the same strings
+// in other files. A string a datum is initialized with is the datum's
+// own, and may be stored into, so it is written to the data and left
+// out of the shared strings, unless code refers into it too.
+// 
+void
+wrstrp()
+{
+    char lbl[32];
+    char *pool;
+    unsigned i, j, end, n;
+    int indata = 0;
+
+    bifseek(BIFSSTRP);
+    n = RDINT();
+
+    if (n == 0 || ineof) {
+        return;
+    }
+
+    if ((pool = malloc(n + 1)) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < n; i++) {
+        pool[i] = RDBYTE();
+    }
+    pool[n] = '\0';
+
+    for (i = 0; i < n && i < nstrrefs; i++) {
+        if (strrefs[i] & STRDATA) {
+            if (!indata) {
+                wrsect(".data");
+                indata = 1;
+            }
+            wralign(wordsize);
+            sprintf(lbl, ".Ld%u", i);
+            wrlabel(lbl);
+            wrascii(pool + i, strlen(pool + i) + 1);
+        }
+    }
+
+    wrsect(".rodata.str");
+    for (i = 0; i < n; i = j) {
+        // skip a string only data refers to, and its padding
+        //
+        if (i < nstrrefs && strrefs[i] == STRDATA) {
+            end = (i + strlen(pool + i) + 4) & ~3u;
+            for (j = i + 1; j < end && j < n && (j >= nstrrefs || !(strrefs[j] & STRCODE)); j++) {
+                ;
+            }
+            if (j == end || j == n) {
+                continue;
+            }
+        }
+
+        if (i < nstrrefs && (strrefs[i] & STRCODE)) {
+            wralign(wordsize);
+            sprintf(lbl, ".Ls%u", i);
+            wrlabel(lbl);
+        }
+        for (j = i + 1; j < n && (j >= nstrrefs || !strrefs[j]); j++) {
+            ;
+        }
+        wrascii(pool + i, j - i);
+    }
+
+    free(pool);
+}
+
+// Write 'n' bytes of a string
+//
+static void
+wrascii(const char *p, int n)
+{
+    const int perline = 64;
+    int i, m, c;
+
+    if (objout) {
+        for (i = 0; i < n; i++) {
+            elfbyte(p[i]);
+        }
+        return;
+    }
+
+    for (i = 0; i < n; ) {
+        fprintf(fout, "    .ascii \"");
+        for (m = 0; i < n && m < perline; i++) {
+            c = p[i] & 0xff;
+            if (c >= ' ' && c < 0x7f && c != '"' && c != '\\') {
+                fputc(c, fout);
+                m++;
+            } else {
+                fprintf(fout, "\\%03o", c);
+                m += 4;
+            }
+        }
+        fprintf(fout, "\"\n");
+    }
+}
+
+// Return the operand for the string at offset 'offs' in the pool,
+// referred to as 'how'. Each string referred to is labelled when the
+// pool is written, which realigns it on a target with bigger words than
+// the pool's 4 bytes; and the linker, which moves the strings it merges,
+// only follows a reference to a symbol at the string itself.
+//
+static const char *
+strref(unsigned offs, int how, char *buf)
+{
+    unsigned n;
+
+    if (offs >= nstrrefs) {
+        n = nstrrefs ? nstrrefs : 256;
+        while (n <= offs) {
+            n *= 2;
+        }
+        strrefs = realloc(strrefs, n);
+        if (strrefs == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        memset(strrefs + nstrrefs, 0, n - nstrrefs);
+        nstrrefs = n;
+    }
+    strrefs[offs] |= how;
+    sprintf(buf, how == STRDATA ? ".Ld%u" : ".Ls%u", offs);
+    return buf;
+}
+
+// write the asm file header
+//
+void
+wrheader(void)
+{
+    if (!objout) {
+        fprintf(fout, "# %s\n", srcfname);
+    }
+}
+
+static void
+chkinerr(void)
+{
+    if (ineof) {
+        fprintf(stderr, "premature eof or I/O error on %s\n", srcfname);
+        fclose(fout);
+        remove(outfname);
+        exit(1);
+    }
+}
+
+// write a gloal name
+//
+void 
+wrname(const char *name)
+{
+    char label[MAXNAM + 2];
+
+    if (objout) {
+        sprintf(label, "_%s", name);
+        elfalign(wordsize);
+        elflabel(label, 1);
+        return;
+    }
+
+    fprintf(
+        fout,
+            "    .align %d\n"
+            "    .global _%s\n"
+            "_%s:\n",
+        wordsize,
+        name,
+        name);
+}
+
+// The rest of the output goes through these, which write assembly, or
+// with -c add to the object being built.
+//
+
+// switch to a section
+//
+static void
+wrsect(const char *name)
+{
+    strcpy(sectname, name);
+    if (objout) {
+        elfsection(name);
+    } else if (strcmp(name, ".text") == 0 || strcmp(name, ".data") == 0
+        || strcmp(name, ".bss") == 0) {
+        fprintf(fout, "    %s\n", name);
+    } else if (strncmp(name, ".text.", 6) == 0) {
+        fprintf(fout, "    .section %s, \"ax\", @progbits\n", name);
+    } else if (strncmp(name, ".bss.", 5) == 0) {
+        fprintf(fout, "    .section %s, \"aw\", @nobits\n", name);
+    } else if (strncmp(name, ".rodata.str", 11) == 0) {
+        fprintf(fout, "    .section %s, \"aMS\", @progbits, 1\n", name);
+    } else {
+        fprintf(fout, "    .section %s, \"aw\", @progbits\n", name);
+    }
+}
+
+// switch to a section until popsect()
+//
+static void
+pushsect(const char *name, const char *flags)
+{
+    if (objout) {
+        elfpushsection(name);
+    } else {
+        fprintf(fout, "    .pushsection %s, \"%s\", @progbits\n", name, flags);
+    }
+}
+
+static void
+popsect(void)
+{
+    if (objout) {
+        elfpopsection();
+    } else {
+        fprintf(fout, "    .popsection\n");
+    }
+}
+
+static void
+wralign(int align)
+{
+    if (objout) {
+        elfalign(align);
+    } else {
+        fprintf(fout, "    .align %d\n", align);
+    }
+}
+
+// write 'n' zero bytes
+//
+static void
+wrzero(int n)
+{
+    if (objout) {
+        elfzero(n);
+    } else {
+        fprintf(fout, "    .zero %d\n", n);
+    }
+}
+
+// define a label local to the file
+//
+static void
+wrlabel(const char *name)
+{
+    if (objout) {
+        elflabel(name, 0);
+    } else {
+        fprintf(fout, "%s:\n", name);
+    }
+}
+
+// Write a word. The operand is as it would be given to the assembler:
+// a number, a name with an optional offset, or .+n for an address in
+// the current section.
+//
+static void
+wrword(const char *fmt, ...)
+{
+    va_list args;
+    char buf[MAXARGS];
+    char *p;
+    long val = 0;
+    int l;
+
+    va_start(args, fmt);
+    vsnprintf(buf, MAXARGS, fmt, args);
+    va_end(args);
+
+    if (!objout) {
+        fprintf(fout, "    %s %s\n", wordop, buf);
+        return;
+    }
+
+    if (buf[0] == '.' && buf[1] == '+') {
+        elfsectword(elfcursect(), elfoffset() + atoi(buf + 2));
+        return;
+    }
+
+    if (buf[0] == '-' || (buf[0] >= '0' && buf[0] <= '9')) {
+        elfword(NULL, strtol(buf, NULL, 10));
+        return;
+    }
+
+    l = strcspn(buf, " +-");
+    p = buf + l + strspn(buf + l, " ");
+    if (*p == '+' || *p == '-') {
+        val = strtol(p + 1, NULL, 10);
+        if (*p == '-') {
+            val = -val;
+        }
+    }
+    buf[l] = '\0';
+    elfword(buf, val);
+}
+
+// write a profiling counter for label 'id' in function 'fn', the
+// 'fnum'th (-1 for the function entry). the counters are gathered into the .bprof
+// section, which the runtime writes out at exit as 16 byte records:
+// the count, the label, and the function name padded with nul's.
+//
+void
+wrprof(const char *fn, int fnum, int id)
+{
+    char label[32];
+    int i, l = strlen(fn);
+
+    // named from the function and label, so functions can be written
+    // in any order
+    //
+    pushsect(".bprof", "aw");
+    if (id < 0) {
+        sprintf(label, ".Lpf%d", fnum);
+    } else {
+        sprintf(label, ".Lp%d", id);
+    }
+    wrlabel(label);
+    if (objout) {
+        elfword(NULL, 0);
+        elfword(NULL, id);
+        for (i = 0; i < MAXNAM; i++) {
+            elfbyte(i < l ? fn[i] : 0);
+        }
+    } else {
+        fprintf(fout, "    .int 0, %d\n", id);
+        fprintf(fout, "    .ascii \"%s", fn);
+        for (i = l; i < MAXNAM; i++) {
+            fprintf(fout, "\\0");
+        }
+        fprintf(fout, "\"\n");
+    }
+    popsect();
+    emit("PROF", "%s", label);
+}
+
+// hash a function name into ordtab
+//
+static unsigned
+ordhash(const char *fn)
+{
+    unsigned h = 0;
+
+    while (*fn) {
+        h = h * 31 + (*fn++ & 0xff);
+    }
+    return h % ORDHASH;
+}
+
+// find or add a function in the ordering table
+//
+static struct fnorder *
+ordent(const char *fn)
+{
+    struct fnorder *fo;
+    unsigned h = ordhash(fn);
+
+    for (fo = ordtab[h]; fo; fo = fo->next) {
+        if (strcmp(fo->name, fn) == 0) {
+            return fo;
+        }
+    }
+
+    fo = calloc(1, sizeof(struct fnorder));
+    if (fo == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    strncpy(fo->name, fn, MAXNAM);
+    fo->rank = -1;
+    fo->next = ordtab[h];
+    ordtab[h] = fo;
+    return fo;
+}
+
+// Read a function ordering file. Each line names one function, hottest
+// first; a name preceded by '-' is cold. Blank lines and lines starting
+// with '#' are ignored. Functions which aren't mentioned are left in
+// .text, between the hot and cold code.
+//
+int
+rdorder(const char *fn)
+{
+    FILE *fp;
+    char line[256];
+    char *p, *e;
+    int rank = 0;
+    int cold;
+    struct fnorder *fo;
+
+    if ((fp = fopen(fn, "r")) == NULL) {
+        perror(fn);
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        for (p = line; *p == ' ' || *p == '\t'; p++)
+            ;
+        for (e = p + strlen(p); e > p && strchr(" \t\r\n", e[-1]); e--)
+            ;
+        *e = '\0';
+        if (*p == '\0' || *p == '#') {
+            continue;
+        }
+
+        cold = *p == '-';
+        if (cold) {
+            p++;
+        }
+        if (e - p > MAXNAM) {
+            p[MAXNAM] = '\0';
+        }
+
+        fo = ordent(p);
+        if (cold) {
+            fo->rank = -1;
+        } else if (fo->rank == -1) {
+            fo->rank = rank++;
+        }
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+// sort profiled functions by descending entry count
+//
+static int
+cmpcount(const void *a, const void *b)
+{
+    const struct fnorder *fa = *(const struct fnorder **)a;
+    const struct fnorder *fb = *(const struct fnorder **)b;
+
+    if (fa->count != fb->count) {
+        return fa->count < fb->count ? 1 : -1;
+    }
+    return strcmp(fa->name, fb->name);
+}
+
+// Derive the function ordering from a profile written by a program 
+// built with -fprofile-generate (see wrprof.) Functions are ordered
+// by how often they were entered; those never entered are cold.
+//
+int
+rdprof(const char *fn)
+{
+    FILE *fp;
+    unsigned char rec[8 + MAXNAM];
+    char name[MAXNAM + 1];
+    struct fnorder *fo, **fns;
+    unsigned count;
+    int label;
+    int i, j, n = 0;
+
+    if ((fp = fopen(fn, "rb")) == NULL) {
+        perror(fn);
+        return 1;
+    }
+
+    while (fread(rec, 1, sizeof(rec), fp) == sizeof(rec)) {
+        count = rec[0] | (rec[1] << 8) | (rec[2] << 16) | ((unsigned)rec[3] << 24);
+        label = rec[4] | (rec[5] << 8) | (rec[6] << 16) | ((unsigned)rec[7] << 24);
+        if (label != -1) {
+            continue;
+        }
+
+        memcpy(name, rec + 8, MAXNAM);
+        name[MAXNAM] = '\0';
+        fo = ordent(name);
+        if (fo->count == 0 && count) {
+            n++;
+        }
+        fo->count += count;
+    }
+    fclose(fp);
+
+    fns = malloc((n + 1) * sizeof(struct fnorder *));
+    if (fns == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (i = j = 0; i < ORDHASH; i++) {
+        for (fo = ordtab[i]; fo; fo = fo->next) {
+            if (fo->count) {
+                fns[j++] = fo;
+            }
+        }
+    }
+
+    qsort(fns, n, sizeof(struct fnorder *), cmpcount);
+    for (i = 0; i < n; i++) {
+        fns[i]->rank = i;
+    }
+    free(fns);
+    return 0;
+}
+
+// Return the section a function's code goes in. Every function has
+// a section of its own, so the linker can drop it if it isn't used.
+// Hot functions go in .text.hot subsections, which blink sorts by
+// name, so the rank is zero padded. Cold functions go in
+// .text.unlikely subsections, which blink puts after everything else,
+// and the rest in .text.fn.
+//
+const char *
+fnsect(const char *fn, char *buf)
+{
+    struct fnorder *fo;
+
+    for (fo = ordtab[ordhash(fn)]; fo; fo = fo->next) {
+        if (strcmp(fo->name, fn) == 0) {
+            break;
+        }
+    }
+
+    if (fo == NULL) {
+        sprintf(buf, ".text.fn.%s", fn);
+    } else if (fo->rank < 0) {
+        sprintf(buf, ".text.unlikely.%s", fn);
+    } else {
+        sprintf(buf, ".text.hot.%06d", fo->rank);
+    }
+    return buf;
+}
+
+// Map the input file to be read. Something that can't be mapped, such
+// as a pipe, is read into memory instead.
+//
+int
+rdopen(const char *fn)
+{
+    struct stat st;
+    unsigned char *p = NULL;
+    size_t max = 0;
+    ssize_t n;
+    int fd;
+    void *m;
+
+    if ((fd = open(fn, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+        perror(fn);
+        return 1;
+    }
+
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED) {
+            close(fd);
+            inp = m;
+            inlen = st.st_size;
+            inmapped = 1;
+            return 0;
+        }
+    }
+
+    inlen = 0;
+    do {
+        if (inlen == max) {
+            max = max ? 2 * max : 65536;
+            if ((p = realloc(p, max)) == NULL) {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+        }
+        n = read(fd, p + inlen, max - inlen);
+        if (n > 0) {
+            inlen += n;
+        }
+    } while (n > 0 || (n == -1 && errno == EINTR));
+
+    close(fd);
+    if (n == -1) {
+        perror(fn);
+        return 1;
+    }
+    inp = p;
+    return 0;
+}
+
+void
+rdclose(void)
+{
+    if (inmapped) {
+        munmap((void *)inp, inlen);
+    } else {
+        free((void *)inp);
+    }
+    inp = NULL;
+}
+
+// read an n byte integer
+// TODO some things should be unsigned
+//
+unsigned
+rdbytes(int n)
+{
+    const unsigned char *p = inp + inpos;
+    unsigned ul = 0;
+    int i;
+
+    if (inpos + n > inlen) {
+        ineof = 1;
+        chkinerr();
+    }
+
+    for (i = 0; i < n; i++) {
+        ul |= (unsigned)p[i] << (8 * i);
+    }
+    inpos += n;
+    return ul;
+}
+
+// read n chars
+//
+void
+rdchars(char *buf, int n)
+{
+    if (inpos + n > inlen) {
+        ineof = 1;
+        chkinerr();
+    }
+    memcpy(buf, inp + inpos, n);
+    inpos += n;
+}
+
+// read a number: INTSIZE bytes in a version 1 file, or a varint in
+// version 2 (see bif.h)
+//
+unsigned
+rdint(void)
+{
+    unsigned zz = 0;
+    int shift = 0, ch;
+
+    if (bifver == 1) {
+        return rdbytes(INTSIZE);
+    }
+
+    do {
+        if (inpos >= inlen) {
+            ineof = 1;
+            chkinerr();
+        }
+        ch = inp[inpos++];
+        zz |= (unsigned)(ch & 0x7f) << shift;
+        shift += 7;
+    } while ((ch & 0x80) && shift < 35);
+
+    return (zz >> 1) ^ -(zz & 1);
 }
 
-// read a name
+// read a name; in a version 2 file, by its number in the name table
 //
 void
 rdname(char *name)
 {
+    unsigned n;
+
     name[0] = '\0';
 
+    if (bifver != 1) {
+        n = RDINT();
+        if (n >= nnames) {
+            fprintf(stderr, "%s: bad name in intermediate file\n", srcfname);
+            exit(1);
+        }
+        strcpy(name, names + n * (MAXNAM + 1));
+        return;
+    }
+
     int len = RDBYTE();
     if (len <= MAXNAM) {
-        fread(name, 1, len, fin);
+        rdchars(name, len);
         name[len] = '\0';
     }
-    chkinerr();
+}
+
+// Read the header of a version 2 file, then the name table and the
+// function index that the rest of the file refers to.
+//
+void
+rdhead(void)
+{
+    unsigned i, n, id, offs, size, len;
+
+    bifver = rdbytes(4);
+    if (bifver != BIFVERSION) {
+        fprintf(stderr, "%s: intermediate file version %d not supported\n", srcfname, bifver);
+        exit(1);
+    }
+
+    n = rdbytes(4);
+    for (i = 0; i < n; i++) {
+        id = rdbytes(4);
+        offs = rdbytes(4);
+        size = rdbytes(4);
+        if (id <= BIFSMAX) {
+            bifoffs[id] = offs;
+            bifsize[id] = size;
+        }
+    }
+
+    bifseek(BIFSNAMES);
+    nnames = RDINT();
+    names = malloc(nnames * (MAXNAM + 1) + 1);
+    if (names == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < nnames; i++) {
+        len = RDBYTE();
+        if (len > MAXNAM) {
+            fprintf(stderr, "%s: bad name in intermediate file\n", srcfname);
+            exit(1);
+        }
+        rdchars(names + i * (MAXNAM + 1), len);
+        names[i * (MAXNAM + 1) + len] = '\0';
+    }
+
+    nfuncs = bifsize[BIFSFUNCS] / 4;
+    funcoffs = malloc(nfuncs * sizeof(unsigned) + 1);
+    if (funcoffs == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    bifseek(BIFSFUNCS);
+    for (i = 0; i < nfuncs; i++) {
+        funcoffs[i] = rdbytes(4);
+    }
+}
+
+// go to a section of a version 2 file. version 1 has no directory,
+// and is read straight through
+//
+void
+bifseek(int sect)
+{
+    if (bifver != 1) {
+        inpos = bifoffs[sect];
+    }
 }
 
 
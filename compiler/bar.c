@@ -0,0 +1,1879 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bif.h"
+#include "b.h"
+
+// bar builds library archives of intermediate files, and picks out of
+// them the functions and data a program needs, following what those
+// refer to in turn. The picks are written as one intermediate file,
+// for ba to compile along with the program, so a program only carries
+// the library code it uses, compiled the same way as its own.
+//
+// Since the picks can come from several members, their names, labels
+// and string pool offsets are renumbered, which means reading the code
+// op by op. The operands of each op are as bif.c writes them.
+//
+// With -l, the program's own files are picked from as well, starting
+// from main, and the whole program is written as one file. As all the
+// code that can call a function or use a datum is then at hand, the
+// code is optimized across the files first (see optimize()).
+//
+
+#define NAMEHASH 1021
+#define INLINEMAX 40                    // most ops in a function to inline
+
+// an op, with its operands
+//
+struct inst {
+    unsigned char op;
+    unsigned char kind;                 // of a constant, symbol or update
+    unsigned char discard;              // the result of an update
+    int n;                              // number, offset, label or string
+    int lab;                            // label of a case
+    struct sym *sym;                    // an extrn
+};
+
+// a function, read in to be rewritten
+//
+struct func {
+    struct sym *name;
+    struct inst *code;
+    int ncode;
+    int nparams;                        // highest argument used, plus 1
+    int *cval;                          // constant passed for each argument
+    char *cstate;                       // 0 no calls yet, 1 constant, 2 not
+};
+
+// an intermediate file, in memory
+//
+struct module {
+    char *name;
+    unsigned char *img;
+    unsigned size;
+    unsigned offs[BIFSMAX + 1];         // of each section in img
+    unsigned len[BIFSMAX + 1];
+    char (*names)[MAXNAM + 1];
+    unsigned nnames;
+    unsigned ndata, nfuncs;
+    unsigned *dataoffs;                 // in img, of each datum
+    unsigned *funcoffs;                 // in img, of each function
+    unsigned *dataname, *funcname;      // name index of each
+    char *datasel, *funcsel;            // picked to be written out
+    struct func *funcs;                 // the picked functions
+    int nsel;
+    int local;                          // one of the program's files
+    int pooled;                         // string pool is in the output
+    unsigned strpbase;                  // added to string offsets
+};
+
+// a name, and where it is defined
+//
+struct sym {
+    struct sym *next;                   // in the hash chain
+    char name[MAXNAM + 1];
+    int member;                         // module defining it, or -1
+    unsigned def;                       // which datum, then function
+    int needed;                         // already looked for
+    int fixed;                          // may be used outside the program
+    int indata;                         // in a data initializer
+    int addr;                           // used other than loaded or called
+    int ncalls;                         // direct calls
+    int isconst;                        // never stored to
+    int value;                          // its value, if so
+    struct func *func;                  // its definition, once picked
+    int index;                          // in the output's name table
+};
+
+struct buf {
+    unsigned char *p;
+    unsigned n, max;
+};
+
+// what to do with a datum read from a module
+//
+enum { SKIP, REFS, EMIT };
+
+static struct module *members;
+static int nmembers, maxmembers;
+static struct sym *symhash[NAMEHASH];
+static struct sym **worklist;
+static int nwork, maxwork;
+static int linking;                     // -l, the whole program
+static int nextlab;                     // next output label
+static struct func **funcs;             // all those picked
+static int nfuncs, maxfuncs;
+
+static struct module *inmod;            // the module being read
+static unsigned char *ip, *iend;
+
+static struct buf osect[BIFSMAX + 1];   // the output file's sections
+static struct buf *out;
+static struct sym **onames;             // its name table
+static int nonames, maxonames;
+static struct sym *onamehash[NAMEHASH];
+
+static void usage(void);
+static void fatal(const char *fmt, ...);
+static void *safemalloc(size_t n);
+static void *grow(void *p, int *max, int n, size_t size);
+static unsigned char *rdfile(const char *fn, unsigned *size);
+static int addmodule(char *name, unsigned char *img, unsigned size);
+static void ldmodule(struct module *m, char *name, unsigned char *img, unsigned size);
+static void seek(struct module *m, unsigned offs);
+static unsigned getbytes(int n);
+static unsigned getint(void);
+static unsigned getname(void);
+static unsigned hash(const char *name);
+static struct sym *lookup(struct sym **tab, const char *name);
+static void need(const char *name);
+static void rdarchive(const char *fn);
+static int mkarchive(const char *fn, char **files, int nfiles);
+static int list(const char *fn);
+static int pick(const char *arch, const char *fn, char **files, int nfiles, char **undefs, int nundefs);
+static void follow(char **undefs, int nundefs);
+static void pickdef(struct sym *sym);
+static void copydata(struct module *m, int i, int mode);
+static void rdfunc(struct module *m, int i);
+static int haslabel(int op);
+static void opnum(int mode);
+static void opname(int mode);
+static void opstrp(int mode);
+static void optimize(void);
+static void uses(void);
+static void constdata(void);
+static void constargs(void);
+static void inlinecalls(void);
+static int inlinable(struct func *f);
+static int expand(struct func *f, struct inst *code, int n, int nargs, int frame);
+static void setop(struct inst *in, int op, int kind, int v);
+static int stkop(struct inst *in, int *pops, int *pushes);
+static int callsite(struct func *f, int k, int *prod);
+static int nparams(struct func *f);
+static void labels(struct func *f, int *lo, int *hi);
+static void putbytes(const void *p, unsigned n);
+static void putbyte(unsigned v);
+static void putword(unsigned v);
+static void putint(unsigned v);
+static void putstr(const char *s);
+static void putname(const char *name);
+static void wrfunc(struct func *f);
+static int wrmodule(const char *fn);
+static int wrout(const char *fn, struct buf *bufs, int nbufs);
+
+int
+main(int argc, char **argv)
+{
+    char **undefs;
+    char *outf = NULL;
+    int ch, mode = 0, nundefs = 0;
+
+    undefs = safemalloc(argc * sizeof(char *));
+
+    while ((ch = getopt(argc, argv, "lrtxo:u:")) != -1) {
+        switch (ch) {
+        case 'l':
+        case 'r':
+        case 't':
+        case 'x':
+            if (mode) {
+                usage();
+            }
+            mode = ch;
+            break;
+
+        case 'o':
+            outf = optarg;
+            break;
+
+        case 'u':
+            undefs[nundefs++] = optarg;
+            break;
+
+        default:
+            usage();
+            break;
+        }
+    }
+
+    if (optind >= argc || mode == 0) {
+        usage();
+    }
+
+    switch (mode) {
+    case 'r':
+        return mkarchive(argv[optind], argv + optind + 1, argc - optind - 1);
+
+    case 't':
+        return list(argv[optind]);
+
+    default:
+        if (outf == NULL) {
+            usage();
+        }
+        linking = mode == 'l';
+        return pick(argv[optind], outf, argv + optind + 1, argc - optind - 1, undefs, nundefs);
+    }
+}
+
+// print usage and exit
+//
+void
+usage(void)
+{
+    fprintf(stderr, "bar: -r archive.bia file.i ...\n");
+    fprintf(stderr, "     -t archive.bia\n");
+    fprintf(stderr, "     -x archive.bia -o out.i [-u name ...] file.i ...\n");
+    fprintf(stderr, "     -l archive.bia -o out.i [-u name ...] file.i ...\n");
+    fprintf(stderr, "   -r    make an archive of intermediate files\n");
+    fprintf(stderr, "   -t    list the names each member defines\n");
+    fprintf(stderr, "   -x    write out the definitions in the archive that the files\n");
+    fprintf(stderr, "         and the -u names need\n");
+    fprintf(stderr, "   -l    write out the whole program, with what it needs from the\n");
+    fprintf(stderr, "         archive, optimized as one\n");
+    exit(1);
+}
+
+// print a message and exit
+//
+void
+fatal(const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    fprintf(stderr, "bar: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    exit(1);
+}
+
+void *
+safemalloc(size_t n)
+{
+    void *p = malloc(n ? n : 1);
+
+    if (p == NULL) {
+        fatal("out of memory");
+    }
+    return p;
+}
+
+// grow an array by doubling, to hold at least n + 1 elements
+//
+void *
+grow(void *p, int *max, int n, size_t size)
+{
+    if (n < *max) {
+        return p;
+    }
+    while (n >= *max) {
+        *max = *max ? 2 * *max : 64;
+    }
+    if ((p = realloc(p, *max * size)) == NULL) {
+        fatal("out of memory");
+    }
+    return p;
+}
+
+// read a whole file
+//
+unsigned char *
+rdfile(const char *fn, unsigned *size)
+{
+    FILE *fp;
+    unsigned char *img;
+    long l;
+
+    if ((fp = fopen(fn, "rb")) == NULL) {
+        perror(fn);
+        exit(1);
+    }
+    fseek(fp, 0, SEEK_END);
+    l = ftell(fp);
+    rewind(fp);
+    img = safemalloc(l);
+    if (l < 0 || fread(img, 1, l, fp) != (size_t)l) {
+        fatal("cannot read %s", fn);
+    }
+    fclose(fp);
+    *size = l;
+    return img;
+}
+
+// add a module to those that can be picked from, to be loaded when
+// first needed
+//
+int
+addmodule(char *name, unsigned char *img, unsigned size)
+{
+    members = grow(members, &maxmembers, nmembers, sizeof(struct module));
+    memset(&members[nmembers], 0, sizeof(struct module));
+    members[nmembers].name = name;
+    members[nmembers].img = img;
+    members[nmembers].size = size;
+    return nmembers++;
+}
+
+// Find the sections, names and definitions of the version 2
+// intermediate file 'img'
+//
+void
+ldmodule(struct module *m, char *name, unsigned char *img, unsigned size)
+{
+    unsigned i, n, id, len;
+
+    memset(m, 0, sizeof(struct module));
+    m->name = name;
+    m->img = img;
+    m->size = size;
+
+    seek(m, 0);
+    if (getbytes(4) != BIFMAGIC2 || getbytes(4) != BIFVERSION) {
+        fatal("%s is not a version 2 intermediate file", name);
+    }
+    n = getbytes(4);
+    for (i = 0; i < n; i++) {
+        id = getbytes(4);
+        if (id > BIFSMAX) {
+            getbytes(8);
+            continue;
+        }
+        m->offs[id] = getbytes(4);
+        m->len[id] = getbytes(4);
+        if (m->offs[id] > size || m->len[id] > size - m->offs[id]) {
+            fatal("%s: bad section directory", name);
+        }
+    }
+
+    seek(m, m->offs[BIFSNAMES]);
+    if ((m->nnames = getint()) > size) {
+        fatal("%s: bad name table", name);
+    }
+    m->names = safemalloc(m->nnames * sizeof(*m->names));
+    for (i = 0; i < m->nnames; i++) {
+        if ((len = getbytes(1)) > MAXNAM || len > iend - ip) {
+            fatal("%s: bad name table", name);
+        }
+        memcpy(m->names[i], ip, len);
+        m->names[i][len] = '\0';
+        ip += len;
+    }
+
+    // data have no index, so are found by reading through them
+    //
+    seek(m, m->offs[BIFSDATA]);
+    if ((m->ndata = getint()) > size) {
+        fatal("%s: bad data", name);
+    }
+    m->dataoffs = safemalloc(m->ndata * sizeof(unsigned));
+    m->dataname = safemalloc(m->ndata * sizeof(unsigned));
+    m->datasel = calloc(m->ndata + 1, 1);
+    for (i = 0; i < m->ndata; i++) {
+        m->dataoffs[i] = ip - img;
+        copydata(m, i, SKIP);
+    }
+
+    m->nfuncs = m->len[BIFSFUNCS] / 4;
+    m->funcoffs = safemalloc(m->nfuncs * sizeof(unsigned));
+    m->funcname = safemalloc(m->nfuncs * sizeof(unsigned));
+    m->funcsel = calloc(m->nfuncs + 1, 1);
+    m->funcs = calloc(m->nfuncs + 1, sizeof(struct func));
+    if (m->datasel == NULL || m->funcsel == NULL || m->funcs == NULL) {
+        fatal("out of memory");
+    }
+    for (i = 0; i < m->nfuncs; i++) {
+        seek(m, m->offs[BIFSFUNCS] + 4 * i);
+        m->funcoffs[i] = m->offs[BIFSCODE] + getbytes(4);
+        seek(m, m->funcoffs[i]);
+        m->funcname[i] = getname();
+    }
+}
+
+// start reading module 'm' at 'offs'
+//
+void
+seek(struct module *m, unsigned offs)
+{
+    inmod = m;
+    if (offs > m->size) {
+        fatal("%s: bad intermediate file", m->name);
+    }
+    ip = m->img + offs;
+    iend = m->img + m->size;
+}
+
+// read an 'n' byte number
+//
+unsigned
+getbytes(int n)
+{
+    unsigned v = 0;
+    int i;
+
+    if (iend - ip < n) {
+        fatal("%s: premature end of file", inmod->name);
+    }
+    for (i = 0; i < n; i++) {
+        v |= (unsigned)*ip++ << (8 * i);
+    }
+    return v;
+}
+
+// read a varint (see bif.h)
+//
+unsigned
+getint(void)
+{
+    unsigned zz = 0;
+    int shift = 0, ch;
+
+    do {
+        if (ip == iend || shift >= 35) {
+            fatal("%s: premature end of file", inmod->name);
+        }
+        ch = *ip++;
+        zz |= (unsigned)(ch & 0x7f) << shift;
+        shift += 7;
+    } while (ch & 0x80);
+
+    return (zz >> 1) ^ -(zz & 1);
+}
+
+// read a name, as its index in the module's name table
+//
+unsigned
+getname(void)
+{
+    unsigned n = getint();
+
+    if (n >= inmod->nnames) {
+        fatal("%s: bad name in intermediate file", inmod->name);
+    }
+    return n;
+}
+
+unsigned
+hash(const char *name)
+{
+    unsigned h = 0;
+
+    for (; *name; name++) {
+        h = h * 31 + (*name & 0xff);
+    }
+    return h % NAMEHASH;
+}
+
+// find or add a name in the table 'tab'
+//
+struct sym *
+lookup(struct sym **tab, const char *name)
+{
+    struct sym *sym;
+    unsigned h = hash(name);
+
+    for (sym = tab[h]; sym; sym = sym->next) {
+        if (strcmp(sym->name, name) == 0) {
+            return sym;
+        }
+    }
+
+    if ((sym = calloc(1, sizeof(struct sym))) == NULL) {
+        fatal("out of memory");
+    }
+    strncpy(sym->name, name, MAXNAM);
+    sym->member = -1;
+    sym->next = tab[h];
+    tab[h] = sym;
+    return sym;
+}
+
+// note that 'name' is referred to, to be looked for in the archive
+//
+void
+need(const char *name)
+{
+    struct sym *sym = lookup(symhash, name);
+
+    if (!sym->needed) {
+        sym->needed = 1;
+        worklist = grow(worklist, &maxwork, nwork, sizeof(struct sym *));
+        worklist[nwork++] = sym;
+    }
+}
+
+// read an archive and its symbols. members are loaded when they are
+// first needed. names already defined by the program are not taken
+// from the archive
+//
+void
+rdarchive(const char *fn)
+{
+    struct module ar;
+    struct sym *sym;
+    unsigned char *img;
+    unsigned size, nsyms, member, n, len, i;
+    int base = nmembers;
+    char name[MAXNAM + 1];
+
+    img = rdfile(fn, &size);
+    memset(&ar, 0, sizeof(ar));
+    ar.name = (char *)fn;
+    ar.img = img;
+    ar.size = size;
+    seek(&ar, 0);
+
+    if (getbytes(4) != BIAMAGIC) {
+        fatal("%s is not an archive", fn);
+    }
+    n = getbytes(4);
+    nsyms = getbytes(4);
+    if (n > size || nsyms > size) {
+        fatal("%s: bad archive", fn);
+    }
+
+    for (i = 0; i < nsyms; i++) {
+        member = getbytes(4);
+        len = getbytes(1);
+        if (member >= n || len > MAXNAM || len > iend - ip) {
+            fatal("%s: bad archive", fn);
+        }
+        memcpy(name, ip, len);
+        name[len] = '\0';
+        ip += len;
+        sym = lookup(symhash, name);
+        if (sym->member == -1) {
+            sym->member = base + member;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        len = getbytes(1);
+        if (len > iend - ip) {
+            fatal("%s: bad archive", fn);
+        }
+        member = addmodule(safemalloc(len + 1), NULL, 0);
+        memcpy(members[member].name, ip, len);
+        members[member].name[len] = '\0';
+        ip += len;
+        members[member].offs[0] = getbytes(4);
+        members[member].size = getbytes(4);
+        if (members[member].offs[0] > size || members[member].size > size - members[member].offs[0]) {
+            fatal("%s: bad archive", fn);
+        }
+        members[member].img = img + members[member].offs[0];
+    }
+}
+
+// Write an archive of intermediate files. A name may only be defined
+// by one member.
+//
+int
+mkarchive(const char *fn, char **files, int nfiles)
+{
+    struct module *m;
+    struct sym *sym, **syms = NULL;
+    struct buf bufs[1];
+    unsigned char *img;
+    const char *base;
+    unsigned size, offs, j;
+    int i, nsyms = 0, maxsyms = 0;
+
+    m = calloc(nfiles + 1, sizeof(struct module));
+    if (m == NULL) {
+        fatal("out of memory");
+    }
+
+    for (i = 0; i < nfiles; i++) {
+        img = rdfile(files[i], &size);
+        ldmodule(&m[i], files[i], img, size);
+
+        for (j = 0; j < m[i].ndata + m[i].nfuncs; j++) {
+            if (j < m[i].ndata) {
+                sym = lookup(symhash, m[i].names[m[i].dataname[j]]);
+            } else {
+                sym = lookup(symhash, m[i].names[m[i].funcname[j - m[i].ndata]]);
+            }
+            if (sym->member != -1) {
+                fatal("%s is defined in both %s and %s", sym->name, files[sym->member], files[i]);
+            }
+            sym->member = i;
+            syms = grow(syms, &maxsyms, nsyms, sizeof(struct sym *));
+            syms[nsyms++] = sym;
+        }
+    }
+
+    out = &osect[0];
+    putword(BIAMAGIC);
+    putword(nfiles);
+    putword(nsyms);
+    for (i = 0; i < nsyms; i++) {
+        putword(syms[i]->member);
+        putstr(syms[i]->name);
+    }
+
+    // the members follow the directory
+    //
+    offs = out->n;
+    for (i = 0; i < nfiles; i++) {
+        base = strrchr(files[i], '/') ? strrchr(files[i], '/') + 1 : files[i];
+        offs += 1 + strlen(base) + 8;
+    }
+    for (i = 0; i < nfiles; i++) {
+        base = strrchr(files[i], '/') ? strrchr(files[i], '/') + 1 : files[i];
+        putstr(base);
+        putword(offs);
+        putword(m[i].size);
+        offs += m[i].size;
+    }
+    for (i = 0; i < nfiles; i++) {
+        putbytes(m[i].img, m[i].size);
+    }
+
+    bufs[0] = osect[0];
+    return wrout(fn, bufs, 1);
+}
+
+// list each member of an archive and the names it defines
+//
+int
+list(const char *fn)
+{
+    struct module *m;
+    unsigned j;
+    int i;
+
+    rdarchive(fn);
+    for (i = 0; i < nmembers; i++) {
+        m = &members[i];
+        ldmodule(m, m->name, m->img, m->size);
+        printf("%s:\n", m->name);
+        for (j = 0; j < m->ndata; j++) {
+            printf("    %s\n", m->names[m->dataname[j]]);
+        }
+        for (j = 0; j < m->nfuncs; j++) {
+            printf("    %s()\n", m->names[m->funcname[j]]);
+        }
+    }
+    return 0;
+}
+
+// Write to 'fn' the definitions in the archive 'arch' needed by the
+// intermediate 'files' and the names 'undefs', and by those in turn.
+// Names the files define themselves are not looked for, unless
+// linking, when the files' definitions are picked from too, starting
+// from main.
+//
+int
+pick(const char *arch, const char *fn, char **files, int nfiles, char **undefs, int nundefs)
+{
+    struct module *m;
+    struct sym *sym;
+    unsigned char *img;
+    unsigned size, j;
+    int i, k;
+
+    for (i = 0; i < nfiles; i++) {
+        img = rdfile(files[i], &size);
+        k = addmodule(files[i], img, size);
+        m = &members[k];
+        ldmodule(m, files[i], img, size);
+        m->local = 1;
+
+        for (j = 0; j < m->ndata + m->nfuncs; j++) {
+            if (j < m->ndata) {
+                sym = lookup(symhash, m->names[m->dataname[j]]);
+            } else {
+                sym = lookup(symhash, m->names[m->funcname[j - m->ndata]]);
+            }
+            if (sym->member != -1 && linking) {
+                fatal("%s is defined in both %s and %s", sym->name, members[sym->member].name, files[i]);
+            }
+            sym->member = k;
+            sym->def = j;
+        }
+        if (!linking) {
+            for (j = 0; j < m->nnames; j++) {
+                need(m->names[j]);
+            }
+        }
+    }
+
+    rdarchive(arch);
+
+    if (linking) {
+        lookup(symhash, "main")->fixed = 1;
+        need("main");
+    }
+    follow(undefs, nundefs);
+
+    if (linking) {
+        optimize();
+
+        // the optimizations leave some definitions unused, so what
+        // is needed is found again
+        //
+        for (i = 0; i < NAMEHASH; i++) {
+            for (sym = symhash[i]; sym; sym = sym->next) {
+                sym->needed = 0;
+            }
+        }
+        for (i = 0; i < nmembers; i++) {
+            m = &members[i];
+            if (m->names) {
+                memset(m->datasel, 0, m->ndata);
+                memset(m->funcsel, 0, m->nfuncs);
+                m->nsel = 0;
+            }
+        }
+        need("main");
+        follow(undefs, nundefs);
+    }
+
+    return wrmodule(fn);
+}
+
+// pick what the -u names need, and what is already to be looked for
+//
+void
+follow(char **undefs, int nundefs)
+{
+    struct sym *sym;
+    int i;
+
+    for (i = 0; i < nundefs; i++) {
+        lookup(symhash, undefs[i])->fixed = 1;
+        need(undefs[i]);
+    }
+
+    while (nwork) {
+        sym = worklist[--nwork];
+        if (sym->member != -1 && (linking || !members[sym->member].local)) {
+            pickdef(sym);
+        }
+    }
+}
+
+// pick the definition of 'sym' from its module, and look for what it
+// refers to
+//
+void
+pickdef(struct sym *sym)
+{
+    struct module *m = &members[sym->member];
+    struct sym *s;
+    struct func *f;
+    unsigned i, n;
+    int k;
+
+    if (m->names == NULL) {
+        ldmodule(m, m->name, m->img, m->size);
+        for (i = 0; i < m->ndata + m->nfuncs; i++) {
+            if (i < m->ndata) {
+                s = lookup(symhash, m->names[m->dataname[i]]);
+            } else {
+                s = lookup(symhash, m->names[m->funcname[i - m->ndata]]);
+            }
+            if (s->member == m - members) {
+                s->def = i;
+            }
+        }
+    }
+
+    // the module's string pool goes into the output's whole
+    //
+    if (!m->pooled) {
+        m->pooled = 1;
+        out = &osect[BIFSSTRP];
+        while (out->n % INTSIZE) {
+            putbyte(0);
+        }
+        m->strpbase = out->n;
+        seek(m, m->offs[BIFSSTRP]);
+        n = m->len[BIFSSTRP] ? getint() : 0;
+        if (n > iend - ip) {
+            fatal("%s: bad string pool", m->name);
+        }
+        putbytes(ip, n);
+    }
+
+    i = sym->def;
+    if (i < m->ndata) {
+        m->datasel[i] = 1;
+        m->nsel++;
+        copydata(m, i, REFS);
+        return;
+    }
+
+    i -= m->ndata;
+    m->funcsel[i] = 1;
+    m->nsel++;
+    f = &m->funcs[i];
+    if (f->code == NULL) {
+        rdfunc(m, i);
+        funcs = grow(funcs, &maxfuncs, nfuncs, sizeof(struct func *));
+        funcs[nfuncs++] = f;
+    }
+    sym->func = f;
+    for (k = 0; k < f->ncode; k++) {
+        if (f->code[k].sym) {
+            need(f->code[k].sym->name);
+        }
+    }
+}
+
+// Read datum 'i' of module 'm'. with SKIP, only its name is kept; with
+// REFS, the names it refers to are looked for; with EMIT it is written
+// to the output.
+//
+void
+copydata(struct module *m, int i, int mode)
+{
+    unsigned fl, ninit;
+
+    seek(m, m->dataoffs[i]);
+    if (mode == SKIP) {
+        m->dataname[i] = getname();
+    } else {
+        opname(mode == REFS ? SKIP : mode);
+    }
+
+    fl = getbytes(1);
+    if (mode == EMIT) {
+        putbyte(fl);
+    }
+    if (fl & BIFVEC) {
+        opnum(mode);
+    }
+    ninit = getint();
+    if (mode == EMIT) {
+        putint(ninit);
+    }
+
+    while (ninit--) {
+        fl = getbytes(1);
+        if (mode == EMIT) {
+            putbyte(fl);
+        }
+        switch (fl) {
+        case BIFINAM:
+        case BIFIVEC:
+            opname(mode);
+            break;
+
+        case BIFIINT:
+            opnum(mode);
+            break;
+
+        case BIFISTR:
+            opstrp(mode);
+            break;
+
+        default:
+            fatal("%s: bad initializer", m->name);
+        }
+    }
+}
+
+// Read in function 'i' of module 'm'. Its labels are renumbered to
+// follow those of the functions read before.
+//
+void
+rdfunc(struct module *m, int i)
+{
+    struct func *f = &m->funcs[i];
+    struct inst *in;
+    unsigned ninst;
+    int k, lo, hi;
+
+    seek(m, m->funcoffs[i]);
+    f->name = lookup(symhash, m->names[getname()]);
+
+    if ((ninst = getint()) > iend - ip) {
+        fatal("%s: bad function %s", m->name, f->name->name);
+    }
+    f->code = calloc(ninst + 1, sizeof(struct inst));
+    if (f->code == NULL) {
+        fatal("out of memory");
+    }
+    f->ncode = ninst;
+
+    for (in = f->code; in < f->code + f->ncode; in++) {
+        in->op = getbytes(1);
+
+        switch (in->op) {
+        case ONAMDEF:
+        case OJMP:
+        case OBZ:
+        case OBNZ:
+        case OBEQ:
+        case OBNE:
+        case OBLE:
+        case OBLT:
+        case OBGE:
+        case OBGT:
+        case OPOPN:
+        case ODUPN:
+        case OENTER:
+        case OAVINIT:
+            in->n = getint();
+            break;
+
+        case OCASE:
+            in->n = getint();
+            in->lab = getint();
+            break;
+
+        case OPSHCON:
+            in->kind = getbytes(1);
+            in->n = getint();
+            if (in->kind) {
+                in->n += m->strpbase;
+            }
+            break;
+
+        case OINC:
+        case ODEC:
+        case OPOSTINC:
+        case OPOSTDEC:
+        case OADDTO:
+        case OSUBTO:
+        case OANDTO:
+        case OORTO:
+            // an extrn, an auto, or a vector element; then whether
+            // the result is discarded
+            //
+            in->kind = getbytes(1);
+            in->discard = getbytes(1);
+            if (in->kind == 0) {
+                in->sym = lookup(symhash, m->names[getname()]);
+            } else if (in->kind == 1) {
+                in->n = getint();
+            } else if (in->kind != 2) {
+                fatal("%s: bad operand", m->name);
+            }
+            break;
+
+        case OPSHSYM:
+            in->kind = getbytes(1);
+            if (in->kind == 0) {
+                in->sym = lookup(symhash, m->names[getname()]);
+            } else {
+                in->n = getint();
+            }
+            break;
+
+        default:
+            if (in->op > OORTO) {
+                fatal("%s: bad op %u", m->name, in->op);
+            }
+            break;
+        }
+    }
+
+    labels(f, &lo, &hi);
+    for (k = 0; k < f->ncode; k++) {
+        if (haslabel(f->code[k].op)) {
+            f->code[k].n += nextlab - lo;
+        } else if (f->code[k].op == OCASE) {
+            f->code[k].lab += nextlab - lo;
+        }
+    }
+    nextlab += hi - lo + 1;
+}
+
+// does 'op' have a label as its operand
+//
+int
+haslabel(int op)
+{
+    switch (op) {
+    case ONAMDEF:
+    case OJMP:
+    case OBZ:
+    case OBNZ:
+    case OBEQ:
+    case OBNE:
+    case OBLE:
+    case OBLT:
+    case OBGE:
+    case OBGT:
+        return 1;
+    }
+    return 0;
+}
+
+// find the lowest and highest labels of 'f', or 0 and -1 if it has
+// none
+//
+void
+labels(struct func *f, int *lo, int *hi)
+{
+    int k, l;
+
+    *lo = 0;
+    *hi = -1;
+    for (k = 0; k < f->ncode; k++) {
+        if (haslabel(f->code[k].op)) {
+            l = f->code[k].n;
+        } else if (f->code[k].op == OCASE) {
+            l = f->code[k].lab;
+        } else {
+            continue;
+        }
+        if (*hi < *lo || l < *lo) {
+            *lo = l;
+        }
+        if (l > *hi) {
+            *hi = l;
+        }
+    }
+}
+
+// copy a number operand
+//
+void
+opnum(int mode)
+{
+    unsigned n = getint();
+
+    if (mode == EMIT) {
+        putint(n);
+    }
+}
+
+// a name operand; looked for with REFS
+//
+void
+opname(int mode)
+{
+    unsigned n = getname();
+
+    if (mode == REFS) {
+        need(inmod->names[n]);
+        lookup(symhash, inmod->names[n])->indata = 1;
+    } else if (mode == EMIT) {
+        putname(inmod->names[n]);
+    }
+}
+
+// a string pool offset, moved to where the module's pool is in the
+// output's
+//
+void
+opstrp(int mode)
+{
+    unsigned n = getint();
+
+    if (mode == EMIT) {
+        putint(inmod->strpbase + n);
+    }
+}
+
+// Optimize the whole program. Data that are never stored to are
+// replaced by their values, as are arguments that every call passes
+// the same constant for, and small functions are copied into their
+// callers. Only direct calls, where the function's
+// name is pushed and called, are followed; a function or datum whose
+// address is used otherwise, or that is named by -u, is left alone.
+//
+void
+optimize(void)
+{
+    constdata();
+    constargs();
+    inlinecalls();
+}
+
+// Count how each name is used by the code. Calls are found from the
+// sequence bc compiles them to,
+//
+//     PSHSYM f; args; DUPN nargs; DEREF; CALL; POPN nargs+1; PUSHT
+//
+// where the arguments are straight line code.
+//
+void
+uses(void)
+{
+    struct sym *sym;
+    struct func *f;
+    char *head = NULL;
+    int i, k, h, maxhead = 0;
+
+    for (i = 0; i < NAMEHASH; i++) {
+        for (sym = symhash[i]; sym; sym = sym->next) {
+            sym->addr = sym->indata || sym->fixed;
+            sym->ncalls = 0;
+        }
+    }
+
+    for (i = 0; i < nfuncs; i++) {
+        f = funcs[i];
+        head = grow(head, &maxhead, f->ncode, 1);
+        memset(head, 0, f->ncode);
+        for (k = 0; k < f->ncode; k++) {
+            if (f->code[k].op == OCALL && (h = callsite(f, k, NULL)) >= 0) {
+                head[h] = 1;
+                f->code[h].sym->ncalls++;
+            }
+        }
+
+        for (k = 0; k < f->ncode; k++) {
+            sym = f->code[k].sym;
+            if (sym == NULL || head[k]) {
+                continue;
+            }
+            if (f->code[k].op != OPSHSYM || f->code[k + 1].op != ODEREF || sym->func) {
+                sym->addr = 1;
+            }
+        }
+    }
+    free(head);
+}
+
+// Replace loads of scalars that are never stored to with their
+// initial values
+//
+void
+constdata(void)
+{
+    struct module *m;
+    struct sym *sym;
+    struct func *f;
+    struct inst *in;
+    unsigned j, ninit;
+    int i, k, n;
+
+    uses();
+
+    for (i = 0; i < nmembers; i++) {
+        m = &members[i];
+        for (j = 0; j < m->ndata; j++) {
+            if (!m->datasel[j]) {
+                continue;
+            }
+            seek(m, m->dataoffs[j]);
+            sym = lookup(symhash, m->names[getname()]);
+            if (sym->addr || sym->ncalls || (getbytes(1) & BIFVEC)) {
+                continue;
+            }
+            if ((ninit = getint()) > 1) {
+                continue;
+            }
+            if (ninit == 0) {
+                sym->isconst = 1;
+                sym->value = 0;
+            } else if (getbytes(1) == BIFIINT) {
+                sym->isconst = 1;
+                sym->value = getint();
+            }
+        }
+    }
+
+    for (i = 0; i < nfuncs; i++) {
+        f = funcs[i];
+        for (k = n = 0; k < f->ncode; k++) {
+            in = &f->code[k];
+            if (in->op == OPSHSYM && in->sym && in->sym->isconst && in[1].op == ODEREF) {
+                in->op = OPSHCON;
+                in->n = in->sym->value;
+                in->sym = NULL;
+                k++;
+            }
+            f->code[n++] = *in;
+        }
+        f->ncode = n;
+    }
+}
+
+// Replace the arguments of a function that every call passes the same
+// constant for with the constant, when the function only loads them
+//
+void
+constargs(void)
+{
+    struct func *f, *g;
+    struct inst *in;
+    int *prod = NULL, maxprod = 0;
+    int i, k, a, h, nargs, n;
+
+    uses();
+
+    for (i = 0; i < nfuncs; i++) {
+        f = funcs[i];
+        f->nparams = nparams(f);
+        f->cval = calloc(f->nparams + 1, sizeof(int));
+        f->cstate = calloc(f->nparams + 1, 1);
+        if (f->cval == NULL || f->cstate == NULL) {
+            fatal("out of memory");
+        }
+    }
+
+    for (i = 0; i < nfuncs; i++) {
+        f = funcs[i];
+        for (k = 0; k < f->ncode; k++) {
+            if (f->code[k].op != OCALL || k < 2 || f->code[k - 2].op != ODUPN) {
+                continue;
+            }
+            nargs = f->code[k - 2].n;
+            prod = grow(prod, &maxprod, nargs + 1, sizeof(int));
+            if ((h = callsite(f, k, prod)) < 0 || (g = f->code[h].sym->func) == NULL) {
+                continue;
+            }
+            for (a = 0; a < g->nparams; a++) {
+                in = a < nargs ? &f->code[prod[a]] : NULL;
+                if (in == NULL || in->op != OPSHCON || in->kind) {
+                    g->cstate[a] = 2;
+                } else if (g->cstate[a] == 0) {
+                    g->cstate[a] = 1;
+                    g->cval[a] = in->n;
+                } else if (g->cval[a] != in->n) {
+                    g->cstate[a] = 2;
+                }
+            }
+        }
+    }
+    free(prod);
+
+    for (i = 0; i < nfuncs; i++) {
+        f = funcs[i];
+        if (f->name->addr || f->name->ncalls == 0) {
+            continue;
+        }
+
+        // an argument stored to, or whose address is taken, is not
+        // replaced; the address of one leads to the others
+        //
+        for (k = 0; k < f->ncode; k++) {
+            in = &f->code[k];
+            if (in->op == OPSHSYM && in->kind == 1 && in->n >= 0 && f->code[k + 1].op != ODEREF) {
+                break;
+            }
+            if (in->op >= OINC && in->kind == 1 && in->n >= 0) {
+                f->cstate[in->n] = 2;
+            }
+        }
+        if (k < f->ncode) {
+            continue;
+        }
+
+        for (k = n = 0; k < f->ncode; k++) {
+            in = &f->code[k];
+            if (in->op == OPSHSYM && in->kind == 1 && in->n >= 0 && f->cstate[in->n] == 1) {
+                in->op = OPSHCON;
+                in->kind = 0;
+                in->n = f->cval[in->n];
+                k++;
+            }
+            f->code[n++] = *in;
+        }
+        f->ncode = n;
+    }
+}
+
+// Copy small functions into each direct call of them. The callee's autos and arguments are given slots below the
+// caller's autos, keeping their layout, so the callee's frame is laid
+// out as before,
+//
+//     callee's autos; 2 unused words; arguments
+//
+// The arguments are stored to their slots, and the callee's returns
+// jump past its copy with the result on the stack. As the copies run
+// one at a time, all share the same slots.
+//
+void
+inlinecalls(void)
+{
+    struct func *f, *g;
+    struct inst *code;
+    int *callee = NULL, maxcallee = 0;
+    int i, k, h, n, max, frame, slots, extra;
+
+    for (i = 0; i < nfuncs; i++) {
+        f = funcs[i];
+        if (f->ncode == 0 || f->code[0].op != OENTER) {
+            continue;
+        }
+
+        // callee[] marks the calls to expand: -1 where the function
+        // is pushed, and one past that at the call's DUPN
+        //
+        callee = grow(callee, &maxcallee, f->ncode, sizeof(int));
+        memset(callee, 0, f->ncode * sizeof(int));
+        for (k = n = 0; k < f->ncode; k++) {
+            if (f->code[k].op == OCALL && (h = callsite(f, k, NULL)) >= 0) {
+                g = f->code[h].sym->func;
+                if (g && g != f && inlinable(g)) {
+                    callee[h] = -1;
+                    callee[k - 2] = h + 1;
+                    n++;
+                }
+            }
+        }
+        if (n == 0) {
+            continue;
+        }
+
+        code = NULL;
+        max = n = 0;
+        frame = f->code[0].n;
+        extra = 0;
+        for (k = 0; k < f->ncode; k++) {
+            if (callee[k] == -1) {
+                continue;
+            }
+            if (callee[k] == 0) {
+                code = grow(code, &max, n, sizeof(struct inst));
+                code[n++] = f->code[k];
+                continue;
+            }
+
+            g = f->code[callee[k] - 1].sym->func;
+            h = f->code[k].n;
+            slots = (h > g->nparams ? h : g->nparams) + 2 + g->code[0].n;
+            if (slots > extra) {
+                extra = slots;
+            }
+            code = grow(code, &max, n + 4 * h + g->ncode, sizeof(struct inst));
+            n = expand(g, code, n, h, frame);
+            k += 4;
+        }
+        code[0].n = frame + extra;
+
+        free(f->code);
+        f->code = code;
+        f->ncode = n;
+    }
+    free(callee);
+}
+
+// Copy 'f' into 'code' at 'n', for a call with 'nargs' arguments from
+// a function with 'frame' autos, and return the end of the copy
+//
+int
+expand(struct func *f, struct inst *code, int n, int nargs, int frame)
+{
+    struct inst *in;
+    int a, k, lo, hi, args, autos;
+
+    args = frame + (nargs > f->nparams ? nargs : f->nparams);
+    autos = args + 2;
+
+    for (a = 0; a < nargs; a++) {
+        setop(&code[n++], OPOPT, 0, 0);
+        setop(&code[n++], OPSHSYM, 1, a - args);
+        setop(&code[n++], OPUSHT, 0, 0);
+        setop(&code[n++], OSTORE, 0, 0);
+    }
+
+    labels(f, &lo, &hi);
+    for (k = 1; k < f->ncode - 3; k++) {
+        in = &code[n++];
+        *in = f->code[k];
+        if (haslabel(in->op)) {
+            in->n += nextlab - lo;
+        } else if (in->op == OCASE) {
+            in->lab += nextlab - lo;
+        } else if ((in->op == OPSHSYM || in->op >= OINC) && in->kind == 1) {
+            in->n -= in->n >= 0 ? args : autos;
+        } else if (in->op == OAVINIT) {
+            in->n -= autos;
+        }
+    }
+    nextlab += hi - lo + 1;
+
+    return n;
+}
+
+void
+setop(struct inst *in, int op, int kind, int v)
+{
+    memset(in, 0, sizeof(struct inst));
+    in->op = op;
+    in->kind = kind;
+    in->n = v;
+}
+
+// Can 'f' be copied into its callers? It must be small, and end with
+// its only return,
+//
+//     ENTER n; ...; JMP end; ...; end: POPT; LEAVE; RET
+//
+// with each jump to end leaving just the result on the stack.
+//
+int
+inlinable(struct func *f)
+{
+    struct inst *in, *end;
+    int *depth;
+    int k, d, lo, hi, pops, pushes, ok = 1;
+
+    if (f->ncode > INLINEMAX || f->ncode < 5
+        || f->code[0].op != OENTER
+        || f->code[f->ncode - 4].op != ONAMDEF
+        || f->code[f->ncode - 3].op != OPOPT
+        || f->code[f->ncode - 2].op != OLEAVE
+        || f->code[f->ncode - 1].op != ORET) {
+        return 0;
+    }
+    end = &f->code[f->ncode - 4];
+
+    // follow the depth of the stack; a label first reached by a jump
+    // back to it is taken to have an empty stack, which the jump must
+    // then agree with
+    //
+    labels(f, &lo, &hi);
+    depth = safemalloc((hi - lo + 1) * sizeof(int));
+    for (k = 0; k <= hi - lo; k++) {
+        depth[k] = -1;
+    }
+
+    for (d = 0, in = &f->code[1]; ok && in <= end; in++) {
+        if (in->op == ONAMDEF) {
+            if (d == -1) {
+                d = depth[in->n - lo] == -1 ? 0 : depth[in->n - lo];
+            }
+            if (depth[in->n - lo] != -1 && depth[in->n - lo] != d) {
+                ok = 0;
+            }
+            depth[in->n - lo] = d;
+            continue;
+        }
+
+        if (d == -1) {
+            continue;
+        }
+
+        if (in->op == OJMP || (in->op >= OBNZ && in->op <= OBGT) || in->op == OBZ) {
+            d -= in->op == OJMP ? 0 : in->op == OBZ || in->op == OBNZ ? 1 : 2;
+            if (d < 0 || (depth[in->n - lo] != -1 && depth[in->n - lo] != d)) {
+                ok = 0;
+            }
+            depth[in->n - lo] = d;
+            if (in->op == OJMP) {
+                d = -1;
+            }
+            continue;
+        }
+
+        if (!stkop(in, &pops, &pushes) || pops > d) {
+            ok = 0;
+        }
+        d += pushes - pops;
+    }
+
+    if (depth[end->n - lo] != -1 && depth[end->n - lo] != 1) {
+        ok = 0;
+    }
+    free(depth);
+
+    return ok;
+}
+
+// How many values 'in' pops, and pushes. Returns 0 for ops that are
+// not straight line code.
+//
+int
+stkop(struct inst *in, int *pops, int *pushes)
+{
+    *pops = 0;
+    *pushes = 1;
+
+    switch (in->op) {
+    case OPSHCON:
+    case OPSHSYM:
+    case ODUPN:
+    case OPUSHT:
+        break;
+
+    case ODUP:
+        *pops = 1;
+        *pushes = 2;
+        break;
+
+    case OROT:
+        *pops = *pushes = 3;
+        break;
+
+    case ODEREF:
+    case ONEG:
+    case ONOT:
+        *pops = 1;
+        break;
+
+    case OPOP:
+    case OPOPT:
+    case OCALL:
+        *pops = 1;
+        *pushes = 0;
+        break;
+
+    case OPOPN:
+        *pops = in->n;
+        *pushes = 0;
+        break;
+
+    case OAVINIT:
+        *pushes = 0;
+        break;
+
+    case OADD:
+    case OSUB:
+    case OMUL:
+    case ODIV:
+    case OMOD:
+    case OSHL:
+    case OSHR:
+    case OAND:
+    case OOR:
+    case OEQ:
+    case ONE:
+    case OLE:
+    case OLT:
+    case OGE:
+    case OGT:
+    case OLDX:
+        *pops = 2;
+        break;
+
+    case OSTORE:
+        *pops = 2;
+        *pushes = 0;
+        break;
+
+    case OSTX:
+        *pops = 3;
+        break;
+
+    case OINC:
+    case ODEC:
+    case OPOSTINC:
+    case OPOSTDEC:
+    case OADDTO:
+    case OSUBTO:
+    case OANDTO:
+    case OORTO:
+        *pops = (in->kind == 2) * 2 + (in->op >= OADDTO);
+        *pushes = !in->discard;
+        break;
+
+    default:
+        return 0;
+    }
+    return 1;
+}
+
+// If the CALL at 'k' in 'f' is a direct call, return where the
+// function is pushed, else -1. 'prod', if given, is set to where each
+// argument's value is pushed.
+//
+// The code before the DUPN is followed back, keeping a stack of the
+// values still to be found: the arguments, the function, and the
+// operands of the ops passed on the way.
+//
+int
+callsite(struct func *f, int k, int *prod)
+{
+    static int *want;
+    static int maxwant;
+    struct inst *code = f->code;
+    int nargs, nwant, i, j, pops, pushes;
+
+    if (k < 3 || k + 2 >= f->ncode
+        || code[k - 2].op != ODUPN || code[k - 1].op != ODEREF
+        || code[k + 1].op != OPOPN || code[k + 2].op != OPUSHT
+        || code[k + 1].n != code[k - 2].n + 1) {
+        return -1;
+    }
+
+    nargs = code[k - 2].n;
+    want = grow(want, &maxwant, nargs + 1, sizeof(int));
+    for (nwant = 0; nwant <= nargs; nwant++) {
+        want[nwant] = nargs - nwant;
+    }
+
+    for (i = k - 3; i > 0; i--) {
+        if (!stkop(&code[i], &pops, &pushes) || pushes > nwant) {
+            return -1;
+        }
+        for (j = 0; j < pushes; j++) {
+            if (want[--nwant] == nargs) {
+                return code[i].op == OPSHSYM && code[i].kind == 0 && pushes == 1 && pops == 0 ? i : -1;
+            }
+            if (prod && want[nwant] >= 0) {
+                prod[want[nwant]] = i;
+            }
+        }
+        want = grow(want, &maxwant, nwant + pops, sizeof(int));
+        for (j = 0; j < pops; j++) {
+            want[nwant++] = -1;
+        }
+    }
+    return -1;
+}
+
+// the number of arguments 'f' uses
+//
+int
+nparams(struct func *f)
+{
+    struct inst *in;
+    int n = 0;
+
+    for (in = f->code; in < f->code + f->ncode; in++) {
+        if ((in->op == OPSHSYM || in->op >= OINC) && in->kind == 1 && in->n >= n) {
+            n = in->n + 1;
+        }
+    }
+    return n;
+}
+
+void
+putbytes(const void *p, unsigned n)
+{
+    while (out->n + n > out->max) {
+        out->max = out->max ? 2 * out->max : 256;
+        if ((out->p = realloc(out->p, out->max)) == NULL) {
+            fatal("out of memory");
+        }
+    }
+    memcpy(out->p + out->n, p, n);
+    out->n += n;
+}
+
+void
+putbyte(unsigned v)
+{
+    unsigned char c = v;
+
+    putbytes(&c, 1);
+}
+
+// write a 4 byte number
+//
+void
+putword(unsigned v)
+{
+    int i;
+
+    for (i = 0; i < 4; i++, v >>= 8) {
+        putbyte(v & 0xff);
+    }
+}
+
+// write a varint (see bif.h)
+//
+void
+putint(unsigned v)
+{
+    unsigned zz = (v << 1) ^ ((int)v < 0 ? ~0u : 0);
+
+    while (zz >= 0x80) {
+        putbyte((zz & 0x7f) | 0x80);
+        zz >>= 7;
+    }
+    putbyte(zz);
+}
+
+// write a string as its length and chars
+//
+void
+putstr(const char *s)
+{
+    unsigned len = strlen(s);
+
+    if (len > 255) {
+        len = 255;
+    }
+    putbyte(len);
+    putbytes(s, len);
+}
+
+// write a name as its index in the output's name table
+//
+void
+putname(const char *name)
+{
+    struct sym *sym = lookup(onamehash, name);
+
+    if (sym->member == -1) {
+        sym->member = 0;
+        sym->index = nonames;
+        onames = grow(onames, &maxonames, nonames, sizeof(struct sym *));
+        onames[nonames++] = sym;
+    }
+    putint(sym->index);
+}
+
+// write a function out, as bif.c does
+//
+void
+wrfunc(struct func *f)
+{
+    struct inst *in;
+
+    out = &osect[BIFSFUNCS];
+    putword(osect[BIFSCODE].n);
+    out = &osect[BIFSCODE];
+    putname(f->name->name);
+    putint(f->ncode);
+
+    for (in = f->code; in < f->code + f->ncode; in++) {
+        putbyte(in->op);
+
+        switch (in->op) {
+        case ONAMDEF:
+        case OJMP:
+        case OBZ:
+        case OBNZ:
+        case OBEQ:
+        case OBNE:
+        case OBLE:
+        case OBLT:
+        case OBGE:
+        case OBGT:
+        case OPOPN:
+        case ODUPN:
+        case OENTER:
+        case OAVINIT:
+            putint(in->n);
+            break;
+
+        case OCASE:
+            putint(in->n);
+            putint(in->lab);
+            break;
+
+        case OPSHCON:
+            putbyte(in->kind);
+            putint(in->n);
+            break;
+
+        case OINC:
+        case ODEC:
+        case OPOSTINC:
+        case OPOSTDEC:
+        case OADDTO:
+        case OSUBTO:
+        case OANDTO:
+        case OORTO:
+            putbyte(in->kind);
+            putbyte(in->discard);
+            if (in->kind == 0) {
+                putname(in->sym->name);
+            } else if (in->kind == 1) {
+                putint(in->n);
+            }
+            break;
+
+        case OPSHSYM:
+            putbyte(in->kind);
+            if (in->kind == 0) {
+                putname(in->sym->name);
+            } else {
+                putint(in->n);
+            }
+            break;
+        }
+    }
+}
+
+// Write the picks as a version 2 intermediate file. Each module's
+// string pool follows that of the module picked from before.
+//
+int
+wrmodule(const char *fn)
+{
+    struct module *m;
+    struct buf hdr = { NULL, 0, 0 };
+    struct buf bufs[BIFSMAX + 1];
+    unsigned i, j, ndata = 0, offs;
+    int k;
+
+    for (k = 0; k < nmembers; k++) {
+        m = &members[k];
+        for (j = 0; j < m->ndata && m->nsel; j++) {
+            ndata += m->datasel[j];
+        }
+    }
+
+    out = &osect[BIFSDATA];
+    putint(ndata);
+    for (k = 0; k < nmembers; k++) {
+        m = &members[k];
+        for (j = 0; j < m->ndata && m->nsel; j++) {
+            if (m->datasel[j]) {
+                out = &osect[BIFSDATA];
+                copydata(m, j, EMIT);
+            }
+        }
+    }
+
+    for (k = 0; k < nmembers; k++) {
+        m = &members[k];
+        for (j = 0; j < m->nfuncs && m->nsel; j++) {
+            if (m->funcsel[j]) {
+                wrfunc(&m->funcs[j]);
+            }
+        }
+    }
+
+    // the pool was gathered apart, as it is prefixed by its size
+    //
+    out = &osect[0];
+    putint(osect[BIFSSTRP].n);
+    putbytes(osect[BIFSSTRP].p, osect[BIFSSTRP].n);
+    free(osect[BIFSSTRP].p);
+    osect[BIFSSTRP] = osect[0];
+
+    out = &osect[BIFSNAMES];
+    putint(nonames);
+    for (k = 0; k < nonames; k++) {
+        putstr(onames[k]->name);
+    }
+
+    out = &hdr;
+    putword(BIFMAGIC2);
+    putword(BIFVERSION);
+    putword(BIFSMAX);
+    offs = 12 + 12 * BIFSMAX;
+    for (i = 1; i <= BIFSMAX; i++) {
+        putword(i);
+        putword(offs);
+        putword(osect[i].n);
+        offs += osect[i].n;
+    }
+
+    bufs[0] = hdr;
+    for (i = 1; i <= BIFSMAX; i++) {
+        bufs[i] = osect[i];
+    }
+    return wrout(fn, bufs, BIFSMAX + 1);
+}
+
+// write buffers out to the file 'fn'
+//
+int
+wrout(const char *fn, struct buf *bufs, int nbufs)
+{
+    FILE *fp;
+    int i;
+
+    if ((fp = fopen(fn, "wb")) == NULL) {
+        perror(fn);
+        return 1;
+    }
+    for (i = 0; i < nbufs; i++) {
+        fwrite(bufs[i].p, 1, bufs[i].n, fp);
+    }
+    if (ferror(fp) | fclose(fp)) {
+        fprintf(stderr, "bar: I/O error on %s\n", fn);
+        remove(fn);
+        return 1;
+    }
+    return 0;
+}
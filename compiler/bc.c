@@ -7,6 +7,7 @@
 #include <unistd.h>
 
 #include "b.h"
+#include "bif.h"
 #include "lex.h"
 
 #define MAXFNARG 64
@@ -14,10 +15,13 @@
 #define LVAL  0
 #define RVAL  1
 
+#define PROFHASH 1024
+
 struct scase {
     struct scase *next;
     unsigned caseval;
     struct stabent *label;
+    unsigned count;
 };
 
 struct swtch {
@@ -25,6 +29,13 @@ struct swtch {
     struct scase *head, *tail;
 };
 
+struct profent {
+    struct profent *next;
+    char fn[MAXNAM + 1];
+    int label;
+    unsigned count;
+};
+
 static char *srcfn;
 static int errf = 0;
 static struct token *curtok = NULL;
@@ -33,6 +44,9 @@ static struct stablist *local = NULL;
 static struct stablist datasyms = { NULL, NULL };
 static struct swtch *swtchstk = NULL;
 static struct stabent *retlabel = NULL;
+static struct stabent *curfunc = NULL;
+static struct profent *proftab[PROFHASH];
+static int haveprof = 0;
 static int nextlab = 0;
 static int nextauto = 0;
 
@@ -51,6 +65,7 @@ static void stmtcase(struct codefrag *prog);
 static void stmtswitch(struct codefrag *prog);
 static void stmtreturn(struct codefrag *prog);
 static void datadef(struct stabent *sym);
+static void sortcases(struct swtch *sw);
 static void pushtok(const struct token *tok);
 static void nextok(void);
 
@@ -61,7 +76,11 @@ static void pushbr(struct codefrag *prog, enum codeop op, struct stabent *target
 static void pushlbl(struct codefrag *prog, struct stabent *lbl);
 static void pushcase(struct codefrag *prog, unsigned caseval, struct stabent *target);
 static void torval(struct codefrag *prog);
+static struct codenode *rmwop(struct codefrag *prog, enum codeop op);
+static int isrmw(enum codeop op);
+static int sideeffect(enum codeop op);
 static int expr(struct codefrag *prog);
+static void brcond(struct codefrag *prog, struct codefrag *cond, int sense, struct stabent *target);
 
 static struct stabent *stabget(struct stablist *root, const char *name);
 static struct stabent *stabfind(const char *name);
@@ -71,16 +90,20 @@ static struct codenode *cnalloc(void);
 static void cnpush(struct codefrag *frag, struct codenode *node);
 static void cnappend(struct codefrag *fragl, struct codefrag *fragr);
 static void cnsplice(struct codefrag *fragl, struct codefrag *fragr, struct codenode *after);
+static struct codenode *cnpop(struct codefrag *frag);
 static void cfprint(struct codefrag *frag);
 
 static void ddprint(struct stabent *sym);
 
+static int profload(const char *fn);
+static unsigned profcount(int label);
+
 void err(int sline, int line, const char *fmt, ...);
 
 static void
 usage()
 {
-    fprintf(stderr, "bc: [-o outfile] infile\n");
+    fprintf(stderr, "bc: [-fprofile-use=file] [-fbif-version=1|2] [-o outfile] infile\n");
     exit(1);
 }
 
@@ -118,10 +141,27 @@ main(int argc, char **argv)
     struct stabent *sym;
     char *outfn = NULL;
     int listing = 0;
+    int bifver = BIFVERSION;
     int ch;
 
-    while ((ch = getopt(argc, argv, "lo:")) != -1) {
+    while ((ch = getopt(argc, argv, "f:lo:")) != -1) {
         switch (ch) {
+        case 'f':
+            if (strncmp(optarg, "bif-version=", 12) == 0) {
+                bifver = atoi(optarg + 12);
+                if (bifver != 1 && bifver != 2) {
+                    usage();
+                }
+                break;
+            }
+            if (strncmp(optarg, "profile-use=", 12) != 0) {
+                usage();
+            }
+            if (profload(optarg + 12) != 0) {
+                return 1;
+            }
+            break;
+
         case 'o':
             outfn = optarg;
             break;
@@ -158,7 +198,7 @@ main(int argc, char **argv)
         return 1;
     }
 
-    if (bifwrite(outfn, global) != 0) {
+    if (bifwrite(outfn, global.head, bifver) != 0) {
         return 1;
     }
 
@@ -216,6 +256,7 @@ definition(void)
     local = &sym->scope;
     if (curtok->type == TLPAREN) {
         sym->type = FUNC;
+        curfunc = sym;
         nextok();
         funcdef(&sym->fn);
     } else {
@@ -262,11 +303,12 @@ funcdef(struct codefrag *prog)
 
     enter->arg.n = nextauto;
    
+    // the return value is handed back in T
+    //
     pushicon(prog, 0);
     pushlbl(prog, retlabel);
     pushop(prog, OPOPT);
     pushop(prog, OLEAVE);
-    pushop(prog, OPUSHT);
     pushop(prog, ORET);
 }
 
@@ -400,10 +442,14 @@ statement(struct codefrag *prog)
 
             // rvalue ';'
             expr(prog);
-    
-            cn = cnalloc();
-            cn->op = OPOP;
-            cnpush(prog, cn);
+
+            if (prog->tail && isrmw(prog->tail->op)) {
+                prog->tail->arg.rmw.discard = 1;
+            } else {
+                cn = cnalloc();
+                cn->op = OPOP;
+                cnpush(prog, cn);
+            }
             
             if (curtok->type == TSCOLON) {
                 nextok();
@@ -577,11 +623,20 @@ stmtgoto(struct codefrag *prog)
 
 // Parse an if statement
 //
+// With profile feedback, if the then part of an if/else is the 
+// more frequently executed one, the parts are swapped so that it
+// falls through to the end without a jump. The labels are reused
+// so that label numbering matches the instrumented build.
+//
 void
 stmtif(struct codefrag *prog)
 {
     struct stabent *elsepart = mklabel();
     struct stabent *donepart = mklabel();
+    struct codefrag cond = { NULL, NULL };
+    struct codefrag thenp = { NULL, NULL };
+    struct codefrag elsep = { NULL, NULL };
+    unsigned nelse, ndone;
     
     if (curtok->type != TLPAREN) {
         err(__LINE__,curtok->line, "'(' expected");
@@ -589,8 +644,8 @@ stmtif(struct codefrag *prog)
     }
     nextok();
     
-    if (expr(prog) == LVAL) {
-        torval(prog);
+    if (expr(&cond) == LVAL) {
+        torval(&cond);
     }
 
     if (curtok->type != TRPAREN) {
@@ -599,29 +654,55 @@ stmtif(struct codefrag *prog)
     }
     nextok();
 
-    pushbr(prog, OBZ, elsepart);
-    statement(prog);
+    statement(&thenp);
     
     if (curtok->type != TELSE) {
+        brcond(prog, &cond, 0, elsepart);
+        cnappend(prog, &thenp);
         pushlbl(prog, elsepart); 
-    } else {
-        nextok();
+        return;
+    } 
+
+    nextok();
+    statement(&elsep);
+
+    // the end is reached from both parts, so the then part ran the
+    // difference. if the else part returns or jumps out, there is
+    // less than that, and the counts say nothing
+    //
+    if (haveprof) {
+        nelse = profcount(elsepart->labpc);
+        ndone = profcount(donepart->labpc);
+    }
+    if (haveprof && ndone >= nelse && nelse < ndone - nelse) {
+        brcond(prog, &cond, 1, elsepart);
+        cnappend(prog, &elsep);
         pushbr(prog, OJMP, donepart);
         pushlbl(prog, elsepart);
-        statement(prog);
+        cnappend(prog, &thenp);
         pushlbl(prog, donepart);
+        return;
     }
+
+    brcond(prog, &cond, 0, elsepart);
+    cnappend(prog, &thenp);
+    pushbr(prog, OJMP, donepart);
+    pushlbl(prog, elsepart);
+    cnappend(prog, &elsep);
+    pushlbl(prog, donepart);
 }
 
 // Parse a while statement
 //
+// The test is placed after the body, so that each trip around
+// the loop costs just the conditional branch.
+//
 void
 stmtwhile(struct codefrag *prog)
 {
     struct stabent *top = mklabel();
-    struct stabent *bottom = mklabel();
-
-    pushlbl(prog, top);
+    struct stabent *test = mklabel();
+    struct codefrag cond = { NULL, NULL };
 
     if (curtok->type != TLPAREN) {
         err(__LINE__,curtok->line, "'(' expected");
@@ -629,8 +710,8 @@ stmtwhile(struct codefrag *prog)
     }
     nextok();
     
-    if (expr(prog) == LVAL) {
-        torval(prog);
+    if (expr(&cond) == LVAL) {
+        torval(&cond);
     }
 
     if (curtok->type != TRPAREN) {
@@ -639,10 +720,11 @@ stmtwhile(struct codefrag *prog)
     }
     nextok();
 
-    pushbr(prog, OBZ, bottom);
+    pushbr(prog, OJMP, test);
+    pushlbl(prog, top);
     statement(prog);
-    pushbr(prog, OJMP, top);
-    pushlbl(prog, bottom);
+    pushlbl(prog, test);
+    brcond(prog, &cond, 1, top);
 }
 
 // Parse a switch statement
@@ -673,6 +755,10 @@ stmtswitch(struct codefrag *prog)
     pushlbl(prog, nomatch);
     swtchstk = sw->prev;
 
+    if (haveprof) {
+        sortcases(sw);
+    }
+
     for (scase = sw->head; scase; scase = scase->next) {
         pushcase(&cases, scase->caseval, scase->label);
     }
@@ -685,6 +771,38 @@ stmtswitch(struct codefrag *prog)
     cnsplice(&cases, prog, here);
 }
 
+// Order the cases of a switch by profile count, most frequent
+// first, so that the chain of CASE tests finds them sooner. If
+// a value appears twice the first one wins, so such switches are
+// left alone.
+//
+void
+sortcases(struct swtch *sw)
+{
+    struct scase *sc, *p, **pp, *sorted = NULL;
+
+    for (sc = sw->head; sc; sc = sc->next) {
+        for (p = sc->next; p; p = p->next) {
+            if (p->caseval == sc->caseval) {
+                return;
+            }
+        }
+        sc->count = profcount(sc->label->labpc);
+    }
+
+    while ((sc = sw->head) != NULL) {
+        sw->head = sc->next;
+
+        for (pp = &sorted; *pp && (*pp)->count >= sc->count; pp = &(*pp)->next)
+            ;
+
+        sc->next = *pp;
+        *pp = sc;
+    }
+
+    sw->head = sorted;
+}
+
 // Parse a case statement
 //
 void
@@ -987,14 +1105,72 @@ pushcase(struct codefrag *prog, unsigned caseval, struct stabent *target)
     cnpush(prog, cn);
 }
 
-// Convert the top of the stack to an rvalue
+// Convert the top of the stack to an rvalue. If the lvalue was just
+// computed by adding an index to a pointer (as for v[i]), the add
+// and dereference become a single indexed load.
 //
 void
 torval(struct codefrag *prog)
 {
+    if (prog->tail && prog->tail->op == OADD) {
+        prog->tail->op = OLDX;
+        return;
+    }
     pushop(prog, ODEREF);
 }
 
+// If the lvalue on top of the stack is a variable or a vector element,
+// take the code which pushes its address back off the stack and return
+// a node for the in-place update 'op' of it. The caller emits the node
+// once any right hand side is on the stack. Returns NULL for other
+// lvalues.
+//
+struct codenode *
+rmwop(struct codefrag *prog, enum codeop op)
+{
+    struct codenode *cn, *lv = prog->tail;
+
+    if (lv == NULL) {
+        return NULL;
+    }
+
+    if (lv->op == OPSHSYM) {
+        if (lv->arg.target->sc != EXTERN && lv->arg.target->sc != AUTO) {
+            return NULL;
+        }
+    } else if (lv->op != OADD) {
+        return NULL;
+    }
+
+    cn = cnalloc();
+    cn->op = op;
+    if (lv->op == OPSHSYM) {
+        cn->arg.rmw.target = lv->arg.target;
+    }
+
+    free(cnpop(prog));
+    return cn;
+}
+
+// Returns non-zero for the in-place update ops
+//
+int
+isrmw(enum codeop op)
+{
+    switch (op) {
+    case OINC:
+    case ODEC:
+    case OPOSTINC:
+    case OPOSTDEC:
+    case OADDTO:
+    case OSUBTO:
+    case OANDTO:
+    case OORTO:
+        return 1;
+    }
+    return 0;
+}
+
 static const char lvalex[] = "lvalue expected";
 
 // parse a function call. returns the number of arguments
@@ -1113,8 +1289,7 @@ eprimary(struct codefrag *prog)
             if (type == LVAL) {
                 torval(prog);
             }
-            pushop(prog, OCALL);            // fn argn argn-1 ... arg0 retval 
-            pushop(prog, OPOPT);            // fn argn argn-1 ... arg0 ; retval in T
+            pushop(prog, OCALL);            // fn argn argn-1 ... arg0 ; retval in T
             pushopn(prog, OPOPN, args+1);   // ; retval in T
             pushop(prog, OPUSHT);           // retval
 
@@ -1144,6 +1319,8 @@ eprimary(struct codefrag *prog)
             // post-increment, post-decrement
             if (type != LVAL) {
                 err(__LINE__,curtok->line, lvalex);
+            } else if ((cn = rmwop(prog, curtok->type == TPP ? OPOSTINC : OPOSTDEC)) != NULL) {
+                cnpush(prog, cn);       // old-val
             } else {
                                         // lval
                 pushop(prog, ODUP);     // lval lval
@@ -1174,6 +1351,7 @@ static int
 eunary(struct codefrag *prog)
 {
     enum toktyp ttype = curtok->type;
+    struct codenode *cn;
     int type;
         
     if (ttype == TDEREF || ttype == TADDR || ttype == TMINUS || ttype == TNOT || ttype == TPP || ttype == TMM) {
@@ -1207,7 +1385,10 @@ eunary(struct codefrag *prog)
 
         case TMM:
         case TPP:
-            if (type == LVAL) {
+            if (type == LVAL && (cn = rmwop(prog, ttype == TPP ? OINC : ODEC)) != NULL) {
+                cnpush(prog, cn);       // new-val
+                type = RVAL;
+            } else if (type == LVAL) {
                                         // lval
                 pushop(prog, ODUP);     // lval lval
                 pushop(prog, ODEREF);   // lval old-val
@@ -1410,6 +1591,7 @@ eand(struct codefrag *prog)
         }
 
         pushop(prog, OAND);
+        type = RVAL;
     }
 
     return type;
@@ -1433,6 +1615,7 @@ eor(struct codefrag *prog)
         }
 
         pushop(prog, OOR);
+        type = RVAL;
     }
 
     return type;
@@ -1443,20 +1626,23 @@ eor(struct codefrag *prog)
 static int
 econd(struct codefrag *prog)
 {
-    int type = eor(prog);
+    struct codefrag cond = { NULL, NULL };
+    int type = eor(&cond);
     struct stabent *skip;
     struct stabent *done;
 
-    if (curtok->type == TQUES) {
+    if (curtok->type != TQUES) {
+        cnappend(prog, &cond);
+    } else {
         skip = mklabel();
         done = mklabel();
 
         if (type == LVAL) {
-            torval(prog);
+            torval(&cond);
         } 
         nextok();
 
-        pushbr(prog, OBZ, skip);
+        brcond(prog, &cond, 0, skip);
         
         if (econd(prog) == LVAL) {
             torval(prog);
@@ -1518,14 +1704,30 @@ static enum codeop assnop(int line, enum toktyp type)
     return OADD;
 }
 
+// Returns the in-place update op for an assignment operator, or ONAMDEF
+// if it doesn't have one
+//
+static enum codeop
+assnrmw(enum toktyp type)
+{
+    switch (type) {
+    case TAPLUS:    return OADDTO;
+    case TAMINUS:   return OSUBTO;
+    case TAAND:     return OANDTO;
+    case TAOR:      return OORTO;
+    }
+    return ONAMDEF;
+}
+
 static int
 eassign(struct codefrag *prog)
 {
     int type = econd(prog);
+    int indexed;
     enum toktyp tt;
+    struct codefrag rhs = { NULL, NULL };
+    struct codenode *cn = NULL;
 
-    // TODO =+ et al
-    //
     if (curtok->type >= TAFIRST && curtok->type <= TALAST) {
         if (type != LVAL) {
             err(__LINE__,curtok->line, lvalex);
@@ -1534,13 +1736,43 @@ eassign(struct codefrag *prog)
 
         nextok();
 
+        // storing through an indexed lvalue: leave the pointer and
+        // index on the stack for an indexed store
+        //
+        indexed = tt == TASSIGN && prog->tail && prog->tail->op == OADD;
+        if (indexed) {
+            free(cnpop(prog));  // ptr index
+        }
+
+        if (eassign(&rhs) == LVAL) {
+            torval(&rhs);
+        }
+
+        // a variable or vector element is updated in place, unless the
+        // right hand side may change it, as it must see the old value
+        //
+        for (cn = rhs.head; cn && !sideeffect(cn->op); cn = cn->next)
+            ;
+        if (cn == NULL && !indexed && type == LVAL && assnrmw(tt) != ONAMDEF) {
+            cn = rmwop(prog, assnrmw(tt));
+            if (cn) {
+                cnappend(prog, &rhs);
+                cnpush(prog, cn);   // rval ; and value is updated in memory
+                return RVAL;
+            }
+        }
+
         if (tt != TASSIGN) {
             pushop(prog, ODUP);  // lval lval
             torval(prog);        // lval rval-left
         }
 
-        if (eassign(prog) == LVAL) {
-            torval(prog);
+        cnappend(prog, &rhs);
+
+        if (indexed) {
+                                // ptr index rval
+            pushop(prog, OSTX); // rval  ; and value is stored in memory
+            return RVAL;
         }
 
         if (tt != TASSIGN) {
@@ -1571,6 +1803,251 @@ expr(struct codefrag *frag)
     return eassign(frag);
 }
 
+/******************************************************************************
+ *
+ * Conditions in truth-value context
+ *
+ */
+
+// relational ops, with the branch each becomes and the
+// branch for the inverted test
+//
+static struct {
+    enum codeop op;
+    enum codeop br;
+    enum codeop invbr;
+} relops[] = {
+    { OEQ, OBEQ, OBNE },
+    { ONE, OBNE, OBEQ },
+    { OLE, OBLE, OBGT },
+    { OLT, OBLT, OBGE },
+    { OGE, OBGE, OBLT },
+    { OGT, OBGT, OBLE },
+};
+static const int nrelops = sizeof(relops) / sizeof(relops[0]);
+
+// return the index of op in relops, or -1 if it isn't
+// a relational op
+//
+static int
+relop(enum codeop op)
+{
+    int i;
+
+    for (i = 0; i < nrelops; i++) {
+        if (relops[i].op == op) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Get the stack effect of a straight line op into delta. Returns
+// 0 if the op transfers control or otherwise can't be reasoned 
+// about.
+//
+static int
+stkeffect(struct codenode *cn, int *delta)
+{
+    switch (cn->op) {
+    case OPSHCON:
+    case OPSHSYM:
+    case ODUP:
+    case ODUPN:
+    case OPUSHT:
+        *delta = 1;
+        return 1;
+
+    case ODEREF:
+    case OROT:
+    case ONEG:
+    case ONOT:
+        *delta = 0;
+        return 1;
+
+    case OPOP:
+    case OPOPT:
+    case OCALL:
+    case OADD:
+    case OSUB:
+    case OMUL:
+    case ODIV:
+    case OMOD:
+    case OSHL:
+    case OSHR:
+    case OAND:
+    case OOR:
+    case OEQ:
+    case ONE:
+    case OLE:
+    case OLT:
+    case OGE:
+    case OGT:
+    case OLDX:
+        *delta = -1;
+        return 1;
+
+    case OSTORE:
+    case OSTX:
+        *delta = -2;
+        return 1;
+
+    case OPOPN:
+        *delta = -(int)cn->arg.n;
+        return 1;
+
+    case OINC:
+    case ODEC:
+    case OPOSTINC:
+    case OPOSTDEC:
+        *delta = cn->arg.rmw.target ? 1 : -1;
+        return 1;
+
+    case OADDTO:
+    case OSUBTO:
+    case OANDTO:
+    case OORTO:
+        *delta = cn->arg.rmw.target ? 0 : -2;
+        return 1;
+    }
+
+    return 0;
+}
+
+// Returns non-zero if the op can have side effects (or, for
+// POPT/PUSHT/POPN, is part of a function call sequence)
+//
+static int
+sideeffect(enum codeop op)
+{
+    return op == OSTORE || op == OSTX || isrmw(op) || op == OCALL || op == OPOPT || op == OPUSHT || op == OPOPN;
+}
+
+// Split the code for a binary op at the tail of cond into views
+// of its left and right operands. The views share nodes with
+// cond. Fails (returning 0) unless the code is straight line and
+// the right operand has no side effects, since the right operand
+// is only evaluated conditionally once the op becomes a branch.
+//
+static int
+splitbin(struct codefrag *cond, struct codefrag *left, struct codefrag *right)
+{
+    struct codenode *cn, *prev = NULL, *split = NULL;
+    int depth = 0, delta;
+
+    for (cn = cond->head; cn && cn != cond->tail; prev = cn, cn = cn->next) {
+        if (!stkeffect(cn, &delta)) {
+            return 0;
+        }
+        depth += delta;
+
+        // the left operand ends the last time there is exactly
+        // one value on the stack
+        //
+        if (depth == 1) {
+            split = cn;
+        }
+    }
+
+    if (cn == NULL || depth != 2 || split == NULL || split == prev) {
+        return 0;
+    }
+
+    for (cn = split->next; cn != cond->tail; cn = cn->next) {
+        if (sideeffect(cn->op)) {
+            return 0;
+        }
+    }
+
+    left->head = cond->head;
+    left->tail = split;
+    right->head = split->next;
+    right->tail = prev;
+
+    return 1;
+}
+
+// Returns non-zero if the code in cond is known to leave
+// either 0 or 1 on the stack
+//
+static int
+isbool(struct codefrag *cond)
+{
+    struct codefrag left, right;
+    enum codeop op = cond->tail->op;
+
+    if (relop(op) >= 0 || op == ONOT) {
+        return 1;
+    }
+
+    if (op == OAND || op == OOR) {
+        return splitbin(cond, &left, &right) && isbool(&left) && isbool(&right);
+    }
+
+    return 0;
+}
+
+// Append the condition in cond to prog as control flow, branching
+// to target if the truth value of the condition is sense. 
+//
+// Relational ops become conditional branches and '!' swaps the
+// sense of the test. '&' and '|' of conditions which are all 0 or 1
+// become chains of branches, provided the right hand side can 
+// safely be skipped. Anything else is evaluated as a value and 
+// tested against zero.
+//
+void
+brcond(struct codefrag *prog, struct codefrag *cond, int sense, struct stabent *target)
+{
+    struct codefrag left, right;
+    struct codenode *cn = cond->tail;
+    struct stabent *skip;
+    int i, isand;
+
+    if (cn && (i = relop(cn->op)) >= 0) {
+        free(cnpop(cond));
+        cnappend(prog, cond);
+        pushbr(prog, sense ? relops[i].br : relops[i].invbr, target);
+        return;
+    }
+
+    if (cn && cn->op == ONOT) {
+        free(cnpop(cond));
+        brcond(prog, cond, !sense, target);
+        return;
+    }
+
+    if (cn && (cn->op == OAND || cn->op == OOR) && isbool(cond)) {
+        splitbin(cond, &left, &right);
+        left.tail->next = NULL;
+        right.tail->next = NULL;
+        isand = cn->op == OAND;
+        free(cn);
+
+        // the label is made even when it is not used, as the sense
+        // may depend on the profile, and the labels must be numbered
+        // as they were in the instrumented build
+        //
+        skip = mklabel();
+
+        if (isand == !sense) {
+            // a & b is false if either is false; a | b is true
+            // if either is true
+            //
+            brcond(prog, &left, sense, target);
+            brcond(prog, &right, sense, target);
+        } else {
+            brcond(prog, &left, !sense, skip);
+            brcond(prog, &right, sense, target);
+            pushlbl(prog, skip);
+        }
+        return;
+    }
+
+    cnappend(prog, cond);
+    pushbr(prog, sense ? OBNZ : OBZ, target);
+}
+
 /******************************************************************************
  *
  * Symbol table routines
@@ -1683,6 +2160,10 @@ cnpush(struct codefrag *frag, struct codenode *node)
 void 
 cnappend(struct codefrag *fragl, struct codefrag *fragr)
 {
+    if (fragr->head == NULL) {
+        return;
+    }
+
     if (fragl->head == NULL) {
         fragl->head = fragr->head;
     } else {
@@ -1716,6 +2197,27 @@ cnsplice(struct codefrag *fragl, struct codefrag *fragr, struct codenode *after)
     }
 }
 
+// Remove the last node from a code fragment and return it
+//
+struct codenode *
+cnpop(struct codefrag *frag)
+{
+    struct codenode *cn, *last = frag->tail;
+
+    if (frag->head == last) {
+        frag->head = frag->tail = NULL;
+        return last;
+    }
+
+    for (cn = frag->head; cn->next != last; cn = cn->next)
+        ;
+
+    cn->next = NULL;
+    frag->tail = cn;
+
+    return last;
+}
+
 // Hex dump
 //
 void
@@ -1786,9 +2288,33 @@ static struct {
     { OLE,    "LE" },
     { OGT,    "GT" },
     { OGE,    "GE" },
+    { OLDX,   "LDX" },
+    { OSTX,   "STX" },
 };
 static int nsimpleops = sizeof(simpleops) / sizeof(simpleops[0]);
 
+// in-place update ops, in enum order from OINC
+//
+static const char *rmwnames[] = {
+    "INC", "DEC", "POSTINC", "POSTDEC", "ADDTO", "SUBTO", "ANDTO", "ORTO",
+};
+
+static struct {
+    enum codeop op;
+    const char *text;
+} branchops[] = {
+    { OJMP,   "JMP" },
+    { OBZ,    "BZ" },
+    { OBNZ,   "BNZ" },
+    { OBEQ,   "BEQ" },
+    { OBNE,   "BNE" },
+    { OBLE,   "BLE" },
+    { OBLT,   "BLT" },
+    { OBGE,   "BGE" },
+    { OBGT,   "BGT" },
+};
+static int nbranchops = sizeof(branchops) / sizeof(branchops[0]);
+
 void 
 cfprint(struct codefrag *frag) 
 {
@@ -1814,6 +2340,17 @@ cfprint(struct codefrag *frag)
             continue;
         }
 
+        for (i = 0; i < nbranchops; i++) {
+            if (n->op == branchops[i].op) {
+                break;
+            }
+        }
+
+        if (i < nbranchops) {
+            printf("%s @%d\n", branchops[i].text, n->arg.target->labpc);
+            continue;
+        }
+
         switch (n->op) {
         case ONAMDEF:
             printf("@%d:\n", n->arg.target->labpc);
@@ -1835,11 +2372,6 @@ cfprint(struct codefrag *frag)
             printf("AVINIT %d\n", n->arg.n);
             break;
 
-        case OJMP:
-        case OBZ:
-            printf("%s @%d\n", (n->op == OJMP) ? "JMP" : "BZ", n->arg.target->labpc);
-            break;
-
         case OPSHCON:
             prcon("", "PSHCON", &n->arg.con);
             break;
@@ -1851,6 +2383,19 @@ cfprint(struct codefrag *frag)
         case OCASE:
             printf("OCASE %u: @%d\n", n->arg.caseval.disc, n->arg.caseval.label->labpc);
             break;
+
+        case OINC:
+        case ODEC:
+        case OPOSTINC:
+        case OPOSTDEC:
+        case OADDTO:
+        case OSUBTO:
+        case OANDTO:
+        case OORTO:
+            printf("%s %s%s\n", rmwnames[n->op - OINC], 
+                n->arg.rmw.target ? n->arg.rmw.target->name : "[]",
+                n->arg.rmw.discard ? " ; discard" : "");
+            break;
         }
     }
 }
@@ -1879,6 +2424,83 @@ ddprint(struct stabent *sym)
     }
 }
 
+/******************************************************************************
+ *
+ * Profile feedback
+ *
+ */
+
+// hash a function name and label into proftab
+//
+static unsigned
+profhash(const char *fn, int label)
+{
+    unsigned h = label;
+
+    while (*fn) {
+        h = h * 31 + (*fn++ & 0xff);
+    }
+    return h % PROFHASH;
+}
+
+// Load a profile written by a program built with -fprofile-generate.
+// The file is a series of 16 byte records: a count and a label 
+// (-1 for the function entry), as little endian 32 bit words, then
+// the function name padded with nul's. Profiles from several runs
+// can be concatenated; their counts are summed.
+//
+int
+profload(const char *fn)
+{
+    FILE *fp;
+    unsigned char rec[8 + MAXNAM];
+    struct profent *pe;
+    unsigned h;
+
+    if ((fp = fopen(fn, "rb")) == NULL) {
+        perror(fn);
+        return 1;
+    }
+
+    while (fread(rec, 1, sizeof(rec), fp) == sizeof(rec)) {
+        pe = calloc(1, sizeof(struct profent));
+        if (pe == NULL) {
+            fprintf(stderr, "\n\nFATAL: out of memory\n");
+            exit(1);
+        }
+
+        pe->count = rec[0] | (rec[1] << 8) | (rec[2] << 16) | ((unsigned)rec[3] << 24);
+        pe->label = rec[4] | (rec[5] << 8) | (rec[6] << 16) | ((unsigned)rec[7] << 24);
+        memcpy(pe->fn, rec + 8, MAXNAM);
+        pe->fn[MAXNAM] = '\0';
+
+        h = profhash(pe->fn, pe->label);
+        pe->next = proftab[h];
+        proftab[h] = pe;
+    }
+
+    fclose(fp);
+    haveprof = 1;
+    return 0;
+}
+
+// Return how many times the given label in the current function
+// was reached
+//
+unsigned
+profcount(int label)
+{
+    struct profent *pe;
+    unsigned count = 0;
+
+    for (pe = proftab[profhash(curfunc->name, label)]; pe; pe = pe->next) {
+        if (pe->label == label && strcmp(pe->fn, curfunc->name) == 0) {
+            count += pe->count;
+        }
+    }
+    return count;
+}
+
 /******************************************************************************
  *
  * Low level lexical routines
@@ -0,0 +1,754 @@
+#include "belf.h"
+
+#include <elf.h>
+#include <stdlib.h>
+#include <string.h>
+
+// An object is built up as ba would write the assembly for it: words,
+// bytes and labels are added to the current section, and sections may
+// be switched to and from as with .pushsection. References to names
+// defined in the object are relocated against their section, so only
+// global and undefined names go into the symbol table; names local to
+// the file (labels) are dropped.
+//
+
+#define SYMHASH 16381
+#define MAXSTACK 8
+
+struct reloc {
+    unsigned offs;              // of the word to relocate
+    int sym;                    // symbol, or -1 - the section for a section
+};
+
+struct section {
+    int next;                   // in the hash chain, plus 1
+    char *name;
+    unsigned flags;             // SHF_*
+    int link;                   // section attached to, or -1
+    int nobits;                 // only space is reserved, as for .bss
+    unsigned char *data;
+    unsigned size, max;
+    unsigned align;
+    unsigned entsize;           // for merged sections
+    struct reloc *rel;
+    int nrel, maxrel;
+};
+
+struct symbol {
+    struct symbol *next;        // in the hash chain
+    char *name;
+    int sect;                   // -1 if not defined
+    unsigned value;
+    int global;
+    int index;                  // in the symbol table, once written
+};
+
+static struct section *sects;
+static int nsects, maxsects;
+static int secthash[SYMHASH];           // index of each chain, plus 1
+static int cursect = -1;
+static int stack[MAXSTACK];
+static int nstack;
+
+static struct symbol *symhash[SYMHASH];
+static struct symbol **syms;
+static int nsyms, maxsyms;
+
+// The calls building the object may be logged to a file, to be replayed
+// into another process's object by elfreplay(). Each record is an op
+// byte, two strings each preceded by its length in a byte, and a four
+// byte number. A section is logged by its name and that of the section
+// it is linked to, since its index is only known to the process.
+//
+enum {
+    LEND, LSECTION, LPUSH, LPUSHLINKED, LPOP, LALIGN, LZERO, LBYTE,
+    LWORD, LSECTWORD, LLABEL
+};
+
+static FILE *logfp;
+
+static void *grow(void *p, int *max, int n, size_t size);
+static char *strsave(const char *s);
+static unsigned hash(const char *name);
+static int findsect(const char *name, int link);
+static void push(void);
+static struct symbol *lookup(const char *name);
+static void addrel(int sym);
+static void put(const void *p, unsigned n);
+static void putword(long val);
+static void logcall(int op, const char *s1, const char *s2, long n);
+static int rdlogstr(FILE *fp, char *s);
+static unsigned strtabadd(char **tab, unsigned *size, unsigned *max, const char *s);
+static void pad(FILE *fp, unsigned *pos, unsigned to);
+
+// grow an array by doubling, to hold at least n elements
+//
+static void *
+grow(void *p, int *max, int n, size_t size)
+{
+    if (n < *max) {
+        return p;
+    }
+    *max = *max ? 2 * *max : 16;
+    if (*max <= n) {
+        *max = n + 1;
+    }
+    if ((p = realloc(p, *max * size)) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static char *
+strsave(const char *s)
+{
+    char *p = malloc(strlen(s) + 1);
+
+    if (p == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return strcpy(p, s);
+}
+
+static unsigned
+hash(const char *name)
+{
+    unsigned h = 0;
+
+    for (; *name; name++) {
+        h = h * 31 + (*name & 0xff);
+    }
+    return h % SYMHASH;
+}
+
+// find the section 'name', creating it if need be. sections named
+// .text* hold code; the rest are writable data, which for .bss and
+// .bss.* takes no space in the object. A section with a 'link' is
+// attached to that section, and only kept by the linker with it.
+//
+static int
+findsect(const char *name, int link)
+{
+    struct section *s;
+    unsigned h = hash(name);
+    int i;
+
+    for (i = secthash[h]; i; i = sects[i - 1].next) {
+        if (strcmp(sects[i - 1].name, name) == 0 && sects[i - 1].link == link) {
+            return i - 1;
+        }
+    }
+
+    sects = grow(sects, &maxsects, nsects, sizeof(struct section));
+    s = &sects[nsects];
+    memset(s, 0, sizeof(struct section));
+    s->name = strsave(name);
+    s->link = link;
+    if (link >= 0) {
+        s->flags = SHF_ALLOC | SHF_LINK_ORDER;
+    } else if (strncmp(name, ".rodata.str", 11) == 0) {
+        s->flags = SHF_ALLOC | SHF_MERGE | SHF_STRINGS;
+        s->entsize = 1;
+    } else {
+        s->flags = SHF_ALLOC | (strncmp(name, ".text", 5) == 0 ? SHF_EXECINSTR : SHF_WRITE);
+    }
+    s->nobits = strcmp(name, ".bss") == 0 || strncmp(name, ".bss.", 5) == 0;
+    s->align = 1;
+    s->next = secthash[h];
+    secthash[h] = nsects + 1;
+    return nsects++;
+}
+
+// make 'name' the current section
+//
+void
+elfsection(const char *name)
+{
+    logcall(LSECTION, name, "", 0);
+    cursect = findsect(name, -1);
+}
+
+// save the current section for elfpopsection()
+//
+static void
+push(void)
+{
+    if (nstack == MAXSTACK) {
+        fprintf(stderr, "internal error: section stack overflow\n");
+        exit(1);
+    }
+    stack[nstack++] = cursect;
+}
+
+// switch to a section, to return to the current one with
+// elfpopsection()
+//
+void
+elfpushsection(const char *name)
+{
+    logcall(LPUSH, name, "", 0);
+    push();
+    cursect = findsect(name, -1);
+}
+
+// as elfpushsection(), to a section attached to the current one
+//
+void
+elfpushlinked(const char *name)
+{
+    logcall(LPUSHLINKED, name, "", 0);
+    push();
+    cursect = findsect(name, cursect);
+}
+
+void
+elfpopsection(void)
+{
+    logcall(LPOP, "", "", 0);
+    if (nstack) {
+        cursect = stack[--nstack];
+    }
+}
+
+int
+elfcursect(void)
+{
+    return cursect;
+}
+
+// the offset of the next byte in the current section
+//
+unsigned
+elfoffset(void)
+{
+    return sects[cursect].size;
+}
+
+// append bytes to the current section; in a .bss section they must
+// be zero, and are only counted
+//
+static void
+put(const void *p, unsigned n)
+{
+    struct section *s = &sects[cursect];
+
+    if (s->nobits) {
+        s->size += n;
+        return;
+    }
+    while (s->size + n > s->max) {
+        s->max = s->max ? 2 * s->max : 256;
+        if ((s->data = realloc(s->data, s->max)) == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(s->data + s->size, p, n);
+    s->size += n;
+}
+
+void
+elfalign(int align)
+{
+    struct section *s = &sects[cursect];
+    static const char zero[16];
+
+    logcall(LALIGN, "", "", align);
+    if (align > s->align) {
+        s->align = align;
+    }
+    put(zero, (align - s->size % align) % align);
+}
+
+// append 'n' zero bytes
+//
+void
+elfzero(unsigned n)
+{
+    static const char zero[256];
+    unsigned l;
+
+    logcall(LZERO, "", "", n);
+    for (; n; n -= l) {
+        l = n < sizeof(zero) ? n : sizeof(zero);
+        put(zero, l);
+    }
+}
+
+void
+elfbyte(int b)
+{
+    unsigned char c = b;
+
+    logcall(LBYTE, "", "", b);
+    put(&c, 1);
+}
+
+// find or add a symbol
+//
+static struct symbol *
+lookup(const char *name)
+{
+    struct symbol *sym;
+    unsigned h = hash(name);
+
+    for (sym = symhash[h]; sym; sym = sym->next) {
+        if (strcmp(sym->name, name) == 0) {
+            return sym;
+        }
+    }
+
+    sym = calloc(1, sizeof(struct symbol));
+    if (sym == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    sym->name = strsave(name);
+    sym->sect = -1;
+    sym->index = nsyms;
+    sym->next = symhash[h];
+    symhash[h] = sym;
+
+    syms = grow(syms, &maxsyms, nsyms, sizeof(struct symbol *));
+    syms[nsyms++] = sym;
+    return sym;
+}
+
+// record a relocation for the word about to be written
+//
+static void
+addrel(int sym)
+{
+    struct section *s = &sects[cursect];
+
+    s->rel = grow(s->rel, &s->maxrel, s->nrel, sizeof(struct reloc));
+    s->rel[s->nrel].offs = s->size;
+    s->rel[s->nrel].sym = sym;
+    s->nrel++;
+}
+
+// write a word holding the address of 'sym' plus 'val', or just 'val'
+// if 'sym' is NULL
+//
+void
+elfword(const char *sym, long val)
+{
+    logcall(LWORD, sym ? sym : "", "", val);
+    if (sym) {
+        addrel(lookup(sym)->index);
+    }
+    putword(val);
+}
+
+static void
+putword(long val)
+{
+    unsigned char w[4];
+
+    w[0] = val;
+    w[1] = val >> 8;
+    w[2] = val >> 16;
+    w[3] = val >> 24;
+    put(w, 4);
+}
+
+// write a word holding the address of offset 'offs' in section 'sect'
+//
+void
+elfsectword(int sect, unsigned offs)
+{
+    struct section *s = &sects[sect];
+
+    logcall(LSECTWORD, s->name, s->link >= 0 ? sects[s->link].name : "", offs);
+    addrel(-1 - sect);
+    putword(offs);
+}
+
+// define a label at the current location
+//
+void
+elflabel(const char *name, int global)
+{
+    struct symbol *sym;
+
+    logcall(LLABEL, name, "", global);
+    sym = lookup(name);
+    if (sym->sect != -1) {
+        fprintf(stderr, "internal error: %s defined twice\n", name);
+    }
+    sym->sect = cursect;
+    sym->value = sects[cursect].size;
+    sym->global |= global;
+}
+
+// log the calls that follow to 'fp', or stop logging if it is NULL.
+// A log is ended by elflog(NULL).
+//
+void
+elflog(FILE *fp)
+{
+    if (fp == NULL && logfp) {
+        logcall(LEND, "", "", 0);
+    }
+    logfp = fp;
+}
+
+static void
+logcall(int op, const char *s1, const char *s2, long n)
+{
+    int l1 = strlen(s1), l2 = strlen(s2);
+
+    if (logfp == NULL) {
+        return;
+    }
+    if (l1 > 255 || l2 > 255) {
+        fprintf(stderr, "internal error: name too long to log\n");
+        exit(1);
+    }
+    putc(op, logfp);
+    putc(l1, logfp);
+    fwrite(s1, 1, l1, logfp);
+    putc(l2, logfp);
+    fwrite(s2, 1, l2, logfp);
+    putc(n & 0xff, logfp);
+    putc((n >> 8) & 0xff, logfp);
+    putc((n >> 16) & 0xff, logfp);
+    putc((n >> 24) & 0xff, logfp);
+}
+
+static int
+rdlogstr(FILE *fp, char *s)
+{
+    int l = getc(fp);
+
+    if (l == EOF || fread(s, 1, l, fp) != (size_t)l) {
+        return -1;
+    }
+    s[l] = '\0';
+    return 0;
+}
+
+// make the calls logged in 'fp' by elflog(), up to the end of the log.
+// Returns -1 if the log is short or bad.
+//
+int
+elfreplay(FILE *fp)
+{
+    char s1[256], s2[256];
+    unsigned char w[4];
+    long n;
+    int op;
+
+    for (;;) {
+        if ((op = getc(fp)) == EOF || rdlogstr(fp, s1) || rdlogstr(fp, s2)
+            || fread(w, 1, 4, fp) != 4) {
+            return -1;
+        }
+        n = (long)(int)(w[0] | w[1] << 8 | w[2] << 16 | (unsigned)w[3] << 24);
+
+        switch (op) {
+        case LEND:
+            return 0;
+
+        case LSECTION:
+            elfsection(s1);
+            break;
+
+        case LPUSH:
+            elfpushsection(s1);
+            break;
+
+        case LPUSHLINKED:
+            elfpushlinked(s1);
+            break;
+
+        case LPOP:
+            elfpopsection();
+            break;
+
+        case LALIGN:
+            elfalign(n);
+            break;
+
+        case LZERO:
+            elfzero(n);
+            break;
+
+        case LBYTE:
+            elfbyte(n);
+            break;
+
+        case LWORD:
+            elfword(s1[0] ? s1 : NULL, n);
+            break;
+
+        case LSECTWORD:
+            elfsectword(findsect(s1, s2[0] ? findsect(s2, -1) : -1), n);
+            break;
+
+        case LLABEL:
+            elflabel(s1, n);
+            break;
+
+        default:
+            return -1;
+        }
+    }
+}
+
+// add a string to a string table, returning its offset
+//
+static unsigned
+strtabadd(char **tab, unsigned *size, unsigned *max, const char *s)
+{
+    unsigned offs = *size;
+    unsigned l = strlen(s) + 1;
+
+    while (*size + l > *max) {
+        *max = *max ? 2 * *max : 256;
+        if ((*tab = realloc(*tab, *max)) == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(*tab + *size, s, l);
+    *size += l;
+    return offs;
+}
+
+// write zeros up to file offset 'to'
+//
+static void
+pad(FILE *fp, unsigned *pos, unsigned to)
+{
+    while (*pos < to) {
+        fputc(0, fp);
+        (*pos)++;
+    }
+}
+
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+// Write the object. The layout is the ELF header, the contents of each
+// section, their relocations, the symbol and string tables, and last
+// the section headers. Returns -1 on an I/O error.
+//
+int
+elfwrite(FILE *fp)
+{
+    Elf32_Ehdr eh;
+    Elf32_Shdr *sh;
+    Elf32_Sym es;
+    Elf32_Rel er;
+    struct section *s;
+    struct reloc *r;
+    struct symbol *sym;
+    char *shstr = NULL, *str = NULL;
+    unsigned shstrsize = 0, shstrmax = 0, strsize = 0, strmax = 0;
+    unsigned pos, w;
+    int i, j, nrelsects = 0, nsh, symsh, nlocal, nsymtab;
+    char name[256];
+
+    for (i = 0; i < nsects; i++) {
+        nrelsects += sects[i].nrel != 0;
+    }
+    nsh = 1 + nsects + nrelsects + 3;
+    symsh = 1 + nsects + nrelsects;
+    sh = calloc(nsh, sizeof(Elf32_Shdr));
+    if (sh == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    // the symbol table has the null symbol, one for each section, and
+    // then the global and undefined names
+    //
+    strtabadd(&str, &strsize, &strmax, "");
+    nlocal = 1 + nsects;
+    nsymtab = nlocal;
+    for (i = 0; i < nsyms; i++) {
+        sym = syms[i];
+        if (sym->global || sym->sect == -1) {
+            sym->index = nsymtab++;
+        } else {
+            sym->index = 0;
+        }
+    }
+
+    // references to defined names become references to their section,
+    // with the name's offset added into the word
+    //
+    for (i = 0; i < nsects; i++) {
+        s = &sects[i];
+        for (j = 0, r = s->rel; j < s->nrel; j++, r++) {
+            if (r->sym < 0) {
+                r->sym = -r->sym;
+                continue;
+            }
+            sym = syms[r->sym];
+            if (sym->sect == -1) {
+                r->sym = sym->index;
+                continue;
+            }
+            w = s->data[r->offs] | s->data[r->offs+1] << 8
+                | s->data[r->offs+2] << 16 | (unsigned)s->data[r->offs+3] << 24;
+            w += sym->value;
+            s->data[r->offs] = w;
+            s->data[r->offs+1] = w >> 8;
+            s->data[r->offs+2] = w >> 16;
+            s->data[r->offs+3] = w >> 24;
+            r->sym = 1 + sym->sect;
+        }
+    }
+
+    pos = sizeof(Elf32_Ehdr);
+    strtabadd(&shstr, &shstrsize, &shstrmax, "");
+
+    for (i = 0; i < nsects; i++) {
+        s = &sects[i];
+        pos = ALIGN(pos, s->align);
+        sh[1 + i].sh_name = strtabadd(&shstr, &shstrsize, &shstrmax, s->name);
+        sh[1 + i].sh_type = s->nobits ? SHT_NOBITS : SHT_PROGBITS;
+        sh[1 + i].sh_flags = s->flags;
+        sh[1 + i].sh_link = s->link >= 0 ? 1 + s->link : 0;
+        sh[1 + i].sh_offset = pos;
+        sh[1 + i].sh_size = s->size;
+        sh[1 + i].sh_addralign = s->align;
+        sh[1 + i].sh_entsize = s->entsize;
+        if (!s->nobits) {
+            pos += s->size;
+        }
+    }
+
+    for (i = 0, j = 1 + nsects; i < nsects; i++) {
+        s = &sects[i];
+        if (s->nrel == 0) {
+            continue;
+        }
+        pos = ALIGN(pos, 4);
+        sprintf(name, ".rel%.250s", s->name);
+        sh[j].sh_name = strtabadd(&shstr, &shstrsize, &shstrmax, name);
+        sh[j].sh_type = SHT_REL;
+        sh[j].sh_offset = pos;
+        sh[j].sh_size = s->nrel * sizeof(Elf32_Rel);
+        sh[j].sh_link = symsh;
+        sh[j].sh_info = 1 + i;
+        sh[j].sh_addralign = 4;
+        sh[j].sh_entsize = sizeof(Elf32_Rel);
+        pos += sh[j].sh_size;
+        j++;
+    }
+
+    for (i = 0; i < nsyms; i++) {
+        if (syms[i]->index) {
+            strtabadd(&str, &strsize, &strmax, syms[i]->name);
+        }
+    }
+
+    pos = ALIGN(pos, 4);
+    sh[symsh].sh_name = strtabadd(&shstr, &shstrsize, &shstrmax, ".symtab");
+    sh[symsh].sh_type = SHT_SYMTAB;
+    sh[symsh].sh_offset = pos;
+    sh[symsh].sh_size = nsymtab * sizeof(Elf32_Sym);
+    sh[symsh].sh_link = symsh + 1;
+    sh[symsh].sh_info = nlocal;
+    sh[symsh].sh_addralign = 4;
+    sh[symsh].sh_entsize = sizeof(Elf32_Sym);
+    pos += sh[symsh].sh_size;
+
+    sh[symsh+1].sh_name = strtabadd(&shstr, &shstrsize, &shstrmax, ".strtab");
+    sh[symsh+1].sh_type = SHT_STRTAB;
+    sh[symsh+1].sh_offset = pos;
+    sh[symsh+1].sh_size = strsize;
+    sh[symsh+1].sh_addralign = 1;
+    pos += strsize;
+
+    sh[symsh+2].sh_name = strtabadd(&shstr, &shstrsize, &shstrmax, ".shstrtab");
+    sh[symsh+2].sh_type = SHT_STRTAB;
+    sh[symsh+2].sh_offset = pos;
+    sh[symsh+2].sh_size = shstrsize;
+    sh[symsh+2].sh_addralign = 1;
+    pos += shstrsize;
+
+    memset(&eh, 0, sizeof(eh));
+    memcpy(eh.e_ident, ELFMAG, SELFMAG);
+    eh.e_ident[EI_CLASS] = ELFCLASS32;
+    eh.e_ident[EI_DATA] = ELFDATA2LSB;
+    eh.e_ident[EI_VERSION] = EV_CURRENT;
+    eh.e_type = ET_REL;
+    eh.e_machine = EM_386;
+    eh.e_version = EV_CURRENT;
+    eh.e_shoff = ALIGN(pos, 4);
+    eh.e_ehsize = sizeof(Elf32_Ehdr);
+    eh.e_shentsize = sizeof(Elf32_Shdr);
+    eh.e_shnum = nsh;
+    eh.e_shstrndx = symsh + 2;
+
+    // now write it all out, in the same order
+    //
+    pos = 0;
+    fwrite(&eh, sizeof(eh), 1, fp);
+    pos += sizeof(eh);
+
+    for (i = 0; i < nsects; i++) {
+        if (sects[i].nobits) {
+            continue;
+        }
+        pad(fp, &pos, sh[1 + i].sh_offset);
+        fwrite(sects[i].data, 1, sects[i].size, fp);
+        pos += sects[i].size;
+    }
+
+    for (i = 0, j = 1 + nsects; i < nsects; i++) {
+        s = &sects[i];
+        if (s->nrel == 0) {
+            continue;
+        }
+        pad(fp, &pos, sh[j++].sh_offset);
+        for (r = s->rel; r < s->rel + s->nrel; r++) {
+            er.r_offset = r->offs;
+            er.r_info = ELF32_R_INFO(r->sym, R_386_32);
+            fwrite(&er, sizeof(er), 1, fp);
+            pos += sizeof(er);
+        }
+    }
+
+    pad(fp, &pos, sh[symsh].sh_offset);
+    memset(&es, 0, sizeof(es));
+    fwrite(&es, sizeof(es), 1, fp);
+    for (i = 0; i < nsects; i++) {
+        es.st_info = ELF32_ST_INFO(STB_LOCAL, STT_SECTION);
+        es.st_shndx = 1 + i;
+        fwrite(&es, sizeof(es), 1, fp);
+    }
+    for (i = 0, w = 1; i < nsyms; i++) {
+        sym = syms[i];
+        if (sym->index == 0) {
+            continue;
+        }
+        memset(&es, 0, sizeof(es));
+        es.st_name = w;
+        w += strlen(sym->name) + 1;
+        es.st_info = ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+        if (sym->sect != -1) {
+            es.st_value = sym->value;
+            es.st_shndx = 1 + sym->sect;
+        }
+        fwrite(&es, sizeof(es), 1, fp);
+    }
+    pos += nsymtab * sizeof(Elf32_Sym);
+
+    fwrite(str, 1, strsize, fp);
+    fwrite(shstr, 1, shstrsize, fp);
+    pos += strsize + shstrsize;
+
+    pad(fp, &pos, eh.e_shoff);
+    fwrite(sh, sizeof(Elf32_Shdr), nsh, fp);
+
+    free(sh);
+    free(str);
+    free(shstr);
+    return ferror(fp) ? -1 : 0;
+}
@@ -0,0 +1,24 @@
+#ifndef BELF_H_
+#define BELF_H_
+
+#include <stdio.h>
+
+/* building an i386 ELF relocatable object, for ba -c */
+
+extern void elfsection(const char *name);
+extern void elfpushsection(const char *name);
+extern void elfpushlinked(const char *name);
+extern void elfpopsection(void);
+extern int elfcursect(void);
+extern unsigned elfoffset(void);
+extern void elfalign(int align);
+extern void elfzero(unsigned n);
+extern void elfbyte(int b);
+extern void elfword(const char *sym, long val);
+extern void elfsectword(int sect, unsigned offs);
+extern void elflabel(const char *name, int global);
+extern void elflog(FILE *fp);
+extern int elfreplay(FILE *fp);
+extern int elfwrite(FILE *fp);
+
+#endif
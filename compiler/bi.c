@@ -0,0 +1,1517 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bif.h"
+#include "b.h"
+
+// bi runs a B program straight from its intermediate file, without
+// ba, the assembler or the linker. The file is read in, along with
+// what it needs from the runtime's library archive, and its data and
+// threaded code are laid out in memory with the names resolved as the
+// linker would. The handlers of the threaded code, and the runtime's
+// native functions, are those of the x86-64 runtime, linked into bi;
+// so the code is laid out as ba -t x86_64 would write it, but without
+// superinstructions. Then main is called, as $start does.
+//
+// With -j, functions count their calls, and one called often enough
+// is translated to native code the way ba -m native would write it.
+// Native and threaded functions call each other through CALL and RET,
+// so only the hot functions are translated.
+//
+// The handlers take addresses as 32 bit immediates, so bi is linked
+// at a fixed address below 2GB, and the program is put there too.
+//
+
+#define NAMEHASH 1021
+#define WORDSIZE 8                      // of the x86-64 threaded code
+#define CHUNK (1 << 20)                 // memory is mapped this much at a time
+#define NATALIGN 16                     // of native code
+#define SHIFT(p) ((long)(p) >> 3)       // address to B pointer
+
+// an intermediate file, or a member of a library archive
+//
+struct module {
+    const char *fn;
+    const unsigned char *p;             // the file's bytes
+    unsigned size;
+    unsigned offs[BIFSMAX + 1];         // where each section is
+    unsigned len[BIFSMAX + 1];
+    int lib;                            // an archive member, loaded if needed
+    int loaded;
+    struct sym **names;                 // the name table
+    unsigned nnames;
+    const unsigned char *strp;          // the string pool
+    unsigned nstrp;
+    long **strs;                        // strings copied out, by offset / 4
+};
+
+// a global name
+//
+struct sym {
+    struct sym *next;                   // in the hash chain
+    char name[MAXNAM + 1];
+    struct module *def;                 // whose definition is used
+    struct module *lib;                 // archive member defining it
+    long *addr;                         // the word named
+    long *vec;                          // a vector's elements
+    int undef;                          // reported as undefined
+};
+
+// the handlers of the x86-64 runtime, and its functions callable
+// from B, whose names start with an underscore
+//
+#define HANDLER(name) extern char name[];
+#define RTFUNC(name) extern char rt_##name[] __asm__("_" #name);
+
+HANDLER(POP) HANDLER(POPT) HANDLER(PUSHT) HANDLER(ROT) HANDLER(DUP)
+HANDLER(DEREF) HANDLER(STORE) HANDLER(LEAVE) HANDLER(CALL) HANDLER(RET)
+HANDLER(ADD) HANDLER(SUB) HANDLER(MUL) HANDLER(DIV) HANDLER(MOD)
+HANDLER(SHL) HANDLER(SHR) HANDLER(NEG) HANDLER(NOT) HANDLER(AND)
+HANDLER(OR) HANDLER(EQ) HANDLER(NE) HANDLER(LT) HANDLER(LE) HANDLER(GT)
+HANDLER(GE) HANDLER(LDX) HANDLER(STX)
+HANDLER(JMP) HANDLER(BZ) HANDLER(BNZ) HANDLER(BEQ) HANDLER(BNE)
+HANDLER(BLE) HANDLER(BLT) HANDLER(BGE) HANDLER(BGT)
+HANDLER(CASE) HANDLER(POPN) HANDLER(DUPN) HANDLER(ENTER) HANDLER(JENTER)
+HANDLER(AVINIT)
+HANDLER(PSHCON) HANDLER(PSHSYM) HANDLER(PSHAUTO)
+HANDLER(PREINCS) HANDLER(PREINCA) HANDLER(PREINCX)
+HANDLER(PREDECS) HANDLER(PREDECA) HANDLER(PREDECX)
+HANDLER(POSTINCS) HANDLER(POSTINCA) HANDLER(POSTINCX)
+HANDLER(POSTDECS) HANDLER(POSTDECA) HANDLER(POSTDECX)
+HANDLER(INCS) HANDLER(INCA) HANDLER(INCX)
+HANDLER(DECS) HANDLER(DECA) HANDLER(DECX)
+HANDLER(ADDTOS) HANDLER(ADDTOA) HANDLER(ADDTOX)
+HANDLER(SUBTOS) HANDLER(SUBTOA) HANDLER(SUBTOX)
+HANDLER(ANDTOS) HANDLER(ANDTOA) HANDLER(ANDTOX)
+HANDLER(ORTOS) HANDLER(ORTOA) HANDLER(ORTOX)
+HANDLER(ADDTOPS) HANDLER(ADDTOPA) HANDLER(ADDTOPX)
+HANDLER(SUBTOPS) HANDLER(SUBTOPA) HANDLER(SUBTOPX)
+HANDLER(ANDTOPS) HANDLER(ANDTOPA) HANDLER(ANDTOPX)
+HANDLER(ORTOPS) HANDLER(ORTOPA) HANDLER(ORTOPX)
+
+RTFUNC(exit) RTFUNC(putchar) RTFUNC(getchar) RTFUNC(brk) RTFUNC(open)
+RTFUNC(creat) RTFUNC(close) RTFUNC(read) RTFUNC(seek) RTFUNC(write)
+RTFUNC(chdir) RTFUNC(chmod) RTFUNC(chown) RTFUNC(fork) RTFUNC(wait)
+RTFUNC(getuid) RTFUNC(link) RTFUNC(unlink) RTFUNC(mkdir) RTFUNC(setuid)
+RTFUNC(execl) RTFUNC(execv) RTFUNC(gtty) RTFUNC(stty) RTFUNC(char)
+RTFUNC(lchar)
+
+static struct {
+    const char *name;
+    char *code;
+} rtfuncs[] = {
+    { "exit", rt_exit }, { "putchar", rt_putchar }, { "getchar", rt_getchar },
+    { "brk", rt_brk }, { "open", rt_open }, { "creat", rt_creat },
+    { "close", rt_close }, { "read", rt_read }, { "seek", rt_seek },
+    { "write", rt_write }, { "chdir", rt_chdir }, { "chmod", rt_chmod },
+    { "chown", rt_chown }, { "fork", rt_fork }, { "wait", rt_wait },
+    { "getuid", rt_getuid }, { "link", rt_link }, { "unlink", rt_unlink },
+    { "mkdir", rt_mkdir }, { "setuid", rt_setuid }, { "execl", rt_execl },
+    { "execv", rt_execv }, { "gtty", rt_gtty }, { "stty", rt_stty },
+    { "char", rt_char }, { "lchar", rt_lchar },
+};
+static int nrtfuncs = sizeof(rtfuncs) / sizeof(rtfuncs[0]);
+
+// JENTER calls the translator through this
+//
+extern long jithook;
+
+// The runtime's execl and execv pass on the environment from here,
+// which $start would have set. exit writes out the profile counters
+// between prof0 and profn, which the linker script would have set;
+// there are none.
+//
+char **envp;
+__asm__(".globl prof0, profn\nprof0 = 0\nprofn = 0");
+
+// ops without operands
+//
+static struct {
+    enum codeop op;
+    char *h;
+} simpleops[] = {
+    { OPOP,   POP },
+    { OPOPT,  POPT },
+    { OPUSHT, PUSHT },
+    { OROT,   ROT },
+    { ODUP,   DUP },
+    { ODEREF, DEREF },
+    { OSTORE, STORE },
+    { OLEAVE, LEAVE },
+    { OCALL,  CALL },
+    { ORET,   RET },
+    { OADD,   ADD },
+    { OSUB,   SUB },
+    { OMUL,   MUL },
+    { ODIV,   DIV },
+    { OMOD,   MOD },
+    { OSHL,   SHL },
+    { OSHR,   SHR },
+    { ONEG,   NEG },
+    { ONOT,   NOT },
+    { OAND,   AND },
+    { OOR,    OR },
+    { OEQ,    EQ },
+    { ONE,    NE },
+    { OLT,    LT },
+    { OLE,    LE },
+    { OGT,    GT },
+    { OGE,    GE },
+    { OLDX,   LDX },
+    { OSTX,   STX },
+};
+static int nsimpleops = sizeof(simpleops) / sizeof(simpleops[0]);
+
+// ops which take a branch target as their only argument
+//
+static struct {
+    enum codeop op;
+    char *h;
+} branchops[] = {
+    { OJMP,   JMP },
+    { OBZ,    BZ },
+    { OBNZ,   BNZ },
+    { OBEQ,   BEQ },
+    { OBNE,   BNE },
+    { OBLE,   BLE },
+    { OBLT,   BLT },
+    { OBGE,   BGE },
+    { OBGT,   BGT },
+};
+static int nbranchops = sizeof(branchops) / sizeof(branchops[0]);
+
+// in-place update ops, by addressing mode (extrn, auto, vector
+// element), for when the result is used and when it is discarded
+//
+static struct {
+    enum codeop op;
+    char *used[3];
+    char *discard[3];
+} rmwops[] = {
+    { OINC,     { PREINCS, PREINCA, PREINCX },    { INCS, INCA, INCX } },
+    { ODEC,     { PREDECS, PREDECA, PREDECX },    { DECS, DECA, DECX } },
+    { OPOSTINC, { POSTINCS, POSTINCA, POSTINCX }, { INCS, INCA, INCX } },
+    { OPOSTDEC, { POSTDECS, POSTDECA, POSTDECX }, { DECS, DECA, DECX } },
+    { OADDTO,   { ADDTOS, ADDTOA, ADDTOX },       { ADDTOPS, ADDTOPA, ADDTOPX } },
+    { OSUBTO,   { SUBTOS, SUBTOA, SUBTOX },       { SUBTOPS, SUBTOPA, SUBTOPX } },
+    { OANDTO,   { ANDTOS, ANDTOA, ANDTOX },       { ANDTOPS, ANDTOPA, ANDTOPX } },
+    { OORTO,    { ORTOS, ORTOA, ORTOX },          { ORTOPS, ORTOPA, ORTOPX } },
+};
+static int nrmwops = sizeof(rmwops) / sizeof(rmwops[0]);
+
+static struct sym *symhash[NAMEHASH];
+static struct module **mods;
+static int nmods, maxmods;
+static const unsigned char *rp;         // reading here
+static const unsigned char *rend;       // to the end of the section
+static const char *rfn;
+static long *mem, *memend;              // the chunk being laid out in
+static long *labels;                    // a function's labels
+static int maxlabels;
+static long *code;                      // the function being written
+static int ncode;
+static long hot;                        // -j: calls before translation
+static long *jfn;                       // the function being translated
+static unsigned char *nat;              // its native code
+static int nnat;
+static int *natoffs;                    // where each of its cells' code is
+static int maxnatoffs;
+static unsigned char *natmem, *natend;  // the chunk native code is put in
+
+static void usage(void);
+static const unsigned char *mapfile(const char *fn, unsigned *size);
+static char *findlib(const char *name);
+static void rdarchive(const char *fn);
+static struct module *addmodule(const char *fn, const unsigned char *p, unsigned size, int lib);
+static void ldmodule(struct module *m);
+static void define(struct sym *s, struct module *m);
+static void resolve(void);
+static void layout(struct module *m);
+static void wrdata(struct module *m);
+static void wrfunc(struct module *m, struct sym *fn);
+static void put(long w);
+static long target(unsigned lab);
+static long *strcopy(struct module *m, unsigned offs);
+static long *mkprog(void);
+static long *mkargv(int argc, char **argv);
+static void run(long *prog);
+static long translate(long *fn);
+static int natop(long *c);
+static void natsimple(int op);
+static void natbranch(int op, long t);
+static void natrmw(int op, int mode, int discard, long arg);
+static void natpush(long v);
+static void natrel(long t);
+static void natbytes(const char *s, int n);
+static void nat32(long v);
+static void nat64(long v);
+static unsigned char *getcode(size_t n);
+static long *getwords(size_t n);
+static struct sym *lookup(const char *name);
+static struct sym *rdsym(struct module *m);
+static void seek(struct module *m, int sect, unsigned offs);
+static unsigned rdbytes(int n);
+static unsigned rdint(void);
+static int rdbyte(void);
+static long adjauto(unsigned offs);
+static void *grow(void *p, int *max, int n, size_t size);
+
+#define RDINT() rdint()
+#define RDBYTE() rdbyte()
+#define NAT(s) natbytes(s, sizeof(s) - 1)
+
+int
+main(int argc, char **argv)
+{
+    extern char **environ;
+    struct sym *s;
+    char *rtarch;
+    const unsigned char *p;
+    unsigned size;
+    int ch, i;
+
+    envp = environ;
+
+    // the program's own arguments follow its file
+    //
+    while ((ch = getopt(argc, argv, "+j:l:")) != -1) {
+        switch (ch) {
+        case 'j':
+            if ((hot = atol(optarg)) < 1) {
+                usage();
+            }
+            jithook = (long)translate;
+            break;
+
+        case 'l':
+            rdarchive(optarg);
+            break;
+
+        default:
+            usage();
+        }
+    }
+
+    if (optind >= argc) {
+        usage();
+    }
+
+    // the runtime's functions are entered through a word pointing past
+    // their own, which the linker would have shifted into a pointer
+    //
+    for (i = 0; i < nrtfuncs; i++) {
+        s = lookup(rtfuncs[i].name);
+        s->addr = getwords(1);
+        *s->addr = SHIFT(rtfuncs[i].code + WORDSIZE);
+    }
+
+    s = lookup("argv");
+    s->addr = getwords(1);
+    *s->addr = SHIFT(mkargv(argc - optind, argv + optind));
+
+    if ((rtarch = findlib("lib/brt.bia")) != NULL) {
+        rdarchive(rtarch);
+    }
+
+    p = mapfile(argv[optind], &size);
+    ldmodule(addmodule(argv[optind], p, size, 0));
+    resolve();
+
+    for (i = 0; i < nmods; i++) {
+        if (mods[i]->loaded) {
+            layout(mods[i]);
+        }
+    }
+    for (i = 0; i < nmods; i++) {
+        if (mods[i]->loaded) {
+            wrdata(mods[i]);
+        }
+    }
+
+    run(mkprog());
+    return 1;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "bi: [-j calls] [-l archive] infile [arg ...]\n");
+    exit(1);
+}
+
+// Map a file in
+//
+const unsigned char *
+mapfile(const char *fn, unsigned *size)
+{
+    struct stat st;
+    void *p;
+    int fd;
+
+    if ((fd = open(fn, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+        perror(fn);
+        exit(1);
+    }
+    if (st.st_size == 0) {
+        fprintf(stderr, "bi: %s: not an intermediate file\n", fn);
+        exit(1);
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+        perror(fn);
+        exit(1);
+    }
+    close(fd);
+    *size = st.st_size;
+    return p;
+}
+
+// Find 'name' under the directories above where bi is installed, as b
+// finds the sysroot
+//
+char *
+findlib(const char *name)
+{
+    char path[4096 + 64];
+    char *sep;
+    ssize_t n;
+
+    if ((n = readlink("/proc/self/exe", path, 4096)) <= 0) {
+        return NULL;
+    }
+    path[n] = '\0';
+
+    while ((sep = strrchr(path, '/')) != NULL) {
+        sprintf(sep + 1, "%s", name);
+        if (access(path, R_OK) == 0) {
+            return strdup(path);
+        }
+        *sep = '\0';
+    }
+    return NULL;
+}
+
+// Read the index of a library archive (see bif.h). A name is taken
+// from the first archive defining it.
+//
+void
+rdarchive(const char *fn)
+{
+    struct module m;
+    struct sym **syms;
+    unsigned i, nmemb, nsyms, offs, size;
+    int *which;
+    char name[MAXNAM + 1];
+    int len, first;
+
+    memset(&m, 0, sizeof(m));
+    m.p = mapfile(fn, &m.size);
+    m.fn = fn;
+    m.len[0] = m.size;
+    seek(&m, 0, 0);
+
+    if (rdbytes(4) != BIAMAGIC) {
+        fprintf(stderr, "bi: %s: not a library archive\n", fn);
+        exit(1);
+    }
+    nmemb = rdbytes(4);
+    nsyms = rdbytes(4);
+    if (nsyms > m.size || nmemb > m.size) {
+        fprintf(stderr, "bi: %s: bad library archive\n", fn);
+        exit(1);
+    }
+
+    which = malloc((nsyms + 1) * sizeof(int));
+    syms = malloc((nsyms + 1) * sizeof(struct sym *));
+    if (which == NULL || syms == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    for (i = 0; i < nsyms; i++) {
+        which[i] = rdbytes(4);
+        len = RDBYTE();
+        if ((unsigned)which[i] >= nmemb || len > MAXNAM || rend - rp < len) {
+            fprintf(stderr, "bi: %s: bad library archive\n", fn);
+            exit(1);
+        }
+        memcpy(name, rp, len);
+        name[len] = '\0';
+        rp += len;
+        syms[i] = lookup(name);
+    }
+
+    first = nmods;
+    for (i = 0; i < nmemb; i++) {
+        len = RDBYTE();
+        if (rend - rp < len) {
+            fprintf(stderr, "bi: %s: bad library archive\n", fn);
+            exit(1);
+        }
+        rp += len;
+        offs = rdbytes(4);
+        size = rdbytes(4);
+        if (offs > m.size || size > m.size - offs) {
+            fprintf(stderr, "bi: %s: bad library archive\n", fn);
+            exit(1);
+        }
+        addmodule(fn, m.p + offs, size, 1);
+    }
+
+    for (i = 0; i < nsyms; i++) {
+        if (syms[i]->lib == NULL) {
+            syms[i]->lib = mods[first + which[i]];
+        }
+    }
+
+    free(which);
+    free(syms);
+}
+
+// Add an intermediate file to the program, to be loaded now or when
+// something it defines is needed
+//
+struct module *
+addmodule(const char *fn, const unsigned char *p, unsigned size, int lib)
+{
+    struct module *m;
+
+    if ((m = calloc(1, sizeof(struct module))) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    m->fn = fn;
+    m->p = p;
+    m->size = size;
+    m->lib = lib;
+
+    mods = grow(mods, &maxmods, nmods, sizeof(struct module *));
+    mods[nmods++] = m;
+    return m;
+}
+
+// Read an intermediate file's directory and name table, and define
+// the names of its data and functions
+//
+void
+ldmodule(struct module *m)
+{
+    unsigned i, n, id, offs, size, ndata, nfuncs;
+    int fl, ninit;
+    char name[MAXNAM + 1];
+    int len;
+
+    m->loaded = 1;
+    m->offs[0] = 0;
+    m->len[0] = m->size;
+    seek(m, 0, 0);
+
+    if (m->size < 12 || rdbytes(4) != BIFMAGIC2) {
+        fprintf(stderr, "bi: %s: not an intermediate file\n", m->fn);
+        exit(1);
+    }
+    if ((n = rdbytes(4)) != BIFVERSION) {
+        fprintf(stderr, "bi: %s: intermediate file version %u not supported\n", m->fn, n);
+        exit(1);
+    }
+
+    n = rdbytes(4);
+    for (i = 0; i < n; i++) {
+        id = rdbytes(4);
+        offs = rdbytes(4);
+        size = rdbytes(4);
+        if (offs > m->size || size > m->size - offs) {
+            fprintf(stderr, "bi: %s: bad intermediate file\n", m->fn);
+            exit(1);
+        }
+        if (id <= BIFSMAX) {
+            m->offs[id] = offs;
+            m->len[id] = size;
+        }
+    }
+
+    seek(m, BIFSNAMES, 0);
+    m->nnames = RDINT();
+    if (m->nnames > m->len[BIFSNAMES]) {
+        fprintf(stderr, "bi: %s: bad intermediate file\n", m->fn);
+        exit(1);
+    }
+    m->names = malloc((m->nnames + 1) * sizeof(struct sym *));
+    if (m->names == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < m->nnames; i++) {
+        len = RDBYTE();
+        if (len > MAXNAM || rp + len > rend) {
+            fprintf(stderr, "bi: %s: bad name in intermediate file\n", m->fn);
+            exit(1);
+        }
+        memcpy(name, rp, len);
+        name[len] = '\0';
+        rp += len;
+        m->names[i] = lookup(name);
+    }
+
+    seek(m, BIFSSTRP, 0);
+    m->nstrp = RDINT();
+    m->strp = rp;
+    if (m->nstrp > (unsigned)(rend - rp)) {
+        fprintf(stderr, "bi: %s: bad intermediate file\n", m->fn);
+        exit(1);
+    }
+
+    seek(m, BIFSDATA, 0);
+    ndata = RDINT();
+    for (i = 0; i < ndata; i++) {
+        define(rdsym(m), m);
+        fl = RDBYTE();
+        if (fl & BIFVEC) {
+            RDINT();
+        }
+        for (ninit = RDINT(); ninit > 0; ninit--) {
+            RDBYTE();
+            RDINT();
+        }
+    }
+
+    nfuncs = m->len[BIFSFUNCS] / 4;
+    for (i = 0; i < nfuncs; i++) {
+        seek(m, BIFSFUNCS, 4 * i);
+        offs = rdbytes(4);
+        seek(m, BIFSCODE, offs);
+        define(rdsym(m), m);
+    }
+}
+
+// A name may only be defined once in the program. A library archive
+// member only defines what the program hasn't.
+//
+void
+define(struct sym *s, struct module *m)
+{
+    if (s->def == NULL) {
+        s->def = m;
+    } else if (!m->lib) {
+        fprintf(stderr, "bi: %s is defined in %s and %s\n", s->name, s->def->fn, m->fn);
+        exit(1);
+    }
+}
+
+// Load the archive members defining names the program uses, and what
+// they use in turn, until everything is defined
+//
+void
+resolve(void)
+{
+    struct module *m;
+    struct sym *s, *mainsym;
+    unsigned j;
+    int i, undef = 0;
+
+    // the members loaded are added to the end of the list, so are
+    // seen in turn
+    //
+    for (i = 0; i < nmods; i++) {
+        m = mods[i];
+        for (j = 0; m->loaded && j < m->nnames; j++) {
+            s = m->names[j];
+            if (s->def == NULL && s->addr == NULL && s->lib && !s->lib->loaded) {
+                ldmodule(s->lib);
+            }
+        }
+    }
+
+    for (i = 0; i < nmods; i++) {
+        m = mods[i];
+        for (j = 0; m->loaded && j < m->nnames; j++) {
+            s = m->names[j];
+            if (s->def == NULL && s->addr == NULL && !s->undef) {
+                fprintf(stderr, "bi: %s: undefined name %s\n", m->fn, s->name);
+                s->undef = 1;
+                undef = 1;
+            }
+        }
+    }
+
+    mainsym = lookup("main");
+    if (mainsym->def == NULL) {
+        fprintf(stderr, "bi: main is not defined\n");
+        undef = 1;
+    }
+    if (undef) {
+        exit(1);
+    }
+}
+
+// Find room for each datum and function the module defines. A
+// function is named by a word pointing to its code, which can be
+// anywhere, so its code is laid out as it's written.
+//
+void
+layout(struct module *m)
+{
+    struct sym *s;
+    unsigned i, ndata, nfuncs, offs;
+    int fl, vecsize, ninit, j;
+
+    seek(m, BIFSDATA, 0);
+    ndata = RDINT();
+    for (i = 0; i < ndata; i++) {
+        s = rdsym(m);
+        fl = RDBYTE();
+        vecsize = (fl & BIFVEC) ? RDINT() : 0;
+        ninit = RDINT();
+        for (j = 0; j < ninit; j++) {
+            RDBYTE();
+            RDINT();
+        }
+        if (s->def != m) {
+            continue;
+        }
+
+        if (fl & BIFVEC) {
+            s->vec = getwords(vecsize > ninit ? vecsize : ninit ? ninit : 1);
+            s->addr = getwords(1);
+        } else {
+            s->addr = getwords(ninit ? ninit : 1);
+        }
+    }
+
+    nfuncs = m->len[BIFSFUNCS] / 4;
+    for (i = 0; i < nfuncs; i++) {
+        seek(m, BIFSFUNCS, 4 * i);
+        offs = rdbytes(4);
+        seek(m, BIFSCODE, offs);
+        s = rdsym(m);
+        if (s->def == m) {
+            s->addr = getwords(1);
+        }
+    }
+}
+
+// Write the module's initialized data and its functions, now that
+// everything has a place
+//
+void
+wrdata(struct module *m)
+{
+    struct sym *s, *ref;
+    unsigned i, ndata, nfuncs, offs;
+    int fl, ninit, j, type;
+    long *w;
+
+    seek(m, BIFSDATA, 0);
+    ndata = RDINT();
+    for (i = 0; i < ndata; i++) {
+        s = rdsym(m);
+        fl = RDBYTE();
+        if (fl & BIFVEC) {
+            RDINT();
+        }
+        ninit = RDINT();
+        w = s->def != m ? NULL : (fl & BIFVEC) ? s->vec : s->addr;
+
+        for (j = 0; j < ninit; j++) {
+            type = RDBYTE();
+            switch (type) {
+            case BIFINAM:
+            case BIFIVEC:
+                ref = rdsym(m);
+                if (type == BIFIVEC && ref->vec == NULL) {
+                    fprintf(stderr, "bi: %s: %s is not a vector\n", m->fn, ref->name);
+                    exit(1);
+                }
+                if (w) {
+                    w[j] = SHIFT(type == BIFIVEC ? ref->vec : ref->addr);
+                }
+                break;
+
+            case BIFIINT:
+                offs = RDINT();
+                if (w) {
+                    w[j] = (int)offs;
+                }
+                break;
+
+            case BIFISTR:
+                offs = RDINT();
+                if (w) {
+                    w[j] = SHIFT(strcopy(m, offs));
+                }
+                break;
+
+            default:
+                fprintf(stderr, "bi: %s: bad initializer in intermediate file\n", m->fn);
+                exit(1);
+            }
+        }
+
+        if (w && (fl & BIFVEC)) {
+            *s->addr = SHIFT(s->vec);
+        }
+    }
+
+    nfuncs = m->len[BIFSFUNCS] / 4;
+    for (i = 0; i < nfuncs; i++) {
+        seek(m, BIFSFUNCS, 4 * i);
+        offs = rdbytes(4);
+        seek(m, BIFSCODE, offs);
+        s = rdsym(m);
+        if (s->def == m) {
+            wrfunc(m, s);
+        }
+    }
+}
+
+// Write out a function's threaded code, as ba would with
+// -fno-superops. The code is read twice: first to find the labels and
+// the size, then to write the code with the branches resolved.
+//
+void
+wrfunc(struct module *m, struct sym *fn)
+{
+    const unsigned char *start;
+    unsigned n;
+    int ninst, op, mode, discard, i, j, pass, size = 0;
+
+    ninst = RDINT();
+    start = rp;
+    code = NULL;
+
+    for (pass = 0; pass < 2; pass++) {
+        rp = start;
+        ncode = 0;
+        for (i = 0; i < ninst; i++) {
+            op = RDBYTE();
+
+            for (j = 0; j < nsimpleops; j++) {
+                if (simpleops[j].op == op) {
+                    put((long)simpleops[j].h);
+                    break;
+                }
+            }
+            if (j < nsimpleops) {
+                continue;
+            }
+
+            for (j = 0; j < nbranchops; j++) {
+                if (branchops[j].op == op) {
+                    put((long)branchops[j].h);
+                    put(target(RDINT()));
+                    break;
+                }
+            }
+            if (j < nbranchops) {
+                continue;
+            }
+
+            for (j = 0; j < nrmwops; j++) {
+                if (rmwops[j].op == op) {
+                    mode = RDBYTE();
+                    discard = RDBYTE();
+                    if (mode > 2) {
+                        fprintf(stderr, "bi: %s: bad update in %s\n", m->fn, fn->name);
+                        exit(1);
+                    }
+                    put((long)(discard ? rmwops[j].discard[mode] : rmwops[j].used[mode]));
+                    if (mode == 0) {
+                        put((long)rdsym(m)->addr);
+                    } else if (mode == 1) {
+                        put(adjauto(RDINT()));
+                    }
+                    break;
+                }
+            }
+            if (j < nrmwops) {
+                continue;
+            }
+
+            switch (op) {
+            case ONAMDEF:
+                n = RDINT();
+                if (pass == 0) {
+                    labels = grow(labels, &maxlabels, n, sizeof(long));
+                    labels[n] = ncode;
+                }
+                break;
+
+            case OCASE:
+                put((long)CASE);
+                put((int)RDINT());
+                put(target(RDINT()));
+                break;
+
+            case OPOPN:
+                put((long)POPN);
+                put(WORDSIZE * (long)RDINT());
+                break;
+
+            case ODUPN:
+                put((long)DUPN);
+                put(WORDSIZE * (long)RDINT());
+                break;
+
+            case OENTER:
+                // with -j, the function's calls are counted down
+                // from 'hot'
+                //
+                put((long)(hot ? JENTER : ENTER));
+                put(WORDSIZE * (long)RDINT());
+                if (hot) {
+                    put(hot);
+                    put(size);
+                }
+                break;
+
+            case OAVINIT:
+                put((long)AVINIT);
+                put(WORDSIZE * (long)(int)RDINT());
+                break;
+
+            case OPSHCON:
+                if (RDBYTE()) {
+                    put((long)PSHSYM);
+                    put((long)strcopy(m, RDINT()));
+                } else {
+                    put((long)PSHCON);
+                    put((int)RDINT());
+                }
+                break;
+
+            case OPSHSYM:
+                if (RDBYTE() == 0) {
+                    put((long)PSHSYM);
+                    put((long)rdsym(m)->addr);
+                } else {
+                    put((long)PSHAUTO);
+                    put(adjauto(RDINT()));
+                }
+                break;
+
+            default:
+                fprintf(stderr, "bi: %s: intermediate op %d in %s not handled\n", m->fn, op, fn->name);
+                exit(1);
+            }
+        }
+
+        if (pass == 0) {
+            code = getwords(ncode);
+            size = ncode;
+        }
+    }
+
+    *fn->addr = SHIFT(code);
+}
+
+// add a word to the function's code; the first time through, only
+// count it
+//
+void
+put(long w)
+{
+    if (code) {
+        code[ncode] = w;
+    }
+    ncode++;
+}
+
+// the address of a label in the function's code, once it's known
+//
+long
+target(unsigned lab)
+{
+    if (code == NULL) {
+        return 0;
+    }
+    if (lab >= (unsigned)maxlabels) {
+        fprintf(stderr, "bi: bad label in intermediate file\n");
+        exit(1);
+    }
+    return (long)(code + labels[lab]);
+}
+
+// Return the word aligned copy of the string at 'offs' in the module's
+// pool. ba aligns the strings it refers to for 8 byte words the same
+// way. The pool's strings each end in a '\0', and one copy is made of
+// each, so a literal stored into stays changed.
+//
+long *
+strcopy(struct module *m, unsigned offs)
+{
+    const unsigned char *p, *end;
+    unsigned n;
+
+    if (offs >= m->nstrp || offs % INTSIZE) {
+        fprintf(stderr, "bi: %s: bad string in intermediate file\n", m->fn);
+        exit(1);
+    }
+
+    if (m->strs == NULL) {
+        m->strs = calloc(m->nstrp / INTSIZE + 1, sizeof(long *));
+        if (m->strs == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+
+    if (m->strs[offs / INTSIZE] == NULL) {
+        p = m->strp + offs;
+        end = m->strp + m->nstrp;
+        for (n = 0; p + n < end && p[n]; n++) {
+        }
+        m->strs[offs / INTSIZE] = getwords(n / WORDSIZE + 1);
+        memcpy(m->strs[offs / INTSIZE], p, n);
+    }
+    return m->strs[offs / INTSIZE];
+}
+
+// Build the code $start runs: call main, then exit
+//
+long *
+mkprog(void)
+{
+    long *prog = getwords(10);
+    long *w = prog;
+
+    *w++ = (long)ENTER;
+    *w++ = 0;
+    *w++ = (long)PSHSYM;
+    *w++ = (long)lookup("main")->addr;
+    *w++ = (long)DEREF;
+    *w++ = (long)CALL;
+    *w++ = (long)PSHCON;
+    *w++ = 0;
+    *w++ = (long)PSHSYM;
+    *w++ = (long)lookup("exit")->addr;
+    *w++ = (long)DEREF;
+    *w++ = (long)CALL;
+    return prog;
+}
+
+// Build the argument vector as $start does: the count, then each
+// argument as a B string
+//
+long *
+mkargv(int argc, char **argv)
+{
+    long *vec = getwords(argc + 1);
+    long *str;
+    int i, len;
+
+    vec[0] = argc;
+    for (i = 0; i < argc; i++) {
+        len = strlen(argv[i]);
+        str = getwords(len / WORDSIZE + 1);
+        memcpy(str, argv[i], len);
+        ((char *)str)[len] = STREOF;
+        vec[i + 1] = SHIFT(str);
+    }
+    return vec;
+}
+
+// Start the program running. Its stack is this one, and it leaves
+// through exit, so this never returns.
+//
+void
+run(long *prog)
+{
+    __asm__ volatile (
+        "mov %0, %%rcx\n\t"
+        "jmp *(%%rcx)"
+        :
+        : "r" (prog)
+        : "rcx", "memory");
+}
+
+// Translate a function which has become hot to native code, and enter
+// it there from now on. Called from JENTER with the function's code.
+// Returns the native code, or 0 if the function is to stay threaded.
+// The code is written twice, first to find where each cell's code
+// goes and the size, then with the branches resolved.
+//
+long
+translate(long *fn)
+{
+    int ncells = fn[3];
+    int i, n, pass;
+
+    natoffs = grow(natoffs, &maxnatoffs, ncells, sizeof(int));
+    jfn = fn;
+    nat = NULL;
+
+    for (pass = 0; pass < 2; pass++) {
+        nnat = 0;
+        for (i = 0; i < ncells; i += n) {
+            natoffs[i] = nnat;
+            if ((n = natop(fn + i)) == 0) {
+                fn[2] = LONG_MAX;
+                return 0;
+            }
+        }
+
+        if (pass == 0 && (nat = getcode(nnat)) == NULL) {
+            fn[2] = LONG_MAX;
+            return 0;
+        }
+    }
+
+    fn[0] = (long)nat;
+    return (long)nat;
+}
+
+// Write the native code for the instruction at 'c'. Returns the
+// number of cells in the instruction, or 0 if it can't be translated.
+//
+int
+natop(long *c)
+{
+    char *h = (char *)c[0];
+    int i, mode;
+
+    for (i = 0; i < nsimpleops; i++) {
+        if (simpleops[i].h == h) {
+            natsimple(simpleops[i].op);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < nbranchops; i++) {
+        if (branchops[i].h == h) {
+            natbranch(branchops[i].op, c[1]);
+            return 2;
+        }
+    }
+
+    for (i = 0; i < nrmwops; i++) {
+        for (mode = 0; mode < 3; mode++) {
+            if (rmwops[i].used[mode] == h || rmwops[i].discard[mode] == h) {
+                natrmw(rmwops[i].op, mode, rmwops[i].discard[mode] == h, mode < 2 ? c[1] : 0);
+                return mode < 2 ? 2 : 1;
+            }
+        }
+    }
+
+    if (h == ENTER || h == JENTER) {
+        NAT("\x55\x48\x89\xe5\x48\x81\xec");    // push %rbp; mov %rsp, %rbp; sub $n, %rsp
+        nat32(c[1]);
+        return h == ENTER ? 2 : 4;
+    } else if (h == AVINIT) {
+        NAT("\x48\x8d\x85");                    // lea n(%rbp), %rax
+        nat32(c[1]);
+        NAT("\x48\x8d\x50\x08"                  // lea 8(%rax), %rdx
+            "\x48\xc1\xea\x03"                  // shr $3, %rdx
+            "\x48\x89\x10");                    // mov %rdx, (%rax)
+        return 2;
+    } else if (h == CASE) {
+        NAT("\x48\x81\x3c\x24");                // cmpq $n, (%rsp)
+        nat32(c[1]);
+        NAT("\x75\x06\x58\xe9");                // jne 1f; pop %rax; jmp t; 1:
+        natrel(c[2]);
+        return 3;
+    } else if (h == PSHCON) {
+        natpush(c[1]);
+        return 2;
+    } else if (h == PSHSYM) {
+        natpush(c[1] >> 3);
+        return 2;
+    } else if (h == PSHAUTO) {
+        NAT("\x48\x8d\x85");                    // lea n(%rbp), %rax
+        nat32(c[1]);
+        NAT("\x48\xc1\xe8\x03\x50");            // shr $3, %rax; push %rax
+        return 2;
+    } else if (h == POPN) {
+        NAT("\x48\x81\xc4");                    // add $n, %rsp
+        nat32(c[1]);
+        return 2;
+    } else if (h == DUPN) {
+        NAT("\xff\xb4\x24");                    // push n(%rsp)
+        nat32(c[1]);
+        return 2;
+    }
+    return 0;
+}
+
+// Write the native code for an op without operands
+//
+void
+natsimple(int op)
+{
+    switch (op) {
+    case OPOP:  NAT("\x58"); break;                         // pop %rax
+    case OPOPT: NAT("\x5b"); break;                         // pop %rbx
+    case OPUSHT: NAT("\x53"); break;                        // push %rbx
+    case ODUP:  NAT("\xff\x34\x24"); break;                 // push (%rsp)
+    case OROT:  NAT("\x58\x5a\x5e\x50\x56\x52"); break;     // pop %rax; pop %rdx; pop %rsi
+                                                            // push %rax; push %rsi; push %rdx
+    case ODEREF:
+        NAT("\x5a\xff\x34\xd5\0\0\0\0");                    // pop %rdx; push (,%rdx,8)
+        break;
+    case OSTORE:
+        NAT("\x58\x5a\x48\x89\x04\xd5\0\0\0\0");            // pop %rax; pop %rdx; mov %rax, (,%rdx,8)
+        break;
+    case OLDX:
+        NAT("\x58\x5a\x48\x01\xc2"                          // pop %rax; pop %rdx; add %rax, %rdx
+            "\xff\x34\xd5\0\0\0\0");                        // push (,%rdx,8)
+        break;
+    case OSTX:
+        NAT("\x58\x5a\x48\x03\x14\x24"                      // pop %rax; pop %rdx; add (%rsp), %rdx
+            "\x48\x89\x04\xd5\0\0\0\0"                      // mov %rax, (,%rdx,8)
+            "\x48\x89\x04\x24");                            // mov %rax, (%rsp)
+        break;
+
+    case OLEAVE: NAT("\x48\x89\xec\x5d"); break;            // mov %rbp, %rsp; pop %rbp
+    case ORET:  NAT("\x59\xff\x21"); break;                 // pop %rcx; jmp *(%rcx)
+
+    case OCALL:
+        // a call pushes the address of a word holding the address to
+        // return to, as CALL does for threaded code
+        //
+        NAT("\x58\x48\xc1\xe0\x03"                          // pop %rax; shl $3, %rax
+            "\x48\x89\xc1\x68");                            // mov %rax, %rcx; push $1f
+        nat32((long)nat + nnat + 6);
+        NAT("\xff\x21");                                    // jmp *(%rcx)
+        nat64((long)nat + nnat + 8);                        // 1: .quad 2f; 2:
+        break;
+
+    case OADD:  NAT("\x58\x48\x01\x04\x24"); break;         // pop %rax; add %rax, (%rsp)
+    case OSUB:  NAT("\x58\x48\x29\x04\x24"); break;         // pop %rax; sub %rax, (%rsp)
+    case OAND:  NAT("\x58\x48\x21\x04\x24"); break;         // pop %rax; and %rax, (%rsp)
+    case OOR:   NAT("\x58\x48\x09\x04\x24"); break;         // pop %rax; or %rax, (%rsp)
+    case ONEG:  NAT("\x48\xf7\x1c\x24"); break;             // negq (%rsp)
+    case OSHL:  NAT("\x59\x48\xd3\x24\x24"); break;         // pop %rcx; shlq %cl, (%rsp)
+    case OSHR:  NAT("\x59\x48\xd3\x2c\x24"); break;         // pop %rcx; shrq %cl, (%rsp)
+    case OMUL:
+        NAT("\x58\x48\x0f\xaf\x04\x24"                      // pop %rax; imul (%rsp), %rax
+            "\x48\x89\x04\x24");                            // mov %rax, (%rsp)
+        break;
+    case ODIV:
+        NAT("\x5f\x58\x48\x99\x48\xf7\xff\x50");            // pop %rdi; pop %rax; cqto; idiv %rdi; push %rax
+        break;
+    case OMOD:
+        NAT("\x5f\x58\x48\x99\x48\xf7\xff\x52");            // pop %rdi; pop %rax; cqto; idiv %rdi; push %rdx
+        break;
+    case ONOT:
+        NAT("\x58\x31\xd2\x48\x85\xc0"                      // pop %rax; xor %edx, %edx; test %rax, %rax
+            "\x0f\x94\xc2\x52");                            // setz %dl; push %rdx
+        break;
+
+    // a1 a0 [op] a1 cc a0
+    //
+    case OEQ: case ONE: case OLT: case OLE: case OGT: case OGE:
+        NAT("\x58\x5a\x31\xc9\x48\x39\xc2\x0f");            // pop %rax; pop %rdx; xor %ecx, %ecx
+                                                            // cmp %rax, %rdx; set<cc> %cl
+        natbytes(op == OEQ ? "\x94" : op == ONE ? "\x95" : op == OLT ? "\x9c" :
+                 op == OLE ? "\x9e" : op == OGT ? "\x9f" : "\x9d", 1);
+        NAT("\xc1\x51");                                    // push %rcx
+        break;
+    }
+}
+
+// Write the native code for a branch to the cell at 't'
+//
+void
+natbranch(int op, long t)
+{
+    switch (op) {
+    case OJMP: NAT("\xe9"); break;                          // jmp t
+    case OBZ:  NAT("\x5a\x48\x85\xd2\x0f\x84"); break;      // pop %rdx; test %rdx, %rdx; jz t
+    case OBNZ: NAT("\x5a\x48\x85\xd2\x0f\x85"); break;      // pop %rdx; test %rdx, %rdx; jnz t
+
+    // a1 a0 [op] branches if a1 cc a0
+    //
+    default:
+        NAT("\x58\x5a\x48\x39\xc2\x0f");                    // pop %rax; pop %rdx; cmp %rax, %rdx; j<cc> t
+        natbytes(op == OBEQ ? "\x84" : op == OBNE ? "\x85" : op == OBLT ? "\x8c" :
+                 op == OBLE ? "\x8e" : op == OBGT ? "\x8f" : "\x8d", 1);
+        break;
+    }
+    natrel(t);
+}
+
+// Write the native code for an in-place update. The address updated
+// is found in RDX, after the right hand side of an assignment is
+// popped into RAX.
+//
+void
+natrmw(int op, int mode, int discard, long arg)
+{
+    int post = op == OPOSTINC || op == OPOSTDEC;
+
+    if (op == OADDTO || op == OSUBTO || op == OANDTO || op == OORTO) {
+        NAT("\x58");                                        // pop %rax
+    }
+
+    if (mode == 0) {
+        NAT("\x48\xc7\xc2");                                // mov $extrn, %rdx
+        nat32(arg);
+    } else if (mode == 1) {
+        NAT("\x48\x8d\x95");                                // lea n(%rbp), %rdx
+        nat32(arg);
+    } else {
+        NAT("\x5a\x5e\x48\x01\xf2\x48\xc1\xe2\x03");        // pop %rdx; pop %rsi
+                                                            // add %rsi, %rdx; shl $3, %rdx
+    }
+
+    if (post && !discard) {
+        NAT("\xff\x32");                                    // push (%rdx)
+    }
+
+    switch (op) {
+    case OINC: case OPOSTINC: NAT("\x48\xff\x02"); break;   // incq (%rdx)
+    case ODEC: case OPOSTDEC: NAT("\x48\xff\x0a"); break;   // decq (%rdx)
+    case OADDTO: NAT("\x48\x01\x02"); break;                // add %rax, (%rdx)
+    case OSUBTO: NAT("\x48\x29\x02"); break;                // sub %rax, (%rdx)
+    case OANDTO: NAT("\x48\x21\x02"); break;                // and %rax, (%rdx)
+    case OORTO:  NAT("\x48\x09\x02"); break;                // or %rax, (%rdx)
+    }
+
+    if (!post && !discard) {
+        NAT("\xff\x32");                                    // push (%rdx)
+    }
+}
+
+// Write the native code to push a constant
+//
+void
+natpush(long v)
+{
+    if (v == (int)v) {
+        NAT("\x68");                                        // push $v
+        nat32(v);
+    } else {
+        NAT("\x48\xb8");                                    // mov $v, %rax
+        nat64(v);
+        NAT("\x50");                                        // push %rax
+    }
+}
+
+// Write the displacement of a jump to the native code of the cell at
+// 't'. The first time through, it isn't known yet.
+//
+void
+natrel(long t)
+{
+    nat32(natoffs[(t - (long)jfn) / WORDSIZE] - (nnat + 4));
+}
+
+// add bytes to the native code; the first time through, only count
+// them
+//
+void
+natbytes(const char *s, int n)
+{
+    if (nat) {
+        memcpy(nat + nnat, s, n);
+    }
+    nnat += n;
+}
+
+void
+nat32(long v)
+{
+    char b[4];
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        b[i] = v >> (8 * i);
+    }
+    natbytes(b, 4);
+}
+
+void
+nat64(long v)
+{
+    nat32(v);
+    nat32(v >> 32);
+}
+
+// Allocate room for native code below 2GB, where the addresses pushed
+// for calls fit in 32 bits. Returns NULL if none can be mapped.
+//
+unsigned char *
+getcode(size_t n)
+{
+    size_t size;
+    unsigned char *p;
+
+    n = (n + NATALIGN - 1) & ~(size_t)(NATALIGN - 1);
+    if (natmem == NULL || n > (size_t)(natend - natmem)) {
+        size = n > CHUNK ? n : CHUNK;
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+        if (p == MAP_FAILED) {
+            return NULL;
+        }
+        natmem = p;
+        natend = p + size;
+    }
+
+    p = natmem;
+    natmem += n;
+    return p;
+}
+
+// Allocate zeroed words below 2GB
+//
+long *
+getwords(size_t n)
+{
+    size_t size;
+    long *p;
+
+    if (mem == NULL || n > (size_t)(memend - mem)) {
+        size = n * WORDSIZE > CHUNK ? n * WORDSIZE : CHUNK;
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+        if (p == MAP_FAILED) {
+            perror("bi");
+            exit(1);
+        }
+        mem = p;
+        memend = p + size / WORDSIZE;
+    }
+
+    p = mem;
+    mem += n;
+    return p;
+}
+
+// Find a name, adding it if need be
+//
+struct sym *
+lookup(const char *name)
+{
+    struct sym *s;
+    const char *p;
+    unsigned h = 0;
+
+    for (p = name; *p; p++) {
+        h = h * 31 + (*p & 0xff);
+    }
+    h %= NAMEHASH;
+
+    for (s = symhash[h]; s; s = s->next) {
+        if (strcmp(s->name, name) == 0) {
+            return s;
+        }
+    }
+
+    if ((s = calloc(1, sizeof(struct sym))) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    strcpy(s->name, name);
+    s->next = symhash[h];
+    symhash[h] = s;
+    return s;
+}
+
+// read a name, as its number in the module's name table
+//
+struct sym *
+rdsym(struct module *m)
+{
+    unsigned n = RDINT();
+
+    if (n >= m->nnames) {
+        fprintf(stderr, "bi: %s: bad name in intermediate file\n", m->fn);
+        exit(1);
+    }
+    return m->names[n];
+}
+
+// go to 'offs' in a section of a module
+//
+void
+seek(struct module *m, int sect, unsigned offs)
+{
+    rfn = m->fn;
+    rp = m->p + m->offs[sect] + (offs < m->len[sect] ? offs : m->len[sect]);
+    rend = m->p + m->offs[sect] + m->len[sect];
+}
+
+// read an n byte integer
+//
+unsigned
+rdbytes(int n)
+{
+    unsigned ul = 0;
+    int i;
+
+    if (rend - rp < n) {
+        fprintf(stderr, "bi: premature end of file on %s\n", rfn);
+        exit(1);
+    }
+    for (i = 0; i < n; i++) {
+        ul |= (unsigned)rp[i] << (8 * i);
+    }
+    rp += n;
+    return ul;
+}
+
+int
+rdbyte(void)
+{
+    if (rp >= rend) {
+        fprintf(stderr, "bi: premature end of file on %s\n", rfn);
+        exit(1);
+    }
+    return *rp++;
+}
+
+// read a varint (see bif.h)
+//
+unsigned
+rdint(void)
+{
+    unsigned zz = 0;
+    int shift = 0, ch;
+
+    do {
+        ch = RDBYTE();
+        zz |= (unsigned)(ch & 0x7f) << shift;
+        shift += 7;
+    } while ((ch & 0x80) && shift < 35);
+
+    return (zz >> 1) ^ -(zz & 1);
+}
+
+// Adjust an offset for an automatic variable or arg for the stack
+// frame; see adjauto() in ba.c
+//
+long
+adjauto(unsigned offs)
+{
+    long soffs = (int)offs;
+
+    if (soffs >= 0) {
+        soffs += 2;
+    }
+    return soffs * WORDSIZE;
+}
+
+// make sure there's room for element 'n' of a growing array
+//
+void *
+grow(void *p, int *max, int n, size_t size)
+{
+    int newmax = *max ? *max : 64;
+
+    while (n >= newmax) {
+        newmax *= 2;
+    }
+    if (newmax > *max) {
+        if ((p = realloc(p, newmax * size)) == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        *max = newmax;
+    }
+    return p;
+}
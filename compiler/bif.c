@@ -1,3 +1,4 @@
+
 #include "bif.h"
 
 #include "b.h"
@@ -8,41 +9,109 @@
 #include <stdlib.h>
 #include <string.h>
 
+// The file is built up in memory, one buffer per section, so that a
+// version 2 file can start with the directory of where they all are.
+// A version 1 file only uses the first buffer.
+//
+struct buf {
+    unsigned char *p;
+    int n, max;
+};
+
+#define NAMEHASH 1021
+#define STRHASH 1021
+#define STRALIGN 8              // strings are shared at offsets aligned
+                                // for any target's words
+
+struct name {
+    struct name *next;          // in the hash chain
+    int index;                  // in the name table
+    char name[MAXNAM + 1];
+};
+
+// a string in the pool, or a suffix of one that may be shared
+//
+struct strent {
+    struct strent *next;        // in the hash chain
+    const char *str;
+    int len;
+    int seq;                    // order first seen
+    int offs;                   // in the pool, or -1 until placed
+};
+
 static int err = 0;
-static FILE *fp;
+static int version;
+static struct buf sects[BIFSMAX + 1];
+static struct buf *out;         // the section being written
 static char *strpool;
 static int strpnext;
 static int strpsize;
+static struct name *namehash[NAMEHASH];
+static struct name **names;
+static int nnames, maxnames;
+static struct strent *strhash[STRHASH];
+static struct strent **strs;    // the string constants, once each
+static int nstrs, maxstrs;
 
 static void wrdata(struct stabent *syms);
 static void wrcode(struct stabent *syms);
 static void wrfunc(struct stabent *func, struct stabent *syms);
 static void wrbytes(unsigned val, int bytes);
+static void wrbyte(int c);
+static void wrint(unsigned val);
 static void wrname(const char *name);
 static void wrchars(const char *str, int bytes);
+static void strpbuild(struct stabent *syms);
+static struct strent *strfind(const char *str, int len, int add);
+static int  bylen(const void *a, const void *b);
+static void strpput(const char *str, int len);
 static int  strpadd(const char *str, int len);
 static int  wrstrp(void);
+static int  intern(const char *name);
+static int  exref(struct stabent *sym);
+static void wrnames(void);
+static void wrfile(FILE *fp);
 
 
-#define WRINT(v) wrbytes(v, INTSIZE)
-#define WRBYTE(v) wrbytes(v, 1)
+#define WRINT(v) wrint(v)
+#define WRBYTE(v) wrbyte(v)
 
-// write the intermediate file
+// write the intermediate file, in the given version of the format
 //
 int 
-bifwrite(const char *fn, struct stabent *syms)
+bifwrite(const char *fn, struct stabent *syms, int ver)
 {
+    FILE *fp;
+
     if ((fp = fopen(fn, "wb")) == NULL) {
         perror(fn);
         return 2;
     }
 
-    WRINT(BIFMAGIC);
+    version = ver;
+    out = &sects[0];
+    if (version == 1) {
+        WRINT(BIFMAGIC);
+    } else {
+        out = &sects[BIFSDATA];
+    }
 
+    strpbuild(syms);
     wrdata(syms);
     wrcode(syms);
+    if (version != 1) {
+        out = &sects[BIFSSTRP];
+    }
     wrstrp();
 
+    if (version != 1) {
+        wrnames();
+    }
+
+    if (!err) {
+        wrfile(fp);
+    }
+
     if (fclose(fp) == EOF) {
         err = 1;
     }
@@ -55,6 +124,47 @@ bifwrite(const char *fn, struct stabent *syms)
     return 0;
 }
 
+// write the buffered sections out; for version 2, after the header
+// and the directory
+//
+void
+wrfile(FILE *fp)
+{
+    struct buf hdr = { NULL, 0, 0 };
+    unsigned offs;
+    int id;
+
+    if (version == 1) {
+        if (fwrite(sects[0].p, 1, sects[0].n, fp) != sects[0].n) {
+            err = 1;
+        }
+        return;
+    }
+
+    out = &hdr;
+    wrbytes(BIFMAGIC2, 4);
+    wrbytes(version, 4);
+    wrbytes(BIFSMAX, 4);
+
+    offs = 12 + 12 * BIFSMAX;
+    for (id = 1; id <= BIFSMAX; id++) {
+        wrbytes(id, 4);
+        wrbytes(offs, 4);
+        wrbytes(sects[id].n, 4);
+        offs += sects[id].n;
+    }
+
+    if (fwrite(hdr.p, 1, hdr.n, fp) != hdr.n) {
+        err = 1;
+    }
+    for (id = 1; id <= BIFSMAX; id++) {
+        if (fwrite(sects[id].p, 1, sects[id].n, fp) != sects[id].n) {
+            err = 1;
+        }
+    }
+    free(hdr.p);
+}
+
 // write out data definitions
 //
 void 
@@ -105,13 +215,14 @@ wrdata(struct stabent *syms)
                 WRINT(ivp->v.con.v.intcon);
             } else {
                 WRBYTE(BIFISTR);
-                WRINT(strpadd(ivp->v.con.v.strcon, ivp->v.con.strlen));
+                WRINT(err ? EOF : ivp->strpoffs);
             }
         }
     }
 }
 
-// write out functions
+// write out functions. in version 2 the code of each goes in the code
+// section, and its offset there in the function index
 //
 void
 wrcode(struct stabent *syms)
@@ -125,13 +236,21 @@ wrcode(struct stabent *syms)
         }
     }
 
-    WRINT(ncode);
+    if (version == 1) {
+        WRINT(ncode);
+    }
 
     for (symp = syms; symp; symp = symp->next) {
         if (symp->sc != EXTERN || symp->type != FUNC) {
             continue;
         }
 
+        if (version != 1) {
+            out = &sects[BIFSFUNCS];
+            wrbytes(sects[BIFSCODE].n, 4);
+            out = &sects[BIFSCODE];
+        }
+
         wrname(symp->name);
         wrfunc(symp, syms);
     }
@@ -147,30 +266,33 @@ wrfunc(struct stabent *func, struct stabent *syms)
     struct stabent *sym;
     int exidx = 0;
 
-
-    // TODO hoist all the externs up into one big de-duplicated table
-    for (sym = func->scope.head; sym; sym = sym->next) {
-        if (sym->sc == EXTERN) {
-            sym->labpc = exidx++;
+    // version 1 has a table of extrns for each function, which is all
+    // the globals again; version 2 refers to the shared name table
+    //
+    if (version == 1) {
+        for (sym = func->scope.head; sym; sym = sym->next) {
+            if (sym->sc == EXTERN) {
+                sym->labpc = exidx++;
+            }
         }
-    }
 
-    for (sym = syms; sym; sym = sym->next) {
-        if (sym->sc == EXTERN) {
-            sym->labpc = exidx++;
+        for (sym = syms; sym; sym = sym->next) {
+            if (sym->sc == EXTERN) {
+                sym->labpc = exidx++;
+            }
         }
-    }
 
-    WRINT(exidx);
-    for (sym = func->scope.head; sym; sym = sym->next) {
-        if (sym->sc == EXTERN) {
-            wrname(sym->name);
+        WRINT(exidx);
+        for (sym = func->scope.head; sym; sym = sym->next) {
+            if (sym->sc == EXTERN) {
+                wrname(sym->name);
+            }
         }
-    }
 
-    for (sym = syms; sym; sym = sym->next) {
-        if (sym->sc == EXTERN) {
-            wrname(sym->name);
+        for (sym = syms; sym; sym = sym->next) {
+            if (sym->sc == EXTERN) {
+                wrname(sym->name);
+            }
         }
     }
 
@@ -188,6 +310,13 @@ wrfunc(struct stabent *func, struct stabent *syms)
 
         case OJMP:
         case OBZ:
+        case OBNZ:
+        case OBEQ:
+        case OBNE:
+        case OBLE:
+        case OBLT:
+        case OBGE:
+        case OBGT:
             WRINT(cn->arg.target->labpc);
             break;
 
@@ -213,10 +342,31 @@ wrfunc(struct stabent *func, struct stabent *syms)
             }
             break;
 
+        case OINC:
+        case ODEC:
+        case OPOSTINC:
+        case OPOSTDEC:
+        case OADDTO:
+        case OSUBTO:
+        case OANDTO:
+        case OORTO:
+            // 0 for an extrn, 1 for an auto, 2 for a vector element
+            // on the stack; then whether the result is discarded
+            //
+            sym = cn->arg.rmw.target;
+            WRBYTE(sym == NULL ? 2 : sym->sc == EXTERN ? 0 : 1);
+            WRBYTE(cn->arg.rmw.discard);
+            if (sym && sym->sc == EXTERN) {
+                WRINT(exref(sym));
+            } else if (sym) {
+                WRINT(sym->stkoffs);
+            }
+            break;
+
         case OPSHSYM:
             WRBYTE(cn->arg.target->sc == EXTERN ? 0 : 1);
             if (cn->arg.target->sc == EXTERN) {
-                WRINT(cn->arg.target->labpc);
+                WRINT(exref(cn->arg.target));
             } else if (cn->arg.target->sc != AUTO) {
                 fprintf(stderr, "internal compiler error: OPSHSYM neither EXTERN nor AUTO\n");
                 err = 1;
@@ -228,12 +378,23 @@ wrfunc(struct stabent *func, struct stabent *syms)
     }
 }
 
+// the operand referring to an extrn
+//
+int
+exref(struct stabent *sym)
+{
+    return version == 1 ? sym->labpc : intern(sym->name);
+}
+
 // write a value out in a given number of bytes
 //
 void 
 wrbytes(unsigned val, int bytes)
 {
     unsigned maxval;
+    char c[sizeof(unsigned)];
+    int i;
+
     if (bytes == sizeof(int)) {
         maxval = ~0u;
     } else {
@@ -254,20 +415,65 @@ wrbytes(unsigned val, int bytes)
         }
     }
 
-    while (bytes--) {
-        if (fputc(val & 0xff, fp) == EOF) {
-            err = 1;
-        }
+    for (i = 0; i < bytes; i++) {
+        c[i] = val & 0xff;
         val >>= 8;
     }
+    wrchars(c, bytes);
+}
+
+// write a byte; most of the file is single bytes, so they go straight
+// into the buffer when there is room
+//
+void
+wrbyte(int c)
+{
+    char ch = c;
+
+    if (out->n < out->max) {
+        out->p[out->n++] = ch;
+        return;
+    }
+    wrchars(&ch, 1);
+}
+
+// write a number. version 1 has a fixed INTSIZE bytes; version 2 has
+// as few bytes as it takes, 7 bits to a byte with the top bit set in
+// all but the last, for the number with its sign moved into bit 0
+//
+void
+wrint(unsigned val)
+{
+    unsigned zz;
+    char c[5];
+    int n = 0;
+
+    if (version == 1) {
+        wrbytes(val, INTSIZE);
+        return;
+    }
+
+    zz = (val << 1) ^ ((int)val < 0 ? ~0u : 0);
+    while (zz >= 0x80) {
+        c[n++] = (zz & 0x7f) | 0x80;
+        zz >>= 7;
+    }
+    c[n++] = zz;
+    wrchars(c, n);
 }
 
-// write an identifier
+// write an identifier; in version 2, as its index in the name table
 //
 void 
 wrname(const char *name)
 {
     int len = strlen(name);
+
+    if (version != 1) {
+        WRINT(intern(name));
+        return;
+    }
+
     WRBYTE(len);
     wrchars(name, len);
 }
@@ -277,26 +483,213 @@ wrname(const char *name)
 void 
 wrchars(const char *str, int bytes)
 {
-    if (fwrite(str, 1, bytes, fp) != bytes) {
-        err = 1;
+    unsigned char *p;
+    int max = out->max ? out->max : 256;
+
+    while (out->n + bytes > max) {
+        max *= 2;
+    }
+
+    if (max > out->max) {
+        if ((p = realloc(out->p, max)) == NULL) {
+            if (!err) {
+                fprintf(stderr, "out of memory\n");
+            }
+            err = 1;
+            return;
+        }
+        out->p = p;
+        out->max = max;
     }
+
+    memcpy(out->p + out->n, str, bytes);
+    out->n += bytes;
 }
 
-// Add a string constant to the string pool
+// Find a name in the version 2 name table, adding it if need be
 //
-int 
-strpadd(const char *str, int len)
+int
+intern(const char *name)
 {
-    int newsize = strpsize ? strpsize : 16;
-    char *newp;
-    int need;
+    struct name *np;
+    const char *p;
+    unsigned h = 0;
 
-    if (err) {
-        return EOF;
+    for (p = name; *p; p++) {
+        h = h * 31 + (*p & 0xff);
     }
+    h %= NAMEHASH;
 
-    strpnext = ((strpnext + INTSIZE - 1) / INTSIZE) * INTSIZE;
-    need = strpnext + len;
+    for (np = namehash[h]; np; np = np->next) {
+        if (strcmp(np->name, name) == 0) {
+            return np->index;
+        }
+    }
+
+    if (nnames == maxnames) {
+        maxnames = maxnames ? 2 * maxnames : 64;
+        names = realloc(names, maxnames * sizeof(struct name *));
+    }
+    np = calloc(1, sizeof(struct name));
+    if (names == NULL || np == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    strncpy(np->name, name, MAXNAM);
+    np->index = nnames;
+    np->next = namehash[h];
+    namehash[h] = np;
+    names[nnames++] = np;
+
+    return np->index;
+}
+
+// Write the version 2 name table
+//
+void
+wrnames(void)
+{
+    int i, len;
+
+    out = &sects[BIFSNAMES];
+    WRINT(nnames);
+    for (i = 0; i < nnames; i++) {
+        len = strlen(names[i]->name);
+        WRBYTE(len);
+        wrchars(names[i]->name, len);
+    }
+}
+
+// Lay out the string pool. Each string constant in the code is put in
+// once, and a string that is the end of a longer one, at an offset
+// aligned for any word size, is taken from the longer one; so the
+// strings are placed longest first. Each string starts on a word and
+// is followed by a '\0', as ba writes the pool as mergeable strings the
+// linker may share between files.
+//
+// A string a datum is initialized with is the datum's own, which the
+// program may store into, so each of those is put in after the others
+// and shared with nothing. ba writes them to the data.
+//
+void
+strpbuild(struct stabent *syms)
+{
+    struct stabent *symp;
+    struct ival *ivp;
+    struct codenode *cn;
+    struct strent *sp;
+    int i, k;
+
+    for (symp = syms; symp; symp = symp->next) {
+        if (symp->sc == EXTERN && symp->type == FUNC) {
+            for (cn = symp->fn.head; cn; cn = cn->next) {
+                if (cn->op == OPSHCON && cn->arg.con.strlen != INTCONST) {
+                    strfind(cn->arg.con.v.strcon, cn->arg.con.strlen, 1);
+                }
+            }
+        }
+    }
+
+    qsort(strs, nstrs, sizeof(struct strent *), bylen);
+
+    for (i = 0; i < nstrs && !err; i++) {
+        if (strs[i]->offs != -1) {
+            continue;
+        }
+        strpput(strs[i]->str, strs[i]->len);
+        strs[i]->offs = strpnext - strs[i]->len - 1;
+
+        for (k = STRALIGN; k < strs[i]->len; k += STRALIGN) {
+            sp = strfind(strs[i]->str + k, strs[i]->len - k, 0);
+            if (sp && sp->offs == -1) {
+                sp->offs = strs[i]->offs + k;
+            }
+        }
+    }
+
+    for (symp = syms; symp; symp = symp->next) {
+        if (symp->sc != EXTERN) {
+            continue;
+        }
+        for (ivp = symp->ivals.head; ivp; ivp = ivp->next) {
+            if (ivp->isconst && ivp->v.con.strlen != INTCONST) {
+                strpput(ivp->v.con.v.strcon, ivp->v.con.strlen);
+                ivp->strpoffs = strpnext - ivp->v.con.strlen - 1;
+            }
+        }
+    }
+}
+
+// find a string in the pool's table, adding it if 'add' is set
+//
+struct strent *
+strfind(const char *str, int len, int add)
+{
+    struct strent *sp;
+    unsigned h = len;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        h = h * 31 + (str[i] & 0xff);
+    }
+    h %= STRHASH;
+
+    for (sp = strhash[h]; sp; sp = sp->next) {
+        if (sp->len == len && memcmp(sp->str, str, len) == 0) {
+            return sp;
+        }
+    }
+    if (!add) {
+        return NULL;
+    }
+
+    if ((sp = malloc(sizeof(struct strent))) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    sp->str = str;
+    sp->len = len;
+    sp->seq = nstrs;
+    sp->offs = -1;
+    sp->next = strhash[h];
+    strhash[h] = sp;
+
+    if (nstrs == maxstrs) {
+        maxstrs = maxstrs ? 2 * maxstrs : 64;
+        if ((strs = realloc(strs, maxstrs * sizeof(struct strent *))) == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    strs[nstrs++] = sp;
+    return sp;
+}
+
+// longest strings first, then in the order seen
+//
+int
+bylen(const void *a, const void *b)
+{
+    const struct strent *sa = *(const struct strent **)a;
+    const struct strent *sb = *(const struct strent **)b;
+
+    if (sa->len != sb->len) {
+        return sb->len - sa->len;
+    }
+    return sa->seq - sb->seq;
+}
+
+// Append a string and its '\0' to the pool, on a word boundary
+//
+void 
+strpput(const char *str, int len)
+{
+    int newsize = strpsize ? strpsize : 16;
+    char *newp;
+    int need, start;
+
+    start = ((strpnext + INTSIZE - 1) / INTSIZE) * INTSIZE;
+    need = start + len + 1;
  
     while (need > newsize) {
         newsize *= 2;
@@ -304,21 +697,36 @@ strpadd(const char *str, int len)
 
     if (newsize > strpsize) {
         if ((newp = realloc(strpool, newsize)) == NULL) {
-            if (!err) {
-                fprintf(stderr, "out of memory\n");
-                err = 1;
-                return EOF;
-            }
+            fprintf(stderr, "out of memory\n");
+            err = 1;
+            return;
         }
         strpsize = newsize;
         strpool = newp;
     }
 
-    memcpy(strpool + strpnext, str, len);
-    
-    strpnext += len;
+    memset(strpool + strpnext, 0, start - strpnext);
+    memcpy(strpool + start, str, len);
+    strpool[start + len] = '\0';
+    strpnext = need;
+}
+
+// Return the offset in the string pool of a string constant
+//
+int 
+strpadd(const char *str, int len)
+{
+    struct strent *sp = strfind(str, len, 0);
 
-    return strpnext - len;
+    if (err) {
+        return EOF;
+    }
+    if (sp == NULL || sp->offs == -1) {
+        fprintf(stderr, "internal compiler error: string constant not in the pool\n");
+        err = 1;
+        return EOF;
+    }
+    return sp->offs;
 }
 
 // Write the string pool
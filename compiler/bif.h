@@ -3,6 +3,34 @@
 
 #define BIFMAGIC 0x4642   /* BF */
 
+/*
+ * Version 2 starts with BIFMAGIC2, the version and the number of
+ * sections, as 4 byte words, followed by a directory entry of the id,
+ * file offset and size of each section, and then the sections. Names
+ * are numbers in the name table, and all other numbers are varints:
+ * 7 bits to a byte, low bits first, with the top bit set in all but
+ * the last, and the sign moved into bit 0.
+ */
+#define BIFMAGIC2  0x32464942     /* BIF2 */
+#define BIFVERSION 2
+
+#define BIFSNAMES  1      /* count, then each name as length and chars */
+#define BIFSDATA   2      /* data definitions, as in version 1 */
+#define BIFSFUNCS  3      /* offset in BIFSCODE of each function, 4 bytes */
+#define BIFSCODE   4      /* each function's name and code */
+#define BIFSSTRP   5      /* the string pool, as in version 1 */
+#define BIFSMAX    5
+
+/*
+ * A library archive (.bia, written by bar) starts with BIAMAGIC, the
+ * number of members and the number of symbols, as 4 byte words. Each
+ * symbol follows as the 4 byte number of the member defining it, then
+ * the name as length and chars. Then each member's file name, the
+ * same way, and its file offset and size. The members are version 2
+ * intermediate files.
+ */
+#define BIAMAGIC   0x31414942     /* BIA1 */
+
 #define BIFVEC   0x01     /* data flag - is vector */
 
 #define BIFINAM  0x00     /* initializer element is name */
@@ -11,7 +39,7 @@
 #define BIFIVEC  0x03     /* initializer element is a vector */
 
 struct stabent;
-extern int bifwrite(const char *fn, struct stabent *syms);
+extern int bifwrite(const char *fn, struct stabent *syms, int version);
 
 #endif
 
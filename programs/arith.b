@@ -0,0 +1,17 @@
+/* Arithmetic in a loop. This is almost all expression evaluation
+   on the operand stack, which makes it a handy benchmark for the
+   threaded interpreter's stack handling. */
+
+main()
+{
+    extrn printf;
+    auto i, s;
+
+    s = 0;
+    i = 0;
+    while (i < 5000000) {
+        s = (s + i * 3 - (i & 7)) % 1000003 + (i >> 2) - (i | 1) / 2;
+        i++;
+    }
+    printf("%d*n", s);
+}
@@ -0,0 +1,51 @@
+/* Writes a large B program to standard output: many functions full of
+   constants, strings, calls and branches, and data to go with them.
+   Its intermediate file is several megabytes, which makes it a handy
+   benchmark for bc writing and ba reading intermediate files:
+
+       b -o bigbif bigbif.b && ./bigbif >big.b
+       time bc -o big.i big.b
+       time ba -o big.s big.i
+       time ba -c -o big.o big.i  */
+
+nfuncs 4000;
+
+func(i)
+{
+    extrn printf, nfuncs;
+    auto j;
+
+    printf("f%d(a, b)*n{*n    extrn printf, v%d;*n    auto x, y;*n*n", i, i);
+    j = 0;
+    while (j < 8) {
+        printf("    x = a ** %d + b / %d - (a & %d);*n", i + j, j + 1, 255 - j);
+        printf("    if (x > %d)*n        y = v%d[%d];*n", 1000 * j, i, j % 3);
+        printf("    else*n        y = x << %d;*n", j);
+        printf("    printf(*"f%d %d: %cd %cd**n*", x, y);*n", i, j, '%', '%');
+        j++;
+    }
+    if (i % 100)
+        printf("    return (f%d(x, y) + %d);*n}*n*n", i - 1, i);
+    else
+        printf("    return (x + y);*n}*n*n");
+    printf("v%d[8] %d, %d, %d, *"v%d*", %d;*n*n", i, i, i * 2, i * 3, i, i * 4);
+}
+
+main()
+{
+    extrn printf, nfuncs;
+    auto i;
+
+    i = 0;
+    while (i < nfuncs)
+        func(i++);
+
+    /* the functions call each other in chains of 100 */
+    printf("main()*n{*n");
+    i = 99;
+    while (i < nfuncs) {
+        printf("    f%d(1, 2);*n", i);
+        i =+ 100;
+    }
+    printf("}*n");
+}
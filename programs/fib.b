@@ -0,0 +1,17 @@
+/* Recursive fibonacci. This is almost all function call and
+   return overhead, which makes it a handy benchmark for the
+   calling convention. */
+
+fib(n)
+{
+    if (n < 2)
+        return (n);
+    return (fib(n-1) + fib(n-2));
+}
+
+main()
+{
+    extrn printf;
+
+    printf("%d*n", fib(30));
+}
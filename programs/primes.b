@@ -0,0 +1,34 @@
+/* Count the primes below 200000 by trial division. Nearly all the
+   time is spent in the loop of prime(), which is called once for
+   each number, which makes it a handy benchmark for bi -j:
+
+       bc -o primes.i primes.b
+       time bi primes.i
+       time bi -j 100 primes.i  */
+
+prime(n)
+{
+    auto d;
+
+    if (n < 2)
+        return (0);
+    d = 2;
+    while (d * d <= n) {
+        if (n % d == 0)
+            return (0);
+        d++;
+    }
+    return (1);
+}
+
+main()
+{
+    extrn printf;
+    auto i, n;
+
+    n = 0;
+    i = 0;
+    while (i < 200000)
+        n =+ prime(i++);
+    printf("%d*n", n);
+}
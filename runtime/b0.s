@@ -10,7 +10,6 @@ SYSBRK = 45
 $start:
     call meminit
     call argv
-    call dopinit
 main:
     leal __prog, %ecx
     jmp *(%ecx)
@@ -21,7 +20,6 @@ __prog:
     .int PSHSYM, _main
     .int DEREF
     .int CALL
-    .int POP
     .int PSHCON, 0
     .int PSHSYM, _exit
     .int DEREF
@@ -124,20 +122,3 @@ argv:
     and $0xfffffffc, %edi
     loop 1b
     ret
-#
-# initialize addresses that need to be shifted into pointers
-#
-dopinit:
-    mov $p0, %edi
-    mov $pn, %esi
-1:
-    cmp %esi, %edi
-    jge 2f
-    mov (%edi), %eax
-    shrl $2, (%eax)
-    add $4, %edi
-    jmp 1b
-2:
-    ret
-
-
@@ -0,0 +1,138 @@
+#
+# B subroutine threaded opcodes
+#
+
+################################################################################
+#
+# With ba -m call, control transfers, frame handling and short ops are
+# expanded inline as native code, and the remaining ops are compiled to
+# a native call of the handlers here. The handlers do the same work as
+# those in blib.s, but are entered through call and leave through ret,
+# which the CPU predicts from its return stack instead of the indirect
+# jmp *(%ecx) of threaded code.
+#
+# The operand stack is the machine stack, so each handler first pops
+# its return address into EDI and pushes it back before returning.
+# Operands are passed in registers: the first in ECX, the second in EAX.
+# EBX (T) and EBP are used as in blib.s.
+#
+
+    .text
+
+#
+# make a handler
+#
+    .macro mkcall name, body
+    .global c_\name
+c_\name :
+    pop %edi            # return address
+    \body
+    push %edi
+    ret
+    .endm
+
+################################################################################
+#
+# stack and memory
+#
+
+    mkcall ROT, "pop %eax; pop %edx; pop %esi; push %eax; push %esi; push %edx"
+    mkcall LDX, "pop %eax; pop %edx; add %eax, %edx; push (,%edx,4)"
+    mkcall STX, "pop %eax; pop %edx; add (%esp), %edx; mov %eax, (,%edx,4); mov %eax, (%esp)"
+    mkcall ASSIGN, "pop %eax; pop %edx; mov %eax, (,%edx,4); push %eax"
+    mkcall STXP, "pop %eax; pop %edx; pop %esi; add %esi, %edx; mov %eax, (,%edx,4)"
+
+#
+# ECX is the offset of the auto holding the vector pointer
+#
+    mkcall LDXA, "pop %edx; add (%ebp,%ecx), %edx; push (,%edx,4)"
+
+#
+# ECX is the offset (LDXAA) or address (LDXSA) of the vector pointer,
+# and EAX the offset of the auto holding the index
+#
+    mkcall LDXAA, "mov (%ebp,%ecx), %edx; add (%ebp,%eax), %edx; push (,%edx,4)"
+    mkcall LDXSA, "mov (%ecx), %edx; add (%ebp,%eax), %edx; push (,%edx,4)"
+
+################################################################################
+#
+# in place updates
+#
+
+#
+# find the address to update in edx: ECX holds the address of an
+# extrn (S) or the offset of an auto (A); the X mode pops an index and
+# a vector pointer
+#
+    .macro cvS
+    mov %ecx, %edx
+    .endm
+
+    .macro cvA
+    lea (%ebp,%ecx), %edx
+    .endm
+
+    .macro cvX
+    pop %edx            # index
+    pop %esi            # shifted pointer
+    add %esi, %edx
+    shl $2, %edx        # address of the element
+    .endm
+
+#
+# make an update op, as mkrmw in blib.s
+#
+    .macro mkcrmw name, rv, lv, body
+    mkcall \name, "\rv; \lv; \body"
+    .endm
+
+    .macro mkcasn mode, lv
+    mkcrmw ADDTO\mode, "pop %eax", \lv, "add %eax, (%edx); push (%edx)"
+    mkcrmw SUBTO\mode, "pop %eax", \lv, "sub %eax, (%edx); push (%edx)"
+    mkcrmw ANDTO\mode, "pop %eax", \lv, "and %eax, (%edx); push (%edx)"
+    mkcrmw ORTO\mode, "pop %eax", \lv, "or %eax, (%edx); push (%edx)"
+    .endm
+
+    mkcasn S, cvS
+    mkcasn A, cvA
+    mkcasn X, cvX
+
+    mkcrmw INCX, , cvX, "incl (%edx)"
+    mkcrmw DECX, , cvX, "decl (%edx)"
+    mkcrmw PREINCX, , cvX, "incl (%edx); push (%edx)"
+    mkcrmw PREDECX, , cvX, "decl (%edx); push (%edx)"
+    mkcrmw POSTINCX, , cvX, "push (%edx); incl (%edx)"
+    mkcrmw POSTDECX, , cvX, "push (%edx); decl (%edx)"
+    mkcrmw ADDTOPX, "pop %eax", cvX, "add %eax, (%edx)"
+    mkcrmw SUBTOPX, "pop %eax", cvX, "sub %eax, (%edx)"
+    mkcrmw ANDTOPX, "pop %eax", cvX, "and %eax, (%edx)"
+    mkcrmw ORTOPX, "pop %eax", cvX, "or %eax, (%edx)"
+
+################################################################################
+#
+# math
+#
+
+    mkcall NOT, "pop %eax; push $0; test %eax, %eax; setz (%esp)"
+    mkcall DIV, "pop %esi; pop %eax; cltd; idiv %esi; push %eax"
+    mkcall MOD, "pop %esi; pop %eax; cltd; idiv %esi; push %edx"
+    mkcall MUL, "pop %eax; imul (%esp), %eax; mov %eax, (%esp)"
+
+#
+# ECX is the divisor
+#
+    mkcall MODCON, "pop %eax; cltd; idiv %ecx; push %edx"
+
+#
+# a1 a0 [op] (a1 op a0)
+#
+    .macro mkcmp name, cc
+    mkcall \name, "pop %eax; pop %edx; push $0; cmp %eax, %edx; set\cc (%esp)"
+    .endm
+
+    mkcmp EQ, e
+    mkcmp NE, ne
+    mkcmp LT, l
+    mkcmp LE, le
+    mkcmp GT, g
+    mkcmp GE, ge
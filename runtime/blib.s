@@ -17,6 +17,11 @@
 #       stack into EBX and back, to aid in stack juggling. Other opcode 
 #       implementations should therefore not use EBX.
 #
+#       EBX also carries the return value of a function call. A function leaves
+#       its return value in EBX before RET, and the caller pushes it back onto
+#       the stack with PUSHT once the arguments have been popped. Native code
+#       called through NCALL returns its value the same way.
+#
 # EBP - Frame pointer. EBP points to the activation record for the current function
 #       call. Arguments to the function are at EBP+8, EBP+12, etc. The leftmost
 #       argument is the last argument pushed. EBP+4 contains the return address
@@ -41,9 +46,10 @@
 #   bits needed to divide by the native word size (2 bits for 4 bytes on x86.)
 #   All addresses must therefore be aligned on 4 byte boundaries.
 #
-#   Pointers in extrn data, and function pointers, are shifted during dopinit
-#   before main() is called. Pointers loaded during the course of program 
-#   execution are shifted right when loaded, and again to the left before use.
+#   Pointers in extrn data, and function pointers, are listed in .pinit and 
+#   shifted in the program file by b once it is linked. Pointers loaded during
+#   the course of program execution are shifted right when loaded, and again to
+#   the left before use.
 #
 # This architecture is very similar to that described in the original B language 
 # memo for the PDP-11 implementation.
@@ -60,6 +66,7 @@
 #
 # Call a function. The address is on the stack. Push the
 # return address on the stack and start executing the function.
+# On return, the function's return value is in EBX.
 #
     .global CALL
 CALL:
@@ -98,17 +105,12 @@ LEAVE:
 
 #
 # Return from a function. The stack should already have been
-# cleaned up. Before the return address is the return value,
-# which needs to be preserved.
-#
-# TODO it would save some stack manipulation to defined the
-# return value as being in a CPU register.
+# cleaned up, so the return address is on top of the stack. The
+# return value is in EBX.
 #
     .global RET
 RET:
-    pop %eax            # return value
     pop %ecx            # return address
-    push %eax           # return value
     jmp *(%ecx)         # continue back in caller
 
 
@@ -154,6 +156,46 @@ BZ:
 1:
     jmp *(%ecx)
     
+#
+# branch if the top of the stack is not zero
+#
+    .global BNZ
+BNZ:
+    add $4, %ecx        # -> arg (stack space)
+    mov (%ecx), %eax    # jump target
+    add $4, %ecx        
+    pop %edx            # condition
+    or %edx, %edx       # is condition zero?
+    jz 1f               # yes
+    mov %eax, %ecx      # nope, jump to target
+1:
+    jmp *(%ecx)
+
+#
+# compare and branch. a1 a0 [Bcc] branches to the argument if
+# a1 cc a0, popping both. the macro is given the inverse of cc,
+# the condition for falling through.
+#
+    .macro mkbr name, ncc
+    .global \name
+\name :
+    pop %eax            # a0
+    pop %edx            # a1
+    add $8, %ecx        # past the instruction
+    cmp %eax, %edx
+    j\ncc 1f            # condition doesn't hold
+    mov -4(%ecx), %ecx  # jump to target
+1:
+    jmp *(%ecx)
+    .endm
+
+    mkbr BEQ, ne
+    mkbr BNE, e
+    mkbr BLE, g
+    mkbr BLT, ge
+    mkbr BGE, l
+    mkbr BGT, le
+
 #
 # case statement
 #
@@ -252,6 +294,35 @@ ROT:
     jmp *(%ecx)
 
 
+#
+# Indexed load. a1 is a (shifted) pointer, a0 an index into the
+# vector it points to. pointers are word indices, so the element
+# is addressed by scaling their sum back up.
+# a1 a0 [LDX] mem[a1+a0]
+#
+    .global LDX
+LDX:
+    pop %eax            # index
+    pop %edx            # shifted pointer
+    add %eax, %edx
+    push (,%edx,4)
+    add $4, %ecx
+    jmp *(%ecx)
+
+#
+# Indexed store. leaves the stored value on the stack.
+# a2 a1 a0 [STX] a0, with mem[a2+a1] = a0
+#
+    .global STX
+STX:
+    pop %eax            # value to store
+    pop %edx            # index
+    add (%esp), %edx    # + shifted pointer
+    movl %eax, (,%edx,4)
+    movl %eax, (%esp)   # replace the pointer with the value
+    add $4, %ecx
+    jmp *(%ecx)
+
 #
 # Pushes the temporary register onto the stack.
 #
@@ -319,11 +390,23 @@ NAMDEF:
     add $4, %ecx        # past the instruction
     jmp *(%ecx)
 
+#
+# bump the profiling counter at the address in the argument. this
+# is only emitted with -fprofile-generate.
+#
+    .global PROF
+PROF:
+    mov 4(%ecx), %eax   # -> counter
+    incl (%eax)
+    add $8, %ecx
+    jmp *(%ecx)
+
 #
 # native call. this only occurs in library functions,
 # and the pointer is not shifted. the native code
 # is expected to remember ecx and eventually use it
-# to restart threaded execution.
+# to restart threaded execution, with its return value
+# in ebx.
 #
     .global NCALL
 NCALL:
@@ -331,6 +414,82 @@ NCALL:
     add $8, %ecx        # past argument
     ret
     
+################################################################################
+#
+# in-place update
+#
+# ++, -- and the =+ =- =& =| assignments on a variable or vector element
+# update memory directly. each op comes in three addressing modes, by
+# suffix:
+#
+#   S   the EXTRN whose address is the argument
+#   A   the auto variable or argument at the frame offset in the argument
+#   X   the vector element a1[a0], with a1 and a0 on the stack
+#
+# INC/DEC and the ADDTOP family discard the result; the others push
+# it. the assignments take the right hand side on top of the stack.
+#
+
+    .macro lvS
+    mov 4(%ecx), %edx   # address of the extrn
+    .endm
+
+    .macro lvA
+    mov 4(%ecx), %edx   # frame offset
+    add %ebp, %edx
+    .endm
+
+    .macro lvX
+    pop %edx            # index
+    pop %esi            # shifted pointer
+    add %esi, %edx
+    shl $2, %edx        # address of the element
+    .endm
+
+#
+# make an update op. 'rv' is non-blank if the op pops a right hand 
+# side into eax first; 'lv' computes the address to update into edx; 
+# 'len' is the length of the instruction and 'body' does the update
+#
+    .macro mkrmw name, rv, lv, len, body
+    .global \name
+\name :
+    .ifnb \rv
+    pop %eax            # right hand side
+    .endif
+    \lv
+    \body
+    add $\len, %ecx
+    jmp *(%ecx)
+    .endm
+
+    .macro mkinc mode, lv, len
+    mkrmw INC\mode, , \lv, \len, "incl (%edx)"
+    mkrmw DEC\mode, , \lv, \len, "decl (%edx)"
+    mkrmw PREINC\mode, , \lv, \len, "incl (%edx); push (%edx)"
+    mkrmw PREDEC\mode, , \lv, \len, "decl (%edx); push (%edx)"
+    mkrmw POSTINC\mode, , \lv, \len, "push (%edx); incl (%edx)"
+    mkrmw POSTDEC\mode, , \lv, \len, "push (%edx); decl (%edx)"
+    .endm
+
+    .macro mkasn mode, lv, len
+    mkrmw ADDTO\mode, rv, \lv, \len, "add %eax, (%edx); push (%edx)"
+    mkrmw SUBTO\mode, rv, \lv, \len, "sub %eax, (%edx); push (%edx)"
+    mkrmw ANDTO\mode, rv, \lv, \len, "and %eax, (%edx); push (%edx)"
+    mkrmw ORTO\mode, rv, \lv, \len, "or %eax, (%edx); push (%edx)"
+    mkrmw ADDTOP\mode, rv, \lv, \len, "add %eax, (%edx)"
+    mkrmw SUBTOP\mode, rv, \lv, \len, "sub %eax, (%edx)"
+    mkrmw ANDTOP\mode, rv, \lv, \len, "and %eax, (%edx)"
+    mkrmw ORTOP\mode, rv, \lv, \len, "or %eax, (%edx)"
+    .endm
+
+    mkinc S, lvS, 8
+    mkinc A, lvA, 8
+    mkinc X, lvX, 4
+    mkasn S, lvS, 8
+    mkasn A, lvA, 8
+    mkasn X, lvX, 4
+
 ################################################################################
 #
 # math
@@ -552,3 +711,171 @@ GE:
     jmp *(%ecx) 
 
 
+
+################################################################################
+#
+# superinstructions. ba combines common runs of ops into these; see
+# superopt in ba.c for the runs each one replaces.
+#
+
+#
+# Push the value of the given auto variable or argument
+# (PSHAUTO DEREF)
+#
+    .global LDAUTO
+LDAUTO:
+    mov 4(%ecx), %eax   # frame offset
+    push (%ebp,%eax)
+    add $8, %ecx
+    jmp *(%ecx)
+
+#
+# Push the value of the EXTRN (PSHSYM DEREF)
+#
+    .global LDSYM
+LDSYM:
+    mov 4(%ecx), %eax   # address of the extrn
+    push (%eax)
+    add $8, %ecx
+    jmp *(%ecx)
+
+#
+# a0 [ADDCON c] a0+c (PSHCON ADD)
+#
+    .global ADDCON
+ADDCON:
+    mov 4(%ecx), %eax
+    add %eax, (%esp)
+    add $8, %ecx
+    jmp *(%ecx)
+
+#
+# a0 [SUBCON c] a0-c (PSHCON SUB)
+#
+    .global SUBCON
+SUBCON:
+    mov 4(%ecx), %eax
+    sub %eax, (%esp)
+    add $8, %ecx
+    jmp *(%ecx)
+
+#
+# a0 [MULCON c] a0*c (PSHCON MUL)
+#
+    .global MULCON
+MULCON:
+    mov 4(%ecx), %eax
+    imul (%esp), %eax
+    mov %eax, (%esp)
+    add $8, %ecx
+    jmp *(%ecx)
+
+#
+# a0 [MODCON c] a0%c (PSHCON MOD)
+#
+    .global MODCON
+MODCON:
+    pop %eax            # lhs
+    mov %eax, %edx
+    sar $31, %edx       # sign ex eax into edx
+    idivl 4(%ecx)
+    push %edx
+    add $8, %ecx
+    jmp *(%ecx)
+
+#
+# Call the function whose pointer is at the given offset 
+# into the stack (DUPN DEREF CALL)
+#
+    .global CALLN
+CALLN:
+    mov 4(%ecx), %eax   # offset of the function pointer
+    mov (%esp,%eax), %eax
+    shl $2, %eax        # -> function
+    mov (%eax), %eax    # shifted entry address
+    shl $2, %eax
+    add $8, %ecx        # past the instruction
+    push %ecx           # return address
+    mov %eax, %ecx      # %ecx is function entry
+    jmp *(%ecx)
+
+#
+# store a value into memory, leaving the value on the stack.
+# a1 a0 [ASSIGN] a0, with *a1 = a0 (DUP ROT STORE)
+#
+    .global ASSIGN
+ASSIGN:
+    pop %eax            # value to store
+    pop %edx            # pointer
+    shl $2, %edx
+    movl %eax, (%edx)
+    push %eax
+    add $4, %ecx
+    jmp *(%ecx)
+
+#
+# Indexed load with the index in an auto (LDAUTO LDX)
+# a0 [LDXA off] mem[a0+auto]
+#
+    .global LDXA
+LDXA:
+    mov 4(%ecx), %eax   # frame offset of the index
+    pop %edx            # shifted pointer
+    add (%ebp,%eax), %edx
+    push (,%edx,4)
+    add $8, %ecx
+    jmp *(%ecx)
+
+#
+# Indexed load with a constant index (PSHCON LDX)
+# a0 [LDXC c] mem[a0+c]
+#
+    .global LDXC
+LDXC:
+    pop %edx            # shifted pointer
+    add 4(%ecx), %edx
+    push (,%edx,4)
+    add $8, %ecx
+    jmp *(%ecx)
+
+#
+# Indexed load with both the pointer and the index in autos
+# (LDAUTO LDAUTO LDX)
+#
+    .global LDXAA
+LDXAA:
+    mov 4(%ecx), %eax   # frame offset of the pointer
+    mov (%ebp,%eax), %edx
+    mov 8(%ecx), %eax   # frame offset of the index
+    add (%ebp,%eax), %edx
+    push (,%edx,4)
+    add $12, %ecx
+    jmp *(%ecx)
+
+#
+# Indexed load with the pointer in an EXTRN and the index in
+# an auto (LDSYM LDAUTO LDX)
+#
+    .global LDXSA
+LDXSA:
+    mov 4(%ecx), %eax   # address of the extrn
+    mov (%eax), %edx
+    mov 8(%ecx), %eax   # frame offset of the index
+    add (%ebp,%eax), %edx
+    push (,%edx,4)
+    add $12, %ecx
+    jmp *(%ecx)
+
+#
+# Indexed store, discarding the value (STX POP)
+# a2 a1 a0 [STXP] with mem[a2+a1] = a0
+#
+    .global STXP
+STXP:
+    pop %eax            # value to store
+    pop %edx            # index
+    add (%esp), %edx    # + shifted pointer
+    movl %eax, (,%edx,4)
+    add $4, %esp        # pop the pointer
+    add $4, %ecx
+    jmp *(%ecx)
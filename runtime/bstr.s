@@ -8,7 +8,7 @@
 _char:
     .int .+4
 0:
-    .pushsection .pinit, "aw", @progbits
+    .pushsection .pinit, "ao", @progbits, .text
     .int 0b-4
     .popsection
     .int NCALL, __char
@@ -21,7 +21,7 @@ __char:
     xor %eax, %eax
     shl $2,%esi
     movb (%edx,%esi), %al
-    push %eax
+    mov %eax, %ebx
     jmp *(%ecx)
 
     .align 4
@@ -29,7 +29,7 @@ __char:
 _lchar:
     .int .+4
 0:
-    .pushsection .pinit, "aw", @progbits
+    .pushsection .pinit, "ao", @progbits, .text
     .int 0b-4
     .popsection
     .int NCALL, __lchar
@@ -42,5 +42,5 @@ __lchar:
     mov 12(%esp), %eax      # character to store
     shl $2,%esi
     movb %al, (%edx,%esi) 
-    push %eax
+    mov %eax, %ebx
     jmp *(%ecx)
@@ -34,15 +34,17 @@ WRONLY=1
 
 
 #
-# mkncall - create a threaded interpreter stub for a native code function
+# mkncall - create a threaded interpreter stub for a native code function,
+# in a section of its own so the linker can drop it if it isn't called
 #
     .macro mkncall name
+    .section .text.fn.\name, "ax", @progbits
     .align 4
     .global _\name
 _\name :
     .int .+4
 0:
-    .pushsection .pinit, "aw", @progbits
+    .pushsection .pinit, "ao", @progbits, .text.fn.\name
     .int 0b-4
     .popsection
     .int NCALL, \name
@@ -58,6 +60,7 @@ _\name :
 # exits the process with return code rc
 #
     mkncall exit
+    call profdump
     mov 4(%esp), %ebx   # return address
     mov $SYSEXIT, %eax  # exit syscall
     int $0x80
@@ -68,19 +71,16 @@ _\name :
 #
     mkncall putchar
     push %ecx
-    push %ebx
-    push 12(%esp)
+    push 8(%esp)
 
-    mov $SYSWRITE, %eax # write syscal write syscall 
+    mov $SYSWRITE, %eax # write syscall 
     mov $STDOUT, %ebx   # stdout
     mov %esp, %ecx      # buffer to write
     mov $1, %edx        # bytes to write
     int $0x80
 
-    pop %eax
-    pop %ebx
+    pop %ebx            # return the character
     pop %ecx
-    push %eax
     jmp *(%ecx)
 
 #
@@ -90,7 +90,6 @@ _\name :
 #
     mkncall getchar
     push %ecx
-    push %ebx
     push $0
 
     mov $SYSREAD, %eax  # read syscall 
@@ -102,10 +101,8 @@ _\name :
     je 1f
     movb $0xff, (%esp)  # return EOF otherwise
 1:
-    pop %eax
-    pop %ebx
+    pop %ebx            # return the character
     pop %ecx
-    push %eax
     jmp *(%ecx)
 
 
@@ -115,16 +112,12 @@ _\name :
 # new fence or a negative number on error.
 #
     mkncall brk
-    push %ecx
-    push %ebx
-    mov 12(%esp), %ebx
+    mov 4(%esp), %ebx
 
     mov $SYSBRK, %eax
     int $0x80
     
-    pop %ecx
-    pop %ebx
-    push %eax
+    mov %eax, %ebx
     jmp *(%ecx)
 
 #
@@ -135,11 +128,10 @@ _\name :
 #
     mkncall open
     push %ecx
-    push %ebx
     mov $SYSOPEN, %eax
-    mov 12(%esp), %ebx
+    mov 8(%esp), %ebx
     shl $2, %ebx
-    mov 16(%esp), %ecx
+    mov 12(%esp), %ecx
     or %ecx, %ecx           # NB 0 = RDONLY
     jz 1f
     mov $WRONLY, %ecx        
@@ -148,9 +140,8 @@ _\name :
     call scstr
     int $0x80
     movb $0xff, (%edi)
-    pop %ebx
+    mov %eax, %ebx
     pop %ecx
-    push %eax
     jmp *(%ecx)
 
 #
@@ -161,17 +152,15 @@ _\name :
 #
     mkncall creat
     push %ecx
-    push %ebx
     mov $SYSCREAT, %eax
-    mov 12(%esp), %ebx
+    mov 8(%esp), %ebx
     shl $2, %ebx
     call scstr
-    mov 16(%esp), %ecx
+    mov 12(%esp), %ecx
     int $0x80
     movb $0xff, (%edi)
-    pop %ebx
+    mov %eax, %ebx
     pop %ecx
-    push %eax
     jmp *(%ecx)
 
 #
@@ -180,12 +169,10 @@ _\name :
 # number on failure.
 #
     mkncall close
-    push %ebx
     mov $SYSCLOSE, %eax
-    mov 8(%esp), %ebx
+    mov 4(%esp), %ebx
     int $0x80
-    pop %ebx
-    push %eax
+    mov %eax, %ebx
     jmp *(%ecx)
 
 #
@@ -195,16 +182,14 @@ _\name :
 #
     mkncall read
     push %ecx
-    push %ebx
     mov $SYSREAD, %eax
-    mov 12(%esp), %ebx
-    mov 16(%esp), %ecx
+    mov 8(%esp), %ebx
+    mov 12(%esp), %ecx
     shl $2, %ecx
-    mov 20(%esp), %edx
+    mov 16(%esp), %edx
     int $0x80
-    pop %ebx
+    mov %eax, %ebx
     pop %ecx
-    push %eax
     jmp *(%ecx)
 
 #
@@ -218,15 +203,13 @@ _\name :
 #
     mkncall seek
     push %ecx
-    push %edx
     mov $SYSSEEK, %eax
-    mov 12(%esp), %ebx
-    mov 16(%esp), %ecx
-    mov 20(%esp), %edx
+    mov 8(%esp), %ebx
+    mov 12(%esp), %ecx
+    mov 16(%esp), %edx
     int $0x80
-    pop %ebx
+    mov %eax, %ebx
     pop %ecx
-    push %eax
     jmp *(%ecx)
 
 #
@@ -236,16 +219,14 @@ _\name :
 #
     mkncall write
     push %ecx
-    push %ebx
     mov $SYSWRITE, %eax
-    mov 12(%esp), %ebx
-    mov 16(%esp), %ecx
+    mov 8(%esp), %ebx
+    mov 12(%esp), %ecx
     shl $2, %ecx
-    mov 20(%esp), %edx
+    mov 16(%esp), %edx
     int $0x80
-    pop %ebx
+    mov %eax, %ebx
     pop %ecx
-    push %eax
     jmp *(%ecx)
 
 #
@@ -254,15 +235,13 @@ _\name :
 # or a negative number on error.
 #
     mkncall chdir
-    push %ebx
     mov $SYSCHDIR, %eax
-    mov 8(%esp), %ebx
+    mov 4(%esp), %ebx
     shl $2, %ebx
     call scstr
     int $0x80
     movb $0xff, (%edi)
-    pop %ebx
-    push %eax
+    mov %eax, %ebx
     jmp *(%ecx)
 
 #
@@ -271,18 +250,16 @@ _\name :
 # negative numer on failure
 #
     mkncall chmod
-    push %ebx
     push %ecx
     mov $SYSCHMOD, %eax
-    mov 12(%esp), %ebx
-    mov 16(%esp), %ecx
+    mov 8(%esp), %ebx
+    mov 12(%esp), %ecx
     shl $2, %ebx
     call scstr
     int $0x80
     movb $0xff, (%edi)
+    mov %eax, %ebx
     pop %ecx
-    pop %ebx
-    push %eax
     jmp *(%ecx)
 
 #
@@ -291,20 +268,18 @@ _\name :
 # return negative on failure.
 #
     mkncall chown
-    push %ebx
     push %ecx
     mov $SYSCHOWN, %eax
-    mov 12(%esp), %ebx
-    mov 16(%esp), %ecx
+    mov 8(%esp), %ebx
+    mov 12(%esp), %ecx
     shl $2, %ebx
     call scstr
-    movb $0xff, (%edi)
     mov $-1, %edx       # lchown expects a gid_t in EDX; -1 
                         # means ignore it.
     int $0x80
+    movb $0xff, (%edi)
+    mov %eax, %ebx
     pop %ecx
-    pop %ebx
-    push %eax
     jmp *(%ecx)
 
 #
@@ -316,7 +291,7 @@ _\name :
     mkncall fork
     mov $SYSFORK, %eax
     int $0x80
-    push %eax
+    mov %eax, %ebx
     jmp *(%ecx)
 
 #
@@ -326,15 +301,13 @@ _\name :
 #
     mkncall wait
     push %ecx
-    push %ebx
     mov $SYSWAIT, %eax
     mov $-1, %ebx       # -1 - wait for any child
     xor %ecx, %ecx      # NULL for status pointer
     xor %edx, %edx      # no option flags
     int $0x80
-    pop %ebx
+    mov %eax, %ebx
     pop %ecx
-    push %eax
     jmp *(%ecx)
 
 #
@@ -344,7 +317,7 @@ _\name :
     mkncall getuid
     mov $SYSGETUID, %eax
     int $0x80
-    push %eax
+    mov %eax, %ebx
     jmp *(%ecx)
 
 #
@@ -353,11 +326,10 @@ _\name :
 # on error.
 #
     mkncall link
-    push %ebx
     push %ecx
     mov $SYSLINK, %eax
-    mov 12(%esp), %ebx
-    mov 16(%esp), %ecx
+    mov 8(%esp), %ebx
+    mov 12(%esp), %ecx
     shl $2, %ebx
     shl $2, %ecx
     call scstr
@@ -370,9 +342,8 @@ _\name :
     movb $0xff, (%edi)
     pop %edi
     movb $0xff, (%edi)
+    mov %eax, %ebx
     pop %ecx
-    pop %ebx
-    push %eax
     jmp *(%ecx)
 
 #
@@ -380,15 +351,13 @@ _\name :
 # remove the given link. returns a negative number on failure.
 #
     mkncall unlink
-    push %ebx
     mov $SYSUNLINK, %eax
-    mov 8(%esp), %ebx
+    mov 4(%esp), %ebx
     shl $2, %ebx
     call scstr
     int $0x80
     movb $0xff, (%edi)
-    pop %ebx
-    push %eax
+    mov %eax, %ebx
     jmp *(%ecx)
 
 #
@@ -398,17 +367,15 @@ _\name :
 #
     mkncall mkdir
     push %ecx
-    push %ebx
     mov $SYSMKDIR, %eax
-    mov 12(%esp), %ebx
+    mov 8(%esp), %ebx
     shl $2, %ebx
     call scstr
-    mov 16(%esp), %ecx
+    mov 12(%esp), %ecx
     int $0x80
     movb $0xff, (%edi)
-    pop %ebx
+    mov %eax, %ebx
     pop %ecx
-    push %eax
     jmp *(%ecx)
 
 #
@@ -416,12 +383,10 @@ _\name :
 # sets the process uid to 'uid'. returns a negative number of failure.
 #
     mkncall setuid 
-    push %ebx
     mov $SYSSETUID, %eax
-    mov 8(%esp), %ebx
+    mov 4(%esp), %ebx
     int $0x80
-    pop %ebx
-    push %eax
+    mov %eax, %ebx
     jmp *(%ecx)
 
 
@@ -435,7 +400,6 @@ _\name :
     push %ebp
     mov %esp, %ebp
     push %ecx
-    push %ebx
 
     # walk the stack, converting the pointers to native addresses
     # and fixing end of string markers
@@ -471,10 +435,9 @@ _\name :
     movb $0xff, (%edi)
     jmp 1b
 2:
-    pop %ebx
     pop %ecx
     pop %ebp
-    push %eax
+    mov %eax, %ebx
     jmp *(%ecx)
 
 #
@@ -485,7 +448,6 @@ _\name :
     push %ebp
     mov %esp, %ebp
     push %ecx
-    push %ebx
 
     movl 12(%ebp), %esi         # esi -> base of vector
     shl $2, %esi                # ptr to address
@@ -522,11 +484,10 @@ _\name :
     pop %edi
     movb $0xff, (%edi)
     jmp 2b
-1:  leal -8(%ebp), %esp
-    pop %ebx
+1:  leal -4(%ebp), %esp
     pop %ecx
     pop %ebp
-    push %eax
+    mov %eax, %ebx
     jmp *(%ecx)
 
 
@@ -536,14 +497,49 @@ _\name :
 #
 
     mkncall gtty
-    push $-1
+    mov $-1, %ebx
     jmp *(%ecx)
 
     mkncall stty
-    push $-1
+    mov $-1, %ebx
     jmp *(%ecx)
 
 
+#
+# Write out the profiling counters, if the program was built with
+# -fprofile-generate. bprof.out is a straight copy of the .bprof
+# section, which the linker script brackets with prof0 and profn.
+#
+    .text
+    .local profdump
+profdump:
+    mov $profn, %esi
+    sub $prof0, %esi    # bytes of counters
+    jz 1f               # not profiling
+
+    mov $SYSCREAT, %eax
+    mov $profnam, %ebx
+    mov $0644, %ecx
+    int $0x80
+    or %eax, %eax
+    js 1f
+
+    mov %eax, %ebx      # fd
+    mov $SYSWRITE, %eax
+    mov $prof0, %ecx
+    mov %esi, %edx
+    int $0x80
+
+    mov $SYSCLOSE, %eax
+    int $0x80
+1:
+    ret
+
+    .data
+profnam:
+    .asciz "bprof.out"
+    .text
+
 #
 # Convert B strings to nul-terminated strings (temporarily) for 
 # system calls. Takes the original pointer in ebx; returns
@@ -0,0 +1,376 @@
+#
+# B token threaded opcodes
+#
+
+################################################################################
+#
+# With ba -m token, a function's code is a string of one byte opcodes,
+# each followed by its operands, in the .tcode section. This is a
+# fraction of the size of threaded code, at the cost of a table lookup
+# for each op.
+#
+# Register usage
+#
+# EDI - Instruction pointer into the current function's code. Each handler
+#       fetches its operands, advancing EDI past them, and ends by
+#       dispatching the next op through ttab.
+#
+# ECX - The first operand of the op. Calls and returns use ECX just as
+#       threaded code does, so token threaded functions call and are
+#       called through the usual CALL, ENTER and RET.
+#
+# EAX - The opcode on entry to a handler, and the second operand of
+#       the op if it has one.
+#
+# EBX, EBP and the stack are used just as in blib.s.
+#
+# Operands
+#
+#   Numbers (constants and frame or stack offsets) are a signed byte for
+#   an op, and a word for its long form, whose name ends in L. Addresses
+#   are always a word. Branch targets are a 16 bit offset from the end of
+#   the operand. A call is followed by a word aligned return address,
+#   which holds the address of TRESUME just as a threaded return address
+#   holds the next op.
+#
+# The opcodes are the global absolute symbols tNAME, which ba refers to
+# by name, so the numbering is private to this file.
+#
+
+    .set ntok, 0
+
+    .section .rodata
+    .align 4
+ttab:
+
+    .text
+
+#
+# start the handler for the next opcode
+#
+    .macro tok name
+    .global t\name
+    .set t\name, ntok
+    .set ntok, ntok + 1
+    .pushsection .rodata
+    .int x\name
+    .popsection
+x\name :
+    .endm
+
+#
+# dispatch the op at EDI
+#
+    .macro next
+    movzbl (%edi), %eax
+    inc %edi
+    jmp *ttab(,%eax,4)
+    .endm
+
+#
+# fetch an operand of 'len' bytes into 'reg'
+#
+    .macro fetch len, reg
+    .if \len == 1
+    movsbl (%edi), \reg
+    inc %edi
+    .else
+    mov (%edi), \reg
+    add $\len, %edi
+    .endif
+    .endm
+
+#
+# make an op with a numeric operand in ECX, and its long form
+#
+    .macro mkn name, body
+    tok \name
+    fetch 1, %ecx
+    \body
+    next
+    tok \name\()L
+    fetch 4, %ecx
+    \body
+    next
+    .endm
+
+#
+# make an op with no operands, or only word operands fetched by 'body'
+#
+    .macro mk name, body
+    tok \name
+    \body
+    next
+    .endm
+
+################################################################################
+#
+# function calls
+#
+
+#
+# Entered through a function's entry word. ECX is the address of the
+# word, which is followed by the address of the function's code.
+#
+    .global TSTART
+TSTART:
+    mov 4(%ecx), %edi
+    next
+
+#
+# A return lands here, with ECX pointing at the return address word
+# that follows the call.
+#
+    .global TRESUME
+TRESUME:
+    lea 4(%ecx), %edi
+    next
+
+#
+# call the function whose entry word is at eax
+#
+    .macro tcall
+    lea 3(%edi), %ecx
+    and $-4, %ecx       # -> return address
+    push %ecx
+    mov %eax, %ecx      # %ecx is function entry
+    jmp *(%ecx)
+    .endm
+
+    tok CALL
+    pop %eax            # shifted entry address
+    shl $2, %eax
+    tcall
+
+#
+# call the function whose pointer is at the given offset into the stack
+#
+    .macro tcalln name, len
+    tok \name
+    fetch \len, %ecx
+    mov (%esp,%ecx), %eax
+    shl $2, %eax        # -> function
+    mov (%eax), %eax    # shifted entry address
+    shl $2, %eax
+    tcall
+    .endm
+
+    tcalln CALLN, 1
+    tcalln CALLNL, 4
+
+    mkn ENTER, "push %ebp; mov %esp, %ebp; sub %ecx, %esp"
+    mk LEAVE, "mov %ebp, %esp; pop %ebp"
+
+    tok RET
+    pop %ecx            # return address
+    jmp *(%ecx)         # continue back in caller
+
+    mkn AVINIT, "lea 4(%ebp,%ecx), %edx; shr $2, %edx; mov %edx, (%ebp,%ecx)"
+
+################################################################################
+#
+# control transfer
+#
+
+#
+# take the branch if 'cc', else step past the target
+#
+    .macro brif cc
+    j\cc 1f
+    add $2, %edi
+    next
+1:
+    movswl (%edi), %eax
+    lea 2(%edi,%eax), %edi
+    next
+    .endm
+
+    tok JMP
+    movswl (%edi), %eax
+    lea 2(%edi,%eax), %edi
+    next
+
+    tok BZ
+    pop %eax
+    test %eax, %eax
+    brif z
+
+    tok BNZ
+    pop %eax
+    test %eax, %eax
+    brif nz
+
+    .macro mkbr name, cc
+    tok \name
+    pop %eax
+    pop %edx
+    cmp %eax, %edx
+    brif \cc
+    .endm
+
+    mkbr BEQ, e
+    mkbr BNE, ne
+    mkbr BLE, le
+    mkbr BLT, l
+    mkbr BGE, ge
+    mkbr BGT, g
+
+#
+# a0 [CASE c, target]: branch and pop a0 if a0 == c
+#
+    tok CASE
+    fetch 4, %eax
+    cmp %eax, (%esp)
+    je 1f
+    add $2, %edi
+    next
+1:
+    add $4, %esp
+    movswl (%edi), %eax
+    lea 2(%edi,%eax), %edi
+    next
+
+################################################################################
+#
+# stack and memory
+#
+
+    mkn PSHCON, "push %ecx"
+    mk PSHSYM, "fetch 4, %eax; shr $2, %eax; push %eax"
+    mkn PSHAUTO, "lea (%ebp,%ecx), %eax; shr $2, %eax; push %eax"
+    mk DEREF, "pop %edx; push (,%edx,4)"
+    mk STORE, "pop %eax; pop %edx; mov %eax, (,%edx,4)"
+    mk ROT, "pop %eax; pop %edx; pop %esi; push %eax; push %esi; push %edx"
+    mk PUSHT, "push %ebx"
+    mk POPT, "pop %ebx"
+    mk DUP, "push (%esp)"
+    mkn DUPN, "push (%esp,%ecx)"
+    mk POP, "add $4, %esp"
+    mkn POPN, "add %ecx, %esp"
+    mk PROF, "fetch 4, %eax; incl (%eax)"
+    mk LDX, "pop %eax; pop %edx; add %eax, %edx; push (,%edx,4)"
+    mk STX, "pop %eax; pop %edx; add (%esp), %edx; mov %eax, (,%edx,4); mov %eax, (%esp)"
+
+################################################################################
+#
+# in-place update
+#
+
+#
+# find the address to update in edx, for an extrn (S), an auto (A)
+# or a vector element (X)
+#
+    .macro tvS len
+    fetch 4, %edx
+    .endm
+
+    .macro tvA len
+    fetch \len, %ecx
+    lea (%ebp,%ecx), %edx
+    .endm
+
+    .macro tvX len
+    pop %edx            # index
+    pop %esi            # shifted pointer
+    add %esi, %edx
+    shl $2, %edx        # address of the element
+    .endm
+
+#
+# make an update op for the addressing mode 'lv', with an operand
+# of 'len' bytes; 'rv' is non-blank if it pops a right hand side
+# into eax first
+#
+    .macro mkrmw name, rv, lv, len, body
+    tok \name
+    .ifnb \rv
+    pop %eax            # right hand side
+    .endif
+    \lv \len
+    \body
+    next
+    .endm
+
+    .macro mkinc mode, lv, len
+    mkrmw INC\mode, , \lv, \len, "incl (%edx)"
+    mkrmw DEC\mode, , \lv, \len, "decl (%edx)"
+    mkrmw PREINC\mode, , \lv, \len, "incl (%edx); push (%edx)"
+    mkrmw PREDEC\mode, , \lv, \len, "decl (%edx); push (%edx)"
+    mkrmw POSTINC\mode, , \lv, \len, "push (%edx); incl (%edx)"
+    mkrmw POSTDEC\mode, , \lv, \len, "push (%edx); decl (%edx)"
+    .endm
+
+    .macro mkasn mode, lv, len
+    mkrmw ADDTO\mode, rv, \lv, \len, "add %eax, (%edx); push (%edx)"
+    mkrmw SUBTO\mode, rv, \lv, \len, "sub %eax, (%edx); push (%edx)"
+    mkrmw ANDTO\mode, rv, \lv, \len, "and %eax, (%edx); push (%edx)"
+    mkrmw ORTO\mode, rv, \lv, \len, "or %eax, (%edx); push (%edx)"
+    mkrmw ADDTOP\mode, rv, \lv, \len, "add %eax, (%edx)"
+    mkrmw SUBTOP\mode, rv, \lv, \len, "sub %eax, (%edx)"
+    mkrmw ANDTOP\mode, rv, \lv, \len, "and %eax, (%edx)"
+    mkrmw ORTOP\mode, rv, \lv, \len, "or %eax, (%edx)"
+    .endm
+
+    mkinc S, tvS, 4
+    mkinc A, tvA, 1
+    mkinc AL, tvA, 4
+    mkinc X, tvX, 0
+    mkasn S, tvS, 4
+    mkasn A, tvA, 1
+    mkasn AL, tvA, 4
+    mkasn X, tvX, 0
+
+################################################################################
+#
+# math
+#
+
+    mk ADD, "pop %eax; add %eax, (%esp)"
+    mk SUB, "pop %eax; sub %eax, (%esp)"
+    mk NEG, "negl (%esp)"
+    mk NOT, "pop %eax; push $0; test %eax, %eax; setz (%esp)"
+    mk SHR, "pop %ecx; shrl %cl, (%esp)"
+    mk SHL, "pop %ecx; shll %cl, (%esp)"
+    mk AND, "pop %eax; and %eax, (%esp)"
+    mk OR, "pop %eax; or %eax, (%esp)"
+    mk DIV, "pop %esi; pop %eax; cltd; idiv %esi; push %eax"
+    mk MOD, "pop %esi; pop %eax; cltd; idiv %esi; push %edx"
+    mk MUL, "pop %eax; imul (%esp), %eax; mov %eax, (%esp)"
+
+#
+# a1 a0 [op] (a1 op a0)
+#
+    .macro mkcmp name, cc
+    mk \name, "pop %eax; pop %edx; push $0; cmp %eax, %edx; set\cc (%esp)"
+    .endm
+
+    mkcmp EQ, e
+    mkcmp NE, ne
+    mkcmp LT, l
+    mkcmp LE, le
+    mkcmp GT, g
+    mkcmp GE, ge
+
+################################################################################
+#
+# superinstructions; see superopt in ba.c
+#
+
+    mkn LDAUTO, "push (%ebp,%ecx)"
+    mk LDSYM, "fetch 4, %eax; push (%eax)"
+    mkn ADDCON, "add %ecx, (%esp)"
+    mkn SUBCON, "sub %ecx, (%esp)"
+    mkn MULCON, "imul (%esp), %ecx; mov %ecx, (%esp)"
+    mkn MODCON, "pop %eax; cltd; idiv %ecx; push %edx"
+    mk ASSIGN, "pop %eax; pop %edx; mov %eax, (,%edx,4); push %eax"
+    mkn LDXA, "pop %edx; add (%ebp,%ecx), %edx; push (,%edx,4)"
+    mkn LDXC, "pop %edx; add %ecx, %edx; push (,%edx,4)"
+    mk STXP, "pop %eax; pop %edx; pop %esi; add %esi, %edx; mov %eax, (,%edx,4)"
+
+#
+# the frame offset of the index is the last operand, in EAX
+#
+    mk LDXAA, "fetch 1, %ecx; fetch 1, %eax; mov (%ebp,%ecx), %edx; add (%ebp,%eax), %edx; push (,%edx,4)"
+    mk LDXAAL, "fetch 4, %ecx; fetch 4, %eax; mov (%ebp,%ecx), %edx; add (%ebp,%eax), %edx; push (,%edx,4)"
+    mk LDXSA, "fetch 4, %ecx; fetch 1, %eax; mov (%ecx), %edx; add (%ebp,%eax), %edx; push (,%edx,4)"
+    mk LDXSAL, "fetch 4, %ecx; fetch 4, %eax; mov (%ecx), %edx; add (%ebp,%eax), %edx; push (,%edx,4)"
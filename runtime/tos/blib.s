@@ -0,0 +1,755 @@
+#
+# B threaded opcodes, keeping the top of the stack in a register
+#
+
+################################################################################
+#
+# This is a variant of blib.s in which the top of the operand stack is
+# kept in EAX rather than in memory, which saves most of the stack
+# traffic of expression evaluation: ADD is a pop and an add rather than
+# two pops, an add and a push. It runs the same threaded code, and is
+# linked in place of blib.s by b -t i386-tos.
+#
+# Register usage
+#
+# EAX - The top of the stack (a0). The rest of the stack is in memory, so
+#       (%esp) is a1. When the stack is empty, EAX holds whatever was last
+#       popped, and pushing writes it to memory as a dummy entry, which is
+#       popped again before the stack is next empty.
+#
+# ECX, EBX and EBP are used as in blib.s. EDX, ESI and EDI are scratch.
+#
+# Function calls
+#
+#   CALL takes the function from EAX, leaving the arguments in memory,
+#   so the frame is laid out just as for blib.s. RET pops the entry
+#   below the arguments back into EAX. Native code entered through
+#   NCALL therefore sees its arguments where it expects them, and may
+#   use EAX freely, so b0.s, bsys.s and bstr.s are shared with blib.s.
+#
+
+    .text
+
+
+################################################################################
+#
+# function calls
+#
+
+#
+# Call the function whose (shifted) address is in EAX
+#
+    .global CALL
+CALL:
+    add $4, %ecx        # past the instruction
+    shl $2, %eax        # %eax to address
+    push %ecx           # return address
+    mov %eax, %ecx      # %ecx is function entry
+    jmp *(%ecx)
+
+#
+# Set the stack frame at the start of a function, as in blib.s.
+#
+    .global ENTER
+ENTER:
+    push %ebp           # set up
+    mov %esp, %ebp      # stack frame
+    add $4, %ecx
+    subl (%ecx), %esp   # allocate space
+    add $4, %ecx
+    jmp *(%ecx)
+
+#
+# Leave a function: restore the stack and frame pointer to their values
+# at original invocation.
+#
+    .global LEAVE
+LEAVE:
+    mov %ebp, %esp      # clean up autos from stack
+    pop %ebp            # restore previous frame ptr
+    add $4, %ecx
+    jmp *(%ecx)
+
+#
+# Return from a function. The return address is on top of the stack,
+# and the caller's top of stack is below it.
+#
+    .global RET
+RET:
+    pop %ecx            # return address
+    pop %eax            # caller's top of stack
+    jmp *(%ecx)         # continue back in caller
+
+#
+# Initialize the base address of a vector on the stack
+#
+    .global AVINIT
+AVINIT:
+    mov 4(%ecx), %edx   # stack offset of base of vector
+    add %ebp, %edx      # edx -> vector pointer
+    leal 4(%edx), %esi  # esi -> base of vector
+    shr $2, %esi        # esi is adjusted pointer
+    mov %esi, (%edx)    # save adjusted vector
+    add $8, %ecx
+    jmp *(%ecx)
+
+################################################################################
+#
+# control transfer
+#
+
+#
+# jump to the argument
+#
+    .global JMP
+JMP:
+    mov 4(%ecx), %ecx   # jump
+    jmp *(%ecx)
+
+#
+# branch if the top of the stack is zero
+#
+    .global BZ
+BZ:
+    mov 4(%ecx), %edx   # jump target
+    add $8, %ecx
+    test %eax, %eax     # is condition zero?
+    pop %eax
+    jnz 1f              # nope
+    mov %edx, %ecx      # yes, jump to target
+1:
+    jmp *(%ecx)
+
+#
+# branch if the top of the stack is not zero
+#
+    .global BNZ
+BNZ:
+    mov 4(%ecx), %edx   # jump target
+    add $8, %ecx
+    test %eax, %eax     # is condition zero?
+    pop %eax
+    jz 1f               # yes
+    mov %edx, %ecx      # nope, jump to target
+1:
+    jmp *(%ecx)
+
+#
+# compare and branch. a1 a0 [Bcc] branches to the argument if
+# a1 cc a0, popping both. the macro is given the inverse of cc,
+# the condition for falling through.
+#
+    .macro mkbr name, ncc
+    .global \name
+\name :
+    add $8, %ecx        # past the instruction
+    pop %edx            # a1
+    cmp %eax, %edx
+    pop %eax
+    j\ncc 1f            # condition doesn't hold
+    mov -4(%ecx), %ecx  # jump to target
+1:
+    jmp *(%ecx)
+    .endm
+
+    mkbr BEQ, ne
+    mkbr BNE, e
+    mkbr BLE, g
+    mkbr BLT, ge
+    mkbr BGE, l
+    mkbr BGT, le
+
+#
+# case statement
+#
+    .global CASE
+CASE:
+    cmp 4(%ecx), %eax   # disc is on top of stack
+    je 1f               # a match!
+    add $12, %ecx       # skip args
+    jmp *(%ecx)         # and keep going
+1:
+    mov 8(%ecx), %ecx   # new instruction ptr
+    pop %eax            # pop disc off stack
+    jmp *(%ecx)
+
+################################################################################
+#
+# stack manipulation
+#
+
+#
+# Push the constant in the arguments on the stack.
+#
+    .global PSHCON
+PSHCON:
+    push %eax
+    mov 4(%ecx), %eax
+    add $8, %ecx
+    jmp *(%ecx)
+
+#
+# Push the EXTRN onto the stack, shifted into a pointer
+#
+    .global PSHSYM
+PSHSYM:
+    push %eax
+    movl 4(%ecx), %eax
+    shr $2, %eax        # address to object index
+    add $8, %ecx
+    jmp *(%ecx)
+
+#
+# Push the lvalue of the given auto variable or argument
+# onto the stack
+#
+    .global PSHAUTO
+PSHAUTO:
+    push %eax
+    movl 4(%ecx), %eax
+    add %ebp, %eax
+    shr $2, %eax
+    add $8, %ecx
+    jmp *(%ecx)
+
+#
+# dereference the (shifted) address on the stack
+#
+    .global DEREF
+DEREF:
+    mov (,%eax,4), %eax # the pointed-to word
+    add $4, %ecx
+    jmp *(%ecx)
+
+#
+# store a value into memory. top of stack is value,
+# second on stack is address.
+#
+    .global STORE
+STORE:
+    pop %edx            # pointer
+    movl %eax, (,%edx,4)
+    pop %eax
+    add $4, %ecx
+    jmp *(%ecx)
+
+#
+# rotate the top three elements on the stack such
+# that
+# a2 a1 a0 [ROT] a0 a2 a1
+#
+    .global ROT
+ROT:
+    mov 4(%esp), %edx   # a2
+    mov %eax, 4(%esp)   # a0
+    mov (%esp), %eax    # a1
+    mov %edx, (%esp)    # a2
+    add $4, %ecx
+    jmp *(%ecx)
+
+#
+# Indexed load.
+# a1 a0 [LDX] mem[a1+a0]
+#
+    .global LDX
+LDX:
+    pop %edx            # shifted pointer
+    add %edx, %eax
+    mov (,%eax,4), %eax
+    add $4, %ecx
+    jmp *(%ecx)
+
+#
+# Indexed store. leaves the stored value on the stack.
+# a2 a1 a0 [STX] a0, with mem[a2+a1] = a0
+#
+    .global STX
+STX:
+    pop %edx            # index
+    pop %esi            # shifted pointer
+    add %esi, %edx
+    movl %eax, (,%edx,4)
+    add $4, %ecx
+    jmp *(%ecx)
+
+#
+# Pushes the temporary register onto the stack.
+#
+    .global PUSHT
+PUSHT:
+    push %eax
+    mov %ebx, %eax
+    add $4, %ecx
+    jmp *(%ecx)
+
+#
+# Pops the stack into the temporary register.
+#
+    .global POPT
+POPT:
+    mov %eax, %ebx
+    pop %eax
+    add $4, %ecx
+    jmp *(%ecx)
+
+#
+# Duplicates the top object on the stack
+#
+    .global DUP
+DUP:
+    push %eax
+    add $4, %ecx
+    jmp *(%ecx)
+
+#
+# Duplicates the stack object at an offset given by the
+# argument, which must be aligned. Once a0 is in memory, the
+# offset is from the stack pointer as in blib.s.
+#
+    .global DUPN
+DUPN:
+    push %eax
+    mov 4(%ecx), %edx
+    mov (%esp,%edx), %eax
+    add $8, %ecx
+    jmp *(%ecx)
+
+#
+# pop one thing off the stack
+#
+    .global POP
+POP:
+    pop %eax
+    add $4, %ecx
+    jmp *(%ecx)
+
+#
+# pop 'n' things off the stack
+#
+    .global POPN
+POPN:
+    push %eax
+    add 4(%ecx), %esp   # do the pop
+    pop %eax
+    add $8, %ecx        # past the argument
+    jmp *(%ecx)
+
+#
+# TODO this is a compiler placeholder and shouldn't be
+# emitted
+#
+    .global NAMDEF
+NAMDEF:
+    add $4, %ecx        # past the instruction
+    jmp *(%ecx)
+
+#
+# bump the profiling counter at the address in the argument. this
+# is only emitted with -fprofile-generate.
+#
+    .global PROF
+PROF:
+    mov 4(%ecx), %edx   # -> counter
+    incl (%edx)
+    add $8, %ecx
+    jmp *(%ecx)
+
+#
+# native call, as in blib.s. this is only used at the start of a
+# function, so EAX is free for the native code.
+#
+    .global NCALL
+NCALL:
+    push 4(%ecx)        # entry to function
+    add $8, %ecx        # past argument
+    ret
+
+################################################################################
+#
+# in-place update
+#
+# as in blib.s. the right hand side, if any, is moved to esi and the
+# address to update found in edx. the result, if any, is left in edi
+# and replaces the operands on the stack.
+#
+
+    .macro lvS rv
+    mov 4(%ecx), %edx   # address of the extrn
+    .endm
+
+    .macro lvA rv
+    mov 4(%ecx), %edx   # frame offset
+    add %ebp, %edx
+    .endm
+
+    .macro lvX rv
+    .ifb \rv
+    pop %edx            # shifted pointer
+    add %eax, %edx      # + index
+    .else
+    pop %edx            # index
+    pop %eax            # shifted pointer
+    add %eax, %edx
+    .endif
+    shl $2, %edx        # address of the element
+    .endm
+
+#
+# make an update op. 'rv' is non-blank if the op takes a right hand
+# side; 'lv' computes the address to update into edx; 'len' is the
+# length of the instruction; 'body' does the update, and 'res' is
+# non-blank if it leaves a result. 'x' is non-blank for the vector
+# element mode.
+#
+    .macro mkrmw name, rv, lv, len, body, res, x
+    .global \name
+\name :
+    .ifnb \rv
+    mov %eax, %esi      # right hand side
+    .endif
+    \lv \rv
+    \body
+    .ifnb \res
+    .ifb \rv\x
+    push %eax           # nothing was popped
+    .endif
+    mov %edi, %eax
+    .else
+    .ifnb \rv\x
+    pop %eax            # the operands are gone
+    .endif
+    .endif
+    add $\len, %ecx
+    jmp *(%ecx)
+    .endm
+
+    .macro mkinc mode, lv, len, x
+    mkrmw INC\mode, , \lv, \len, "incl (%edx)", , \x
+    mkrmw DEC\mode, , \lv, \len, "decl (%edx)", , \x
+    mkrmw PREINC\mode, , \lv, \len, "incl (%edx); mov (%edx), %edi", res, \x
+    mkrmw PREDEC\mode, , \lv, \len, "decl (%edx); mov (%edx), %edi", res, \x
+    mkrmw POSTINC\mode, , \lv, \len, "mov (%edx), %edi; incl (%edx)", res, \x
+    mkrmw POSTDEC\mode, , \lv, \len, "mov (%edx), %edi; decl (%edx)", res, \x
+    .endm
+
+    .macro mkasn mode, lv, len, x
+    mkrmw ADDTO\mode, rv, \lv, \len, "add %esi, (%edx); mov (%edx), %edi", res, \x
+    mkrmw SUBTO\mode, rv, \lv, \len, "sub %esi, (%edx); mov (%edx), %edi", res, \x
+    mkrmw ANDTO\mode, rv, \lv, \len, "and %esi, (%edx); mov (%edx), %edi", res, \x
+    mkrmw ORTO\mode, rv, \lv, \len, "or %esi, (%edx); mov (%edx), %edi", res, \x
+    mkrmw ADDTOP\mode, rv, \lv, \len, "add %esi, (%edx)", , \x
+    mkrmw SUBTOP\mode, rv, \lv, \len, "sub %esi, (%edx)", , \x
+    mkrmw ANDTOP\mode, rv, \lv, \len, "and %esi, (%edx)", , \x
+    mkrmw ORTOP\mode, rv, \lv, \len, "or %esi, (%edx)", , \x
+    .endm
+
+    mkinc S, lvS, 8
+    mkinc A, lvA, 8
+    mkinc X, lvX, 4, x
+    mkasn S, lvS, 8
+    mkasn A, lvA, 8
+    mkasn X, lvX, 4, x
+
+################################################################################
+#
+# math
+#
+
+#
+# a1 a0 [ADD] a1+a0
+#
+    .global ADD
+ADD:
+    pop %edx            # lhs
+    add %edx, %eax
+    add $4, %ecx
+    jmp *(%ecx)
+
+#
+# a1 a0 [SUB] a1-a0
+#
+    .global SUB
+SUB:
+    pop %edx            # lhs
+    sub %eax, %edx
+    mov %edx, %eax
+    add $4, %ecx
+    jmp *(%ecx)
+
+#
+# a0 [NEG] -a0
+#
+    .global NEG
+NEG:
+    neg %eax
+    add $4, %ecx
+    jmp *(%ecx)
+
+#
+# a0 [NOT] !a0
+#
+    .global NOT
+NOT:
+    test %eax, %eax
+    setz %al
+    movzbl %al, %eax
+    add $4, %ecx
+    jmp *(%ecx)
+
+#
+# a1 a0 [SHR] a1>>a0
+#
+    .global SHR
+SHR:
+    mov %ecx, %edi
+    mov %eax, %ecx      # shift must be in cl
+    pop %eax            # lhs
+    shr %cl, %eax
+    leal 4(%edi), %ecx
+    jmp *(%ecx)
+
+#
+# a1 a0 [SHL] a1<<a0
+#
+    .global SHL
+SHL:
+    mov %ecx, %edi
+    mov %eax, %ecx      # shift must be in cl
+    pop %eax            # lhs
+    shl %cl, %eax
+    leal 4(%edi), %ecx
+    jmp *(%ecx)
+
+#
+# a1 a0 [AND] a1&a0
+#
+    .global AND
+AND:
+    pop %edx
+    and %edx, %eax
+    add $4, %ecx
+    jmp *(%ecx)
+
+#
+# a1 a0 [OR] a1|a0
+#
+    .global OR
+OR:
+    pop %edx
+    or %edx, %eax
+    add $4, %ecx
+    jmp *(%ecx)
+
+#
+# a1 a0 [DIV] a1/a0
+#
+# IDIV xxx: EDX:EAX / xxx => EAX (rem EDX)
+#
+    .global DIV
+DIV:
+    mov %eax, %esi      # rhs
+    pop %eax            # lhs
+    cltd
+    idiv %esi
+    add $4, %ecx
+    jmp *(%ecx)
+
+#
+# a1 a0 [MOD] a1%a0
+#
+    .global MOD
+MOD:
+    mov %eax, %esi      # rhs
+    pop %eax            # lhs
+    cltd
+    idiv %esi
+    mov %edx, %eax
+    add $4, %ecx
+    jmp *(%ecx)
+
+#
+# a1 a0 [MUL] a1*a0
+#
+    .global MUL
+MUL:
+    pop %edx
+    imul %edx, %eax
+    add $4, %ecx
+    jmp *(%ecx)
+
+#
+# a1 a0 [op] a1 op a0 ? 1 : 0
+#
+    .macro mkcmp name, cc
+    .global \name
+\name :
+    pop %edx            # a1
+    cmp %eax, %edx
+    set\cc %al
+    movzbl %al, %eax
+    add $4, %ecx
+    jmp *(%ecx)
+    .endm
+
+    mkcmp EQ, e
+    mkcmp NE, ne
+    mkcmp LT, l
+    mkcmp LE, le
+    mkcmp GT, g
+    mkcmp GE, ge
+
+################################################################################
+#
+# superinstructions. see superopt in ba.c for the runs each one
+# replaces.
+#
+
+#
+# Push the value of the given auto variable or argument
+#
+    .global LDAUTO
+LDAUTO:
+    push %eax
+    mov 4(%ecx), %edx   # frame offset
+    mov (%ebp,%edx), %eax
+    add $8, %ecx
+    jmp *(%ecx)
+
+#
+# Push the value of the EXTRN
+#
+    .global LDSYM
+LDSYM:
+    push %eax
+    mov 4(%ecx), %edx   # address of the extrn
+    mov (%edx), %eax
+    add $8, %ecx
+    jmp *(%ecx)
+
+#
+# a0 [ADDCON c] a0+c
+#
+    .global ADDCON
+ADDCON:
+    add 4(%ecx), %eax
+    add $8, %ecx
+    jmp *(%ecx)
+
+#
+# a0 [SUBCON c] a0-c
+#
+    .global SUBCON
+SUBCON:
+    sub 4(%ecx), %eax
+    add $8, %ecx
+    jmp *(%ecx)
+
+#
+# a0 [MULCON c] a0*c
+#
+    .global MULCON
+MULCON:
+    imul 4(%ecx), %eax
+    add $8, %ecx
+    jmp *(%ecx)
+
+#
+# a0 [MODCON c] a0%c
+#
+    .global MODCON
+MODCON:
+    cltd
+    idivl 4(%ecx)
+    mov %edx, %eax
+    add $8, %ecx
+    jmp *(%ecx)
+
+#
+# Call the function whose pointer is at the given offset
+# into the stack (DUPN DEREF CALL)
+#
+    .global CALLN
+CALLN:
+    push %eax           # the arguments are all in memory
+    mov 4(%ecx), %edx   # offset of the function pointer
+    mov (%esp,%edx), %eax
+    shl $2, %eax        # -> function
+    mov (%eax), %eax    # shifted entry address
+    shl $2, %eax
+    add $8, %ecx        # past the instruction
+    push %ecx           # return address
+    mov %eax, %ecx      # %ecx is function entry
+    jmp *(%ecx)
+
+#
+# a1 a0 [ASSIGN] a0, with *a1 = a0 (DUP ROT STORE)
+#
+    .global ASSIGN
+ASSIGN:
+    pop %edx            # pointer
+    movl %eax, (,%edx,4)
+    add $4, %ecx
+    jmp *(%ecx)
+
+#
+# a0 [LDXA off] mem[a0+auto]
+#
+    .global LDXA
+LDXA:
+    mov 4(%ecx), %edx   # frame offset of the index
+    add (%ebp,%edx), %eax
+    mov (,%eax,4), %eax
+    add $8, %ecx
+    jmp *(%ecx)
+
+#
+# a0 [LDXC c] mem[a0+c]
+#
+    .global LDXC
+LDXC:
+    add 4(%ecx), %eax
+    mov (,%eax,4), %eax
+    add $8, %ecx
+    jmp *(%ecx)
+
+#
+# Indexed load with both the pointer and the index in autos
+#
+    .global LDXAA
+LDXAA:
+    push %eax
+    mov 4(%ecx), %edx   # frame offset of the pointer
+    mov (%ebp,%edx), %eax
+    mov 8(%ecx), %edx   # frame offset of the index
+    add (%ebp,%edx), %eax
+    mov (,%eax,4), %eax
+    add $12, %ecx
+    jmp *(%ecx)
+
+#
+# Indexed load with the pointer in an EXTRN and the index in
+# an auto
+#
+    .global LDXSA
+LDXSA:
+    push %eax
+    mov 4(%ecx), %edx   # address of the extrn
+    mov (%edx), %eax
+    mov 8(%ecx), %edx   # frame offset of the index
+    add (%ebp,%edx), %eax
+    mov (,%eax,4), %eax
+    add $12, %ecx
+    jmp *(%ecx)
+
+#
+# a2 a1 a0 [STXP] with mem[a2+a1] = a0
+#
+    .global STXP
+STXP:
+    pop %edx            # index
+    pop %esi            # shifted pointer
+    add %esi, %edx
+    movl %eax, (,%edx,4)
+    pop %eax
+    add $4, %ecx
+    jmp *(%ecx)
@@ -0,0 +1,129 @@
+#
+# b startup for x86-64
+#
+
+SYSBRK = 12
+
+    .text
+    .global $start
+
+$start:
+    call meminit
+    call argv
+main:
+    mov $__prog, %rcx
+    jmp *(%rcx)
+
+    .local __prog
+__prog:
+    .quad ENTER, 0
+    .quad PSHSYM, _main
+    .quad DEREF
+    .quad CALL
+    .quad PSHCON, 0
+    .quad PSHSYM, _exit
+    .quad DEREF
+    .quad CALL
+
+    .data
+memtop:
+    .quad   0
+
+    .text
+meminit:
+    mov $SYSBRK, %eax
+    xor %edi, %edi
+    syscall
+    mov %rax, memtop
+    ret
+
+    .data
+    .global _argv, envp
+    .align 8
+_argv:
+    .quad   0
+envp:
+    .quad   0
+    .text
+#
+# build argv
+#
+argv:
+    cld
+    lea 8(%rsp), %rbp
+#
+# first, add up the length of all argv strings (rounded up to
+# word boundaries)    
+#
+    mov (%rbp), %rcx        # number of args
+    xor %rax, %rax          # length of args
+1:    
+    add $8, %rbp            # next arg 
+    mov (%rbp), %rdi        # rdi -> arg
+    push %rax
+    xor %rax, %rax          # scan for nul
+    push %rcx
+    mov $-1, %rcx           # search forever
+    repne scasb             # find nul
+    pop %rcx
+    sub (%rbp), %rdi        # length of arg in %rdi
+    add $7, %rdi            # round up to next word
+    and $-8, %rdi
+    pop %rax
+    add %rdi, %rax          # add into total
+    loop 1b
+ #
+ # save off environment pointer
+ #
+    add $16, %rbp
+    mov %rbp, envp
+
+ #
+ # adjust the top of memory
+ #
+    mov memtop, %rbx
+    add $7, %rbx
+    and $-8, %rbx           # round up and
+    push %rbx               # save pointer for argv
+    add %rax, %rbx          # space for strings
+    mov 16(%rsp), %rcx      # number of arguments
+    inc %rcx                # slot for arg count
+    shl $3, %rcx            # convert to words
+    add %rcx, %rbx          # how much we need total
+    mov $SYSBRK, %eax       # brk syscall
+    mov %rbx, %rdi
+    push %rcx               # syscall clobbers rcx
+    syscall
+    pop %rcx
+    mov %rax, memtop
+    pop %rbx                # get back base
+    shr $3, %rbx
+    mov %rbx, _argv         # save pointer 
+    shl $3, %rbx
+    lea (%rbx, %rcx), %rdi  # string space
+    lea 8(%rsp), %rdx       # pointer to orig args
+    mov (%rdx), %rcx
+    mov %rcx, (%rbx)        # arg count
+1:
+    add $8, %rdx            # -> next string ptr
+    add $8, %rbx            # -> next string loc
+    shr $3, %rdi            # string start to ptr
+    mov %rdi, (%rbx)        # save in vector
+    shl $3, %rdi
+    mov (%rdx), %rsi        # start of string
+2:
+    lodsb                   # strcpy
+    or %al, %al
+    jz 3f
+    stosb
+    jmp 2b
+3:
+    mov $0xff, %al          # B string terminator
+    stosb
+
+    add $7, %rdi            # pad for next string
+    and $-8, %rdi
+    loop 1b
+    ret
+
+    .section .note.GNU-stack, "", @progbits
@@ -0,0 +1,886 @@
+#
+# B threaded opcodes for x86-64
+#
+
+################################################################################
+#
+# These are the handlers of ../blib.s, widened to 64 bits. A word is 8
+# bytes, so instruction cells and operands are .quad's, and pointers are
+# addresses shifted right by 3 bits rather than 2. The registers keep
+# their roles:
+#
+# RCX - Instruction pointer into the current routine.
+# RBX - The temporary register, and a function's return value.
+# RBP - Frame pointer. Arguments start at RBP+16, after the saved frame
+#       pointer and the return address.
+#
+# Programs are linked below 2GB, so addresses fit in the 32 bit
+# immediates and displacements used here.
+#
+
+    .text
+
+
+################################################################################
+#
+# function calls
+#
+
+#
+# Call a function. The address is on the stack. Push the
+# return address on the stack and start executing the function.
+# On return, the function's return value is in RBX.
+#
+    .global CALL
+CALL:
+    add $8, %rcx        # past the instruction
+    pop %rax            # %rax is the shifted entry address
+    shl $3, %rax        # %rax to address
+    push %rcx           # return address
+    mov %rax, %rcx      # %rcx is function entry
+    jmp *(%rcx)
+
+#
+# Set the stack frame at the start of a function. The return address is 
+# already on the top of the stack. Pushes the old frame pointer, sets up
+# the new frame pointer, and allocates space for auto's on the stack (# of
+# bytes as the argument). # of bytes to allocate must be aligned.
+#
+    .global ENTER
+ENTER:
+    push %rbp           # set up
+    mov %rsp, %rbp      # stack frame
+    add $8, %rcx        
+    sub (%rcx), %rsp    # allocate space
+    add $8, %rcx
+    jmp *(%rcx)
+
+#
+# ENTER for bi -j, which translates functions to native code once
+# they are hot. The arguments are the # of bytes to allocate, the
+# calls left before the function is translated, and its length in
+# cells. When the calls run out, the translator in jithook is called
+# with the function, and returns the address of its native code, or
+# 0 to keep running it threaded.
+#
+    .global JENTER
+JENTER:
+    decq 16(%rcx)       # count the call
+    jz 2f               # the function is hot
+1:
+    push %rbp           # set up
+    mov %rsp, %rbp      # stack frame
+    sub 8(%rcx), %rsp   # allocate space
+    add $32, %rcx       # past the arguments
+    jmp *(%rcx)
+2:
+    push %rbp           # the translator is C, which
+    mov %rsp, %rbp      # wants the stack aligned
+    and $-16, %rsp
+    push %rcx
+    push %rcx
+    mov %rcx, %rdi      # -> function
+    call *jithook
+    pop %rcx
+    pop %rcx
+    mov %rbp, %rsp
+    pop %rbp
+    test %rax, %rax     # translated?
+    jz 1b               # nope
+    jmp *%rax           # run the native code instead
+
+    .data
+    .global jithook
+jithook:
+    .quad 0
+    .text
+
+#
+# Leave a function: restore the stack and frame pointer to their values
+# at original invocation.
+#
+    .global LEAVE
+LEAVE:
+    mov %rbp, %rsp      # clean up autos from stack
+    pop %rbp            # restore previous frame ptr
+    add $8, %rcx        
+    jmp *(%rcx)
+
+#
+# Return from a function. The stack should already have been
+# cleaned up, so the return address is on top of the stack. The
+# return value is in RBX.
+#
+    .global RET
+RET:
+    pop %rcx            # return address
+    jmp *(%rcx)         # continue back in caller
+
+
+#
+# Initialize the base address of a vector on the stack
+#
+    .global AVINIT
+AVINIT:
+    mov 8(%rcx), %rax   # stack offset of base of vector
+    add %rbp, %rax      # rax -> vector pointer
+    lea 8(%rax), %rdx   # rdx -> base of vector
+    shr $3, %rdx        # rdx is adjusted pointer
+    mov %rdx, (%rax)    # save adjusted vector
+    add $16, %rcx
+    jmp *(%rcx)
+
+################################################################################
+#
+# control transfer
+#
+
+#
+# jump to the argument
+#
+    .global JMP
+JMP:
+    add $8, %rcx        # -> arg (stack space)
+    mov (%rcx), %rcx    # jump
+    jmp *(%rcx)
+    
+#
+# branch if the top of the stack is zero 
+#
+    .global BZ
+BZ:
+    add $8, %rcx        # -> arg (stack space)
+    mov (%rcx), %rax    # jump target
+    add $8, %rcx        
+    pop %rdx            # condition
+    or %rdx, %rdx       # is condition zero?
+    jnz 1f              # nope
+    mov %rax, %rcx      # yes, jump to target
+1:
+    jmp *(%rcx)
+    
+#
+# branch if the top of the stack is not zero
+#
+    .global BNZ
+BNZ:
+    add $8, %rcx        # -> arg (stack space)
+    mov (%rcx), %rax    # jump target
+    add $8, %rcx        
+    pop %rdx            # condition
+    or %rdx, %rdx       # is condition zero?
+    jz 1f               # yes
+    mov %rax, %rcx      # nope, jump to target
+1:
+    jmp *(%rcx)
+
+#
+# compare and branch. a1 a0 [Bcc] branches to the argument if
+# a1 cc a0, popping both. the macro is given the inverse of cc,
+# the condition for falling through.
+#
+    .macro mkbr name, ncc
+    .global \name
+\name :
+    pop %rax            # a0
+    pop %rdx            # a1
+    add $16, %rcx       # past the instruction
+    cmp %rax, %rdx
+    j\ncc 1f            # condition doesn't hold
+    mov -8(%rcx), %rcx  # jump to target
+1:
+    jmp *(%rcx)
+    .endm
+
+    mkbr BEQ, ne
+    mkbr BNE, e
+    mkbr BLE, g
+    mkbr BLT, ge
+    mkbr BGE, l
+    mkbr BGT, le
+
+#
+# case statement
+#
+    .global CASE
+CASE:
+    mov 8(%rcx), %rax   # case value
+    mov 16(%rcx), %rdx  # start of routine
+    cmp %rax, (%rsp)    # disc is on top of stack
+    je 1f               # a match!
+    add $24, %rcx       # skip args
+    jmp *(%rcx)         # and keep going
+1:
+    pop %rax            # pop disc off stack
+    mov %rdx, %rcx      # new instruction ptr
+    jmp *(%rcx)
+
+################################################################################
+#
+# stack manipulation 
+#
+
+#
+# Push the constant in the arguments on the stack.
+#
+    .global PSHCON
+PSHCON:
+    push 8(%rcx)
+    add $16, %rcx        
+    jmp *(%rcx)
+
+#
+# Push the EXTRN onto the stack. This is a pointer so it must be
+# aligned and will be shifted remove the always zero bits.
+#
+    .global PSHSYM
+PSHSYM:
+    mov 8(%rcx), %rax
+    shr $3, %rax        # address to object index
+    push %rax
+    add $16, %rcx       
+    jmp *(%rcx)
+
+#
+# Push the lvalue of the given auto variable or argument 
+# onto the stack
+#
+    .global PSHAUTO
+PSHAUTO:
+    mov 8(%rcx), %rax
+    add %rbp, %rax
+    shr $3, %rax
+    push %rax
+    add $16, %rcx        
+    jmp *(%rcx)
+
+#
+# dereference the (shifted) address on the stack
+#
+    .global DEREF
+DEREF:
+    pop %rdx            # shiftd pointer
+    shl $3, %rdx        # raw pointer
+    push (%rdx)         # push the pointed-to word
+    add $8, %rcx       
+    jmp *(%rcx)
+
+#
+# store a value into memory. top of stack is value,
+# second on stack is address. 
+#
+    .global STORE
+STORE:
+    pop %rax            # value to store
+    pop %rdx            # pointer
+    shl $3, %rdx
+    mov %rax, (%rdx)
+    add $8, %rcx       
+    jmp *(%rcx)
+
+#
+# rotate the top three elements on the stack such
+# that
+# a2 a1 a0 [ROT] a0 a2 a1 
+#
+    .global ROT
+ROT:
+    pop %rax            # a0
+    pop %rdx            # a1
+    pop %rsi            # a2
+
+    push %rax           # a0
+    push %rsi           # a2
+    push %rdx           # a1
+
+    add $8, %rcx       
+    jmp *(%rcx)
+
+
+#
+# Indexed load. a1 is a (shifted) pointer, a0 an index into the
+# vector it points to. pointers are word indices, so the element
+# is addressed by scaling their sum back up.
+# a1 a0 [LDX] mem[a1+a0]
+#
+    .global LDX
+LDX:
+    pop %rax            # index
+    pop %rdx            # shifted pointer
+    add %rax, %rdx
+    push (,%rdx,8)
+    add $8, %rcx
+    jmp *(%rcx)
+
+#
+# Indexed store. leaves the stored value on the stack.
+# a2 a1 a0 [STX] a0, with mem[a2+a1] = a0
+#
+    .global STX
+STX:
+    pop %rax            # value to store
+    pop %rdx            # index
+    add (%rsp), %rdx    # + shifted pointer
+    mov %rax, (,%rdx,8)
+    mov %rax, (%rsp)    # replace the pointer with the value
+    add $8, %rcx
+    jmp *(%rcx)
+
+#
+# Pushes the temporary register onto the stack.
+#
+    .global PUSHT
+PUSHT:
+    push %rbx
+    add $8, %rcx       
+    jmp *(%rcx)
+
+#
+# Pops the stack into the temporary register.
+#
+    .global POPT
+POPT:
+    pop %rbx
+    add $8, %rcx       
+    jmp *(%rcx)
+
+#
+# Duplicates the top object on the stack
+#
+    .global DUP
+DUP:
+    push (%rsp)
+    add $8, %rcx       
+    jmp *(%rcx)
+
+#
+# Duplicates the stack object at an offset given by the
+# argument, which must be aligned.
+#
+    .global DUPN
+DUPN:
+    mov 8(%rcx), %rsi
+    mov (%rsp,%rsi), %rax
+    push %rax
+    add $16, %rcx       
+    jmp *(%rcx)
+
+#
+# pop one thing off the stack
+#
+    .global POP
+POP:
+    pop %rax            # pop and discard
+    add $8, %rcx       
+    jmp *(%rcx)
+
+#
+# pop 'n' things off the stack
+#
+    .global POPN
+POPN:
+    mov 8(%rcx), %rax   # rax is aligned bytes to pop
+    add %rax, %rsp      # do the pop
+    add $16, %rcx       # past the argument
+    jmp *(%rcx)
+
+#
+# TODO this is a compiler placeholder and shouldn't be
+# emitted
+#
+    .global NAMDEF
+NAMDEF:
+    add $8, %rcx        # past the instruction
+    jmp *(%rcx)
+
+#
+# bump the profiling counter at the address in the argument. this
+# is only emitted with -fprofile-generate.
+#
+    .global PROF
+PROF:
+    mov 8(%rcx), %rax   # -> counter
+    incl (%rax)
+    add $16, %rcx
+    jmp *(%rcx)
+
+#
+# native call. this only occurs in library functions,
+# and the pointer is not shifted. the native code
+# is expected to remember rcx and eventually use it
+# to restart threaded execution, with its return value
+# in rbx.
+#
+    .global NCALL
+NCALL:
+    push 8(%rcx)        # entry to function
+    add $16, %rcx       # past argument
+    ret
+    
+################################################################################
+#
+# in-place update
+#
+# ++, -- and the =+ =- =& =| assignments on a variable or vector element
+# update memory directly. each op comes in three addressing modes, by
+# suffix:
+#
+#   S   the EXTRN whose address is the argument
+#   A   the auto variable or argument at the frame offset in the argument
+#   X   the vector element a1[a0], with a1 and a0 on the stack
+#
+# INC/DEC and the ADDTOP family discard the result; the others push
+# it. the assignments take the right hand side on top of the stack.
+#
+
+    .macro lvS
+    mov 8(%rcx), %rdx   # address of the extrn
+    .endm
+
+    .macro lvA
+    mov 8(%rcx), %rdx   # frame offset
+    add %rbp, %rdx
+    .endm
+
+    .macro lvX
+    pop %rdx            # index
+    pop %rsi            # shifted pointer
+    add %rsi, %rdx
+    shl $3, %rdx        # address of the element
+    .endm
+
+#
+# make an update op. 'rv' is non-blank if the op pops a right hand 
+# side into rax first; 'lv' computes the address to update into rdx; 
+# 'len' is the length of the instruction and 'body' does the update
+#
+    .macro mkrmw name, rv, lv, len, body
+    .global \name
+\name :
+    .ifnb \rv
+    pop %rax            # right hand side
+    .endif
+    \lv
+    \body
+    add $\len, %rcx
+    jmp *(%rcx)
+    .endm
+
+    .macro mkinc mode, lv, len
+    mkrmw INC\mode, , \lv, \len, "incq (%rdx)"
+    mkrmw DEC\mode, , \lv, \len, "decq (%rdx)"
+    mkrmw PREINC\mode, , \lv, \len, "incq (%rdx); push (%rdx)"
+    mkrmw PREDEC\mode, , \lv, \len, "decq (%rdx); push (%rdx)"
+    mkrmw POSTINC\mode, , \lv, \len, "push (%rdx); incq (%rdx)"
+    mkrmw POSTDEC\mode, , \lv, \len, "push (%rdx); decq (%rdx)"
+    .endm
+
+    .macro mkasn mode, lv, len
+    mkrmw ADDTO\mode, rv, \lv, \len, "add %rax, (%rdx); push (%rdx)"
+    mkrmw SUBTO\mode, rv, \lv, \len, "sub %rax, (%rdx); push (%rdx)"
+    mkrmw ANDTO\mode, rv, \lv, \len, "and %rax, (%rdx); push (%rdx)"
+    mkrmw ORTO\mode, rv, \lv, \len, "or %rax, (%rdx); push (%rdx)"
+    mkrmw ADDTOP\mode, rv, \lv, \len, "add %rax, (%rdx)"
+    mkrmw SUBTOP\mode, rv, \lv, \len, "sub %rax, (%rdx)"
+    mkrmw ANDTOP\mode, rv, \lv, \len, "and %rax, (%rdx)"
+    mkrmw ORTOP\mode, rv, \lv, \len, "or %rax, (%rdx)"
+    .endm
+
+    mkinc S, lvS, 16
+    mkinc A, lvA, 16
+    mkinc X, lvX, 8
+    mkasn S, lvS, 16
+    mkasn A, lvA, 16
+    mkasn X, lvX, 8
+
+################################################################################
+#
+# math
+#
+
+#
+# a1 a0 [ADD] a1+a0
+#
+    .global ADD
+ADD:
+    pop %rax            # rhs
+    pop %rdx            # lhs
+    add %rdx, %rax
+    push %rax
+    add $8, %rcx        # past argument
+    jmp *(%rcx) 
+
+#
+# a1 a0 [SUB] a1-a0
+#
+    .global SUB 
+SUB:
+    pop %rax            # rhs
+    pop %rdx            # lhs
+    sub %rax, %rdx
+    push %rdx
+    add $8, %rcx        # past argument
+    jmp *(%rcx) 
+
+#
+# a0 [NEG] -a0
+#
+    .global NEG
+NEG:
+    negq (%rsp)
+    add $8, %rcx        # past argument
+    jmp *(%rcx) 
+
+#
+# a0 [NOT] !a0
+#
+    .global NOT
+NOT:
+    pop %rax
+    push $0
+    cmp $0, %rax
+    setz (%rsp)
+    add $8, %rcx        # past argument
+    jmp *(%rcx) 
+
+#
+# a1 a0 [SHR] a1>>a0 
+#
+    .global SHR
+SHR:
+    pop %rdi            # rhs
+    pop %rax            # lhs
+    xchg %rcx, %rdi     # shift must be in cl
+    shr %cl, %rax
+    push %rax
+    lea 8(%rdi), %rcx
+    jmp *(%rcx) 
+
+#
+# a1 a0 [SHL] a1<<a0 
+#
+    .global SHL
+SHL:
+    pop %rdi            # rhs
+    pop %rax            # lhs
+    xchg %rcx, %rdi     # shift must be in cl
+    shl %cl, %rax
+    push %rax
+    lea 8(%rdi), %rcx
+    jmp *(%rcx) 
+
+#
+# a1 a0 [AND] a1&a1
+#
+    .global AND
+AND:
+    pop %rdi            # rhs
+    and %rdi, (%rsp)
+    add $8, %rcx        # past argument
+    jmp *(%rcx) 
+
+#
+# a1 a0 [OR] a1|a1
+#
+    .global OR
+OR:
+    pop %rdi            # rhs
+    or %rdi, (%rsp)
+    add $8, %rcx        # past argument
+    jmp *(%rcx) 
+
+
+
+#
+# a1 a0 [DIV] a1/a0
+#
+# IDIV xxx: RDX:RAX / xxx => RAX (rem RDX)
+#
+    .global DIV
+DIV:
+    pop %rdi            # rhs
+    pop %rax            # lhs
+    mov %rax, %rdx
+    sar $63, %rdx       # sign ex rax into rdx
+    idiv %rdi
+    push %rax
+    add $8, %rcx        # past argument
+    jmp *(%rcx) 
+
+#
+# a1 a0 [MOD] a1/a0
+#
+# IDIV xxx: RDX:RAX / xxx => RAX (rem RDX)
+#
+    .global MOD
+MOD:
+    pop %rdi            # rhs
+    pop %rax            # lhs
+    mov %rax, %rdx
+    sar $63, %rdx       # sign ex rax into rdx
+    idiv %rdi
+    push %rdx
+    add $8, %rcx        # past argument
+    jmp *(%rcx) 
+
+#
+# a1 a0 [MUL] a1*a0
+#
+    .global MUL
+MUL:
+    pop %rdi            # rhs
+    pop %rax            # lhs
+    imul %rdi
+    push %rax
+    add $8, %rcx
+    jmp *(%rcx)
+
+#
+# a1 a0 [EQ] a1==a0 ? 1 : 0
+#
+    .global EQ
+EQ:
+    pop %rax
+    pop %rdx
+    push $0
+    cmp %rdx, %rax
+    setz (%rsp)
+    add $8, %rcx        # past argument
+    jmp *(%rcx) 
+
+#
+# a1 a0 [NE] a1!=a0 ? 1 : 0
+#
+    .global NE
+NE:
+    pop %rax
+    pop %rdx
+    push $0
+    cmp %rdx, %rax
+    setnz (%rsp)
+    add $8, %rcx        # past argument
+    jmp *(%rcx) 
+
+#
+# a1 a0 [LT] a1<a0 ? 1 : 0
+#
+    .global LT 
+LT:
+    pop %rax
+    pop %rdx
+    push $0
+    cmp %rax, %rdx
+    setl (%rsp)
+    add $8, %rcx        # past argument
+    jmp *(%rcx) 
+
+#
+# a1 a0 [LE] a1<a0 ? 1 : 0
+#
+    .global LE 
+LE:
+    pop %rax
+    pop %rdx
+    push $0
+    cmp %rax, %rdx
+    setle (%rsp)
+    add $8, %rcx        # past argument
+    jmp *(%rcx) 
+
+#
+# a1 a0 [GT] a1<a0 ? 1 : 0
+#
+    .global GT 
+GT:
+    pop %rax
+    pop %rdx
+    push $0
+    cmp %rax, %rdx
+    setg (%rsp)
+    add $8, %rcx        # past argument
+    jmp *(%rcx) 
+
+#
+# a1 a0 [GE] a1<a0 ? 1 : 0
+#
+    .global GE 
+GE:
+    pop %rax
+    pop %rdx
+    push $0
+    cmp %rax, %rdx
+    setge (%rsp)
+    add $8, %rcx        # past argument
+    jmp *(%rcx) 
+
+
+
+################################################################################
+#
+# superinstructions. ba combines common runs of ops into these; see
+# superopt in ba.c for the runs each one replaces.
+#
+
+#
+# Push the value of the given auto variable or argument
+# (PSHAUTO DEREF)
+#
+    .global LDAUTO
+LDAUTO:
+    mov 8(%rcx), %rax   # frame offset
+    push (%rbp,%rax)
+    add $16, %rcx
+    jmp *(%rcx)
+
+#
+# Push the value of the EXTRN (PSHSYM DEREF)
+#
+    .global LDSYM
+LDSYM:
+    mov 8(%rcx), %rax   # address of the extrn
+    push (%rax)
+    add $16, %rcx
+    jmp *(%rcx)
+
+#
+# a0 [ADDCON c] a0+c (PSHCON ADD)
+#
+    .global ADDCON
+ADDCON:
+    mov 8(%rcx), %rax
+    add %rax, (%rsp)
+    add $16, %rcx
+    jmp *(%rcx)
+
+#
+# a0 [SUBCON c] a0-c (PSHCON SUB)
+#
+    .global SUBCON
+SUBCON:
+    mov 8(%rcx), %rax
+    sub %rax, (%rsp)
+    add $16, %rcx
+    jmp *(%rcx)
+
+#
+# a0 [MULCON c] a0*c (PSHCON MUL)
+#
+    .global MULCON
+MULCON:
+    mov 8(%rcx), %rax
+    imul (%rsp), %rax
+    mov %rax, (%rsp)
+    add $16, %rcx
+    jmp *(%rcx)
+
+#
+# a0 [MODCON c] a0%c (PSHCON MOD)
+#
+    .global MODCON
+MODCON:
+    pop %rax            # lhs
+    mov %rax, %rdx
+    sar $63, %rdx       # sign ex rax into rdx
+    idivq 8(%rcx)
+    push %rdx
+    add $16, %rcx
+    jmp *(%rcx)
+
+#
+# Call the function whose pointer is at the given offset 
+# into the stack (DUPN DEREF CALL)
+#
+    .global CALLN
+CALLN:
+    mov 8(%rcx), %rax   # offset of the function pointer
+    mov (%rsp,%rax), %rax
+    shl $3, %rax        # -> function
+    mov (%rax), %rax    # shifted entry address
+    shl $3, %rax
+    add $16, %rcx       # past the instruction
+    push %rcx           # return address
+    mov %rax, %rcx      # %rcx is function entry
+    jmp *(%rcx)
+
+#
+# store a value into memory, leaving the value on the stack.
+# a1 a0 [ASSIGN] a0, with *a1 = a0 (DUP ROT STORE)
+#
+    .global ASSIGN
+ASSIGN:
+    pop %rax            # value to store
+    pop %rdx            # pointer
+    shl $3, %rdx
+    mov %rax, (%rdx)
+    push %rax
+    add $8, %rcx
+    jmp *(%rcx)
+
+#
+# Indexed load with the index in an auto (LDAUTO LDX)
+# a0 [LDXA off] mem[a0+auto]
+#
+    .global LDXA
+LDXA:
+    mov 8(%rcx), %rax   # frame offset of the index
+    pop %rdx            # shifted pointer
+    add (%rbp,%rax), %rdx
+    push (,%rdx,8)
+    add $16, %rcx
+    jmp *(%rcx)
+
+#
+# Indexed load with a constant index (PSHCON LDX)
+# a0 [LDXC c] mem[a0+c]
+#
+    .global LDXC
+LDXC:
+    pop %rdx            # shifted pointer
+    add 8(%rcx), %rdx
+    push (,%rdx,8)
+    add $16, %rcx
+    jmp *(%rcx)
+
+#
+# Indexed load with both the pointer and the index in autos
+# (LDAUTO LDAUTO LDX)
+#
+    .global LDXAA
+LDXAA:
+    mov 8(%rcx), %rax   # frame offset of the pointer
+    mov (%rbp,%rax), %rdx
+    mov 16(%rcx), %rax  # frame offset of the index
+    add (%rbp,%rax), %rdx
+    push (,%rdx,8)
+    add $24, %rcx
+    jmp *(%rcx)
+
+#
+# Indexed load with the pointer in an EXTRN and the index in
+# an auto (LDSYM LDAUTO LDX)
+#
+    .global LDXSA
+LDXSA:
+    mov 8(%rcx), %rax   # address of the extrn
+    mov (%rax), %rdx
+    mov 16(%rcx), %rax  # frame offset of the index
+    add (%rbp,%rax), %rdx
+    push (,%rdx,8)
+    add $24, %rcx
+    jmp *(%rcx)
+
+#
+# Indexed store, discarding the value (STX POP)
+# a2 a1 a0 [STXP] with mem[a2+a1] = a0
+#
+    .global STXP
+STXP:
+    pop %rax            # value to store
+    pop %rdx            # index
+    add (%rsp), %rdx    # + shifted pointer
+    mov %rax, (,%rdx,8)
+    add $8, %rsp        # pop the pointer
+    add $8, %rcx
+    jmp *(%rcx)
+
+    .section .note.GNU-stack, "", @progbits
@@ -0,0 +1,48 @@
+#
+# B string routines for x86-64
+#
+    .text
+
+    .align 8
+    .global _char
+_char:
+    .quad .+8
+0:
+    .pushsection .pinit, "ao", @progbits, .text
+    .quad 0b-8
+    .popsection
+    .quad NCALL, __char
+    .quad RET
+
+    .local __char
+__char:
+    mov 8(%rsp), %rsi       # string address
+    mov 16(%rsp), %rdx      # offset
+    xor %eax, %eax
+    shl $3, %rsi
+    movb (%rdx,%rsi), %al
+    mov %rax, %rbx
+    jmp *(%rcx)
+
+    .align 8
+    .global _lchar
+_lchar:
+    .quad .+8
+0:
+    .pushsection .pinit, "ao", @progbits, .text
+    .quad 0b-8
+    .popsection
+    .quad NCALL, __lchar
+    .quad RET
+
+    .local __lchar
+__lchar:
+    mov 8(%rsp), %rsi       # string address
+    mov 16(%rsp), %rdx      # offset
+    mov 24(%rsp), %rax      # character to store
+    shl $3, %rsi
+    movb %al, (%rdx,%rsi) 
+    mov %rax, %rbx
+    jmp *(%rcx)
+
+    .section .note.GNU-stack, "", @progbits
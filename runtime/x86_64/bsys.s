@@ -0,0 +1,580 @@
+#
+# B syscall wrappers for x86-64
+#
+
+# Linux x86-64 syscalls. syscall takes its arguments in RDI, RSI, RDX
+# and R10, and clobbers RCX and R11, so every wrapper saves the
+# instruction pointer around it.
+SYSREAD=0
+SYSWRITE=1
+SYSOPEN=2
+SYSCLOSE=3
+SYSSEEK=8
+SYSBRK=12
+SYSFORK=57
+SYSEXECVE=59
+SYSEXIT=60
+SYSWAIT4=61
+SYSCHDIR=80
+SYSMKDIR=83
+SYSCREAT=85
+SYSLINK=86
+SYSUNLINK=87
+SYSCHMOD=90
+SYSLCHOWN=94
+SYSGETUID=102
+SYSSETUID=105
+
+# standard descriptors
+STDIN=0
+STDOUT=1
+STDERR=2
+
+# file open flags
+RDONLY=0
+WRONLY=1
+
+
+#
+# mkncall - create a threaded interpreter stub for a native code function,
+# in a section of its own so the linker can drop it if it isn't called
+#
+    .macro mkncall name
+    .section .text.fn.\name, "ax", @progbits
+    .align 8
+    .global _\name
+_\name :
+    .quad .+8
+0:
+    .pushsection .pinit, "ao", @progbits, .text.fn.\name
+    .quad 0b-8
+    .popsection
+    .quad NCALL, \name
+    .quad RET
+    .local \name
+\name :
+    .endm
+    
+    .text
+
+#
+# exit(rc)
+# exits the process with return code rc
+#
+    mkncall exit
+    call profdump
+    mov 8(%rsp), %rdi   # return code
+    mov $SYSEXIT, %eax  # exit syscall
+    syscall
+    
+#
+# putchar(ch)
+# writes the character ch to the console
+#
+    mkncall putchar
+    push %rcx
+    push 16(%rsp)
+
+    mov $SYSWRITE, %eax # write syscall 
+    mov $STDOUT, %edi   # stdout
+    mov %rsp, %rsi      # buffer to write
+    mov $1, %edx        # bytes to write
+    syscall
+
+    pop %rbx            # return the character
+    pop %rcx
+    jmp *(%rcx)
+
+#
+# getchar() 
+# reads a character from the console and returns it, or '*e' on end of
+# file or error
+#
+    mkncall getchar
+    push %rcx
+    push $0
+
+    mov $SYSREAD, %eax  # read syscall 
+    mov $STDIN, %edi    # stdin
+    mov %rsp, %rsi      # buffer to read
+    mov $1, %edx        # bytes to read
+    syscall
+    cmp $1, %rax        # should get a byte, eventually
+    je 1f
+    movb $0xff, (%rsp)  # return EOF otherwise
+1:
+    pop %rbx            # return the character
+    pop %rcx
+    jmp *(%rcx)
+
+
+#
+# brk(fence)     NOT IN ORIGINAL STDLIB
+# sets the memory fence to address 'fence', if possible; returns the
+# new fence or a negative number on error.
+#
+    mkncall brk
+    push %rcx
+    mov 16(%rsp), %rdi
+    mov $SYSBRK, %eax
+    syscall
+    mov %rax, %rbx
+    pop %rcx
+    jmp *(%rcx)
+
+#
+# open(fname, rdwr)
+# opens an existing file for read (if rdwr == 0) or write
+# (if rdwr != 0). returns the file descriptor, or a negative
+# number on error.
+#
+    mkncall open
+    push %rcx
+    mov 16(%rsp), %rdi
+    shl $3, %rdi
+    mov 24(%rsp), %rsi
+    or %rsi, %rsi           # NB 0 = RDONLY
+    jz 1f
+    mov $WRONLY, %esi
+1:
+    xor %edx, %edx
+    call scstr
+    mov $SYSOPEN, %eax
+    syscall
+    movb $0xff, (%r8)
+    mov %rax, %rbx
+    pop %rcx
+    jmp *(%rcx)
+
+#
+# creat(fname, mode)
+# creates a new file an opens in for write. if the file exists, it is truncated.
+# 'mode' specifies the mode bits. returns a file descriptor on success or 
+# a negative number on error.
+#
+    mkncall creat
+    push %rcx
+    mov 16(%rsp), %rdi
+    shl $3, %rdi
+    call scstr
+    mov 24(%rsp), %rsi
+    mov $SYSCREAT, %eax
+    syscall
+    movb $0xff, (%r8)
+    mov %rax, %rbx
+    pop %rcx
+    jmp *(%rcx)
+
+#
+# close(fd)
+# closes the given file descriptor. returns on success or a negative
+# number on failure.
+#
+    mkncall close
+    push %rcx
+    mov 16(%rsp), %rdi
+    mov $SYSCLOSE, %eax
+    syscall
+    mov %rax, %rbx
+    pop %rcx
+    jmp *(%rcx)
+
+#
+# read(fd, buffer,size)
+# read 'size' bytes from file descriptor 'fd' into vector 'buffer'. returns
+# the number of bytes read, or a negative number on error.
+#
+    mkncall read
+    push %rcx
+    mov 16(%rsp), %rdi
+    mov 24(%rsp), %rsi
+    shl $3, %rsi
+    mov 32(%rsp), %rdx
+    mov $SYSREAD, %eax
+    syscall
+    mov %rax, %rbx
+    pop %rcx
+    jmp *(%rcx)
+
+#
+# seek(fd, offset, pos)
+# move the file pointer of fd. if pos = 0, offset is relative to the start
+# of file. if pos = 1, it is relative to the current position. if pos = 2,
+# it is relative to the end.
+# 
+# on success, returns the new position from the start of the file; a 
+# negative number indicates an error.
+#
+    mkncall seek
+    push %rcx
+    mov 16(%rsp), %rdi
+    mov 24(%rsp), %rsi
+    mov 32(%rsp), %rdx
+    mov $SYSSEEK, %eax
+    syscall
+    mov %rax, %rbx
+    pop %rcx
+    jmp *(%rcx)
+
+#
+# write(fd, buffer,size)
+# write 'size' bytes to file descriptor 'fd' from vector 'buffer'. returns
+# the number of bytes written, or a negative number on error.
+#
+    mkncall write
+    push %rcx
+    mov 16(%rsp), %rdi
+    mov 24(%rsp), %rsi
+    shl $3, %rsi
+    mov 32(%rsp), %rdx
+    mov $SYSWRITE, %eax
+    syscall
+    mov %rax, %rbx
+    pop %rcx
+    jmp *(%rcx)
+
+#
+# chdir(dir)
+# change the process current directory to 'dir'. Returns 0 on success
+# or a negative number on error.
+#
+    mkncall chdir
+    push %rcx
+    mov 16(%rsp), %rdi
+    shl $3, %rdi
+    call scstr
+    mov $SYSCHDIR, %eax
+    syscall
+    movb $0xff, (%r8)
+    mov %rax, %rbx
+    pop %rcx
+    jmp *(%rcx)
+
+#
+# chmod(path, mode)
+# change the mode bits for the given inode. returns 0 on success or a
+# negative numer on failure
+#
+    mkncall chmod
+    push %rcx
+    mov 16(%rsp), %rdi
+    mov 24(%rsp), %rsi
+    shl $3, %rdi
+    call scstr
+    mov $SYSCHMOD, %eax
+    syscall
+    movb $0xff, (%r8)
+    mov %rax, %rbx
+    pop %rcx
+    jmp *(%rcx)
+
+#
+# chown(path, owner)
+# change the owner of the given inode to 'owner', which is a uid.
+# return negative on failure.
+#
+    mkncall chown
+    push %rcx
+    mov 16(%rsp), %rdi
+    mov 24(%rsp), %rsi
+    shl $3, %rdi
+    call scstr
+    mov $-1, %rdx       # lchown expects a gid_t in RDX; -1 
+                        # means ignore it.
+    mov $SYSLCHOWN, %eax
+    syscall
+    movb $0xff, (%r8)
+    mov %rax, %rbx
+    pop %rcx
+    jmp *(%rcx)
+
+#
+# fork()
+# split the process in two. in the original (parent) process, returns
+# the pid of the child, or a negative number on failure. on success,
+# returns 0 in the new child process.
+#
+    mkncall fork
+    push %rcx
+    mov $SYSFORK, %eax
+    syscall
+    mov %rax, %rbx
+    pop %rcx
+    jmp *(%rcx)
+
+#
+# wait()
+# wait for any child process to exit and return that child's pid.
+# returns -1 on error.
+#
+    mkncall wait
+    push %rcx
+    mov $-1, %rdi       # -1 - wait for any child
+    xor %esi, %esi      # NULL for status pointer
+    xor %edx, %edx      # no option flags
+    xor %r10, %r10      # NULL for rusage
+    mov $SYSWAIT4, %eax
+    syscall
+    mov %rax, %rbx
+    pop %rcx
+    jmp *(%rcx)
+
+#
+# getuid()
+# return the uid of the current process
+#
+    mkncall getuid
+    push %rcx
+    mov $SYSGETUID, %eax
+    syscall
+    mov %rax, %rbx
+    pop %rcx
+    jmp *(%rcx)
+
+#
+# link(oldpath, newpath)
+# create a hard link newpath to oldpath. returns a negative number
+# on error.
+#
+    mkncall link
+    push %rcx
+    mov 16(%rsp), %rdi
+    mov 24(%rsp), %rsi
+    shl $3, %rdi
+    shl $3, %rsi
+    call scstr
+    mov %r8, %r9
+    xchg %rdi, %rsi
+    call scstr
+    xchg %rdi, %rsi
+    mov $SYSLINK, %eax
+    syscall
+    movb $0xff, (%r8)
+    movb $0xff, (%r9)
+    mov %rax, %rbx
+    pop %rcx
+    jmp *(%rcx)
+
+#
+# unlink(path)
+# remove the given link. returns a negative number on failure.
+#
+    mkncall unlink
+    push %rcx
+    mov 16(%rsp), %rdi
+    shl $3, %rdi
+    call scstr
+    mov $SYSUNLINK, %eax
+    syscall
+    movb $0xff, (%r8)
+    mov %rax, %rbx
+    pop %rcx
+    jmp *(%rcx)
+
+#
+# mkdir(path, mode)
+# create a new directory with permission bits 'mode'. returns a negative
+# number on failure.
+#
+    mkncall mkdir
+    push %rcx
+    mov 16(%rsp), %rdi
+    shl $3, %rdi
+    call scstr
+    mov 24(%rsp), %rsi
+    mov $SYSMKDIR, %eax
+    syscall
+    movb $0xff, (%r8)
+    mov %rax, %rbx
+    pop %rcx
+    jmp *(%rcx)
+
+#
+# setuid(uid)
+# sets the process uid to 'uid'. returns a negative number of failure.
+#
+    mkncall setuid 
+    push %rcx
+    mov 16(%rsp), %rdi
+    mov $SYSSETUID, %eax
+    syscall
+    mov %rax, %rbx
+    pop %rcx
+    jmp *(%rcx)
+
+
+#
+# execl(prog, arg1, arg2, ..., 0)
+# replace the process with the program 'prog', with command line args
+# arg1 arg2 ...
+# never returns on success. returns a negative number on failure.
+#
+    mkncall execl
+    push %rbp
+    mov %rsp, %rbp
+    push %rcx
+
+    # walk the stack, converting the pointers to native addresses
+    # and fixing end of string markers
+    #
+    push $0
+    lea 16(%rbp), %rbx
+1:  mov (%rbx), %rdi
+    shl $3, %rdi
+    or %rdi, %rdi
+    jz 2f
+    mov %rdi, (%rbx)
+    call scstr
+    push %r8
+    add $8, %rbx
+    jmp 1b
+2:
+
+    # now the args on the stack are set up as the syscall needs
+    # unless the call fails, this won't return
+    #
+    lea 16(%rbp), %rsi      # rsi -> arg array
+    mov (%rsi), %rdi        # rdi -> program
+    mov envp, %rdx          # environment
+    mov $SYSEXECVE, %eax
+    syscall
+    
+    # NB we only get here if execve failed.
+    # fix the strings back to B termination style
+    #
+1:  pop %rdi
+    or %rdi, %rdi
+    jz 2f
+    movb $0xff, (%rdi)
+    jmp 1b
+2:
+    pop %rcx
+    pop %rbp
+    mov %rax, %rbx
+    jmp *(%rcx)
+
+#
+# execv(prog, args, count)
+# like execl but the args are in a vector
+#
+    mkncall execv
+    push %rbp
+    mov %rsp, %rbp
+    push %rcx
+
+    mov 24(%rbp), %rsi          # rsi -> base of vector
+    shl $3, %rsi                # ptr to address
+    mov 32(%rbp), %rcx          # # things in array
+    shl $3, %rcx                # # bytes
+    add %rcx, %rsi              # rsi -> end of vector
+    shr $3, %rcx
+    push $0                     # push terminator
+1:  add $-8, %rsi               # previous arg
+    push (%rsi)                 # push on stack
+    shlq $3, (%rsp)             # ptr to address of string
+    loop 1b                     # for all args
+    push 16(%rbp)               # 0'th arg is the program name
+    shlq $3, (%rsp)             # ptr to address of string
+    mov %rsp, %rsi              # save base of vector
+    mov %rsp, %rdx              # also for iteration
+2:  mov (%rdx), %rdi            # get B string
+    or %rdi, %rdi               # are we done?
+    jz 1f                       # yes
+    call scstr                  # fix string
+    push %r8                    # save string fixup pointer
+    add $8, %rdx                # next string
+    jmp 2b                      # keep going
+1:
+    mov (%rsi), %rdi
+    mov envp, %rdx
+    mov $SYSEXECVE, %eax
+    syscall
+
+    # NB we only get here if we failed
+2:  cmp %rsi, %rsp
+    jz 1f
+    pop %rdi
+    movb $0xff, (%rdi)
+    jmp 2b
+1:  lea -8(%rbp), %rsp
+    pop %rcx
+    pop %rbp
+    mov %rax, %rbx
+    jmp *(%rcx)
+
+
+################################################################################
+#
+# calls which aren't implemented on Linux
+#
+
+    mkncall gtty
+    mov $-1, %rbx
+    jmp *(%rcx)
+
+    mkncall stty
+    mov $-1, %rbx
+    jmp *(%rcx)
+
+
+#
+# Write out the profiling counters, if the program was built with
+# -fprofile-generate. bprof.out is a straight copy of the .bprof
+# section, which the linker script brackets with prof0 and profn.
+#
+    .text
+    .local profdump
+profdump:
+    mov $profn, %r12
+    sub $prof0, %r12    # bytes of counters
+    jz 1f               # not profiling
+
+    mov $SYSCREAT, %eax
+    mov $profnam, %edi
+    mov $0644, %esi
+    syscall
+    or %rax, %rax
+    js 1f
+
+    mov %rax, %r13      # fd
+    mov %rax, %rdi
+    mov $prof0, %esi
+    mov %r12, %rdx
+    mov $SYSWRITE, %eax
+    syscall
+
+    mov %r13, %rdi
+    mov $SYSCLOSE, %eax
+    syscall
+1:
+    ret
+
+    .data
+profnam:
+    .asciz "bprof.out"
+    .text
+
+#
+# Convert B strings to nul-terminated strings (temporarily) for 
+# system calls. Takes the original pointer in rdi; returns with the
+# string in place nul terminated and r8 pointing to where to replace
+# the *e when done.
+#
+    .local scstr
+scstr:
+    push %rcx           # save regs
+    push %rax
+    push %rdi
+    mov $-1, %rcx       # scan count (all of memory)
+    cld
+    mov $0xff, %al      # *e character
+    repne scasb         # rdi -> just past it
+    dec %rdi            # -> nul
+    movb $0, (%rdi)
+    mov %rdi, %r8
+    pop %rdi
+    pop %rax
+    pop %rcx
+    ret
+
+    .section .note.GNU-stack, "", @progbits
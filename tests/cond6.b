@@ -0,0 +1,44 @@
+main()
+{
+    extrn printf, f, n;
+    auto a, b, i;
+
+    a = 3;
+    b = 5;
+
+    if (a < b & b < 10) printf("and*n");
+    if (a > b & b < 10) printf("wrong*n");
+    if (a > b | b < 10) printf("or*n");
+    if (a > b | b > 10) printf("wrong*n");
+    if (!(a == b)) printf("not*n");
+    if (!(a < b & b < 10)) printf("wrong*n"); else printf("else*n");
+    if (a & 1) printf("bits*n");
+    if (a & 4) printf("wrong*n");
+    if (a < b & b) printf("mixed*n");
+    printf("%d %d*n", a < b ? 1 : 2, a >= b | a == 3 ? 3 : 4);
+
+    /* the right hand side has side effects, so it is always evaluated */
+    n = 0;
+    if (a > b & f()) printf("wrong*n");
+    if (a < b | f()) printf("called*n");
+    printf("%d*n", n);
+
+    i = 0;
+    while (i < 10 & i != 7)
+        i++;
+    printf("%d*n", i);
+
+    i = 0;
+    while (!(i >= 4))
+        i++;
+    printf("%d*n", i);
+}
+
+f()
+{
+    extrn n;
+    n++;
+    return (1);
+}
+
+n;
@@ -0,0 +1,46 @@
+main()
+{
+    extrn e, v, printf;
+    auto a, u 3, p, i;
+
+    a = 5;
+    e = 10;
+    u[0] = u[1] = u[2] = 0;
+
+    a++;
+    ++e;
+    u[1]++;
+    --v[2];
+    printf("%d %d %d %d*n", a, e, u[1], v[2]);
+
+    printf("%d %d %d %d*n", a++, ++a, e--, --e);
+    printf("%d %d %d %d*n", u[1]++, ++u[1], v[2]--, --v[2]);
+    printf("%d %d %d %d*n", a, e, u[1], v[2]);
+
+    a =+ 10;
+    e =- 3;
+    u[2] =| 12;
+    v[1] =& 6;
+    printf("%d %d %d %d*n", a, e, u[2], v[1]);
+    printf("%d %d %d %d*n", a =- 1, e =+ 2, u[2] =& 5, v[1] =| 8);
+
+    i = 0;
+    while (i++ < 3)
+        u[i - 1] =+ i;
+    printf("%d %d %d %d*n", i, u[0], u[1], u[2]);
+
+    /* the left side is read before the right side changes it */
+    a = 5;
+    a =+ a =* 2;
+    u[0] = 1;
+    u[0] =- u[0]++;
+    printf("%d %d*n", a, u[0]);
+
+    p = &v[0];
+    (*p)++;
+    *p =+ 4;
+    printf("%d*n", v[0]);
+}
+
+e;
+v[3] 7, 7, 7;
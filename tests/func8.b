@@ -0,0 +1,71 @@
+g 10;
+h 4;
+c 7;
+w;
+
+sq(x)
+{
+    return (x * x);
+}
+
+add(a, b)
+{
+    return (a + b);
+}
+
+dec(n)
+{
+    n = n - 1;
+    return (n);
+}
+
+sum(n)
+{
+    auto s, v 4;
+
+    s = 0;
+    v[0] = n;
+    while (n > 0) {
+        s =+ n;
+        n--;
+    }
+    return (s + v[0]);
+}
+
+scale(x, f)
+{
+    extrn printf;
+    auto s;
+
+    s = f;
+    while (x > 0) {
+        if (x & 1)
+            s =+ f;
+        else
+            s =+ f + f;
+        x--;
+    }
+    printf("(%d) ", f);
+    return (s);
+}
+
+fact(n)
+{
+    return (n <= 1 ? 1 : n * fact(n - 1));
+}
+
+main()
+{
+    extrn g, h, c, w, printf;
+    auto p, fp;
+
+    p = &h;
+    *p = 5;
+    fp = sq;
+    w++;
+    printf("%d %d %d %d*n", sq(add(g, 1)), add(sq(2), sq(3)), fp(h), w);
+    printf("%d %d %d*n", dec(3), dec(3), sum(4));
+    printf("%d %d*n", fact(5), c ? sq(c) : 0);
+    printf("%d*n", add(1, add(2, add(3, 4))));
+    printf("%d %d*n", scale(g, 3), scale(sum(2), 3));
+}
@@ -0,0 +1,16 @@
+k 3;
+n 5;
+
+twice(x)
+{
+    return (x + x);
+}
+
+main()
+{
+    extrn k, n, setk, printf;
+
+    printf("%d %d ", k, n);
+    setk();
+    printf("%d %d %d*n", k, twice(k), twice(n));
+}
@@ -0,0 +1,8 @@
+/* compiled without -flto, and linked with func9.b */
+
+setk()
+{
+    extrn k;
+
+    k = 9;
+}
@@ -0,0 +1,37 @@
+/* built with -fprofile-use, the cases of the switch are tested hottest
+   first. the if before it has a hotter then part, so its parts are
+   swapped, and its condition is an '&' */
+
+n 0;
+
+f(i)
+{
+    extrn n;
+
+    if (i > 0 & i < 4)
+        n =+ i;
+    else
+        n =- 1;
+
+    switch i {
+    case 1:
+        return (10);
+    case 2:
+        return (20);
+    case 3:
+        return (30);
+    }
+    return (0);
+}
+
+main()
+{
+    extrn printf, n;
+    auto i, s;
+
+    s = f(0) + f(1) + f(2) + f(2);
+    i = 0;
+    while (i++ < 5)
+        s =+ f(3);
+    printf("%d %d*n", s, n);
+}
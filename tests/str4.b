@@ -0,0 +1,16 @@
+/* a string a datum is initialized with is the datum's own, even when
+   the same string is used elsewhere */
+
+a "....";
+b "....";
+v[] "ab", "ab";
+
+main()
+{
+    extrn printf, lchar, a, b, v;
+
+    lchar(a, 0, 'X');
+    lchar(v[0], 1, 'Y');
+    printf("%s|%s|%s*n", a, b, "....");
+    printf("%s|%s*n", v[0], v[1]);
+}
@@ -0,0 +1,14 @@
+/* escapes followed by more of the string, escaped quotes, and an
+   escaped '*' just before the closing quote */
+
+main()
+{
+    extrn printf;
+
+    printf("a*tb*"c*"*n");
+    printf("*(x*) *=*n");
+    printf("star ***n");
+    printf("%c%c%c*n", '*'', '**', '*"');
+    printf("**");
+    printf("*n");
+}
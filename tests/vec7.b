@@ -0,0 +1,29 @@
+main()
+{
+    extrn v, printf;
+    auto u 5, i, x, p;
+
+    i = 0;
+    while (i < 5) {
+        u[i] = i * i;
+        v[i] = u[i] + 1;
+        i++;
+    }
+
+    x = v[2] = u[3];
+    v[4] =+ 10;
+    p = &v[1];
+    u[i - 1] = *(p + 2) + p[3];
+
+    if ((u[0] = 7) == 7) {
+        printf("%d %d %d*n", x, u[0], v[2]);
+    }
+
+    i = 0;
+    while (i < 5) {
+        printf("%d %d*n", u[i], v[i]);
+        i++;
+    }
+}
+
+v[5];
@@ -0,0 +1,28 @@
+main()
+{
+    extrn z, w, s, printf;
+    auto i, sum;
+
+    sum = 0;
+    i = 0;
+    while (i < 4000) {
+        sum =+ z[i];
+        z[i] = i;
+        i++;
+    }
+    printf("%d %d %d*n", sum, z[0], z[3999]);
+
+    sum = 0;
+    i = 0;
+    while (i < 100) {
+        sum =+ w[i];
+        i++;
+    }
+    printf("%d %d %d %d*n", sum, w[0], w[2], w[99]);
+    printf("%s*n", s[0]);
+    printf("%s*n", s[1]);
+}
+
+z[4000];
+w[100] 1, 2, 3;
+s[2] "tab*tquote*"back\slash", "*(*)*'";